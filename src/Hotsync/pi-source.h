@@ -138,6 +138,7 @@ extern "C" {
 	extern pi_socket_list_t *pi_socket_recognize PI_ARGS((pi_socket_t *));
 	extern pi_socket_t *find_pi_socket PI_ARGS((int sd));
 	extern int crc16 PI_ARGS((unsigned char *ptr, int count));
+	extern unsigned char slp_checksum PI_ARGS((const unsigned char *header));
 	extern char *printlong PI_ARGS((uint32_t val));
 	extern uint32_t makelong PI_ARGS((char *c));
 
@@ -202,8 +202,6 @@ slp_tx(pi_socket_t *ps, const unsigned char *buf, size_t len, int flags)
 	struct 	pi_slp_data *data;
 	struct 	slp *slp;
 	unsigned char *slp_buf;
-	unsigned int	i,
-			n;
 
 	prot = pi_protocol(ps->sd, PI_LEVEL_SLP);
 	if (prot == NULL)
@@ -231,9 +229,7 @@ slp_tx(pi_socket_t *ps, const unsigned char *buf, size_t len, int flags)
 	set_short(&slp->dlen, len);
 	slp->id_ 	= data->txid;
 
-	for (n = i = 0; i < 9; i++)
-		n += slp_buf[i];
-	slp->csum = 0xff & n;
+	slp->csum = slp_checksum(slp_buf);
 
 	/* Copy in the packet data */
 	memcpy (slp_buf + PI_SLP_HEADER_LEN, buf, len);
@@ -277,8 +273,7 @@ slp_tx(pi_socket_t *ps, const unsigned char *buf, size_t len, int flags)
 ssize_t
 slp_rx(pi_socket_t *ps, pi_buffer_t *buf, size_t len, int flags)
 {
-	int 	i,
-		computed_crc,
+	int 	computed_crc,
 		received_crc,
 		b1, 
 		b2, 
@@ -345,8 +340,7 @@ slp_rx(pi_socket_t *ps, pi_buffer_t *buf, size_t len, int flags)
 
 		case 2:
 			/* Addition check sum for header */
-			for (header_checksum = i = 0; i < 9; i++)
-				header_checksum += slp_buf->data[i];
+			header_checksum = slp_checksum(slp_buf->data);
 
 			/* read in the whole SLP header. */
 			if (header_checksum == slp_buf->data[PI_SLP_OFFSET_SUM]) {
@@ -25,6 +25,8 @@
 #include <config.h>
 #endif
 
+#include <PalmOS.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -37,6 +39,7 @@
 
 #include "pi-debug.h"
 #include "pi-source.h"
+#include "pi-slp.h"
 
 void pi_timeout_to_timespec(int timeout, struct timespec *ts);
 void get_pilot_rate(int *establishrate, int *establishhighrate);
@@ -60,19 +63,31 @@ size_t palm_strftime(char *s, size_t max, const char *fmt,
  ***********************************************************************/
 int crc16(unsigned char *ptr, int count)
 {
-	int	crc,
-		i;
-
-	crc = 0;
-	while (--count >= 0) {
-		crc = crc ^ (int) *ptr++ << 8;
-		for (i = 0; i < 8; ++i)
-			if (crc & 0x8000)
-				crc = crc << 1 ^ 0x1021;
-			else
-				crc = crc << 1;
-	}
-	return (crc & 0xFFFF);
+	/* same CRC-CCITT, computed by the table driven system routine */
+	return count > 0 ? Crc16CalcBigBlock(ptr, count, 0) : 0;
+}
+
+/***********************************************************************
+ *
+ * Function:    slp_checksum
+ *
+ * Summary:     Additive checksum of an SLP header, shared by the
+ *		transmit and receive paths
+ *
+ * Parameters:  Header, at least PI_SLP_OFFSET_SUM bytes
+ *
+ * Returns:     Sum of the bytes before the checksum byte, modulo 256
+ *
+ ***********************************************************************/
+unsigned char slp_checksum(const unsigned char *header)
+{
+	unsigned int sum = 0;
+	int i;
+
+	for (i = 0; i < PI_SLP_OFFSET_SUM; i++)
+		sum += header[i];
+
+	return (unsigned char)sum;
 }
 
 void get_pilot_rate(int *establishrate, int *establishhighrate)
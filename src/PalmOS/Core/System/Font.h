@@ -60,6 +60,8 @@ typedef struct FontTag
   uint8_t *width;
   uint8_t *data;
   BitmapType *bmp;
+  void *glyphs;
+  uint8_t advance[256];
 }
 #endif
 FontType;
@@ -106,6 +108,8 @@ typedef struct FontTagV2
   uint8_t **data;
   BitmapType **bmp;
   uint32_t size;
+  void *glyphs;
+  uint8_t advance[256];
 }
 #endif
 FontTypeV2;
@@ -18,6 +18,15 @@
 #define REALM         "HTTP"
 #define MAX_PATH      256
 #define MAX_HEADERS   64
+#define MAX_REQUESTS  100
+#define READ_TIMEOUT  100000
+#define HEADER_TIMEOUT 10000000
+#define MAX_WORKERS   8
+#define MAX_EVENTS    64
+#define MAX_BACKLOG   128
+#define MAX_HEADER    4096
+#define MAX_CHUNK     65536
+#define MIME_HASH     64
 
 #define TAG_HTTPD   "HTTPD"
 #define TAG_WORKER  "WORKER"
@@ -36,12 +45,56 @@ typedef struct httpd_server_t {
   secure_t *s;
   int (*callback)(http_connection_t *con);
   void *data;
+  int poll;
+  cond_t *cond;
+  http_connection_t *conns, *queue, *last;
+  int workers[MAX_WORKERS];
+  int num_workers, running;
 } httpd_server_t;
 
 static int conn_action(void *arg);
+static int conn_serve(http_connection_t *con, int park);
+static void conn_free(http_connection_t *con);
 static int unescape_url(char *url);
 static void plus2space(char *s);
 
+typedef struct {
+  char *ext;
+  char *mimetype;
+} mime_type_t;
+
+static mime_type_t mime_types[] = {
+  { "html", MIME_TYPE_HTML   },
+  { "htm",  MIME_TYPE_HTML   },
+  { "txt",  MIME_TYPE_TEXT   },
+  { "css",  MIME_TYPE_CSS    },
+  { "js",   MIME_TYPE_JS     },
+  { "json", MIME_TYPE_JSON   },
+  { "xml",  MIME_TYPE_XML    },
+  { "jpg",  MIME_TYPE_JPEG   },
+  { "jpeg", MIME_TYPE_JPEG   },
+  { "png",  MIME_TYPE_PNG    },
+  { "gif",  MIME_TYPE_GIF    },
+  { "bmp",  MIME_TYPE_BMP    },
+  { "svg",  MIME_TYPE_SVG    },
+  { "ico",  MIME_TYPE_ICON   },
+  { "pdf",  MIME_TYPE_PDF    },
+  { "zip",  MIME_TYPE_ZIP    },
+  { "wasm", MIME_TYPE_WASM   },
+  { "prc",  MIME_TYPE_PALM   },
+  { "pdb",  MIME_TYPE_PALM   },
+  { "pqa",  MIME_TYPE_PALM   },
+  { "wav",  MIME_TYPE_WAV    },
+  { "mp3",  MIME_TYPE_MP3    },
+  { "mid",  MIME_TYPE_MIDI   },
+  { "midi", MIME_TYPE_MIDI   },
+  { NULL,   NULL             }
+};
+
+// open addressing index into mime_types (entry + 1, 0 is empty), built by the first httpd_create
+static uint8_t mime_index[MIME_HASH];
+static int mime_ready;
+
 static char *weekday[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
 static char *month[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Ago", "Sep", "Oct", "Nov", "Dec"};
 
@@ -53,28 +106,31 @@ static int httpd_init(char *host, int port) {
     return -1;
   }
 
+  // the default backlog is too short for bursts of clients
+  sys_socket_listen(sock, MAX_BACKLOG);
+
   debug(DEBUG_INFO, "WEB", "HTTP server initialized on port %d", p);
 
   return sock;
 }
 
-static int httpd_spawn(int sock, char *host, int port, httpd_server_t *server, int timeout, ext_type_t *types, int num_types) {
+static http_connection_t *httpd_connection(int sock, char *host, int port, httpd_server_t *server, int timeout, ext_type_t *types, int num_types) {
   http_connection_t *con;
-  int handle;
 
   if ((con = xcalloc(1, sizeof(http_connection_t))) == NULL) {
-    return -1;
+    return NULL;
   }
 
   if (server->secure && (con->s = server->secure->connect(server->sc, host, port, sock)) == NULL) {
     xfree(con);
-    return -1;
+    return NULL;
   }
 
   con->tag = TAG_CONN;
   con->sock = sock;
   con->secure = server->secure;
   con->timeout = timeout;
+  con->header_t = sys_get_clock();
   con->system = server->system;
   con->home = server->home;
   con->callback = server->callback;
@@ -88,12 +144,25 @@ static int httpd_spawn(int sock, char *host, int port, httpd_server_t *server, i
   sys_strncpy(con->host, host, MAX_HOST-1);
   debug(DEBUG_INFO, "WEB", "connection from client %s:%d", con->host, con->remote_port);
 
+  return con;
+}
+
+static int httpd_spawn(int sock, char *host, int port, httpd_server_t *server, int timeout, ext_type_t *types, int num_types) {
+  http_connection_t *con;
+  int handle;
+
+  if ((con = httpd_connection(sock, host, port, server, timeout, types, num_types)) == NULL) {
+    return -1;
+  }
+
   if (server->multithreaded) {
     if ((handle = thread_begin(TAG_WORKER, conn_action, con)) == -1) {
       if (server->secure) server->secure->close(con->s);
       xfree(con);
     }
   } else {
+    // served inline by the caller's loop, so only one request per connection
+    con->once = 1;
     conn_action(con);
     handle = 0;
   }
@@ -212,7 +281,6 @@ static uint64_t parse_date(char *date) {
 static int httpd_handle(http_connection_t *con) {
   char *path, *p, *q, *e;
   sys_stat_t statbuf;
-  uint64_t if_modified_since;
   char *value;
   int n, i, isget, r;
 
@@ -272,6 +340,9 @@ static int httpd_handle(http_connection_t *con) {
     return httpd_reply(con, 400);
   }
 
+  // HTTP/1.1 connections are persistent unless the client says otherwise
+  con->keepalive = con->protocol[7] == '1';
+
   con->num_params = 0;
 
   if ((p = sys_strchr(con->uri, '?')) != NULL) {
@@ -321,8 +392,6 @@ static int httpd_handle(http_connection_t *con) {
 
   debug(DEBUG_TRACE, "WEB", "uri \"%s\"", con->uri);
 
-  if_modified_since = 0;
-
   con->num_headers = 0;
   for (p = con->headers; p && p[0] && con->num_headers < MAX_HEADERS;) {
     if ((q = sys_strstr(p, "\r\n")) == NULL) break;
@@ -348,18 +417,35 @@ static int httpd_handle(http_connection_t *con) {
     } else if (!sys_strcmp(con->header_name[con->num_headers], "Content-Type")) {
       con->content_type = con->header_value[con->num_headers];
 
-    } else if (!sys_strcmp(con->header_name[con->num_headers], "Connection")) {
-      con->keepalive = !sys_strcasecmp(con->header_value[con->num_headers], "keep-alive");
+    } else if (!sys_strcasecmp(con->header_name[con->num_headers], "Connection")) {
+      if (!sys_strcasecmp(con->header_value[con->num_headers], KEEP_ALIVE)) {
+        con->keepalive = 1;
+      } else if (!sys_strcasecmp(con->header_value[con->num_headers], CLOSE)) {
+        con->keepalive = 0;
+      }
       debug(DEBUG_TRACE, "WEB", "keep alive %d", con->keepalive);
 
-    } else if (!sys_strcmp(con->header_name[con->num_headers], "If-Modified-Since")) {
-      if_modified_since = parse_date(con->header_value[con->num_headers]);
-      debug(DEBUG_TRACE, "WEB", "if modified since %d (%s)", if_modified_since, con->header_value[con->num_headers]);
+    } else if (!sys_strcasecmp(con->header_name[con->num_headers], "If-Modified-Since")) {
+      con->if_modified_since = parse_date(con->header_value[con->num_headers]);
+      debug(DEBUG_TRACE, "WEB", "if modified since %llu (%s)", (unsigned long long)con->if_modified_since, con->header_value[con->num_headers]);
+
+    } else if (!sys_strcasecmp(con->header_name[con->num_headers], "If-None-Match")) {
+      con->if_none_match = con->header_value[con->num_headers];
+
+    } else if (!sys_strcasecmp(con->header_name[con->num_headers], "If-Range")) {
+      con->if_range = con->header_value[con->num_headers];
+
+    } else if (!sys_strcasecmp(con->header_name[con->num_headers], "Range")) {
+      con->range = con->header_value[con->num_headers];
     }
 
     con->num_headers++;
   }
 
+  if (con->once) {
+    con->keepalive = 0;
+  }
+
   for (i = 0; i < con->num_headers; i++) {
     debug(DEBUG_TRACE, "WEB", "header %d \"%s\" = \"%s\"", i, con->header_name[i], con->header_value[i]);
   }
@@ -402,9 +488,15 @@ static int httpd_handle(http_connection_t *con) {
     con->status = HTTPD_ACTION;
     if ((r = con->callback(con)) != 0) {
       debug(DEBUG_ERROR, "WEB", "callback failed (%d)", r);
+      con->keepalive = 0;
       xfree(path);
       return -1;
     }
+    if (!con->commited) {
+      // the client would wait for a response that never comes
+      debug(DEBUG_ERROR, "WEB", "callback sent no response");
+      con->keepalive = 0;
+    }
     xfree(path);
     return 0;
   }
@@ -415,13 +507,6 @@ static int httpd_handle(http_connection_t *con) {
     return httpd_reply(con, 400);
   }
 
-  if (if_modified_since && statbuf.mtime <= if_modified_since) {
-    debug(DEBUG_TRACE, "WEB", "\"%s\" not modified", path);
-    xfree(path);
-    httpd_reply(con, 304);
-    return 0;
-  }
-
   debug(DEBUG_INFO, "WEB", "sending file \"%s\"", path);
   r = httpd_file(con, path);
   xfree(path);
@@ -445,16 +530,23 @@ static void make_reply(char *header, int hlen, int code, char *msg, char *system
   sys_snprintf(header, hlen, "HTTP/1.1 %d %s\r\nServer: %s\r\nDate: %s\r\n", code, msg, system, date);
 }
 
-static void make_header(char *header, int hlen, int code, char *status, char *type, int length, uint64_t modified, int cache, http_connection_t *con) {
+static int keepalive_timeout(http_connection_t *con) {
+  int t = (int)(((int64_t)con->timeout * READ_TIMEOUT) / 1000000);
+
+  return t > 0 ? t : 1;
+}
+
+static void make_header(char *header, int hlen, int code, char *status, char *type, int64_t length, uint64_t modified, int cache, http_connection_t *con) {
   char data_mod[80], op_mod[80], op_length[80], op_cache[80];
   int n, i;
 
   make_reply(header, hlen, code, status, con->system);
   n = sys_strlen(header);
+  con->commited = 1;
 
   if (type) {
     if (length >= 0) {
-      sys_snprintf(op_length, sizeof(op_length)-1, "\r\nContent-Length: %d", length);
+      sys_snprintf(op_length, sizeof(op_length)-1, "\r\nContent-Length: %lld", (long long)length);
     } else {
       op_length[0] = '\0';
     }
@@ -484,6 +576,11 @@ static void make_header(char *header, int hlen, int code, char *status, char *ty
     }
   }
 
+  if (con->keepalive) {
+    sys_snprintf(header+n, hlen-n, "Keep-Alive: timeout=%d, max=%d\r\n", keepalive_timeout(con), MAX_REQUESTS);
+    n = sys_strlen(header);
+  }
+
   sys_snprintf(header+n, hlen-n, "Connection: %s\r\n\r\n", con->keepalive ? KEEP_ALIVE : CLOSE);
 }
 
@@ -531,11 +628,15 @@ static char *status_msg(int code) {
 
   switch (code) {
     case 200: msg = "OK"; break;
+    case 206: msg = "Partial Content"; break;
     case 304: msg = "Not Modified"; break;
     case 400: msg = "Bad Request"; break;
     case 401: msg = "Unauthorized"; break;
     case 403: msg = "Forbidden"; break;
     case 404: msg = "Not Found"; break;
+    case 408: msg = "Request Timeout"; break;
+    case 416: msg = "Range Not Satisfiable"; break;
+    case 431: msg = "Request Header Fields Too Large"; break;
     case 500: msg = "Internal Server Error"; break;
     case 501: msg = "Not Implemented"; break;
     case 503: msg = "Service Unavailable"; break;
@@ -567,39 +668,212 @@ int httpd_string(http_connection_t *con, int code, char *str, char *mime) {
   return 0;
 }
 
-int httpd_file_stream(http_connection_t *con, int fd, char *mime, uint64_t mtime) {
-  int len, n, i;
-  char *buffer;
+// returns 1 if the entity tag etag is in the comma separated list of an
+// If-None-Match or If-Range header; weak tags only match when weak is set
+static int match_etag(char *list, char *etag, int weak) {
+  int n, len;
 
-  if (sys_seek(fd, 0, SYS_SEEK_END) == -1) {
-    return httpd_reply(con, 500);
+  len = sys_strlen(etag);
+
+  for (; *list;) {
+    while (*list == ' ' || *list == ',') list++;
+    if (*list == '*') return 1;
+    if (!sys_strncmp(list, "W/", 2)) {
+      if (!weak) return 0;
+      list += 2;
+    }
+    for (n = 0; list[n] && list[n] != ',' && list[n] != ' '; n++);
+    if (n == len && !sys_strncmp(list, etag, len)) return 1;
+    list += n;
   }
-  len = sys_seek(fd, 0, SYS_SEEK_CUR);
 
-  if (sys_seek(fd, 0, SYS_SEEK_SET) == -1) {
-    return httpd_reply(con, 500);
+  return 0;
+}
+
+static int parse_offset(char **s, int64_t *value) {
+  int n;
+
+  for (n = 0, *value = 0; (*s)[0] >= '0' && (*s)[0] <= '9' && *value < 0x7fffffffffffLL; n++, (*s)++) {
+    *value = *value * 10 + (*s)[0] - '0';
   }
 
-  n = len;
-  if (n < MAX_PACKET) n = MAX_PACKET;
-  else if (n > 65536) n = 65536;
+  return n;
+}
 
+// Parses a single "bytes=" range of a Range header against an entity of
+// len bytes. Returns 1 and the inclusive range in first and last, 0 if the
+// header must be ignored (invalid or several ranges) and -1 if the range is
+// not satisfiable.
+static int parse_range(char *s, int64_t len, int64_t *first, int64_t *last) {
+  int64_t a, b;
+
+  if (sys_strncasecmp(s, "bytes=", 6) || sys_strchr(s, ',')) return 0;
+  s += 6;
+  while (*s == ' ') s++;
+
+  if (*s == '-') {
+    s++;
+    if (parse_offset(&s, &b) == 0) return 0;
+    if (b == 0 || len == 0) return -1;
+    a = len > b ? len - b : 0;
+    b = len - 1;
+  } else {
+    if (parse_offset(&s, &a) == 0 || *s != '-') return 0;
+    s++;
+    if (parse_offset(&s, &b) == 0) b = -1;
+    else if (b < a) return 0;
+    if (a >= len) return -1;
+    if (b == -1 || b >= len) b = len - 1;
+  }
+
+  while (*s == ' ') s++;
+  if (*s) return 0;
+
+  *first = a;
+  *last = b;
+
+  return 1;
+}
+
+// Sends count bytes of fd starting at offset: with sendfile on plain
+// sockets, from a read only mapping under TLS, and through a buffer when
+// neither is available.
+static int httpd_send_fd(http_connection_t *con, int fd, int64_t offset, int64_t count) {
+  uint8_t *p, *buffer;
+  int64_t sent;
+  int n, i;
+
+  if (count <= 0) {
+    return 0;
+  }
+
+  if (con->secure == NULL) {
+    if ((sent = sys_sendfile(con->sock, fd, offset, count)) != -1) {
+      return sent == count ? 0 : -1;
+    }
+
+  } else if ((p = sys_mmap(fd, offset + count)) != NULL) {
+    for (sent = 0; sent < count && !thread_must_end(); sent += n) {
+      n = (count - sent) > MAX_CHUNK ? MAX_CHUNK : (int)(count - sent);
+      if (httpd_write(con, p + offset + sent, n) != n) break;
+    }
+    sys_munmap(p, offset + count);
+    return sent == count ? 0 : -1;
+  }
+
+  if (sys_seek(fd, offset, SYS_SEEK_SET) == -1) {
+    return -1;
+  }
+
+  n = count > MAX_CHUNK ? MAX_CHUNK : (int)count;
   if ((buffer = xmalloc(n)) == NULL) {
+    return -1;
+  }
+
+  for (sent = 0; sent < count && !thread_must_end(); sent += i) {
+    i = (count - sent) > n ? n : (int)(count - sent);
+    if ((i = sys_read(fd, buffer, i)) <= 0) break;
+    if (httpd_write(con, buffer, i) != i) break;
+  }
+  xfree(buffer);
+
+  return sent == count ? 0 : -1;
+}
+
+// Sends an open file. When mtime is given the reply carries an ETag made of
+// mtime and size, and If-None-Match or If-Modified-Since are answered with
+// 304. A single byte range is answered with 206, unless an If-Range
+// validator does not match.
+int httpd_file_stream(http_connection_t *con, int fd, char *mime, uint64_t mtime) {
+  char header[MAX_HEADER], etag[64], range[80];
+  int64_t len, first, last;
+  int code, r;
+
+  if ((len = sys_seek(fd, 0, SYS_SEEK_END)) == -1) {
     return httpd_reply(con, 500);
   }
 
-  make_header(buffer, n-1, 200, "OK", mime, len, mtime, 1, con);
-  httpd_write(con, (uint8_t *)buffer, sys_strlen(buffer));
-  debug(DEBUG_TRACE, "WEB", "sending header \"%s\"", buffer);
+  etag[0] = 0;
+  if (mtime) {
+    sys_snprintf(etag, sizeof(etag)-1, "\"%llx-%llx\"", (unsigned long long)mtime, (unsigned long long)len);
+    httpd_set_header(con, "ETag", etag);
 
-  for (; !thread_must_end();) {
-    if ((i = sys_read(fd, (uint8_t *)buffer, n)) <= 0) break;
-    httpd_write(con, (uint8_t *)buffer, i);
+    if (con->if_none_match ? match_etag(con->if_none_match, etag, 1) : (con->if_modified_since && mtime <= con->if_modified_since)) {
+      debug(DEBUG_TRACE, "WEB", "\"%s\" not modified", con->uri ? con->uri : "");
+      make_header(header, sizeof(header)-1, 304, status_msg(304), NULL, -1, 0, 1, con);
+      httpd_write(con, (uint8_t *)header, sys_strlen(header));
+      return 0;
+    }
   }
 
-  xfree(buffer);
+  httpd_set_header(con, "Accept-Ranges", "bytes");
+  first = 0;
+  last = len - 1;
+  code = 200;
+
+  if (con->range && (con->if_range == NULL ||
+      (etag[0] && (con->if_range[0] == '"' ? match_etag(con->if_range, etag, 0) : parse_date(con->if_range) == mtime)))) {
+    switch (parse_range(con->range, len, &first, &last)) {
+      case 1:
+        sys_snprintf(range, sizeof(range)-1, "bytes %lld-%lld/%lld", (long long)first, (long long)last, (long long)len);
+        httpd_set_header(con, "Content-Range", range);
+        code = 206;
+        break;
+      case -1:
+        sys_snprintf(range, sizeof(range)-1, "bytes */%lld", (long long)len);
+        httpd_set_header(con, "Content-Range", range);
+        debug(DEBUG_ERROR, "WEB", "range \"%s\" not satisfiable", con->range);
+        make_header(header, sizeof(header)-1, 416, status_msg(416), MIME_TYPE_TEXT, 0, 0, 1, con);
+        httpd_write(con, (uint8_t *)header, sys_strlen(header));
+        return 0;
+    }
+  }
 
-  return 0;
+  make_header(header, sizeof(header)-1, code, status_msg(code), mime, last - first + 1, mtime, 1, con);
+  httpd_write(con, (uint8_t *)header, sys_strlen(header));
+  debug(DEBUG_TRACE, "WEB", "sending header \"%s\"", header);
+
+  if ((r = httpd_send_fd(con, fd, first, last - first + 1)) != 0) {
+    // the body was cut short, so the connection can not carry another reply
+    debug(DEBUG_ERROR, "WEB", "file body not completely sent");
+    con->keepalive = 0;
+  }
+
+  return r;
+}
+
+static char *mime_lookup(char *ext) {
+  uint32_t h, i;
+  int j;
+
+  for (h = 0, j = 0; ext[j]; j++) {
+    h = h * 31 + sys_tolower(ext[j]);
+  }
+
+  for (i = h % MIME_HASH; mime_index[i]; i = (i + 1) % MIME_HASH) {
+    if (!sys_strcasecmp(ext, mime_types[mime_index[i] - 1].ext)) {
+      return mime_types[mime_index[i] - 1].mimetype;
+    }
+  }
+
+  return NULL;
+}
+
+static void mime_init(void) {
+  uint32_t h, i;
+  int j, k;
+
+  if (mime_ready) return;
+
+  for (k = 0; mime_types[k].ext; k++) {
+    for (h = 0, j = 0; mime_types[k].ext[j]; j++) {
+      h = h * 31 + mime_types[k].ext[j];
+    }
+    for (i = h % MIME_HASH; mime_index[i]; i = (i + 1) % MIME_HASH);
+    mime_index[i] = k + 1;
+  }
+
+  mime_ready = 1;
 }
 
 int httpd_file(http_connection_t *con, char *filename) {
@@ -627,19 +901,7 @@ int httpd_file(http_connection_t *con, char *filename) {
     }
 
     if (mimetype == NULL) {
-      if (!sys_strcmp(ext, "jpg")) {
-        mimetype = MIME_TYPE_JPEG;
-      } else if (!sys_strcmp(ext, "png")) {
-        mimetype = MIME_TYPE_PNG;
-      } else if (!sys_strcmp(ext, "html")) {
-        mimetype = MIME_TYPE_HTML;
-      } else if (!sys_strcmp(ext, "js")) {
-        mimetype = MIME_TYPE_JS;
-      } else if (!sys_strcmp(ext, "css")) {
-        mimetype = MIME_TYPE_CSS;
-      } else if (!sys_strcmp(ext, "txt")) {
-        mimetype = MIME_TYPE_TEXT;
-      }
+      mimetype = mime_lookup(ext);
     }
   }
 
@@ -658,8 +920,14 @@ int httpd_reply(http_connection_t *con, int code) {
   msg = status_msg(code);
   r = (code == 200) ? 0 : -1;
 
+  // after a malformed request or a server error the connection is not reused
+  if (code == 400 || code >= 500) {
+    con->keepalive = 0;
+  }
+
   debug(code < 400 ? DEBUG_INFO : DEBUG_ERROR, "WEB", "reply %d (%s)", code, msg);
   make_reply(buffer, sizeof(buffer)-1, code, msg, con->system);
+  con->commited = 1;
 
   body[0] = 0;
   if (code >= 400 && code < 600) {
@@ -672,9 +940,15 @@ int httpd_reply(http_connection_t *con, int code) {
 
   if (body[0]) {
     sys_snprintf(&buffer[sys_strlen(buffer)], sizeof(buffer)-sys_strlen(buffer)-1, "MIME-version: 1.0\r\nContent-Type: text/html\r\nContent-Length: %d\r\n", (int)sys_strlen(body));
+  } else if (code != 304) {
+    sys_strncat(buffer, "Content-Length: 0\r\n", sizeof(buffer)-sys_strlen(buffer)-1);
   }
 
-  sys_strncat(buffer, "Connection: close\r\n\r\n", sizeof(buffer)-sys_strlen(buffer)-1);
+  if (con->keepalive) {
+    sys_snprintf(&buffer[sys_strlen(buffer)], sizeof(buffer)-sys_strlen(buffer)-1, "Keep-Alive: timeout=%d, max=%d\r\n", keepalive_timeout(con), MAX_REQUESTS);
+  }
+
+  sys_snprintf(&buffer[sys_strlen(buffer)], sizeof(buffer)-sys_strlen(buffer)-1, "Connection: %s\r\n\r\n", con->keepalive ? KEEP_ALIVE : CLOSE);
   httpd_write(con, (uint8_t *)buffer, sys_strlen(buffer));
 
   if (body[0]) {
@@ -699,116 +973,417 @@ static int httpd_closesock(secure_provider_t *secure, secure_t *s, int sock) {
   return r;
 }
 
-static int con_save(http_connection_t *con, uint32_t us) {
-  unsigned char buf[1024];
-  int nread, n, r = 0;
+// reads exactly len bytes of the request body
+static int con_recv(http_connection_t *con, uint8_t *buf, int len, uint32_t us) {
+  int nread, n, timeouts;
 
-  for (; !thread_must_end();) {
-    n = httpd_read(con, buf, sizeof(buf), &nread, us);
-    if (n == 0) break;
-    if (n < 0) {
-      r = -1;
-      break;
+  for (timeouts = 0; len > 0 && !thread_must_end();) {
+    n = httpd_read(con, buf, len, &nread, us);
+    if (n < 0 || (n == 1 && nread == 0)) {
+      return -1;
     }
-    if (nread == 0) break;
+    if (n == 0 || nread == 0) {
+      if (con->timeout >= 0 && ++timeouts >= con->timeout) {
+        return -1;
+      }
+      continue;
+    }
+    timeouts = 0;
+    buf += nread;
+    len -= nread;
+  }
 
-    if (sys_write(con->body_fd, buf, nread) != nread) {
+  return len == 0 ? 0 : -1;
+}
+
+// reads the remaining len bytes of a large request body into body_fd
+static int con_save(http_connection_t *con, int len, uint32_t us) {
+  uint8_t *buf;
+  int n, r = 0;
+
+  if ((buf = xmalloc(MAX_BODY_MEM)) == NULL) {
+    return -1;
+  }
+
+  for (; len > 0;) {
+    n = len < MAX_BODY_MEM ? len : MAX_BODY_MEM;
+    if (con_recv(con, buf, n, us) != 0 || sys_write(con->body_fd, buf, n) != n) {
       r = -1;
       break;
     }
+    len -= n;
   }
+  xfree(buf);
 
   return r;
 }
 
-static int conn_action(void *arg) {
-  http_connection_t *con;
-  int i, r, n, nread, err, timeouts;
+// Gets the body of the current request. avail bytes of it are already at
+// data. Bodies already in the request buffer are used in place, small ones
+// are read into memory and only large ones are spooled to a temporary file.
+static int con_body(http_connection_t *con, char *data, int avail, int len) {
+  con->body = NULL;
+  con->body_len = len;
+  con->body_pos = 0;
+  con->body_alloc = 0;
+  con->body_fd = 0;
+
+  if (len == 0 || avail == len) {
+    con->body = data;
+    return 0;
+  }
+
+  if (len <= MAX_BODY_MEM) {
+    if ((con->body = xmalloc(len)) == NULL) return -1;
+    con->body_alloc = 1;
+    if (avail > 0) sys_memcpy(con->body, data, avail);
+    return con_recv(con, (uint8_t *)con->body + avail, len - avail, READ_TIMEOUT);
+  }
+
+  if ((con->body_fd = sys_mkstemp()) == -1) {
+    con->body_fd = 0;
+    return -1;
+  }
+
+  if ((avail > 0 && sys_write(con->body_fd, (uint8_t *)data, avail) != avail) ||
+      con_save(con, len - avail, READ_TIMEOUT) != 0) {
+    return -1;
+  }
+  sys_seek(con->body_fd, 0, SYS_SEEK_SET);
+
+  return 0;
+}
+
+static void con_body_free(http_connection_t *con) {
+  if (con->body_fd > 0) sys_close(con->body_fd);
+  if (con->body_alloc) xfree(con->body);
+  con->body_fd = 0;
+  con->body = NULL;
+  con->body_alloc = 0;
+  con->body_len = 0;
+  con->body_pos = 0;
+}
+
+int httpd_body_read(http_connection_t *con, uint8_t *buf, int len) {
+  int n;
+
+  if (con->body_fd > 0) {
+    return sys_read(con->body_fd, buf, len);
+  }
+
+  n = con->body_len - con->body_pos;
+  if (len > n) len = n;
+  if (len > 0) {
+    sys_memcpy(buf, con->body + con->body_pos, len);
+    con->body_pos += len;
+  }
+
+  return len;
+}
+
+// returns the Content-Length of the request whose header ends at end, or -1 if the body can not be delimited
+static int request_length(char *buffer, char *end) {
+  char *p, *q;
+  int len = 0;
+
+  for (p = sys_strstr(buffer, "\r\n"); p && p < end; p = q) {
+    p += 2;
+    q = sys_strstr(p, "\r\n");
+    if (!sys_strncasecmp(p, "Content-Length:", 15)) {
+      len = sys_atoi(p + 15 + (p[15] == ' '));
+      if (len < 0) return -1;
+    } else if (!sys_strncasecmp(p, "Transfer-Encoding:", 18)) {
+      // chunked request bodies are not supported
+      return -1;
+    }
+  }
+
+  return len;
+}
+
+// releases the per request state, so that the next request on the connection starts clean
+static void con_reset(http_connection_t *con) {
+  int i;
+
+  for (i = 0; i < con->num_res_headers; i++) {
+    if (con->res_header_name[i]) xfree(con->res_header_name[i]);
+    if (con->res_header_value[i]) xfree(con->res_header_value[i]);
+    con->res_header_name[i] = NULL;
+    con->res_header_value[i] = NULL;
+  }
+
+  con->num_res_headers = 0;
+  con->num_headers = 0;
+  con->num_params = 0;
+  con->method = NULL;
+  con->uri = NULL;
+  con->protocol = NULL;
+  con->headers = NULL;
+  con->content_type = NULL;
+  con->content_length = 0;
+  con->authorization = NULL;
+  con->if_modified_since = 0;
+  con->if_none_match = NULL;
+  con->if_range = NULL;
+  con->range = NULL;
+  con->commited = 0;
+  con->keepalive = 0;
+  con_body_free(con);
+}
+
+// Serves the requests of a connection until the client closes it, stops
+// asking for keep-alive or stays idle for con->timeout reads. Pipelined
+// requests are kept in con->buffer after the body of the current one.
+// When park is set and the connection is idle between requests, it returns
+// 1 instead of waiting, so the reactor can watch the socket meanwhile.
+// A request header must fit in the buffer and arrive within HEADER_TIMEOUT
+// of the accept (first request) or of its first byte, however it trickles in.
+static int conn_serve(http_connection_t *con, int park) {
+  int i, r, n, len, avail, hlen, nread, timeouts;
   char *p;
 
-  con = (http_connection_t *)arg;
   timeouts = 0;
   n = 0;
 
-  for (; !thread_must_end() && n < MAX_PACKET-1 && (con->timeout < 0 || timeouts < con->timeout);) {
-    r = httpd_read(con, (unsigned char *)&con->buffer[n], MAX_PACKET-1-n, &nread, 100000);
-    debug(DEBUG_TRACE, "WEB", "read r=%d n=%d ", r, nread);
-    if (r < 0) break;
-    if (r == 0 || nread == 0) {
-      timeouts++;
+  for (; !thread_must_end() && (con->timeout < 0 || timeouts < con->timeout);) {
+    con->buffer[n] = 0;
+
+    if ((p = sys_strstr(con->buffer, "\r\n\r\n")) == NULL) {
+      if (n == MAX_PACKET-1) {
+        debug(DEBUG_ERROR, "WEB", "end of request header not found in \"%s\"", con->buffer);
+        httpd_reply(con, 431);
+        break;
+      }
+      if (con->header_t && sys_get_clock() - con->header_t > HEADER_TIMEOUT) {
+        debug(DEBUG_ERROR, "WEB", "request header from %s:%d incomplete after %d us", con->host, con->remote_port, HEADER_TIMEOUT);
+        httpd_reply(con, 408);
+        break;
+      }
+      r = httpd_read(con, (unsigned char *)&con->buffer[n], MAX_PACKET-1-n, &nread, READ_TIMEOUT);
+      debug(DEBUG_TRACE, "WEB", "read r=%d n=%d ", r, nread);
+      if (r < 0) break;
+      if (r == 1 && nread == 0) break;
+      if (r == 0 || nread == 0) {
+        timeouts++;
+        continue;
+      }
+      if (con->header_t == 0) con->header_t = sys_get_clock();
+      timeouts = 0;
+      n += nread;
       continue;
     }
-    if (nread == 0) break;
 
-    timeouts = 0;
-    n += nread;
-    con->buffer[n] = 0;
-    con->body_fd = 0;
     debug(DEBUG_TRACE, "WEB", "buffer \"%s\"", con->buffer);
+    hlen = p + 4 - con->buffer;
 
-    if ((p = sys_strstr(con->buffer, "\r\n\r\n")) == NULL) {
-      continue;
+    if ((len = request_length(con->buffer, p)) == -1) {
+      httpd_reply(con, 501);
+      break;
     }
 
-    // XXX
-    if ((p = sys_strstr(con->buffer, "\r\n\r\n")) != NULL) {
-      if ((con->body_fd = sys_mkstemp()) != -1) {
-        n -= (p + 4 - con->buffer);
-        p[2] = 0;
-        err = 0;
+    // part of the body (and maybe the next request) may already be in the buffer
+    avail = n - hlen;
+    if (avail > len) avail = len;
 
-        if (n > 0) {
-          if (sys_write(con->body_fd, (uint8_t *)(p+4), n) != n) {
-            err = -1;
-          } else {
-            err = con_save(con, 100000);
-          }
-        }
+    if (con_body(con, p+4, avail, len) != 0) {
+      httpd_reply(con, 500);
+      r = -1;
+    } else {
+      p[2] = 0;
+      r = httpd_handle(con);
+    }
 
-        if (err) {
-          httpd_reply(con, 500);
-          r = -1;
-        } else {
-          sys_seek(con->body_fd, 0, SYS_SEEK_SET);
-          r = httpd_handle(con);
-        }
+    con_body_free(con);
+    con->requests++;
 
-        sys_close(con->body_fd);
-        con->body_fd = 0;
-        n = 0;
-        // can't handle more than one request because the callback
-        // inside httpd_handle may have freed resources
-        //if (!con->keepalive || r != 0) break;
-        break;
+    if (!con->keepalive || con->requests >= MAX_REQUESTS) break;
 
-      } else {
-        httpd_reply(con, 500);
-        break;
-      }
+    // move the pipelined bytes to the beginning of the buffer
+    n -= hlen + avail;
+    for (i = 0; i < n; i++) {
+      con->buffer[i] = con->buffer[hlen + avail + i];
+    }
+    con_reset(con);
+    con->header_t = n ? sys_get_clock() : 0;
+    timeouts = 0;
 
-    } else {
-      debug(DEBUG_ERROR, "WEB", "end of request header not found in \"%s\"", con->buffer);
-      httpd_reply(con, 400);
-      break;
+    if (park && n == 0) {
+      return 1;
     }
   }
 
-  debug(DEBUG_INFO, "WEB", "client %s:%d disconnected", con->host, con->remote_port);
+  debug(DEBUG_INFO, "WEB", "client %s:%d disconnected after %d request(s)", con->host, con->remote_port, con->requests);
 
-  thread_end(TAG_WORKER, thread_get_handle());
-  httpd_closesock(con->secure, con->s, con->sock);
+  return 0;
+}
 
-  for (i = 0; i < con->num_res_headers; i++) {
-    if (con->res_header_name[i]) xfree(con->res_header_name[i]);
-    if (con->res_header_value[i]) xfree(con->res_header_value[i]);
-  }
+static void conn_free(http_connection_t *con) {
+  httpd_closesock(con->secure, con->s, con->sock);
+  con_reset(con);
 
   if (con->types) xfree(con->types);
   xfree(con);
+}
+
+static int conn_action(void *arg) {
+  http_connection_t *con;
+
+  con = (http_connection_t *)arg;
+  conn_serve(con, 0);
+  thread_end(TAG_WORKER, thread_get_handle());
+  conn_free(con);
 
   return 0;
 }
 
+// Reactor mode: the server thread waits on all idle connections at once
+// and hands the ones with pending requests to a fixed pool of workers (or
+// serves them inline when the server is not multithreaded). A connection
+// is owned by whoever is serving it; once idle again it is rearmed.
+
+static void reactor_release(httpd_server_t *server, http_connection_t *con, int parked) {
+  if (parked && sys_poll_rearm(server->poll, con->sock, con) == 0) {
+    return;
+  }
+
+  mutex_lock(server->mutex);
+  if (con->prev) con->prev->next = con->next;
+  else server->conns = con->next;
+  if (con->next) con->next->prev = con->prev;
+  mutex_unlock(server->mutex);
+
+  conn_free(con);
+}
+
+static void reactor_dispatch(httpd_server_t *server, http_connection_t *con) {
+  if (server->num_workers == 0) {
+    reactor_release(server, con, conn_serve(con, 1));
+    return;
+  }
+
+  mutex_lock(server->mutex);
+  con->qnext = NULL;
+  if (server->last) server->last->qnext = con;
+  else server->queue = con;
+  server->last = con;
+  cond_signal(server->cond);
+  mutex_unlock(server->mutex);
+}
+
+static int reactor_worker(void *arg) {
+  httpd_server_t *server;
+  http_connection_t *con;
+
+  server = (httpd_server_t *)arg;
+
+  for (; !thread_must_end();) {
+    mutex_lock(server->mutex);
+    if (server->queue == NULL) {
+      cond_timedwait(server->cond, server->mutex, READ_TIMEOUT);
+    }
+    if ((con = server->queue) != NULL) {
+      server->queue = con->qnext;
+      if (server->queue == NULL) server->last = NULL;
+    }
+    mutex_unlock(server->mutex);
+
+    if (con) {
+      reactor_release(server, con, conn_serve(con, 1));
+    }
+  }
+
+  mutex_lock(server->mutex);
+  server->running--;
+  mutex_unlock(server->mutex);
+
+  return 0;
+}
+
+static int reactor_accept(httpd_server_t *server) {
+  http_connection_t *con;
+  sys_timeval_t tv;
+  char host[MAX_HOST];
+  int sock, port;
+
+  for (;;) {
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    if ((sock = sys_socket_accept(server->sock, host, MAX_HOST, &port, &tv)) <= 0) return sock;
+
+    if ((con = httpd_connection(sock, host, port, server, 10, NULL, 0)) == NULL) {
+      sys_close(sock);
+      continue;
+    }
+    con->server = server;
+
+    mutex_lock(server->mutex);
+    con->prev = NULL;
+    con->next = server->conns;
+    if (server->conns) server->conns->prev = con;
+    server->conns = con;
+    mutex_unlock(server->mutex);
+
+    if (sys_poll_add(server->poll, sock, 1, con) == -1) {
+      reactor_release(server, con, 0);
+    }
+  }
+}
+
+static void reactor_loop(httpd_server_t *server, http_connection_t *status) {
+  http_connection_t *con;
+  void *ready[MAX_EVENTS];
+  int i, n;
+
+  if (sys_poll_add(server->poll, server->sock, 0, server) == -1) return;
+
+  if (server->multithreaded) {
+    server->cond = cond_create("httpd");
+    for (i = 0; i < MAX_WORKERS && server->cond; i++) {
+      if ((server->workers[i] = thread_begin(TAG_WORKER, reactor_worker, server)) == -1) break;
+      server->num_workers++;
+      server->running++;
+    }
+  }
+  debug(DEBUG_INFO, "WEB", "HTTP server using reactor with %d worker(s)", server->num_workers);
+
+  for (; !thread_must_end();) {
+    if ((n = sys_poll_wait(server->poll, ready, MAX_EVENTS, server->multithreaded ? READ_TIMEOUT : 0)) == -1) break;
+
+    for (i = 0; i < n; i++) {
+      if (ready[i] == server) {
+        if (reactor_accept(server) == -1) break;
+      } else {
+        reactor_dispatch(server, (http_connection_t *)ready[i]);
+      }
+    }
+    if (i < n) break;
+
+    if (n == 0) {
+      status->status = HTTPD_IDLE;
+      if (server->callback(status) != 0) break;
+    }
+  }
+
+  for (i = 0; i < server->num_workers; i++) {
+    thread_end(TAG_WORKER, server->workers[i]);
+  }
+  // workers still own the connections they are serving
+  for (;;) {
+    mutex_lock(server->mutex);
+    n = server->running;
+    mutex_unlock(server->mutex);
+    if (n == 0) break;
+    sys_usleep(10000);
+  }
+
+  // connections that were idle or still queued
+  for (con = server->conns; con; con = server->conns) {
+    server->conns = con->next;
+    conn_free(con);
+  }
+  if (server->cond) cond_destroy(server->cond);
+}
+
 static void plus2space(char *s) {
   int i;
 
@@ -860,7 +1435,13 @@ static int httpd_action(void *arg) {
   con->data = server->data;
   server->callback(con);
 
-  for (; !thread_must_end();) {
+  // TLS sessions may buffer data the socket does not report, so they keep one thread per connection
+  if (server->secure == NULL && (server->poll = sys_poll_create()) != -1) {
+    reactor_loop(server, con);
+    sys_close(server->poll);
+  }
+
+  for (; server->poll == -1 && !thread_must_end();) {
     tv.tv_sec = 0;
     tv.tv_usec = server->multithreaded ? 100000 : 0;
     if ((sock = sys_socket_accept(server->sock, host, MAX_HOST, &port, &tv)) == -1) break;
@@ -926,7 +1507,9 @@ int httpd_create(char *host, int port, char *system, char *home, char *user, cha
     }
   }
 
+  mime_init();
   server->multithreaded = multithreaded;
+  server->poll = -1;
   server->system = xstrdup(system);
   server->home = xstrdup(home);
   server->user = user && user[0] ? xstrdup(user) : NULL;
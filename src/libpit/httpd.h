@@ -8,6 +8,11 @@
 #define MAX_EXT  16
 #define MAX_MIME 256
 
+// request bodies up to this size are kept in memory, larger ones go to a temporary file
+#ifndef MAX_BODY_MEM
+#define MAX_BODY_MEM 65536
+#endif
+
 #define TAG_CONN  "connection"
 
 typedef enum {
@@ -19,12 +24,15 @@ typedef struct {
   char mimetype[MAX_MIME];
 } ext_type_t;
 
+struct httpd_server_t;
+
 typedef struct http_connection_t {
   char *tag;
   int sock;
   httpd_status_t status;
   int keepalive;
   int timeout;
+  int64_t header_t;
   int commited;
   int remote_port;
   char host[MAX_HOST];
@@ -47,7 +55,13 @@ typedef struct http_connection_t {
   char *res_header_name[MAX_REQ_HEADERS];
   char *res_header_value[MAX_REQ_HEADERS];
   char *authorization;
+  uint64_t if_modified_since;
+  char *if_none_match;
+  char *if_range;
+  char *range;
   int body_fd;
+  char *body;
+  int body_len, body_pos, body_alloc;
   char body_buf[MAX_PACKET];
   char *user;
   char *password;
@@ -59,6 +73,10 @@ typedef struct http_connection_t {
   void *response_data;
   ext_type_t *types;
   int num_types;
+  int requests;
+  int once;
+  struct httpd_server_t *server;
+  struct http_connection_t *prev, *next, *qnext;
 } http_connection_t;
 
 int httpd_string(http_connection_t *con, int code, char *str, char *mime);
@@ -67,6 +85,19 @@ int httpd_file_stream(http_connection_t *con, int fd, char *mime, uint64_t mtime
 int httpd_set_header(http_connection_t *con, char *name, char *value);
 int httpd_reply(http_connection_t *con, int code);
 
+// Reads up to len bytes of the request body, returning the number of bytes
+// read and 0 at its end (content_length bytes in total). Depending on its
+// size the body is held in memory or spooled to a temporary file, so
+// callbacks must read it with httpd_body_read and not through body_fd.
+int httpd_body_read(http_connection_t *con, uint8_t *buf, int len);
+
+// The callback is called with status HTTPD_ACTION once per request, and a
+// connection may carry several requests (keep-alive and pipelining). The
+// request fields (method, uri, headers, params) and body, and the response
+// headers set with httpd_set_header are only valid until the callback
+// returns, so it must not keep references to them. A callback that does
+// not want to be called again on the same connection clears con->keepalive;
+// returning non-zero also closes the connection.
 int httpd_create(char *host, int port, char *system, char *home, char *user, char *password, secure_provider_t *secure, char *cert, char *key, int (*callback)(http_connection_t *con), void *data, int multithreaded);
 int httpd_close(int handle);
 
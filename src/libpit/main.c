@@ -5,6 +5,7 @@
 #include "vfs.h"
 #include "ptr.h"
 #include "thread.h"
+#include "mutex.h"
 #include "vfont.h"
 #include "endianness.h"
 #include "debug.h"
@@ -33,6 +34,9 @@ int pit_main(int argc, char *argv[], void (*callback)(int pe, void *data), void
           case 'f':
             debugfile = argv[++i];
             break;
+          case 'm':
+            mutex_stats(1);
+            break;
           case 'd':
             d = argv[++i];
             dlevel = sys_atoi(d);
@@ -129,6 +133,7 @@ int pit_main(int argc, char *argv[], void (*callback)(int pe, void *data), void
   vfs_finish();
   status = thread_get_status();
   thread_close();
+  mutex_report();
   debug(DEBUG_INFO, "MAIN", "%s stopping", SYSTEM_NAME);
   debug_close();
 
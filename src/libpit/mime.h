@@ -9,5 +9,18 @@
 #define MIME_TYPE_BINARY "application/octet-stream"
 #define MIME_TYPE_JPEG   "image/jpeg"
 #define MIME_TYPE_PNG    "image/png"
+#define MIME_TYPE_GIF    "image/gif"
+#define MIME_TYPE_BMP    "image/bmp"
+#define MIME_TYPE_SVG    "image/svg+xml"
+#define MIME_TYPE_ICON   "image/x-icon"
+#define MIME_TYPE_JSON   "application/json"
+#define MIME_TYPE_XML    "application/xml"
+#define MIME_TYPE_PDF    "application/pdf"
+#define MIME_TYPE_ZIP    "application/zip"
+#define MIME_TYPE_WASM   "application/wasm"
+#define MIME_TYPE_PALM   "application/vnd.palm"
+#define MIME_TYPE_WAV    "audio/wav"
+#define MIME_TYPE_MP3    "audio/mpeg"
+#define MIME_TYPE_MIDI   "audio/midi"
 
 #endif
@@ -1,24 +1,114 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "sys.h"
 #include "mutex.h"
 #include "debug.h"
 #include "xalloc.h"
 
+// Define MUTEX_TRACE to log every lock and unlock. Contention statistics
+// are only collected after mutex_stats(1), so the normal path costs about
+// the same as a raw pthread_mutex_lock.
+
+#ifndef MUTEX_SPIN
+#define MUTEX_SPIN    100   // upper bound of the adaptive spin, 0 disables spinning
+#endif
+#define MUTEX_SAMPLE  16    // one in MUTEX_SAMPLE acquisitions has its hold time measured
+#define MUTEX_LONG    300000
+#define MAX_STATS     64
+
+#ifdef MUTEX_TRACE
+#define mutex_trace(fmt, args...) debug(DEBUG_TRACE, "MUTEX", fmt, ##args)
+#else
+#define mutex_trace(fmt, args...)
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax()
+#endif
+
+typedef struct {
+  char name[16];
+  uint64_t locks;
+  uint64_t contended;
+  uint64_t samples;
+  uint64_t held;
+  uint64_t maxheld;
+} mutex_stat_t;
+
 struct mutex_t {
   pthread_mutex_t mutex;
   char name[16];
   int64_t t;
   int count;
+  int spin;
+  uint32_t locks;
+  mutex_stat_t *stat;
 };
 
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static mutex_stat_t stats[MAX_STATS];
+static int num_stats;
+static int stats_on;
+static int spin_max = -1;
+
+// mutexes with the same name share one entry, so the report shows the contention of each subsystem
+static mutex_stat_t *mutex_stat(char *name) {
+  mutex_stat_t *stat = NULL;
+  int i;
+
+  pthread_mutex_lock(&stats_mutex);
+  for (i = 0; i < num_stats; i++) {
+    if (!sys_strcmp(stats[i].name, name)) {
+      stat = &stats[i];
+      break;
+    }
+  }
+  if (stat == NULL && num_stats < MAX_STATS) {
+    stat = &stats[num_stats++];
+    sys_strncpy(stat->name, name, sizeof(stat->name)-1);
+  }
+  pthread_mutex_unlock(&stats_mutex);
+
+  return stat;
+}
+
+void mutex_stats(int enable) {
+  stats_on = enable;
+}
+
+void mutex_report(void) {
+  mutex_stat_t *stat;
+  int i;
+
+  pthread_mutex_lock(&stats_mutex);
+  for (i = 0; i < num_stats; i++) {
+    stat = &stats[i];
+    if (stat->locks == 0) continue;
+    debug(DEBUG_INFO, "MUTEX", "%-15s locks %llu contended %llu (%llu%%) held avg %llu us max %llu us",
+      stat->name, (unsigned long long)stat->locks, (unsigned long long)stat->contended,
+      (unsigned long long)(stat->contended * 100 / stat->locks),
+      (unsigned long long)(stat->samples ? stat->held / stat->samples : 0), (unsigned long long)stat->maxheld);
+  }
+  pthread_mutex_unlock(&stats_mutex);
+}
+
 struct cond_t {
   pthread_cond_t cond;
   char name[16];
 };
 
+struct rwlock_t {
+  pthread_rwlock_t rwlock;
+  char name[16];
+};
+
 struct sema_t {
   sem_t sem;
   sem_t *s;
@@ -31,6 +121,16 @@ mutex_t *mutex_create(char *name) {
 
   if ((m = xcalloc(1, sizeof(mutex_t))) != NULL) {
     sys_strncpy(m->name, name, sizeof(m->name)-1);
+    m->stat = mutex_stat(m->name);
+
+    if (spin_max == -1) {
+      // spinning only helps when the owner can run on another processor
+#ifdef _SC_NPROCESSORS_ONLN
+      spin_max = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? MUTEX_SPIN : 0;
+#else
+      spin_max = MUTEX_SPIN;
+#endif
+    }
 
     if (pthread_mutexattr_init(&attr) == 0) {
       pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
@@ -80,20 +180,50 @@ int mutex_unlock_only(mutex_t *m) {
   return pthread_mutex_unlock(&m->mutex);
 }
 
+// Tries the lock first. When it is taken, spins for a while before blocking,
+// adapting the spin length to how long this mutex took to become free in
+// the past, as glibc does for PTHREAD_MUTEX_ADAPTIVE_NP.
+static int mutex_acquire(mutex_t *m, int *contended) {
+  int i, max, r;
+
+  if ((r = pthread_mutex_trylock(&m->mutex)) != EBUSY) {
+    return r;
+  }
+  *contended = 1;
+
+  max = m->spin * 2 + 10;
+  if (max > spin_max) max = spin_max;
+
+  for (i = 0; i < max; i++) {
+    cpu_relax();
+    if ((r = pthread_mutex_trylock(&m->mutex)) != EBUSY) {
+      m->spin += (i - m->spin) / 8;
+      return r;
+    }
+  }
+
+  if ((r = pthread_mutex_lock(&m->mutex)) == 0) {
+    m->spin += (max - m->spin) / 8;
+  }
+
+  return r;
+}
+
 int mutex_lock(mutex_t *m) {
+  int contended = 0;
   int r = -1;
 
   if (m) {
-    debug(DEBUG_TRACE, "MUTEX", "locking mutex %s (%08x)", m->name, m);
-    r = pthread_mutex_lock(&m->mutex);
-    if (r != 0) {
+    mutex_trace("locking mutex %s (%08x)", m->name, m);
+    if ((r = mutex_acquire(m, &contended)) != 0) {
       debug_errno("MUTEX", "pthread_mutex_lock");
     } else {
-      if (m->count == 0) {
-        m->t = sys_get_clock();
+      if (m->count++ == 0 && stats_on && m->stat) {
+        __sync_fetch_and_add(&m->stat->locks, 1);
+        if (contended) __sync_fetch_and_add(&m->stat->contended, 1);
+        m->t = (++m->locks % MUTEX_SAMPLE) == 0 ? sys_get_clock() : 0;
       }
-      m->count++;
-      debug(DEBUG_TRACE, "MUTEX", "locked mutex %s (%08x) count %d", m->name, m, m->count);
+      mutex_trace("locked mutex %s (%08x) count %d", m->name, m, m->count);
     }
   }
 
@@ -105,16 +235,21 @@ int mutex_unlock(mutex_t *m) {
   int r = -1;
 
   if (m) {
-    debug(DEBUG_TRACE, "MUTEX", "unlocking mutex %s (%08x) count %d", m->name, m, m->count);
-    m->count--;
-    if (m->count == 0) {
+    mutex_trace("unlocking mutex %s (%08x) count %d", m->name, m, m->count);
+    if (--m->count == 0 && m->t) {
       dt = sys_get_clock() - m->t;
-      if (dt >= 300000) {
+      m->t = 0;
+      if (m->stat) {
+        __sync_fetch_and_add(&m->stat->samples, 1);
+        __sync_fetch_and_add(&m->stat->held, dt);
+        if (dt > (int64_t)m->stat->maxheld) m->stat->maxheld = dt;
+      }
+      if (dt >= MUTEX_LONG) {
         debug(DEBUG_INFO, "MUTEX", "mutex %s (%08x) locked for %lld us", m->name, m, dt);
       }
     }
     r = pthread_mutex_unlock(&m->mutex);
-    debug(DEBUG_TRACE, "MUTEX", "unlocked mutex %s (%08x)", m->name, m);
+    mutex_trace("unlocked mutex %s (%08x)", m->name, m);
     if (r != 0) {
       debug_errno("MUTEX", "pthread_mutex_unlock");
     }
@@ -243,6 +378,86 @@ int cond_timedwait(cond_t *c, mutex_t *m, int us) {
 #define S_IRUSR 0
 #endif
 
+rwlock_t *rwlock_create(char *name) {
+  rwlock_t *l;
+  int r;
+
+  if ((l = xcalloc(1, sizeof(rwlock_t))) != NULL) {
+    sys_strncpy(l->name, name, sizeof(l->name)-1);
+
+    r = pthread_rwlock_init(&l->rwlock, NULL);
+    if (r != 0) {
+      debug(DEBUG_ERROR, "MUTEX", "pthread_rwlock_init: %d", r);
+      xfree(l);
+      l = NULL;
+    }
+  }
+
+  if (l) {
+    debug(DEBUG_TRACE, "MUTEX", "created rwlock %s (%08x)", l->name, l);
+  }
+
+  return l;
+}
+
+int rwlock_destroy(rwlock_t *l) {
+  int r = -1;
+
+  if (l) {
+    r = pthread_rwlock_destroy(&l->rwlock);
+    if (r != 0) {
+      debug(DEBUG_ERROR, "MUTEX", "pthread_rwlock_destroy: %d", r);
+      r = -1;
+    }
+    debug(DEBUG_TRACE, "MUTEX", "destroyed rwlock %s (%08x)", l->name, l);
+    xfree(l);
+  }
+
+  return r;
+}
+
+int rwlock_rdlock(rwlock_t *l) {
+  int r = -1;
+
+  if (l) {
+    r = pthread_rwlock_rdlock(&l->rwlock);
+    if (r != 0) {
+      debug(DEBUG_ERROR, "MUTEX", "pthread_rwlock_rdlock \"%s\": %d", l->name, r);
+      r = -1;
+    }
+  }
+
+  return r;
+}
+
+int rwlock_wrlock(rwlock_t *l) {
+  int r = -1;
+
+  if (l) {
+    r = pthread_rwlock_wrlock(&l->rwlock);
+    if (r != 0) {
+      debug(DEBUG_ERROR, "MUTEX", "pthread_rwlock_wrlock \"%s\": %d", l->name, r);
+      r = -1;
+    }
+  }
+
+  return r;
+}
+
+int rwlock_unlock(rwlock_t *l) {
+  int r = -1;
+
+  if (l) {
+    r = pthread_rwlock_unlock(&l->rwlock);
+    if (r != 0) {
+      debug(DEBUG_ERROR, "MUTEX", "pthread_rwlock_unlock \"%s\": %d", l->name, r);
+      r = -1;
+    }
+  }
+
+  return r;
+}
+
 sema_t *semaphore_create_named(char *name, int count) {
   sema_t *sem;
 
@@ -8,6 +8,7 @@ extern "C" {
 typedef struct mutex_t mutex_t;
 typedef struct cond_t cond_t;
 typedef struct sema_t sema_t;
+typedef struct rwlock_t rwlock_t;
 
 mutex_t *mutex_create(char *name);
 
@@ -21,6 +22,10 @@ int mutex_lock(mutex_t *m);
 
 int mutex_unlock(mutex_t *m);
 
+void mutex_stats(int enable);
+
+void mutex_report(void);
+
 cond_t *cond_create(char *name);
 
 int cond_destroy(cond_t *c);
@@ -33,6 +38,16 @@ int cond_wait(cond_t *c, mutex_t *m);
 
 int cond_timedwait(cond_t *c, mutex_t *m, int us);
 
+rwlock_t *rwlock_create(char *name);
+
+int rwlock_destroy(rwlock_t *l);
+
+int rwlock_rdlock(rwlock_t *l);
+
+int rwlock_wrlock(rwlock_t *l);
+
+int rwlock_unlock(rwlock_t *l);
+
 sema_t *semaphore_create_named(char *name, int count);
 
 int semaphore_remove_named(char *name);
@@ -2,8 +2,33 @@
 #include "ptr.h"
 #include "mutex.h"
 #include "debug.h"
-
-#define MAX_PTRS 1024
+#include "xalloc.h"
+
+// A handle is (generation << INDEX_BITS) | index. Each slot keeps its
+// generation, flags and reference count in one 64 bit state word that is
+// only changed with compare and swap, so handles are validated without
+// taking the table mutex. The mutex is only used to allocate slots. Pages
+// of slots are never released before ptr_close, and neither are the slot
+// mutexes and conditions, so a stale handle can at worst touch an idle slot.
+// Freed slots wait in a FIFO queue of at least QUARANTINE entries before they
+// are reused, so a stale handle only matches again after its slot has gone
+// through the whole generation range, QUARANTINE * 2^15 frees later.
+
+#define INDEX_BITS  16
+#define INDEX_MASK  ((1 << INDEX_BITS) - 1)
+#define GEN_MASK    ((1 << (31 - INDEX_BITS)) - 1)
+#define PAGE_BITS   10
+#define PAGE_SIZE   (1 << PAGE_BITS)
+#define PAGE_MASK   (PAGE_SIZE - 1)
+#define MAX_PAGES   (1 << (INDEX_BITS - PAGE_BITS))
+#define QUARANTINE  PAGE_SIZE
+
+#define STATE_USED    1
+#define STATE_DELETE  2
+#define STATE_REF     4
+#define STATE_REFS(s) ((uint32_t)(s) >> 2)
+#define STATE_GEN(s)  ((uint32_t)((s) >> 32))
+#define STATE(gen)    ((uint64_t)(gen) << 32)
 
 #define OP_LOCK   1
 #define OP_UNLOCK 2
@@ -11,113 +36,171 @@
 #define OP_SIGNAL 4
 #define OP_FREE   5
 
+#ifdef PTR_TRACE
+#define ptr_trace(fmt, args...) debug_full(file, func, line, DEBUG_TRACE, "PTR", fmt, ##args)
+#else
+#define ptr_trace(fmt, args...)
+#endif
+
 typedef struct {
-  unsigned int id;
-  int used, locking, delete;
-  int64_t t;
+  volatile uint64_t state;
   void (*destructor)(void *p);
   mutex_t *mutex;
   cond_t *cond;
   void *p;
+  char name[16];
+  uint32_t next_free;
 } ptr_t;
 
 typedef struct {
   char *tag;
 } generic_t;
 
-static ptr_t table[MAX_PTRS];
-static unsigned int next_id;
+static ptr_t *pages[MAX_PAGES];
+static volatile uint32_t num_slots;
+static uint32_t free_head, free_tail, num_free;
 static mutex_t *mutex;
 static char *op_name[] = { "", "lock", "unlock", "wait", "signal", "free" };
 
 int ptr_init(void) {
-  int i;
-
   if ((mutex = mutex_create("ptr")) == NULL) {
     return -1;
   }
 
-  for (i = 0; i < MAX_PTRS; i++) {
-    table[i].id = 0;
-    table[i].used = 0;
-    table[i].locking = 0;
-    table[i].delete = 0;
-    table[i].destructor = NULL;
-    table[i].mutex = NULL;
-    table[i].p = NULL;
-  }
-
-  table[0].used = 1;
-  next_id = 1;
+  sys_memset(pages, 0, sizeof(pages));
+  num_slots = 0;
+  free_head = free_tail = num_free = 0;
 
   return 0;
 }
 
 int ptr_close(void) {
-  //generic_t *gp;
-  int i;
-
-  for (i = 1; i < MAX_PTRS; i++) {
-/*
-    gp = (generic_t *)table[i].p;
-    if (table[i].used) {
-      debug(DEBUG_INFO, "PTR", "handle %d (%d) (%s) was not closed", table[i].id, i, gp->tag);
-    }
-*/
-    table[i].used = 0;
-    table[i].locking = 0;
-    table[i].delete = 0;
-    table[i].destructor = NULL;
-    if (table[i].mutex) mutex_destroy(table[i].mutex);
-    if (table[i].cond) cond_destroy(table[i].cond);
-    table[i].mutex = NULL;
-    table[i].cond = NULL;
-    table[i].p = NULL;
+  ptr_t *slot;
+  uint32_t i;
+
+  for (i = 0; i < num_slots; i++) {
+    slot = &pages[i >> PAGE_BITS][i & PAGE_MASK];
+    if (slot->mutex) mutex_destroy(slot->mutex);
+    if (slot->cond) cond_destroy(slot->cond);
+  }
+
+  for (i = 0; i < MAX_PAGES; i++) {
+    if (pages[i]) xfree(pages[i]);
+    pages[i] = NULL;
   }
 
+  num_slots = 0;
+  free_head = free_tail = num_free = 0;
   mutex_destroy(mutex);
 
   return 0;
 }
 
+static ptr_t *ptr_slot(int id) {
+  uint32_t index;
+
+  index = id & INDEX_MASK;
+  if (id <= 0 || index == 0 || index >= __atomic_load_n(&num_slots, __ATOMIC_ACQUIRE)) return NULL;
+
+  return &pages[index >> PAGE_BITS][index & PAGE_MASK];
+}
+
+// queues a released slot index at the tail of the free list
+static void ptr_release(uint32_t index) {
+  ptr_slot(index)->next_free = 0;
+  if (free_tail) {
+    ptr_slot(free_tail)->next_free = index;
+  } else {
+    free_head = index;
+  }
+  free_tail = index;
+  num_free++;
+}
+
+// takes the slot index at the head of the free list
+static uint32_t ptr_dequeue(void) {
+  uint32_t index;
+
+  index = free_head;
+  free_head = ptr_slot(index)->next_free;
+  if (free_head == 0) free_tail = 0;
+  num_free--;
+
+  return index;
+}
+
+// returns the oldest free slot index once enough slots are queued, otherwise
+// adds a slot to the table, with a new page when the last one is full
+static uint32_t ptr_alloc(void) {
+  uint32_t n;
+  ptr_t *page;
+
+  if (num_free > QUARANTINE) {
+    return ptr_dequeue();
+  }
+
+  n = num_slots;
+  if ((n & PAGE_MASK) == 0) {
+    // when the table can not grow the quarantine is cut short
+    if ((n >> PAGE_BITS) == MAX_PAGES || (page = xcalloc(PAGE_SIZE, sizeof(ptr_t))) == NULL) {
+      return num_free ? ptr_dequeue() : 0;
+    }
+    pages[n >> PAGE_BITS] = page;
+    // slot 0 is never used, so that no handle is 0
+    if (n == 0) n++;
+  }
+
+  // the page must be visible before readers see the new slot count
+  __sync_synchronize();
+  num_slots = n + 1;
+
+  return n;
+}
+
 static int ptr_new_aux(void *p, void (*destructor)(void *p), int c) {
   generic_t *gp;
-  char buf[16];
-  int id, i, index;
+  uint32_t index;
+  ptr_t *slot;
+  int id;
 
   id = -1;
 
   if (mutex_lock(mutex) == 0) {
-    for (i = 0; i < MAX_PTRS; i++) {
-      id = next_id + i;
-      index = id % MAX_PTRS;
-
-      if (!table[index].used) {
-        sys_snprintf(buf, sizeof(buf)-1, "ptr%d", id);
-        table[index].mutex = mutex_create(buf);
-
-        if (table[index].mutex == NULL) {
-          id = -1;
-        } else {
-          table[index].id = id;
-          table[index].used = 1;
-          table[index].locking = 0;
-          table[index].delete = 0;
-          table[index].destructor = destructor;
-          table[index].p = p;
-          if (c) table[index].cond = cond_create(buf);
-          gp = (generic_t *)table[index].p;
-          debug(DEBUG_TRACE, "PTR", "new handle %d (%d) (%s) (%08x)", id, index, gp->tag, p);
-        }
-        break;
-      }
-    }
-
-    if (i == MAX_PTRS) {
+    if ((index = ptr_alloc()) == 0) {
       debug(DEBUG_ERROR, "PTR", "max pointers reached");
-      id = -1;
+
     } else {
-      next_id = id + 1;
+      slot = &pages[index >> PAGE_BITS][index & PAGE_MASK];
+      gp = (generic_t *)p;
+
+      // the slot mutex is named after the handle type, so it is created again
+      // when the slot is reused for a different type
+      if (sys_strncmp(slot->name, gp->tag, sizeof(slot->name)-1)) {
+        if (slot->mutex) mutex_destroy(slot->mutex);
+        if (slot->cond) cond_destroy(slot->cond);
+        slot->mutex = NULL;
+        slot->cond = NULL;
+        sys_strncpy(slot->name, gp->tag, sizeof(slot->name)-1);
+      }
+
+      if (slot->mutex == NULL) {
+        slot->mutex = mutex_create(slot->name);
+      }
+      if (c && slot->cond == NULL) {
+        slot->cond = cond_create(slot->name);
+      }
+
+      if (slot->mutex == NULL || (c && slot->cond == NULL)) {
+        ptr_release(index);
+
+      } else {
+        slot->destructor = destructor;
+        slot->p = p;
+        id = (STATE_GEN(slot->state) << INDEX_BITS) | index;
+        // publishes the fields above together with the used flag
+        __sync_fetch_and_or(&slot->state, STATE_USED);
+        debug(DEBUG_TRACE, "PTR", "new handle %d (%d) (%s) (%08x)", id, index, gp->tag, p);
+      }
     }
 
     mutex_unlock(mutex);
@@ -134,138 +217,135 @@ int ptr_new_c(void *p, void (*destructor)(void *p)) {
   return ptr_new_aux(p, destructor, 1);
 }
 
-static void *ptr_access(const char *file, const char *func, int line, int id, char *tag, int op, uint32_t arg) {
-  int index, delete, locking, ok;
+// Takes a reference to the slot of handle id. Deleted handles can only be
+// referenced by the owners of a lock, to release it.
+static int ptr_ref(ptr_t *slot, int id, int op) {
+  uint64_t state;
+
+  for (;;) {
+    state = slot->state;
+
+    if (!(state & STATE_USED)) {
+      debug(DEBUG_ERROR, "PTR", "attempt to %s unused handle %d (%d)", op_name[op], id, id & INDEX_MASK);
+      return -1;
+    }
+    if (STATE_GEN(state) != ((uint32_t)id >> INDEX_BITS)) {
+      debug(DEBUG_ERROR, "PTR", "attempt to %s wrong handle %d != %d (%d)", op_name[op], id,
+        (STATE_GEN(state) << INDEX_BITS) | (id & INDEX_MASK), id & INDEX_MASK);
+      return -1;
+    }
+    if ((state & STATE_DELETE) && (op != OP_UNLOCK || STATE_REFS(state) == 0)) {
+      debug(DEBUG_ERROR, "PTR", "attempt to %s deleted handle %d (%d)", op_name[op], id, id & INDEX_MASK);
+      return -1;
+    }
+
+    if (__sync_bool_compare_and_swap(&slot->state, state, state + STATE_REF)) {
+      return 0;
+    }
+  }
+}
+
+// Drops a reference. The last reference of a deleted handle releases the
+// slot, with a new generation so that the old handle becomes invalid, and
+// calls the destructor.
+static void ptr_unref(ptr_t *slot, int id, char *tag) {
   void (*destructor)(void *p);
-  mutex_t *ptr_mutex;
-  cond_t *ptr_cond;
-  generic_t *p;
-  int64_t t;
+  uint64_t state;
+  void *p;
 
-  index = id % MAX_PTRS;
-  destructor = NULL;
-  ptr_mutex = NULL;
-  p = NULL;
-  ok = 0;
+  state = __sync_sub_and_fetch(&slot->state, STATE_REF);
 
-  if (mutex_lock(mutex) == 0) {
-    if (index > 0 && index < MAX_PTRS) {
-      if (table[index].used) {
-        if (!table[index].delete) {
-          if (table[index].id == id) {
-            p = (generic_t *)table[index].p;
-
-            if (!sys_strcmp(p->tag, tag)) {
-              switch (op) {
-                case OP_LOCK:
-                  table[index].locking++;
-                  ok = 1;
-                  break;
-                case OP_UNLOCK:
-                  if (table[index].locking) {
-                    table[index].locking--;
-                    ok = 1;
-                  }
-                  break;
-                case OP_WAIT:
-                  if (table[index].locking) {
-                    ok = 1;
-                  }
-                  break;
-                case OP_SIGNAL:
-                  if (table[index].locking) {
-                    ok = 1;
-                  }
-                  break;
-                case OP_FREE:
-                  table[index].delete = 1;
-                  ok = 1;
-                  break;
-              }
-
-              delete = table[index].delete;
-              locking = table[index].locking;
-              ptr_mutex = table[index].mutex;
-              ptr_cond = table[index].cond;
-              destructor = table[index].destructor;
-
-            } else {
-              debug(DEBUG_ERROR, "PTR", "attempt to %s handle %d with tag %s != %s", op_name[op], id, p->tag, tag);
-            }
-          } else {
-            debug(DEBUG_ERROR, "PTR", "attempt to %s wrong handle %d != %d (%d)", op_name[op], id, table[index].id, index);
-          }
-        } else {
-          debug(DEBUG_ERROR, "PTR", "attempt to %s deleted handle %d (%d)", op_name[op], id, index);
-        }
-      } else {
-        debug(DEBUG_ERROR, "PTR", "attempt to %s unused handle %d (%d)", op_name[op], id, index);
-      }
-    } else {
-      debug(DEBUG_ERROR, "PTR", "attempt to %s invalid handle %d (%d)", op_name[op], id, index);
+  if ((state & STATE_DELETE) && STATE_REFS(state) == 0) {
+    debug(DEBUG_TRACE, "PTR", "free handle %d (%d) (%s)", id, id & INDEX_MASK, tag);
+    destructor = slot->destructor;
+    p = slot->p;
+    slot->destructor = NULL;
+    slot->p = NULL;
+
+    if (mutex_lock(mutex) == 0) {
+      __sync_bool_compare_and_swap(&slot->state, state, STATE((STATE_GEN(state) + 1) & GEN_MASK));
+      ptr_release(id & INDEX_MASK);
+      mutex_unlock(mutex);
     }
-    mutex_unlock(mutex);
+
+    if (destructor) destructor(p);
   }
+}
+
+static void *ptr_access(const char *file, const char *func, int line, int id, char *tag, int op, uint32_t arg) {
+  uint64_t state;
+  generic_t *p;
+  ptr_t *slot;
+  int ok;
+
+  if ((slot = ptr_slot(id)) == NULL) {
+    debug(DEBUG_ERROR, "PTR", "attempt to %s invalid handle %d (%d)", op_name[op], id, id & INDEX_MASK);
+    return NULL;
+  }
+
+  if (ptr_ref(slot, id, op) != 0) {
+    return NULL;
+  }
+
+  // tags are usually the same literal, so the string compare is rarely needed
+  p = (generic_t *)slot->p;
+  if (p->tag != tag && sys_strcmp(p->tag, tag)) {
+    debug(DEBUG_ERROR, "PTR", "attempt to %s handle %d with tag %s != %s", op_name[op], id, p->tag, tag);
+    ptr_unref(slot, id, tag);
+    return NULL;
+  }
+
+  // besides the reference taken above, unlock, wait and signal need a lock owner
+  state = slot->state;
+  ok = op == OP_LOCK || op == OP_FREE || STATE_REFS(state) > 1;
 
   if (ok) {
     switch (op) {
       case OP_LOCK:
-        debug_full(file, func, line, DEBUG_TRACE, "PTR", "locking handle %d (%d) (%s) locking=%d", id, index, tag, locking);
-        t = sys_get_clock();
-        if (mutex_lock(ptr_mutex) != 0) {
-          p = NULL;
-        } else {
-          debug_full(file, func, line, DEBUG_TRACE, "PTR", "locked handle %d (%d) (%s) locking=%d", id, index, tag, locking);
-          t = sys_get_clock() - t;
-          if (t >= 5000) {
-            debug_full(file, func, line, DEBUG_INFO, "PTR", "lock handle %d (%d) (%s) wait %lld us", id, index, tag, t);
-          }
+        ptr_trace("locking handle %d (%s) refs=%d", id, tag, STATE_REFS(state));
+        if (mutex_lock(slot->mutex) != 0) {
+          ptr_unref(slot, id, tag);
+          return NULL;
         }
-        break;
+        ptr_trace("locked handle %d (%s)", id, tag);
+        // the reference is kept until ptr_unlock
+        return p;
       case OP_UNLOCK:
-        mutex_unlock(ptr_mutex);
-        debug_full(file, func, line, DEBUG_TRACE, "PTR", "unlocked handle %d (%d) (%s) locking=%d", id, index, tag, locking);
+        mutex_unlock(slot->mutex);
+        ptr_trace("unlocked handle %d (%s)", id, tag);
+        // drops the reference of the matching ptr_lock
+        ptr_unref(slot, id, tag);
         break;
       case OP_WAIT:
-        debug_full(file, func, line, DEBUG_TRACE, "PTR", "waiting handle %d (%d) (%s) locking=%d us=%d", id, index, tag, locking, arg);
-        if (cond_timedwait(ptr_cond, ptr_mutex, arg) != 0) {
+        ptr_trace("waiting handle %d (%s) us=%d", id, tag, arg);
+        if (slot->cond == NULL || cond_timedwait(slot->cond, slot->mutex, arg) != 0) {
           p = NULL;
-        } else {
-          debug_full(file, func, line, DEBUG_TRACE, "PTR", "waited handle %d (%d) (%s) locking=%d us=%d", id, index, tag, locking, arg);
         }
         break;
       case OP_SIGNAL:
-        debug_full(file, func, line, DEBUG_TRACE, "PTR", "signaling handle %d (%d) (%s) locking=%d", id, index, tag, locking);
-        if (cond_signal(ptr_cond) != 0) {
+        ptr_trace("signaling handle %d (%s)", id, tag);
+        if (slot->cond == NULL || cond_signal(slot->cond) != 0) {
           p = NULL;
-        } else {
-          debug_full(file, func, line, DEBUG_TRACE, "PTR", "signaled handle %d (%d) (%s) locking=%d", id, index, tag, locking);
         }
         break;
-    }
-
-    if (delete && locking == 0) {
-      if (mutex_lock(mutex) == 0) {
-        debug(DEBUG_TRACE, "PTR", "free handle %d (%d) (%s)", id, index, tag);
-        table[index].used = 0;
-        table[index].locking = 0;
-        table[index].delete = 0;
-        table[index].destructor = NULL;
-        if (table[index].mutex) mutex_destroy(table[index].mutex);
-        if (table[index].cond) cond_destroy(table[index].cond);
-        table[index].mutex = NULL;
-        table[index].cond = NULL;
-        table[index].p = NULL;
-        mutex_unlock(mutex);
-        if (destructor) destructor(p);
-      } else {
-        debug(DEBUG_ERROR, "PTR", "free handle %d (%d) (%s), lock failed", id, index, tag);
-      }
+      case OP_FREE:
+        for (;;) {
+          state = slot->state;
+          if (state & STATE_DELETE) {
+            debug(DEBUG_ERROR, "PTR", "attempt to %s deleted handle %d (%d)", op_name[op], id, id & INDEX_MASK);
+            p = NULL;
+            break;
+          }
+          if (__sync_bool_compare_and_swap(&slot->state, state, state | STATE_DELETE)) break;
+        }
+        break;
     }
   } else {
     p = NULL;
   }
 
+  ptr_unref(slot, id, tag);
+
   return p;
 }
 
@@ -39,6 +39,7 @@
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #ifdef SERENITY
 #include <sys/select.h>
 #include <sys/statvfs.h>
@@ -47,6 +48,11 @@
 #else
 #include <sys/syscall.h>
 #include <sys/vfs.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#define SYS_EPOLL 1
+#define SYS_SENDFILE 1
 #endif
 #include <sys/wait.h>
 #include <arpa/inet.h>
@@ -119,8 +125,8 @@ static int socket_select(int socket, uint32_t us, int nf) {
   FD_ZERO(&fds);
   FD_SET(socket, &fds);
 
-  tv.tv_sec = 0;
-  tv.tv_usec = us;
+  tv.tv_sec = us / 1000000;
+  tv.tv_usec = us % 1000000;
   n = select(nf ? (socket + 1) : 0, &fds, NULL, NULL, us == ((uint32_t)-1) ? NULL : &tv);
 
   if (n == -1) {
@@ -1029,6 +1035,157 @@ int sys_select_fds(int nfds, sys_fdset_t *readfds, sys_fdset_t *writefds, sys_fd
   return r;
 }
 
+// Readiness notification for many descriptors (epoll where available).
+// sys_poll_create returns -1 on systems without it, so callers can fall
+// back to one thread per descriptor. A oneshot descriptor is reported only
+// once until it is rearmed with sys_poll_rearm.
+
+int sys_poll_create(void) {
+#ifdef SYS_EPOLL
+  int r;
+
+  if ((r = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    debug_errno("SYS", "epoll_create1");
+  }
+
+  return r;
+#else
+  return -1;
+#endif
+}
+
+static int sys_poll_ctl(int pfd, int op, int fd, int oneshot, void *data) {
+#ifdef SYS_EPOLL
+  struct epoll_event ev;
+  int r;
+
+  sys_memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | (oneshot ? EPOLLONESHOT : 0);
+  ev.data.ptr = data;
+
+  if ((r = epoll_ctl(pfd, op, fd, &ev)) == -1) {
+    debug_errno("SYS", "epoll_ctl %d", op);
+  }
+
+  return r;
+#else
+  return -1;
+#endif
+}
+
+int sys_poll_add(int pfd, int fd, int oneshot, void *data) {
+#ifdef SYS_EPOLL
+  return sys_poll_ctl(pfd, EPOLL_CTL_ADD, fd, oneshot, data);
+#else
+  return -1;
+#endif
+}
+
+int sys_poll_rearm(int pfd, int fd, void *data) {
+#ifdef SYS_EPOLL
+  return sys_poll_ctl(pfd, EPOLL_CTL_MOD, fd, 1, data);
+#else
+  return -1;
+#endif
+}
+
+int sys_poll_del(int pfd, int fd) {
+#ifdef SYS_EPOLL
+  return sys_poll_ctl(pfd, EPOLL_CTL_DEL, fd, 0, NULL);
+#else
+  return -1;
+#endif
+}
+
+// returns the number of ready descriptors, whose data pointers are stored in data
+int sys_poll_wait(int pfd, void **data, int n, uint32_t us) {
+#ifdef SYS_EPOLL
+  struct epoll_event ev[64];
+  int i, r;
+
+  if (n > 64) n = 64;
+  if ((r = epoll_wait(pfd, ev, n, us / 1000)) == -1) {
+    if (errno == EINTR) return 0;
+    debug_errno("SYS", "epoll_wait");
+    return -1;
+  }
+
+  for (i = 0; i < r; i++) {
+    data[i] = ev[i].data.ptr;
+  }
+
+  return r;
+#else
+  return -1;
+#endif
+}
+
+// Sends len bytes of file in, starting at offset, to the socket out without
+// copying them through user space. Returns the number of bytes sent, or -1 if
+// this is not possible for these descriptors and nothing was sent, in which
+// case the caller must copy the data itself.
+int64_t sys_sendfile(int out, int in, int64_t offset, int64_t len) {
+#ifdef SYS_SENDFILE
+  struct pollfd pfd;
+  int64_t sent;
+  off_t off;
+  ssize_t r;
+
+  off = offset;
+  for (sent = 0; sent < len;) {
+    if ((r = sendfile(out, in, &off, (len - sent) > 0x40000000 ? 0x40000000 : (size_t)(len - sent))) == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // sockets are non blocking, wait until the peer drains the send buffer
+        pfd.fd = out;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 10000) <= 0) {
+          debug(DEBUG_ERROR, "SYS", "sendfile to fd %d timeout", out);
+          break;
+        }
+        continue;
+      }
+      if (sent == 0 && (errno == EINVAL || errno == ENOSYS)) return -1;
+      debug_errno("SYS", "sendfile(%d, %d)", out, in);
+      break;
+    }
+    if (r == 0) break;
+    sent += r;
+  }
+
+  return sent;
+#else
+  return -1;
+#endif
+}
+
+// Maps the first len bytes of a file read only. Returns NULL where this is not possible.
+void *sys_mmap(int fd, int64_t len) {
+#ifndef WINDOWS
+  void *p;
+
+  if (len <= 0 || (uint64_t)len != (size_t)len) return NULL;
+
+  if ((p = mmap(NULL, (size_t)len, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    debug_errno("SYS", "mmap(%d)", fd);
+    return NULL;
+  }
+
+  return p;
+#else
+  return NULL;
+#endif
+}
+
+int sys_munmap(void *p, int64_t len) {
+#ifndef WINDOWS
+  return munmap(p, (size_t)len);
+#else
+  return -1;
+#endif
+}
+
 // return -1: error
 // return  0: nothing to read from fd
 // return  1, nread = 0: nothing was read from fd
@@ -208,6 +208,22 @@ int sys_mkdir(const char *pathname);
 int sys_select_fds(int nfds, sys_fdset_t *readfds, sys_fdset_t *writefds, sys_fdset_t *exceptfds,
                    sys_timeval_t *timeout);
 
+int sys_poll_create(void);
+
+int sys_poll_add(int pfd, int fd, int oneshot, void *data);
+
+int sys_poll_rearm(int pfd, int fd, void *data);
+
+int sys_poll_del(int pfd, int fd);
+
+int sys_poll_wait(int pfd, void **data, int n, uint32_t us);
+
+int64_t sys_sendfile(int out, int in, int64_t offset, int64_t len);
+
+void *sys_mmap(int fd, int64_t len);
+
+int sys_munmap(void *p, int64_t len);
+
 void sys_fdclr(int n, sys_fdset_t *fds);
 
 void sys_fdset(int n, sys_fdset_t *fds);
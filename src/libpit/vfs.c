@@ -8,13 +8,27 @@
 #define MAX_MOUNTS  32
 #define MAX_BUF     1024
 
+#define BUF_NONE    0
+#define BUF_READ    1
+#define BUF_WRITE   2
+
 typedef struct {
   char *path;
+  int len;
   void *data;
   vfs_callback_t callback;
   int raw;
 } vfs_mount_t;
 
+// Mount lists are never modified once published: vfs_map builds a new list
+// and swaps the pointer, so lookups need no lock. Replaced lists are kept
+// in the prev chain until vfs_finish, because a lookup may still use them.
+typedef struct vfs_mounts_t {
+  int n;
+  struct vfs_mounts_t *prev;
+  vfs_mount_t mount[MAX_MOUNTS];
+} vfs_mounts_t;
+
 struct vfs_session_t {
   char cwd[VFS_PATH];
 };
@@ -35,27 +49,31 @@ struct vfs_file_t {
   int (*close)(struct vfs_fpriv_t *f);
   uint32_t (*seek)(vfs_fpriv_t *f, uint32_t pos, int fromend);
   vfs_ent_t *(*fstat)(vfs_fpriv_t *fpriv);
-  char buf[MAX_BUF];
+  uint8_t *buf;       // read-ahead or write-behind data, allocated on first use
+  uint32_t bufsize;   // 0 when the file is not buffered
+  uint32_t bpos, blen;
+  int bmode;
+  uint32_t pos;       // logical position, the backend may be ahead by blen-bpos
+  int64_t size;       // cached size for vfs_peek, -1 when unknown
 };
 
 static mutex_t *mutex;
-static vfs_mount_t mounts[MAX_MOUNTS];
-static int nmounts;
+static vfs_mounts_t *mounts;
 
 int vfs_init(void) {
   mutex = mutex_create("VFS");
-  xmemset(mounts, 0, sizeof(mounts));
-  nmounts = 0;
+  mounts = NULL;
 
   return 0;
 }
 
+// refresh and loadlib callbacks are not reentrant, so they still run under the mutex
 int vfs_refresh(void) {
   int i, r = -1;
 
   if (mutex_lock(mutex) == 0) {
-    for (i = 0; i < nmounts; i++) {
-      if (mounts[i].callback.refresh) mounts[i].callback.refresh(mounts[i].data);
+    for (i = 0; mounts && i < mounts->n; i++) {
+      if (mounts->mount[i].callback.refresh) mounts->mount[i].callback.refresh(mounts->mount[i].data);
     }
     mutex_unlock(mutex);
     r = 0;
@@ -65,12 +83,19 @@ int vfs_refresh(void) {
 }
 
 int vfs_finish(void) {
+  vfs_mounts_t *list, *prev;
   int i;
 
-  for (i = 0; i < nmounts; i++) {
-    if (mounts[i].callback.unmap) mounts[i].callback.unmap(mounts[i].data);
-    if (mounts[i].path) xfree(mounts[i].path);
+  for (i = 0; mounts && i < mounts->n; i++) {
+    if (mounts->mount[i].callback.unmap) mounts->mount[i].callback.unmap(mounts->mount[i].data);
+    if (mounts->mount[i].path) xfree(mounts->mount[i].path);
   }
+
+  for (list = mounts; list; list = prev) {
+    prev = list->prev;
+    xfree(list);
+  }
+  mounts = NULL;
   mutex_destroy(mutex);
 
   return 0;
@@ -117,17 +142,13 @@ static int vfs_backup_level(char *abspath, int j) {
   return j;
 }
 
-char *vfs_abspath(char *cwd, char *relpath) {
-  char *abspath;
+// resolves relpath against cwd into abspath, which has room for VFS_PATH chars
+static int vfs_resolve(char *cwd, char *relpath, char *abspath) {
   int s, i, j;
 
   if (!relpath || !relpath[0]) {
     debug(DEBUG_ERROR, "VFS", "invalid relpath");
-    return NULL;
-  }
-
-  if ((abspath = xcalloc(1, VFS_PATH)) == NULL) {
-    return NULL;
+    return -1;
   }
 
   i = j = 0;
@@ -136,7 +157,8 @@ char *vfs_abspath(char *cwd, char *relpath) {
     j = sys_strlen(abspath);
   }
 
-  for (s = 0; relpath[i] && j < VFS_PATH-1; i++) {
+  // each step appends at most three chars
+  for (s = 0; relpath[i] && j < VFS_PATH-3; i++) {
     //debug(DEBUG_TRACE, "VFS", "c=%c abs=\"%s\"", relpath[i], abspath);
     switch (s) {
       case 0:
@@ -156,8 +178,7 @@ char *vfs_abspath(char *cwd, char *relpath) {
               j = vfs_backup_level(abspath, j);
               if (j == -1) {
                 debug(DEBUG_ERROR, "VFS", "attempt to backup past root \"%s\"", relpath);
-                xfree(abspath);
-                return NULL;
+                return -1;
               }
             } else {
               s = 2;
@@ -180,8 +201,7 @@ char *vfs_abspath(char *cwd, char *relpath) {
           j = vfs_backup_level(abspath, j);
           if (j == -1) {
             debug(DEBUG_ERROR, "VFS", "attempt to backup past root \"%s\"", relpath);
-            xfree(abspath);
-            return NULL;
+            return -1;
           }
           s = 0;
         } else {
@@ -194,36 +214,65 @@ char *vfs_abspath(char *cwd, char *relpath) {
   }
   abspath[j] = 0;
 
+  return 0;
+}
+
+char *vfs_abspath(char *cwd, char *relpath) {
+  char *abspath;
+
+  if ((abspath = xcalloc(1, VFS_PATH)) == NULL) {
+    return NULL;
+  }
+
+  if (vfs_resolve(cwd, relpath, abspath) == -1) {
+    xfree(abspath);
+    return NULL;
+  }
+
   return abspath;
 }
 
+// returns the mount with the longest path that is a prefix of path
 static vfs_mount_t *vfs_find(char *path, int *pos) {
-  int i, len, imax, max, r;
+  vfs_mounts_t *list;
+  int i;
 
   if (!path || !path[0]) {
     return NULL;
   }
 
-  for (i = 0, imax = -1, max = 0; i < nmounts; i++) {
-    len = sys_strlen(mounts[i].path);
-    r = sys_strncmp(mounts[i].path, path, len);
-    if (r == 0) {
-      if (len > max) {
-        imax = i;
-        max = len;
-      }
+  list = __atomic_load_n(&mounts, __ATOMIC_ACQUIRE);
+
+  for (i = 0; list && i < list->n; i++) {
+    if (sys_strncmp(list->mount[i].path, path, list->mount[i].len) == 0) {
+      *pos = list->mount[i].len;
+      return &list->mount[i];
     }
   }
 
-  if (imax != -1) {
-    *pos = max;
-    return &mounts[imax];
+  return NULL;
+}
+
+// resolves path and finds its mount, abspath must have room for VFS_PATH chars
+static vfs_mount_t *vfs_lookup(vfs_session_t *session, char *path, char *abspath, int *pos) {
+  vfs_mount_t *mount;
+
+  if (vfs_resolve(session->cwd, path, abspath) == -1) {
+    return NULL;
+  }
+
+  if ((mount = vfs_find(abspath, pos)) == NULL) {
+    debug(DEBUG_ERROR, "VFS", "unmapped path \"%s\"", abspath);
   }
 
-  return NULL;
+  return mount;
 }
 
 int vfs_map(char *label, char *path, void *data, vfs_callback_t *callback, int raw) {
+  vfs_mounts_t *list;
+  vfs_mount_t mount;
+  int i, n;
+
   if (!path || path[0] != '/' || !callback) {
     debug(DEBUG_ERROR, "VFS", "invalid map arguments");
     return -1;
@@ -233,23 +282,42 @@ int vfs_map(char *label, char *path, void *data, vfs_callback_t *callback, int r
     return -1;
   }
 
-  if (nmounts == MAX_MOUNTS) {
+  n = mounts ? mounts->n : 0;
+  if (n == MAX_MOUNTS) {
     mutex_unlock(mutex);
     debug(DEBUG_ERROR, "VFS", "max number of mounts reached");
     return -1;
   }
 
-  mounts[nmounts].path = xstrdup(path);
-  if (!mounts[nmounts].path) {
+  if ((list = xcalloc(1, sizeof(vfs_mounts_t))) == NULL) {
+    mutex_unlock(mutex);
+    return -1;
+  }
+
+  xmemset(&mount, 0, sizeof(vfs_mount_t));
+  if ((mount.path = xstrdup(path)) == NULL) {
     mutex_unlock(mutex);
+    xfree(list);
     return -1;
   }
-  mounts[nmounts].raw = raw;
+  mount.len = sys_strlen(path);
+  mount.raw = raw;
+  xmemcpy(&mount.callback, callback, sizeof(vfs_callback_t));
+  mount.data = data;
+
+  // keeps the list sorted by decreasing path length, earlier mounts first among equals
+  for (i = 0; i < n && mounts->mount[i].len >= mount.len; i++) {
+    list->mount[i] = mounts->mount[i];
+  }
+  list->mount[i] = mount;
+  for (; i < n; i++) {
+    list->mount[i+1] = mounts->mount[i];
+  }
+  list->n = n + 1;
+  list->prev = mounts;
 
+  __atomic_store_n(&mounts, list, __ATOMIC_RELEASE);
   debug(DEBUG_INFO, "VFS", "mapped \"%s\" to %s", path, label);
-  xmemcpy(&mounts[nmounts].callback, callback, sizeof(vfs_callback_t));
-  mounts[nmounts].data = data;
-  nmounts++;
   mutex_unlock(mutex);
 
   return 0;
@@ -257,107 +325,57 @@ int vfs_map(char *label, char *path, void *data, vfs_callback_t *callback, int r
 
 char *vfs_getmount(vfs_session_t *session, char *path) {
   vfs_mount_t *mount;
-  char *abspath, *s = NULL;
+  char abspath[VFS_PATH];
   int pos;
 
-  if ((abspath = vfs_abspath(session->cwd, path)) == NULL) {
+  if (vfs_resolve(session->cwd, path, abspath) == -1) {
     return NULL;
   }
 
-  if (mutex_lock(mutex) == 0) {
-    if ((mount = vfs_find(abspath, &pos)) != NULL) {
-      s = mount->callback.getmount ? mount->callback.getmount(mount->data) : NULL;
-    }
-    mutex_unlock(mutex);
+  if ((mount = vfs_find(abspath, &pos)) == NULL) {
+    return NULL;
   }
 
-  return s;
+  return mount->callback.getmount ? mount->callback.getmount(mount->data) : NULL;
 }
 
 int vfs_checktype(vfs_session_t *session, char *path) {
   vfs_mount_t *mount;
-  char *abspath;
-  int pos, r;
-
-  if ((abspath = vfs_abspath(session->cwd, path)) == NULL) {
-    return -1;
-  }
-
-  if (mutex_lock(mutex) == -1) {
-    xfree(abspath);
-    return -1;
-  }
+  char abspath[VFS_PATH];
+  int pos;
 
-  if ((mount = vfs_find(abspath, &pos)) == NULL) {
-    debug(DEBUG_ERROR, "VFS", "unmapped path \"%s\"", abspath);
-    mutex_unlock(mutex);
-    xfree(abspath);
+  if ((mount = vfs_lookup(session, path, abspath, &pos)) == NULL) {
     return -1;
   }
 
-  r = mount->callback.checktype ? mount->callback.checktype(&abspath[pos], mount->data) : -1;
-  xfree(abspath);
-  mutex_unlock(mutex);
-
-  return r;
+  return mount->callback.checktype ? mount->callback.checktype(&abspath[pos], mount->data) : -1;
 }
 
 int vfs_statfs(vfs_session_t *session, char *path, uint64_t *total, uint64_t *free) {
   vfs_mount_t *mount;
-  char *abspath;
-  int pos, r;
-
-  if ((abspath = vfs_abspath(session->cwd, path)) == NULL) {
-    return -1;
-  }
-
-  if (mutex_lock(mutex) == -1) {
-    xfree(abspath);
-    return -1;
-  }
+  char abspath[VFS_PATH];
+  int pos;
 
-  if ((mount = vfs_find(abspath, &pos)) == NULL) {
-    debug(DEBUG_ERROR, "VFS", "unmapped path \"%s\"", abspath);
-    mutex_unlock(mutex);
-    xfree(abspath);
+  if ((mount = vfs_lookup(session, path, abspath, &pos)) == NULL) {
     return -1;
   }
 
-  r = mount->callback.statfs ? mount->callback.statfs(&abspath[pos], total, free, mount->data) : -1;
-  mutex_unlock(mutex);
-  xfree(abspath);
-
-  return r;
+  return mount->callback.statfs ? mount->callback.statfs(&abspath[pos], total, free, mount->data) : -1;
 }
 
 int vfs_chdir(vfs_session_t *session, char *path) {
   vfs_mount_t *mount;
-  char *abspath;
+  char abspath[VFS_PATH];
   int pos, n;
 
-  if ((abspath = vfs_abspath(session->cwd, path)) == NULL) {
-    return -1;
-  }
-
-  if (mutex_lock(mutex) == -1) {
-    xfree(abspath);
-    return -1;
-  }
-
-  if ((mount = vfs_find(abspath, &pos)) == NULL) {
-    debug(DEBUG_ERROR, "VFS", "unmapped path \"%s\"", abspath);
-    mutex_unlock(mutex);
-    xfree(abspath);
+  if ((mount = vfs_lookup(session, path, abspath, &pos)) == NULL) {
     return -1;
   }
 
   if ((mount->callback.checktype ? mount->callback.checktype(&abspath[pos], mount->data) : -1) != VFS_DIR) {
-    mutex_unlock(mutex);
     debug(DEBUG_ERROR, "VFS", "\"%s\" is not a directory", abspath);
-    xfree(abspath);
     return -1;
   }
-  mutex_unlock(mutex);
 
   sys_strncpy(session->cwd, abspath, VFS_PATH-2);
   n = sys_strlen(session->cwd);
@@ -366,7 +384,6 @@ int vfs_chdir(vfs_session_t *session, char *path) {
     session->cwd[n+1] = 0;
   }
 
-  xfree(abspath);
   debug(DEBUG_INFO, "VFS", "current directory \"%s\"", session->cwd);
 
   return 0;
@@ -374,30 +391,14 @@ int vfs_chdir(vfs_session_t *session, char *path) {
 
 int vfs_mkdir(vfs_session_t *session, char *path) {
   vfs_mount_t *mount;
-  char *abspath;
-  int pos, r;
-
-  if ((abspath = vfs_abspath(session->cwd, path)) == NULL) {
-    return -1;
-  }
-
-  if (mutex_lock(mutex) == -1) {
-    xfree(abspath);
-    return -1;
-  }
+  char abspath[VFS_PATH];
+  int pos;
 
-  if ((mount = vfs_find(abspath, &pos)) == NULL) {
-    debug(DEBUG_ERROR, "VFS", "unmapped path \"%s\"", abspath);
-    mutex_unlock(mutex);
-    xfree(abspath);
+  if ((mount = vfs_lookup(session, path, abspath, &pos)) == NULL) {
     return -1;
   }
 
-  r = mount->callback.mkdir ? mount->callback.mkdir(&abspath[pos], mount->data) : -1;
-  mutex_unlock(mutex);
-  xfree(abspath);
-
-  return r;
+  return mount->callback.mkdir ? mount->callback.mkdir(&abspath[pos], mount->data) : -1;
 }
 
 char *vfs_cwd(vfs_session_t *session) {
@@ -419,36 +420,20 @@ int vfs_type(void *p) {
 vfs_dir_t *vfs_opendir(vfs_session_t *session, char *path) {
   vfs_mount_t *mount;
   vfs_dir_t *vdir;
-  char *abspath;
+  char abspath[VFS_PATH];
   int pos;
 
   debug(DEBUG_TRACE, "VFS", "vfs_opendir \"%s\"", path);
-  if ((abspath = vfs_abspath(session->cwd, path)) == NULL) {
+  if ((mount = vfs_lookup(session, path, abspath, &pos)) == NULL) {
     return NULL;
   }
   debug(DEBUG_TRACE, "VFS", "abspath \"%s\"", abspath);
 
-  if (mutex_lock(mutex) == -1) {
-    xfree(abspath);
-    return NULL;
-  }
-
-  if ((mount = vfs_find(abspath, &pos)) == NULL) {
-    debug(DEBUG_ERROR, "VFS", "unmapped path \"%s\"", abspath);
-    mutex_unlock(mutex);
-    xfree(abspath);
-    return NULL;
-  }
-
   if ((vdir = xcalloc(1, sizeof(vfs_dir_t))) == NULL) {
-    mutex_unlock(mutex);
-    xfree(abspath);
     return NULL;
   }
 
   if ((vdir->priv = (mount->callback.opendir ? mount->callback.opendir(&abspath[pos], mount->data) : NULL)) == NULL) {
-    mutex_unlock(mutex);
-    xfree(abspath);
     xfree(vdir);
     return NULL;
   }
@@ -456,7 +441,6 @@ vfs_dir_t *vfs_opendir(vfs_session_t *session, char *path) {
   vdir->type = VFS_DIR;
   vdir->readdir = mount->callback.readdir;
   vdir->closedir = mount->callback.closedir;
-  mutex_unlock(mutex);
 
   return vdir;
 }
@@ -469,10 +453,14 @@ vfs_ent_t *vfs_readdir(vfs_dir_t *dir) {
 }
 
 int vfs_closedir(vfs_dir_t *dir) {
+  int r = -1;
+
   if (dir) {
-    return dir->closedir ? dir->closedir(dir->priv) : -1;
+    r = dir->closedir ? dir->closedir(dir->priv) : -1;
+    xfree(dir);
   }
-  return -1;
+
+  return r;
 }
 
 vfs_file_t *vfs_open_special(vfs_fpriv_t *fpriv,
@@ -482,51 +470,38 @@ vfs_file_t *vfs_open_special(vfs_fpriv_t *fpriv,
 
   vfs_file_t *vfile;
 
+  // special files are streams without a position, so they are never buffered
   if ((vfile = xcalloc(1, sizeof(vfs_file_t))) != NULL) {
     vfile->type = VFS_FILE;
     vfile->fpriv = fpriv;
     vfile->peek = peek;
     vfile->read = read;
     vfile->write = write;
+    vfile->size = -1;
   }
 
   return vfile;
 }
 
+// The mount list is read without locking and the backend opens the file
+// outside of any VFS lock, so opens from different tasks run in parallel.
 vfs_file_t *vfs_open(vfs_session_t *session, char *path, int mode) {
   vfs_mount_t *mount;
   vfs_file_t *vfile;
-  char *abspath;
+  char abspath[VFS_PATH];
   int pos;
 
   debug(DEBUG_TRACE, "VFS", "vfs_open \"%s\" mode 0x%04X", path, mode);
-  if ((abspath = vfs_abspath(session->cwd, path)) == NULL) {
-    return NULL;
-  }
-  debug(DEBUG_TRACE, "VFS", "abspath \"%s\"", abspath);
-
-  if (mutex_lock(mutex) == -1) {
-    xfree(abspath);
-    return NULL;
-  }
-
-  if ((mount = vfs_find(abspath, &pos)) == NULL) {
-    debug(DEBUG_ERROR, "VFS", "unmapped path \"%s\"", abspath);
-    mutex_unlock(mutex);
-    xfree(abspath);
+  if ((mount = vfs_lookup(session, path, abspath, &pos)) == NULL) {
     return NULL;
   }
   debug(DEBUG_TRACE, "VFS", "find \"%s\" (%d)", &abspath[pos], pos);
 
   if ((vfile = xcalloc(1, sizeof(vfs_file_t))) == NULL) {
-    mutex_unlock(mutex);
-    xfree(abspath);
     return NULL;
   }
 
   if ((vfile->fpriv = (mount->callback.open ? mount->callback.open(&abspath[pos], mode, mount->data) : NULL)) == NULL) {
-    mutex_unlock(mutex);
-    xfree(abspath);
     xfree(vfile);
     return NULL;
   }
@@ -538,30 +513,236 @@ vfs_file_t *vfs_open(vfs_session_t *session, char *path, int mode) {
   vfile->close = mount->callback.close;
   vfile->seek  = mount->callback.seek;
   vfile->fstat = mount->callback.fstat;
-  mutex_unlock(mutex);
+  // read-ahead must be undone with a seek before writing, so only seekable files are buffered
+  vfile->bufsize = vfile->seek ? VFS_BUFSIZE : 0;
+  vfile->size = -1;
 
   return vfile;
 }
 
+// writes out pending write-behind data
+int vfs_flush(vfs_file_t *f) {
+  int r = 0;
+
+  if (f && f->bmode == BUF_WRITE) {
+    if (f->blen && (f->write == NULL || f->write(f->fpriv, f->buf, f->blen) != f->blen)) {
+      r = -1;
+    }
+    f->bmode = BUF_NONE;
+    f->bpos = f->blen = 0;
+  }
+
+  return r;
+}
+
+// Flushes write-behind data, or drops read-ahead data moving the backend
+// back to the logical position, so that the backend can be used directly.
+static int vfs_sync(vfs_file_t *f) {
+  int r = 0;
+
+  if (f->bmode == BUF_WRITE) {
+    r = vfs_flush(f);
+  } else if (f->bmode == BUF_READ) {
+    if (f->bpos < f->blen && f->seek(f->fpriv, f->pos, 0) != f->pos) {
+      r = -1;
+    }
+    f->bmode = BUF_NONE;
+    f->bpos = f->blen = 0;
+  }
+
+  return r;
+}
+
+static int vfs_alloc_buf(vfs_file_t *f) {
+  if (f->buf == NULL && f->bufsize) {
+    if ((f->buf = xmalloc(f->bufsize)) == NULL) {
+      f->bufsize = 0;
+    }
+  }
+
+  return f->buf ? 0 : -1;
+}
+
+int vfs_setbuf(vfs_file_t *f, uint32_t size) {
+  if (f == NULL || (size && f->seek == NULL) || vfs_sync(f) == -1) {
+    return -1;
+  }
+
+  if (f->buf) {
+    xfree(f->buf);
+    f->buf = NULL;
+  }
+  f->bufsize = size;
+
+  return 0;
+}
+
 int vfs_peek(vfs_file_t *f, uint32_t us) {
+  vfs_ent_t *ent;
+
   if (f) {
+    if (f->bmode == BUF_READ && f->bpos < f->blen) {
+      return 1;
+    }
+
+    // the cached size avoids asking the backend until the end of the file is reached
+    if (f->bufsize && f->fstat) {
+      if (f->size != -1 && f->pos < f->size) {
+        return 1;
+      }
+      vfs_flush(f);
+      if ((ent = f->fstat(f->fpriv)) != NULL) {
+        f->size = ent->size;
+        return f->pos < f->size ? 1 : 0;
+      }
+    }
+
     return f->peek ? f->peek(f->fpriv, us) : -1;
   }
   return -1;
 }
 
 int vfs_read(vfs_file_t *f, uint8_t *buf, uint32_t len) {
-  if (f) {
-    return f->read ? f->read(f->fpriv, buf, len) : -1;
+  uint32_t n, total;
+  int r = 0;
+
+  if (f == NULL || f->read == NULL || buf == NULL) {
+    return -1;
   }
-  return -1;
+
+  if (f->bufsize == 0) {
+    if ((r = f->read(f->fpriv, buf, len)) > 0) f->pos += r;
+    return r;
+  }
+
+  if (f->bmode == BUF_WRITE && vfs_flush(f) == -1) {
+    return -1;
+  }
+
+  for (total = 0; total < len;) {
+    if (f->bmode == BUF_READ && f->bpos < f->blen) {
+      n = f->blen - f->bpos;
+      if (n > len - total) n = len - total;
+      sys_memcpy(buf + total, f->buf + f->bpos, n);
+      f->bpos += n;
+      f->pos += n;
+      total += n;
+      continue;
+    }
+
+    f->bmode = BUF_NONE;
+    f->bpos = f->blen = 0;
+
+    // large reads go straight to the caller's buffer
+    if (len - total >= f->bufsize || vfs_alloc_buf(f) == -1) {
+      if ((r = f->read(f->fpriv, buf + total, len - total)) <= 0) break;
+      f->pos += r;
+      total += r;
+      break;
+    }
+
+    if ((r = f->read(f->fpriv, f->buf, f->bufsize)) <= 0) break;
+    f->bmode = BUF_READ;
+    f->blen = r;
+  }
+
+  return total ? (int)total : r;
 }
 
 int vfs_write(vfs_file_t *f, uint8_t *buf, uint32_t len) {
-  if (f) {
-    return f->write ? f->write(f->fpriv, buf, len) : -1;
+  uint32_t n, total;
+  int r;
+
+  if (f == NULL || f->write == NULL || buf == NULL) {
+    return -1;
   }
-  return -1;
+
+  if (f->bufsize == 0) {
+    r = f->write(f->fpriv, buf, len);
+  } else {
+    if (f->bmode == BUF_READ && vfs_sync(f) == -1) {
+      return -1;
+    }
+
+    if (len >= f->bufsize || vfs_alloc_buf(f) == -1) {
+      if (vfs_flush(f) == -1) return -1;
+      r = f->write(f->fpriv, buf, len);
+
+    } else {
+      for (total = 0; total < len; total += n) {
+        if (f->blen == f->bufsize && vfs_flush(f) == -1) {
+          return total ? (int)total : -1;
+        }
+        n = f->bufsize - f->blen;
+        if (n > len - total) n = len - total;
+        sys_memcpy(f->buf + f->blen, buf + total, n);
+        f->blen += n;
+        f->bmode = BUF_WRITE;
+      }
+      r = len;
+    }
+  }
+
+  if (r > 0) {
+    f->pos += r;
+    if (f->size != -1 && f->pos > f->size) f->size = f->pos;
+  }
+
+  return r;
+}
+
+int vfs_preadv(vfs_file_t *f, vfs_iovec_t *iov, int n, uint32_t offset) {
+  uint32_t pos;
+  int i, r, total;
+
+  if (f == NULL || f->seek == NULL) {
+    return -1;
+  }
+
+  pos = f->pos;
+  if (vfs_seek(f, offset, 0) != offset) {
+    return -1;
+  }
+
+  for (i = 0, total = 0; i < n; i++) {
+    if ((r = vfs_read(f, iov[i].buf, iov[i].len)) <= 0) break;
+    total += r;
+    if (r < iov[i].len) break;
+  }
+
+  vfs_seek(f, pos, 0);
+
+  return total;
+}
+
+int vfs_pwritev(vfs_file_t *f, vfs_iovec_t *iov, int n, uint32_t offset) {
+  uint32_t pos;
+  int i, r, total;
+
+  if (f == NULL || f->seek == NULL) {
+    return -1;
+  }
+
+  pos = f->pos;
+  if (vfs_seek(f, offset, 0) != offset) {
+    return -1;
+  }
+
+  // small vectors are gathered in the write-behind buffer and reach the backend in one write
+  for (i = 0, total = 0; i < n; i++) {
+    if ((r = vfs_write(f, iov[i].buf, iov[i].len)) != iov[i].len) {
+      if (r > 0) total += r;
+      break;
+    }
+    total += r;
+  }
+
+  if (vfs_flush(f) == -1) {
+    total = -1;
+  }
+  vfs_seek(f, pos, 0);
+
+  return total;
 }
 
 // getc() reads the next character from stream and returns it as an unsigned char cast to an int, or EOF on end of file or error
@@ -570,6 +751,11 @@ int vfs_getc(vfs_file_t *f) {
   uint8_t b;
   int r = SYS_EOF;
 
+  if (f && f->bmode == BUF_READ && f->bpos < f->blen) {
+    f->pos++;
+    return f->buf[f->bpos++];
+  }
+
   if (vfs_read(f, &b, 1) == 1) {
     r = b;
   }
@@ -610,33 +796,70 @@ int vfs_putc(vfs_file_t *f, int c) {
 
 int vfs_printf(vfs_file_t *f, char *fmt, ...) {
   sys_va_list ap;
+  char buf[MAX_BUF];
   int r;
 
-  xmemset(f->buf, 0, MAX_BUF);
-
   sys_va_start(ap, fmt);
-  sys_vsnprintf(f->buf, MAX_BUF-1, fmt, ap);
+  sys_vsnprintf(buf, MAX_BUF-1, fmt, ap);
   sys_va_end(ap);
+  buf[MAX_BUF-1] = 0;
 
-  r = sys_strlen(f->buf);
-  if (r > 0) vfs_write(f, (uint8_t *)f->buf, r);
+  r = sys_strlen(buf);
+  if (r > 0) vfs_write(f, (uint8_t *)buf, r);
 
   return r;
 }
 
 int vfs_close(vfs_file_t *f) {
+  int fr, r = -1;
+
   if (f) {
-    return f->close ? f->close(f->fpriv) : -1;
+    // a write-behind that fails here must still be reported to the caller
+    fr = vfs_flush(f);
+    r = f->close ? f->close(f->fpriv) : -1;
+    if (fr != 0) r = -1;
+    if (f->buf) xfree(f->buf);
+    xfree(f);
   }
-  return -1;
+
+  return r;
 }
 
 uint32_t vfs_seek(vfs_file_t *f, uint32_t pos, int fromend) {
-  if (f) {
-    return f->seek ? f->seek(f->fpriv, pos, fromend) : -1;
+  uint32_t start, r;
+
+  if (f == NULL || f->seek == NULL) {
+    return -1;
   }
 
-  return -1;
+  // telling the position, or moving inside the read-ahead data, needs no backend call
+  if (fromend == -1 && pos == 0) {
+    return f->pos;
+  }
+  if (fromend == 0 && f->bmode == BUF_READ) {
+    start = f->pos - f->bpos;
+    if (pos >= start && pos <= start + f->blen) {
+      f->bpos = pos - start;
+      f->pos = pos;
+      return pos;
+    }
+  }
+
+  if (fromend == -1) {
+    // relative to the logical position
+    pos += f->pos;
+    fromend = 0;
+  }
+
+  if (vfs_sync(f) == -1) {
+    return -1;
+  }
+
+  if ((r = f->seek(f->fpriv, pos, fromend)) != (uint32_t)-1) {
+    f->pos = r;
+  }
+
+  return r;
 }
 
 void vfs_rewind(vfs_file_t *f) {
@@ -644,160 +867,87 @@ void vfs_rewind(vfs_file_t *f) {
 }
 
 vfs_ent_t *vfs_fstat(vfs_file_t *f) {
+  vfs_ent_t *ent = NULL;
+
   if (f) {
-    return f->fstat ? f->fstat(f->fpriv) : NULL;
+    vfs_flush(f);
+    if (f->fstat && (ent = f->fstat(f->fpriv)) != NULL) {
+      f->size = ent->size;
+    }
   }
 
-  return NULL;
+  return ent;
 }
 
 vfs_ent_t *vfs_stat(vfs_session_t *session, char *path, vfs_ent_t *ent) {
   vfs_mount_t *mount;
-  char *abspath;
+  char abspath[VFS_PATH];
   int pos;
 
-  if ((abspath = vfs_abspath(session->cwd, path)) == NULL) {
-    return NULL;
-  }
-
-  if (mutex_lock(mutex) == -1) {
-    xfree(abspath);
-    return NULL;
-  }
-
-  if ((mount = vfs_find(abspath, &pos)) == NULL) {
-    debug(DEBUG_ERROR, "VFS", "unmapped path \"%s\"", abspath);
-    mutex_unlock(mutex);
-    xfree(abspath);
+  if ((mount = vfs_lookup(session, path, abspath, &pos)) == NULL) {
     return NULL;
   }
 
-  ent = mount->callback.stat ? mount->callback.stat(&abspath[pos], mount->data, ent) : NULL;
-  mutex_unlock(mutex);
-  xfree(abspath);
-
-  return ent;
+  return mount->callback.stat ? mount->callback.stat(&abspath[pos], mount->data, ent) : NULL;
 }
 
 int vfs_rename(vfs_session_t *session, char *path1, char *path2) {
   vfs_mount_t *mount1, *mount2;
-  char *abspath1, *abspath2;
+  char abspath1[VFS_PATH], abspath2[VFS_PATH];
   int pos1, pos2;
 
-  if ((abspath1 = vfs_abspath(session->cwd, path1)) == NULL) {
+  if ((mount1 = vfs_lookup(session, path1, abspath1, &pos1)) == NULL) {
     return -1;
   }
 
-  if ((abspath2 = vfs_abspath(session->cwd, path2)) == NULL) {
-    xfree(abspath1);
+  if ((mount2 = vfs_lookup(session, path2, abspath2, &pos2)) == NULL) {
     return -1;
   }
 
-  if (mutex_lock(mutex) == -1) {
-    xfree(abspath2);
-    xfree(abspath1);
-    return -1;
-  }
-
-  if ((mount1 = vfs_find(abspath1, &pos1)) == NULL) {
-    debug(DEBUG_ERROR, "VFS", "unmapped path \"%s\"", abspath1);
-    mutex_unlock(mutex);
-    xfree(abspath2);
-    xfree(abspath1);
-    return -1;
-  }
-
-  if ((mount2 = vfs_find(abspath2, &pos2)) == NULL) {
-    debug(DEBUG_ERROR, "VFS", "unmapped path \"%s\"", abspath2);
-    mutex_unlock(mutex);
-    xfree(abspath2);
-    xfree(abspath1);
-    return -1;
-  }
-
-  if (mount1 != mount2) {
+  // the lookups may have used different mount lists, but copies of a mount share its path
+  if (mount1->path != mount2->path) {
     debug(DEBUG_ERROR, "VFS", "can not rename to different fs");
-    mutex_unlock(mutex);
-    xfree(abspath2);
-    xfree(abspath1);
     return -1;
   }
 
   if ((mount1->callback.rename ? mount1->callback.rename(&abspath1[pos1], &abspath2[pos2], mount1->data) : -1) == -1) {
-    mutex_unlock(mutex);
-    xfree(abspath2);
-    xfree(abspath1);
     return -1;
   }
-  mutex_unlock(mutex);
-
-  xfree(abspath2);
-  xfree(abspath1);
 
   return 0;
 }
 
 int vfs_unlink(vfs_session_t *session, char *path) {
   vfs_mount_t *mount;
-  char *abspath;
+  char abspath[VFS_PATH];
   int pos;
 
-  if ((abspath = vfs_abspath(session->cwd, path)) == NULL) {
-    return -1;
-  }
-
-  if (mutex_lock(mutex) == -1) {
-    xfree(abspath);
-    return -1;
-  }
-
-  if ((mount = vfs_find(abspath, &pos)) == NULL) {
-    debug(DEBUG_ERROR, "VFS", "unmapped path \"%s\"", abspath);
-    mutex_unlock(mutex);
-    xfree(abspath);
+  if ((mount = vfs_lookup(session, path, abspath, &pos)) == NULL) {
     return -1;
   }
 
   if ((mount->callback.unlink ? mount->callback.unlink(&abspath[pos], mount->data) : -1) == -1) {
-    mutex_unlock(mutex);
-    xfree(abspath);
     return -1;
   }
-  mutex_unlock(mutex);
 
-  xfree(abspath);
   return 0;
 }
 
 void *vfs_loadlib(vfs_session_t *session, char *path, int *first_load) {
   vfs_mount_t *mount;
-  char *abspath;
+  char abspath[VFS_PATH];
   int pos;
-  void *lib;
+  void *lib = NULL;
 
-  if ((abspath = vfs_abspath(session->cwd, path)) == NULL) {
+  if ((mount = vfs_lookup(session, path, abspath, &pos)) == NULL) {
     return NULL;
   }
 
-  if (mutex_lock(mutex) == -1) {
-    xfree(abspath);
-    return NULL;
-  }
-
-  if ((mount = vfs_find(abspath, &pos)) == NULL) {
-    debug(DEBUG_ERROR, "VFS", "unmapped path \"%s\"", abspath);
-    mutex_unlock(mutex);
-    xfree(abspath);
-    return NULL;
-  }
-
-  if ((lib = (mount->callback.loadlib ? mount->callback.loadlib(&abspath[pos], first_load, mount->data) : NULL)) == NULL) {
+  // first_load must be reported to exactly one caller
+  if (mutex_lock(mutex) == 0) {
+    lib = mount->callback.loadlib ? mount->callback.loadlib(&abspath[pos], first_load, mount->data) : NULL;
     mutex_unlock(mutex);
-    xfree(abspath);
-    return NULL;
   }
-  mutex_unlock(mutex);
 
-  xfree(abspath);
   return lib;
 }
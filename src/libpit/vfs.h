@@ -16,6 +16,11 @@ extern "C" {
 #define VFS_RDWR  SYS_RDWR
 #define VFS_TRUNC SYS_TRUNC
 
+// default size of the read-ahead / write-behind buffer of files opened with vfs_open
+#ifndef VFS_BUFSIZE
+#define VFS_BUFSIZE 8192
+#endif
+
 int vfs_init(void);
 
 int vfs_refresh(void);
@@ -32,6 +37,11 @@ typedef struct vfs_ent_t {
   uint8_t rd, wr;
 } vfs_ent_t;
 
+typedef struct {
+  uint8_t *buf;
+  uint32_t len;
+} vfs_iovec_t;
+
 typedef struct vfs_session_t vfs_session_t;
 typedef struct vfs_dir_t vfs_dir_t;
 typedef struct vfs_file_t vfs_file_t;
@@ -119,6 +129,14 @@ int vfs_write(vfs_file_t *f, uint8_t *buf, uint32_t len);
 
 int vfs_close(vfs_file_t *f);
 
+int vfs_flush(vfs_file_t *f);
+
+int vfs_setbuf(vfs_file_t *f, uint32_t size);
+
+int vfs_preadv(vfs_file_t *f, vfs_iovec_t *iov, int n, uint32_t offset);
+
+int vfs_pwritev(vfs_file_t *f, vfs_iovec_t *iov, int n, uint32_t offset);
+
 uint32_t vfs_seek(vfs_file_t *f, uint32_t pos, int fromend);
 
 void vfs_rewind(vfs_file_t *f);
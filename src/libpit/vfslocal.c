@@ -113,32 +113,24 @@ static char *vfs_local_getmount(void *_data) {
 static int vfs_local_checktype(char *path, void *_data) {
   vfsassets_mount_t *data;
   sys_stat_t st;
-  char *aux;
+  char aux[VFS_PATH];
 
   data = (vfsassets_mount_t *)_data;
-
-  if ((aux = xcalloc(1, VFS_PATH)) == NULL) {
-    return -1;
-  }
   sys_snprintf(aux, VFS_PATH-1, "%s%s", data->local, path);
 
   if (sys_stat(aux, &st) == -1) {
-    xfree(aux);
     return -1;
   }
 
   if (st.mode & SYS_IFDIR) {
-    xfree(aux);
     return VFS_DIR;
   }
 
   if (st.mode & SYS_IFREG) {
-    xfree(aux);
     return VFS_FILE;
   }
 
   debug(DEBUG_ERROR, "VFS", "\"%s\" is not file or directory", aux);
-  xfree(aux);
   return -1;
 }
 
@@ -293,17 +285,13 @@ static vfs_ent_t *vfs_local_fstat(vfs_fpriv_t *fpriv) {
 
 static vfs_ent_t *vfs_local_stat(char *path, void *_data, vfs_ent_t *ent) {
   vfsassets_mount_t *data;
-  char *aux;
+  char aux[VFS_PATH];
   sys_stat_t st;
   vfs_ent_t *r = NULL;
 
   data = (vfsassets_mount_t *)_data;
   debug(DEBUG_TRACE, "VFS", "vfs_local_stat \"%s\"", path);
 
-  if ((aux = xcalloc(1, VFS_PATH)) == NULL) {
-    return NULL;
-  }
-
   sys_snprintf(aux, VFS_PATH-1, "%s%s", data->local, path);
   debug(DEBUG_TRACE, "VFS", "aux \"%s\"", aux);
 
@@ -321,8 +309,6 @@ static vfs_ent_t *vfs_local_stat(char *path, void *_data, vfs_ent_t *ent) {
     debug_errno("VFS", "sys_stat(\"%s\")", aux);
   }
 
-  xfree(aux);
-
   return r;
 }
 
@@ -346,16 +332,12 @@ static uint32_t vfs_local_seek(vfs_fpriv_t *fpriv, uint32_t pos, int fromend) {
 static vfs_fpriv_t *vfs_local_open(char *path, int mode, void *_data) {
   vfsassets_mount_t *data;
   vfs_fpriv_t *fpriv;
-  char *aux;
+  char aux[VFS_PATH];
   int fd;
 
   data = (vfsassets_mount_t *)_data;
   debug(DEBUG_TRACE, "VFS", "vfs_local_open \"%s\" mode 0x%04X", path, mode);
 
-  if ((aux = xcalloc(1, VFS_PATH)) == NULL) {
-    return NULL;
-  }
-
   sys_snprintf(aux, VFS_PATH-1, "%s%s", data->local, path);
   debug(DEBUG_TRACE, "VFS", "aux \"%s\"", aux);
 
@@ -368,11 +350,9 @@ static vfs_fpriv_t *vfs_local_open(char *path, int mode, void *_data) {
 
   if (fd == -1) {
     debug_errno("VFS", "open(\"%s\", %d)", aux, mode);
-    xfree(aux);
     return NULL;
   }
 
-  xfree(aux);
   if ((fpriv = xcalloc(1, sizeof(vfs_fpriv_t))) == NULL) {
     sys_close(fd);
     return NULL;
@@ -1,59 +1,444 @@
 #include <PalmOS.h>
 
 #include "thread.h"
+#include "mutex.h"
 #include "pwindow.h"
 #include "sys.h"
 #include "vfs.h"
+#include "AppRegistry.h"
 #include "pumpkin.h"
+#include "alarm.h"
 #include "debug.h"
 #include "xalloc.h"
 
 #define PALMOS_MODULE "Alarm"
 
+#define TAG_ALARM "Alarm"
+
+#define ALARM_INC 16
+#define MAX_WAIT  3600  // seconds
+
+typedef struct {
+  UInt32 creator;
+  UInt32 ref;
+  UInt32 alarmSeconds;
+} alarm_t;
+
+typedef struct {
+  mutex_t *mutex;
+  AppRegistryType *ar;
+  alarm_t *heap;
+  UInt32 num, size;
+  alarm_t *display;
+  UInt32 numDisplay, sizeDisplay;
+  int handle;
+  volatile int pending, running;
+  Boolean enabled, busy;
+} alarm_module_t;
+
+static alarm_module_t alm;
+
+static void AlmSwap(UInt32 i, UInt32 j) {
+  alarm_t a;
+
+  a = alm.heap[i];
+  alm.heap[i] = alm.heap[j];
+  alm.heap[j] = a;
+}
+
+static void AlmSiftUp(UInt32 i) {
+  for (; i > 0 && alm.heap[(i - 1) / 2].alarmSeconds > alm.heap[i].alarmSeconds; i = (i - 1) / 2) {
+    AlmSwap(i, (i - 1) / 2);
+  }
+}
+
+static void AlmSiftDown(UInt32 i) {
+  UInt32 j;
+
+  for (;;) {
+    j = 2 * i + 1;
+    if (j >= alm.num) break;
+    if (j + 1 < alm.num && alm.heap[j + 1].alarmSeconds < alm.heap[j].alarmSeconds) j++;
+    if (alm.heap[i].alarmSeconds <= alm.heap[j].alarmSeconds) break;
+    AlmSwap(i, j);
+    i = j;
+  }
+}
+
+static int AlmFind(UInt32 creator) {
+  UInt32 i;
+
+  for (i = 0; i < alm.num; i++) {
+    if (alm.heap[i].creator == creator) return i;
+  }
+
+  return -1;
+}
+
+static void AlmRemove(UInt32 i) {
+  alm.num--;
+  if (i < alm.num) {
+    alm.heap[i] = alm.heap[alm.num];
+    AlmSiftUp(i);
+    AlmSiftDown(i);
+  }
+}
+
+static int AlmInsert(UInt32 creator, UInt32 ref, UInt32 alarmSeconds) {
+  alarm_t *heap;
+  int i;
+
+  if ((i = AlmFind(creator)) != -1) {
+    AlmRemove(i);
+  }
+
+  if (alm.num == alm.size) {
+    if ((heap = xrealloc(alm.heap, (alm.size + ALARM_INC) * sizeof(alarm_t))) == NULL) {
+      return -1;
+    }
+    alm.heap = heap;
+    alm.size += ALARM_INC;
+  }
+
+  i = alm.num++;
+  alm.heap[i].creator = creator;
+  alm.heap[i].ref = ref;
+  alm.heap[i].alarmSeconds = alarmSeconds;
+  AlmSiftUp(i);
+
+  return 0;
+}
+
+// the timer thread recomputes its deadline
+static void AlmWake(void) {
+  uint8_t msg = 1;
+
+  if (alm.handle > 0) {
+    thread_client_write(alm.handle, &msg, 1);
+  }
+}
+
+static void AlmSave(UInt32 creator, UInt32 ref, UInt32 alarmSeconds) {
+  AppRegistryAlarm a;
+
+  a.alarmSeconds = alarmSeconds;
+  a.ref = ref;
+  AppRegistrySet(alm.ar, creator, appRegistryAlarm, 0, &a);
+}
+
+static int AlmTimerAction(void *arg) {
+  unsigned char *buf;
+  unsigned int len;
+  UInt32 now, wait;
+
+  alm.running = 1;
+  debug(DEBUG_INFO, PALMOS_MODULE, "timer thread starting");
+
+  for (; !thread_must_end();) {
+    wait = MAX_WAIT;
+
+    if (mutex_lock(alm.mutex) == 0) {
+      if (alm.num > 0 && !alm.pending) {
+        now = TimGetSeconds();
+        if (alm.heap[0].alarmSeconds <= now) {
+          debug(DEBUG_INFO, PALMOS_MODULE, "alarm due at %u", alm.heap[0].alarmSeconds);
+          alm.pending = 1;
+        } else if (alm.heap[0].alarmSeconds - now < MAX_WAIT) {
+          wait = alm.heap[0].alarmSeconds - now;
+        }
+      }
+      mutex_unlock(alm.mutex);
+    }
+
+    // sleeps until the deadline or until the alarm table changes
+    if (thread_server_read_timeout(wait * 1000000, &buf, &len) == -1) break;
+    if (buf) xfree(buf);
+  }
+
+  debug(DEBUG_INFO, PALMOS_MODULE, "timer thread exiting");
+  alm.running = 0;
+
+  return 0;
+}
+
+static void AlmLoadCallback(UInt32 creator, UInt16 index, UInt16 id, void *p, void *data) {
+  AppRegistryAlarm *a = (AppRegistryAlarm *)p;
+  char st[8];
+
+  if (id == appRegistryAlarm && a->alarmSeconds) {
+    pumpkin_id2s(creator, st);
+    debug(DEBUG_INFO, PALMOS_MODULE, "loading alarm %u for '%s'", a->alarmSeconds, st);
+    AlmInsert(creator, a->ref, a->alarmSeconds);
+  }
+}
+
+int AlmInitGlobal(AppRegistryType *ar) {
+  if ((alm.mutex = mutex_create("alarm")) == NULL) {
+    return -1;
+  }
+
+  alm.ar = ar;
+  alm.enabled = true;
+  AppRegistryEnum(ar, AlmLoadCallback, 0, appRegistryAlarm, NULL);
+
+  if ((alm.handle = thread_begin(TAG_ALARM, AlmTimerAction, NULL)) == -1) {
+    debug(DEBUG_ERROR, PALMOS_MODULE, "could not start timer thread");
+    alm.handle = 0;
+  }
+
+  return 0;
+}
+
+int AlmFinishGlobal(void) {
+  int i;
+
+  if (alm.handle > 0) {
+    thread_end(TAG_ALARM, alm.handle);
+    for (i = 0; i < 100 && alm.running; i++) {
+      sys_usleep(10000);
+    }
+  }
+
+  if (alm.heap) xfree(alm.heap);
+  if (alm.display) xfree(alm.display);
+  mutex_destroy(alm.mutex);
+  sys_memset(&alm, 0, sizeof(alarm_module_t));
+
+  return 0;
+}
+
+int AlmPending(void) {
+  return alm.pending;
+}
+
 Err AlmInit(void) {
   return errNone;
 }
 
+static Err AlmGetCreator(LocalID dbID, UInt32 *creator) {
+  return DmDatabaseInfo(0, dbID, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, creator);
+}
+
+static Err AlmGetName(UInt32 creator, char *name) {
+  DmSearchStateType stateInfo;
+  LocalID dbID;
+  Err err;
+
+  if ((err = DmGetNextDatabaseByTypeCreator(true, &stateInfo, sysFileTApplication, creator, false, NULL, &dbID)) == errNone) {
+    err = DmDatabaseInfo(0, dbID, name, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+  }
+
+  return err;
+}
+
+// Setting alarmSeconds to 0 cancels the alarm of the application.
 Err AlmSetAlarm(UInt16 cardNo, LocalID dbID, UInt32 ref, UInt32 alarmSeconds, Boolean quiet) {
+  UInt32 creator;
+  char st[8];
+  int i;
   Err err = almErrFull;
 
-  if (pumpkin_alarm_set(dbID, alarmSeconds, ref) == 0) {
-    err = errNone;
+  if (cardNo == almProcAlarmCardNo) {
+    debug(DEBUG_ERROR, PALMOS_MODULE, "procedure alarms are not supported");
+    return err;
+  }
+
+  if (AlmGetCreator(dbID, &creator) != errNone) {
+    return err;
+  }
+
+  if (mutex_lock(alm.mutex) == 0) {
+    pumpkin_id2s(creator, st);
+    if (alarmSeconds) {
+      debug(DEBUG_INFO, PALMOS_MODULE, "set alarm %u ref %u for '%s'", alarmSeconds, ref, st);
+      if (AlmInsert(creator, ref, alarmSeconds) == 0) {
+        err = errNone;
+      }
+    } else {
+      debug(DEBUG_INFO, PALMOS_MODULE, "cancel alarm for '%s'", st);
+      if ((i = AlmFind(creator)) != -1) {
+        AlmRemove(i);
+      }
+      ref = 0;
+      err = errNone;
+    }
+    mutex_unlock(alm.mutex);
+
+    if (err == errNone) {
+      AlmSave(creator, ref, alarmSeconds);
+      AlmWake();
+    }
   }
 
   return err;
 }
 
 UInt32 AlmGetAlarm(UInt16 cardNo, LocalID dbID, UInt32 *refP) {
-  UInt32 alarmSeconds = 0;
+  UInt32 creator, alarmSeconds = 0;
+  int i;
+
+  if (refP) *refP = 0;
 
-  pumpkin_alarm_get(dbID, &alarmSeconds, refP);
+  if (cardNo != almProcAlarmCardNo && AlmGetCreator(dbID, &creator) == errNone) {
+    if (mutex_lock(alm.mutex) == 0) {
+      if ((i = AlmFind(creator)) != -1) {
+        alarmSeconds = alm.heap[i].alarmSeconds;
+        if (refP) *refP = alm.heap[i].ref;
+      }
+      mutex_unlock(alm.mutex);
+    }
+  }
 
   return alarmSeconds;
 }
 
 void AlmEnableNotification(Boolean enable) {
   // system use only
-  debug(DEBUG_ERROR, PALMOS_MODULE, "AlmEnableNotification not implemented");
+  if (mutex_lock(alm.mutex) == 0) {
+    alm.enabled = enable;
+    mutex_unlock(alm.mutex);
+  }
 }
 
+// Sends sysAppLaunchCmdDisplayAlarm for the alarms that were triggered and
+// not purged, in the order they were triggered.
 Boolean AlmDisplayAlarm(Boolean okToDisplay) {
   // system use only
-  debug(DEBUG_ERROR, PALMOS_MODULE, "AlmDisplayAlarm not implemented");
-  return false;
+  SysDisplayAlarmParamType displayAlarm;
+  char name[dmDBNameLength];
+  alarm_t a;
+  Boolean displayed = false;
+  UInt32 i;
+
+  if (!okToDisplay) return false;
+
+  for (;;) {
+    if (mutex_lock(alm.mutex) != 0) break;
+    i = alm.numDisplay;
+    if (i > 0) {
+      a = alm.display[0];
+      alm.numDisplay--;
+      if (alm.numDisplay) MemMove(&alm.display[0], &alm.display[1], alm.numDisplay * sizeof(alarm_t));
+    }
+    mutex_unlock(alm.mutex);
+    if (i == 0) break;
+
+    if (AlmGetName(a.creator, name) == errNone) {
+      xmemset(&displayAlarm, 0, sizeof(displayAlarm));
+      displayAlarm.alarmSeconds = a.alarmSeconds;
+      displayAlarm.ref = a.ref;
+      displayAlarm.soundAlarm = false; // not used
+      debug(DEBUG_INFO, PALMOS_MODULE, "display alarm %u for \"%s\"", a.alarmSeconds, name);
+      pumpkin_launch_request(name, sysAppLaunchCmdDisplayAlarm, (UInt8 *)&displayAlarm, 0, NULL, 1);
+      displayed = true;
+    }
+  }
+
+  return displayed;
 }
 
 void AlmCancelAll(void) {
   // system use only
-  debug(DEBUG_ERROR, PALMOS_MODULE, "AlmCancelAll not implemented");
+  alarm_t *heap = NULL;
+  UInt32 i, num = 0;
+
+  if (mutex_lock(alm.mutex) == 0) {
+    heap = alm.heap;
+    num = alm.num;
+    alm.heap = NULL;
+    alm.num = alm.size = 0;
+    alm.numDisplay = 0;
+    alm.pending = 0;
+    mutex_unlock(alm.mutex);
+  }
+
+  if (heap) {
+    for (i = 0; i < num; i++) {
+      AlmSave(heap[i].creator, 0, 0);
+    }
+    xfree(heap);
+  }
+  AlmWake();
 }
 
+// Called when alarms are pending. Removes the alarms that are due, sends
+// sysAppLaunchCmdAlarmTriggered to their applications, launching them as
+// subroutines if they are not running, and then displays them.
 void AlmAlarmCallback(void) {
   // system use only
-  debug(DEBUG_ERROR, PALMOS_MODULE, "AlmAlarmCallback not implemented");
+  SysAlarmTriggeredParamType triggerAlarm;
+  char name[dmDBNameLength];
+  alarm_t *due = NULL, *display;
+  UInt32 i, now, num;
+
+  if (!alm.pending || mutex_lock(alm.mutex) != 0) return;
+
+  if (alm.busy || !alm.enabled) {
+    mutex_unlock(alm.mutex);
+    return;
+  }
+
+  alm.busy = true;
+  alm.pending = 0;
+  now = TimGetSeconds();
+  for (i = 0, num = 0; i < alm.num; i++) {
+    if (alm.heap[i].alarmSeconds <= now) num++;
+  }
+  if (num > 0 && (due = xcalloc(num, sizeof(alarm_t))) != NULL) {
+    for (i = 0; i < num; i++) {
+      due[i] = alm.heap[0];
+      AlmRemove(0);
+    }
+  } else {
+    num = 0;
+  }
+  mutex_unlock(alm.mutex);
+
+  for (i = 0; i < num; i++) {
+    AlmSave(due[i].creator, 0, 0);
+
+    if (AlmGetName(due[i].creator, name) != errNone) {
+      due[i].creator = 0;
+      continue;
+    }
+
+    xmemset(&triggerAlarm, 0, sizeof(triggerAlarm));
+    triggerAlarm.alarmSeconds = due[i].alarmSeconds;
+    triggerAlarm.ref = due[i].ref;
+    debug(DEBUG_INFO, PALMOS_MODULE, "alarm %u triggered for \"%s\"", due[i].alarmSeconds, name);
+    pumpkin_launch_request(name, sysAppLaunchCmdAlarmTriggered, (UInt8 *)&triggerAlarm, 0, NULL, 1);
+
+    if (triggerAlarm.purgeAlarm) {
+      // application requested to cancel the alarm
+      debug(DEBUG_INFO, PALMOS_MODULE, "purge alarm for \"%s\"", name);
+      due[i].creator = 0;
+    }
+  }
+
+  if (mutex_lock(alm.mutex) == 0) {
+    for (i = 0; i < num; i++) {
+      if (due[i].creator == 0) continue;
+      if (alm.numDisplay == alm.sizeDisplay) {
+        if ((display = xrealloc(alm.display, (alm.sizeDisplay + ALARM_INC) * sizeof(alarm_t))) == NULL) break;
+        alm.display = display;
+        alm.sizeDisplay += ALARM_INC;
+      }
+      alm.display[alm.numDisplay++] = due[i];
+    }
+    mutex_unlock(alm.mutex);
+  }
+  if (due) xfree(due);
+
+  AlmDisplayAlarm(true);
+  AlmWake();
+
+  if (mutex_lock(alm.mutex) == 0) {
+    alm.busy = false;
+    mutex_unlock(alm.mutex);
+  }
 }
 
 void AlmTimeChange(void) {
   // system use only
-  debug(DEBUG_ERROR, PALMOS_MODULE, "AlmTimeChange not implemented");
+  AlmWake();
 }
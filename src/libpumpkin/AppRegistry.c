@@ -8,162 +8,466 @@
 #include "xalloc.h"
 #include "debug.h"
 
+// Entries are kept in memory, indexed by a hash of (creator, id, seq).
+// Changes only mark entries as dirty. AppRegistryFlush appends the dirty
+// entries to a journal, and the journal is folded into the registry file
+// when it grows. Older registries, with one file per entry, are read once
+// and converted.
+
+#define REGISTRY_FILE   "registry"
+#define JOURNAL_FILE    "journal"
+#define TMP_FILE        "registry.tmp"
+#define REGISTRY_MAGIC  'AREG'
+#define REGISTRY_HDR    8
+#define RECORD_HDR      10
+#define MIN_JOURNAL     65536
+#define FLUSH_INTERVAL  5000  // ms
+#define FLUSH_QUIET     200   // ms
+
 typedef struct {
   DmResType creator;
   AppRegistryID id;
   UInt16 seq;
   UInt16 size;
+  Boolean dirty;
   void *data;
 } AppRegistryEntry;
 
 struct AppRegistryType {
-  mutex_t *mutex;
+  rwlock_t *lock;
+  mutex_t *flush;
   char *regname;
   AppRegistryEntry *registry;
   UInt32 num, size;
+  UInt32 *hash, hashSize;
   Boolean ordered;
+  UInt32 ndirty;
+  int64_t dirtySince, lastSet, interval;
+  UInt32 journalSize, registrySize;
+  Boolean compact;
+  char **legacy;
+  UInt32 nlegacy;
 };
 
-AppRegistryType *AppRegistryInit(char *regname) {
-  AppRegistryType *ar;
+static UInt32 AppRegistryHash(UInt32 creator, UInt16 id, UInt16 seq) {
+  UInt32 h;
+
+  h = creator * 0x9E3779B1;
+  h ^= (((UInt32)id << 16) | seq) * 0x85EBCA6B;
+  h ^= h >> 15;
+
+  return h;
+}
+
+// slots hold entry index + 1, 0 is an empty slot
+static void AppRegistryIndex(AppRegistryType *ar) {
+  UInt32 i, j, size;
+
+  for (size = 64; size < ar->size * 2; size <<= 1);
+
+  if (size != ar->hashSize) {
+    if (ar->hash) xfree(ar->hash);
+    ar->hash = xcalloc(size, sizeof(UInt32));
+    ar->hashSize = ar->hash ? size : 0;
+  } else {
+    sys_memset(ar->hash, 0, size * sizeof(UInt32));
+  }
+
+  for (i = 0; i < ar->num && ar->hash; i++) {
+    j = AppRegistryHash(ar->registry[i].creator, ar->registry[i].id, ar->registry[i].seq) & (ar->hashSize - 1);
+    while (ar->hash[j]) j = (j + 1) & (ar->hashSize - 1);
+    ar->hash[j] = i + 1;
+  }
+}
+
+static int AppRegistryFind(AppRegistryType *ar, UInt32 creator, UInt16 id, UInt16 seq) {
+  AppRegistryEntry *e;
+  UInt32 j, k;
+
+  if (ar->hash == NULL) return -1;
+
+  j = AppRegistryHash(creator, id, seq) & (ar->hashSize - 1);
+  for (; (k = ar->hash[j]) != 0; j = (j + 1) & (ar->hashSize - 1)) {
+    e = &ar->registry[k - 1];
+    if (e->creator == creator && e->id == id && e->seq == seq) return k - 1;
+  }
+
+  return -1;
+}
+
+// Adds an entry or replaces the data of an existing one, taking ownership of data.
+// Returns the index of the entry, or -1 (and data is freed) if there is no memory.
+static int AppRegistryPut(AppRegistryType *ar, UInt32 creator, UInt16 id, UInt16 seq, void *data, UInt16 size) {
+  AppRegistryEntry *e, *registry;
+  UInt32 j;
+  int i;
+
+  if ((i = AppRegistryFind(ar, creator, id, seq)) == -1) {
+    if (ar->num == ar->size) {
+      if ((registry = xrealloc(ar->registry, (ar->size + 1024) * sizeof(AppRegistryEntry))) == NULL) {
+        debug(DEBUG_ERROR, "AppReg", "could not grow registry to %u entries", ar->size + 1024);
+        if (data) xfree(data);
+        return -1;
+      }
+      ar->registry = registry;
+      ar->size += 1024;
+      AppRegistryIndex(ar);
+    }
+    i = ar->num++;
+    e = &ar->registry[i];
+    xmemset(e, 0, sizeof(AppRegistryEntry));
+    e->creator = creator;
+    e->id = id;
+    e->seq = seq;
+    ar->ordered = false;
+    if (ar->hash) {
+      j = AppRegistryHash(creator, id, seq) & (ar->hashSize - 1);
+      while (ar->hash[j]) j = (j + 1) & (ar->hashSize - 1);
+      ar->hash[j] = i + 1;
+    }
+  } else {
+    e = &ar->registry[i];
+    if (e->data) xfree(e->data);
+  }
+
+  e->size = size;
+  e->data = data;
+
+  return i;
+}
+
+static Boolean AppRegistryValid(UInt16 id, UInt16 size) {
+  switch (id) {
+    case appRegistryCompat:       return size == sizeof(AppRegistryCompat);
+    case appRegistrySize:         return size == sizeof(AppRegistrySize);
+    case appRegistryPosition:     return size == sizeof(AppRegistryPosition);
+    case appRegistryAlarm:        return size == sizeof(AppRegistryAlarm);
+    case appRegistryNotification: return (size % sizeof(AppRegistryNotification)) == 0;
+    case appRegistrySavedPref:
+    case appRegistryUnsavedPref:  return true;
+  }
+
+  return false;
+}
+
+// Reads the records of a registry or journal file. A truncated record at
+// the end, left by an interrupted write, is ignored.
+static UInt32 AppRegistryLoad(AppRegistryType *ar, char *name) {
+  char path[256];
+  uint8_t *buf, *data;
+  uint32_t magic, creator, i, n;
+  uint16_t id, seq, size;
+  int64_t fsize;
+  int fd;
+
+  sys_snprintf(path, sizeof(path) - 1, "%s%s", ar->regname, name);
+  if ((fd = sys_open(path, SYS_READ)) == -1) return 0;
+
+  n = 0;
+  if ((fsize = sys_seek(fd, 0, SYS_SEEK_END)) >= REGISTRY_HDR && sys_seek(fd, 0, SYS_SEEK_SET) != -1) {
+    if ((buf = xmalloc(fsize)) != NULL) {
+      if (sys_read(fd, buf, fsize) == fsize) {
+        get4b(&magic, buf, 0);
+        if (magic == REGISTRY_MAGIC) {
+          for (i = REGISTRY_HDR; i + RECORD_HDR <= fsize; i += size, n++) {
+            i += get4b(&creator, buf, i);
+            i += get2b(&id, buf, i);
+            i += get2b(&seq, buf, i);
+            i += get2b(&size, buf, i);
+            if (i + size > fsize) break;
+            if (!AppRegistryValid(id, size)) continue;
+            data = NULL;
+            if (size && (data = xmalloc(size)) == NULL) break;
+            if (size) xmemcpy(data, buf + i, size);
+            AppRegistryPut(ar, creator, id, seq, data, size);
+          }
+          debug(DEBUG_INFO, "AppReg", "read %u record(s) from %s", n, path);
+        } else {
+          debug(DEBUG_ERROR, "AppReg", "invalid registry file %s", path);
+        }
+      }
+      xfree(buf);
+    }
+  }
+  sys_close(fd);
+
+  return fsize > 0 ? (UInt32)fsize : 0;
+}
+
+// Reads the files of the previous format, one per entry.
+static void AppRegistryLoadLegacy(AppRegistryType *ar) {
   sys_dir_t *dir;
-  char path[64], name[32], screator[8];
+  char path[256], name[32], screator[8], **legacy;
   uint8_t *buf;
   uint32_t creator;
   int64_t size;
-  int i, id, seq, aux, fd;
+  int id, seq, aux, fd;
+
+  if ((dir = sys_opendir(ar->regname)) == NULL) return;
+
+  for (;;) {
+    if (sys_readdir(dir, name, sizeof(name) - 1) == -1) break;
+    screator[4] = 0;
+    if (sys_sscanf(name, "%c%c%c%c.%08X.%d.%d", screator, screator + 1, screator + 2,
+                   screator + 3, &aux, &id, &seq) != 7)
+      continue;
+    if (id < appRegistryCompat || id >= appRegistryLast) continue;
+
+    sys_snprintf(path, sizeof(path) - 1, "%s%s", ar->regname, name);
+    if ((fd = sys_open(path, SYS_READ)) == -1) continue;
+
+    if ((size = sys_seek(fd, 0, SYS_SEEK_END)) != -1 && size < 65536 && AppRegistryValid(id, size)) {
+      if (sys_seek(fd, 0, SYS_SEEK_SET) != -1) {
+        if ((buf = size ? xcalloc(1, size) : NULL) != NULL || size == 0) {
+          if (size == 0 || sys_read(fd, buf, size) == size) {
+            debug(DEBUG_INFO, "AppReg", "reading registry creator '%s' id %d seq %d", screator, id, seq);
+            pumpkin_s2id(&creator, screator);
+            AppRegistryPut(ar, creator, id, seq, buf, size);
+          } else {
+            xfree(buf);
+          }
+        }
+      }
+    }
+    sys_close(fd);
+
+    // the file is removed after the registry file has been written
+    if ((ar->nlegacy % 64) == 0) {
+      if ((legacy = xrealloc(ar->legacy, (ar->nlegacy + 64) * sizeof(char *))) == NULL) continue;
+      ar->legacy = legacy;
+    }
+    if ((ar->legacy[ar->nlegacy] = xstrdup(path)) != NULL) ar->nlegacy++;
+  }
+
+  sys_closedir(dir);
+}
+
+AppRegistryType *AppRegistryInit(char *regname) {
+  AppRegistryType *ar;
+  sys_dir_t *dir;
 
   if ((ar = xcalloc(1, (sizeof(AppRegistryType)))) != NULL) {
-    ar->mutex = mutex_create("registry");
+    ar->lock = rwlock_create("registry");
+    ar->flush = mutex_create("regflush");
     ar->regname = xstrdup(regname);
     ar->size = 1024;
     ar->registry = xcalloc(ar->size, sizeof(AppRegistryEntry));
+    ar->interval = FLUSH_INTERVAL * 1000;
+    AppRegistryIndex(ar);
 
     if ((dir = sys_opendir(regname)) == NULL) {
       sys_mkdir(regname);
-      dir = sys_opendir(regname);
-    }
-    i = 0;
-
-    if (dir) {
-      for (;;) {
-        if (i == ar->size) {
-          ar->size += 1024;
-          ar->registry = xrealloc(ar->registry, ar->size * sizeof(AppRegistryEntry));
-        }
-        if (sys_readdir(dir, name, sizeof(name) - 1) == -1) break;
-        screator[4] = 0;
-        if (sys_sscanf(name, "%c%c%c%c.%08X.%d.%d", screator, screator + 1, screator + 2,
-                       screator + 3, &aux, &id, &seq) != 7)
-          continue;
-        if (id < appRegistryCompat || id >= appRegistryLast) continue;
-
-        sys_snprintf(path, sizeof(path) - 1, "%s%s", regname, name);
-        if ((fd = sys_open(path, SYS_READ)) == -1) continue;
-
-        if ((size = sys_seek(fd, 0, SYS_SEEK_END)) != -1) {
-          if (sys_seek(fd, 0, SYS_SEEK_SET) != -1) {
-            if ((buf = xcalloc(1, size)) != NULL) {
-              if (sys_read(fd, buf, size) == size) {
-                debug(DEBUG_INFO, "AppReg", "reading registry creator '%s' id %d seq %d", screator,
-                      id, seq);
-                pumpkin_s2id(&creator, screator);
-                ar->registry[i].creator = creator;
-                ar->registry[i].id = id;
-                ar->registry[i].seq = seq;
-                ar->registry[i].size = size;
-                ar->registry[i].data = buf;
-                i++;
-              } else {
-                xfree(buf);
-              }
-            }
-          }
-        }
-        sys_close(fd);
-      }
-
+    } else {
       sys_closedir(dir);
     }
-    ar->num = i;
+
+    AppRegistryLoadLegacy(ar);
+    ar->registrySize = AppRegistryLoad(ar, REGISTRY_FILE);
+    ar->journalSize = AppRegistryLoad(ar, JOURNAL_FILE);
+    ar->compact = ar->nlegacy > 0;
   }
 
   return ar;
 }
 
-static int AppRegistrySave(AppRegistryType *ar, int i) {
-  char path[64], screator[8];
+void AppRegistrySetFlushInterval(AppRegistryType *ar, UInt32 ms) {
+  if (ar) ar->interval = (int64_t)ms * 1000;
+}
+
+static UInt32 AppRegistryRecord(uint8_t *buf, UInt32 i, AppRegistryEntry *e) {
+  i += put4b(e->creator, buf, i);
+  i += put2b(e->id, buf, i);
+  i += put2b(e->seq, buf, i);
+  i += put2b(e->size, buf, i);
+  if (e->size) xmemcpy(buf + i, e->data, e->size);
+
+  return i + e->size;
+}
+
+static int AppRegistryWrite(char *path, uint8_t *buf, UInt32 len, Boolean append) {
   int fd, r = -1;
 
-  pumpkin_id2s(ar->registry[i].creator, screator);
-  sys_snprintf(path, sizeof(path)-1, "%s%4s.%08X.%d.%d", ar->regname, screator, ar->registry[i].creator, ar->registry[i].id, ar->registry[i].seq);
+  if (append) {
+    if ((fd = sys_open(path, SYS_WRITE)) != -1) {
+      if (sys_seek(fd, 0, SYS_SEEK_END) == -1) {
+        sys_close(fd);
+        return -1;
+      }
+    } else {
+      fd = sys_create(path, SYS_WRITE | SYS_TRUNC, 0644);
+    }
+  } else {
+    fd = sys_create(path, SYS_WRITE | SYS_TRUNC, 0644);
+  }
 
-  if ((fd = sys_create(path, SYS_WRITE | SYS_TRUNC, 0644)) != -1) {
-    debug(DEBUG_INFO, "AppReg", "saving registry creator '%s' id %d seq %d", screator, ar->registry[i].id, ar->registry[i].seq);
-    if (ar->registry[i].data && ar->registry[i].size) sys_write(fd, (uint8_t *)ar->registry[i].data, ar->registry[i].size);
+  if (fd != -1) {
+    if (sys_write(fd, buf, len) == len) r = 0;
     sys_close(fd);
-    r = 0;
   }
 
   return r;
 }
 
+// Writes the dirty entries to the journal, or all entries to a new registry
+// file when the journal has grown larger than the registry. The entries are
+// serialized under the lock and written after it is released.
+void AppRegistryFlush(AppRegistryType *ar) {
+  char path[256], tmp[256];
+  uint8_t *buf;
+  Boolean compact;
+  UInt32 i, len, n;
+  int r;
+
+  if (ar == NULL || mutex_lock(ar->flush) != 0) return;
+
+  buf = NULL;
+  len = 0;
+  n = 0;
+  compact = ar->compact || ar->journalSize > MIN_JOURNAL + ar->registrySize;
+
+  if (rwlock_wrlock(ar->lock) == 0) {
+    if (compact || ar->ndirty > 0) {
+      for (i = 0, len = REGISTRY_HDR; i < ar->num; i++) {
+        if (compact || ar->registry[i].dirty) len += RECORD_HDR + ar->registry[i].size;
+      }
+      if ((buf = xmalloc(len)) != NULL) {
+        put4b(REGISTRY_MAGIC, buf, 0);
+        put4b(0, buf, 4);
+        for (i = 0, len = REGISTRY_HDR; i < ar->num; i++) {
+          if (compact || ar->registry[i].dirty) {
+            len = AppRegistryRecord(buf, len, &ar->registry[i]);
+            ar->registry[i].dirty = false;
+            n++;
+          }
+        }
+        ar->ndirty = 0;
+      }
+    }
+    rwlock_unlock(ar->lock);
+  }
+
+  if (buf) {
+    if (compact) {
+      sys_snprintf(tmp, sizeof(tmp) - 1, "%s%s", ar->regname, TMP_FILE);
+      sys_snprintf(path, sizeof(path) - 1, "%s%s", ar->regname, REGISTRY_FILE);
+      r = AppRegistryWrite(tmp, buf, len, false);
+      if (r == 0) r = sys_rename(tmp, path);
+      if (r == 0) {
+        sys_snprintf(path, sizeof(path) - 1, "%s%s", ar->regname, JOURNAL_FILE);
+        sys_unlink(path);
+        ar->registrySize = len;
+        ar->journalSize = 0;
+        ar->compact = false;
+        for (i = 0; i < ar->nlegacy; i++) {
+          sys_unlink(ar->legacy[i]);
+          xfree(ar->legacy[i]);
+        }
+        if (ar->legacy) xfree(ar->legacy);
+        ar->legacy = NULL;
+        ar->nlegacy = 0;
+      }
+    } else {
+      sys_snprintf(path, sizeof(path) - 1, "%s%s", ar->regname, JOURNAL_FILE);
+      // the journal starts with the same header as the registry file
+      if (ar->journalSize == 0) {
+        r = AppRegistryWrite(path, buf, len, false);
+      } else {
+        r = AppRegistryWrite(path, buf + REGISTRY_HDR, len - REGISTRY_HDR, true);
+        len -= REGISTRY_HDR;
+      }
+      if (r == 0) ar->journalSize += len;
+    }
+
+    if (r == 0) {
+      debug(DEBUG_INFO, "AppReg", "saved %u registry entries (%s)", n, compact ? "registry" : "journal");
+    } else {
+      // a failed write may leave a partial record, the next flush rewrites everything
+      debug(DEBUG_ERROR, "AppReg", "error saving registry");
+      ar->compact = true;
+    }
+    xfree(buf);
+  }
+
+  mutex_unlock(ar->flush);
+}
+
+// Called from the event loop. Dirty entries are flushed once there have been
+// no changes for a short while, or when they are older than the flush interval.
+void AppRegistryIdle(AppRegistryType *ar) {
+  Boolean flush = false;
+  int64_t now;
+
+  if (ar && rwlock_rdlock(ar->lock) == 0) {
+    if (ar->ndirty > 0) {
+      now = sys_get_clock();
+      flush = (now - ar->lastSet) >= FLUSH_QUIET * 1000 || (now - ar->dirtySince) >= ar->interval;
+    }
+    rwlock_unlock(ar->lock);
+  }
+
+  if (flush) AppRegistryFlush(ar);
+}
+
 void AppRegistryFinish(AppRegistryType *ar) {
   int i;
 
   if (ar) {
+    AppRegistryFlush(ar);
     if (ar->registry) {
       for (i = 0; i < ar->num; i++) {
-        AppRegistrySave(ar, i);
         if (ar->registry[i].data) xfree(ar->registry[i].data);
       }
       xfree(ar->registry);
     }
-    mutex_destroy(ar->mutex);
+    for (i = 0; i < ar->nlegacy; i++) {
+      xfree(ar->legacy[i]);
+    }
+    if (ar->legacy) xfree(ar->legacy);
+    if (ar->hash) xfree(ar->hash);
+    if (ar->regname) xfree(ar->regname);
+    rwlock_destroy(ar->lock);
+    mutex_destroy(ar->flush);
     xfree(ar);
   }
 }
 
 static UInt16 AppRegistryProcess(AppRegistryType *ar, UInt32 creator, UInt16 id, UInt16 seq, UInt16 (*callback)(AppRegistryEntry *e, void *d, UInt16 size, Boolean set), void *d, UInt16 size, Boolean set) {
+  AppRegistryEntry *e;
   char screator[8];
-  int i;
+  int64_t now;
   UInt16 r = 0;
+  int i;
 
-  if (ar && mutex_lock(ar->mutex) == 0) {
-    for (i = 0; i < ar->num; i++) {
-      if (ar->registry[i].creator == creator && ar->registry[i].id == id && ar->registry[i].seq == seq) {
-        break;
-      }
-    }
+  if (ar == NULL || (set ? rwlock_wrlock(ar->lock) : rwlock_rdlock(ar->lock)) != 0) {
+    return 0;
+  }
 
-    if (set) {
-      if (i == ar->num) {
-        ar->num++;
-        if (ar->num == ar->size) {
-          ar->size += 1024;
-          ar->registry = xrealloc(ar->registry, ar->size * sizeof(AppRegistryEntry));
-        }
-        ar->registry[i].creator = creator;
-        ar->registry[i].id = id;
-        ar->registry[i].seq = seq;
-        ar->registry[i].size = size;
-        ar->registry[i].data = size ? xcalloc(1, size) : NULL;
-        ar->ordered = false;
-        pumpkin_id2s(creator, screator);
-        debug(DEBUG_INFO, "AppReg", "creating registry creator '%s' id %d seq %d", screator, id, seq);
-      }
+  i = AppRegistryFind(ar, creator, id, seq);
 
-      r = callback(&ar->registry[i], d, size, true);
-      AppRegistrySave(ar, i);
+  if (set) {
+    if (i == -1 && (i = AppRegistryPut(ar, creator, id, seq, size ? xcalloc(1, size) : NULL, size)) != -1) {
+      pumpkin_id2s(creator, screator);
+      debug(DEBUG_INFO, "AppReg", "creating registry creator '%s' id %d seq %d", screator, id, seq);
+    }
 
-    } else {
-      if (i < ar->num) {
-        r = callback(&ar->registry[i], d, size, false);
+    if (i != -1) {
+      e = &ar->registry[i];
+      r = callback(e, d, size, true);
+
+      now = sys_get_clock();
+      if (!e->dirty) {
+        e->dirty = true;
+        if (ar->ndirty++ == 0) ar->dirtySince = now;
       }
+      ar->lastSet = now;
     }
-    mutex_unlock(ar->mutex);
+
+  } else if (i != -1) {
+    r = callback(&ar->registry[i], d, size, false);
   }
 
+  rwlock_unlock(ar->lock);
+
   return r;
 }
 
@@ -203,6 +507,24 @@ static UInt16 AppRegistryPositionCallback(AppRegistryEntry *e, void *d, UInt16 s
   return sizeof(AppRegistryPosition);
 }
 
+static UInt16 AppRegistryAlarmCallback(AppRegistryEntry *e, void *d, UInt16 size, Boolean set) {
+  AppRegistryAlarm *a1 = (AppRegistryAlarm *)e->data;
+  AppRegistryAlarm *a2 = (AppRegistryAlarm *)d;
+  char st[8];
+
+  if (set) {
+    pumpkin_id2s(e->creator, st);
+    debug(DEBUG_INFO, "AppReg", "updating alarm %u for '%s'", a2->alarmSeconds, st);
+    a1->alarmSeconds = a2->alarmSeconds;
+    a1->ref = a2->ref;
+  } else {
+    a2->alarmSeconds = a1->alarmSeconds;
+    a2->ref = a1->ref;
+  }
+
+  return sizeof(AppRegistryAlarm);
+}
+
 static UInt16 AppRegistryCompatCallback(AppRegistryEntry *e, void *d, UInt16 size, Boolean set) {
   AppRegistryCompat *c1 = (AppRegistryCompat *)e->data;
   AppRegistryCompat *c2 = (AppRegistryCompat *)d;
@@ -287,7 +609,12 @@ static UInt16 AppRegistryPreferenceCallback(AppRegistryEntry *e, void *d, UInt16
   if (set) {
     pumpkin_id2s(e->creator, st);
     debug(DEBUG_INFO, "AppReg", "updating preference %d for '%s'", e->seq, st);
-    MemMove(e->data, d, e->size);
+    if (size != e->size) {
+      if (e->data) xfree(e->data);
+      e->data = size ? xcalloc(1, size) : NULL;
+      e->size = e->data ? size : 0;
+    }
+    if (d && e->size) MemMove(e->data, d, e->size);
   } else {
     if (d) {
       if (size == 0) size = e->size;
@@ -298,6 +625,43 @@ static UInt16 AppRegistryPreferenceCallback(AppRegistryEntry *e, void *d, UInt16
   return e->size;
 }
 
+// Application preferences are stored as a 16-bit version followed by the
+// payload. These pieces are passed separately so that no intermediate
+// buffer is needed.
+typedef struct {
+  Int16 version;
+  void *prefs;
+  UInt16 size;
+} AppRegistryVersionedPref;
+
+static UInt16 AppRegistryVersionedPreferenceCallback(AppRegistryEntry *e, void *d, UInt16 size, Boolean set) {
+  AppRegistryVersionedPref *v = (AppRegistryVersionedPref *)d;
+  UInt16 version;
+  char st[8];
+
+  if (set) {
+    pumpkin_id2s(e->creator, st);
+    debug(DEBUG_INFO, "AppReg", "updating preference %d version %d for '%s'", e->seq, v->version, st);
+    if (size != e->size) {
+      if (e->data) xfree(e->data);
+      e->data = xcalloc(1, size);
+      e->size = e->data ? size : 0;
+    }
+    if (e->size) {
+      version = v->version;
+      MemMove(e->data, &version, sizeof(UInt16));
+      if (v->size) MemMove((UInt8 *)e->data + sizeof(UInt16), v->prefs, v->size);
+    }
+  } else if (e->size >= sizeof(UInt16)) {
+    MemMove(&version, e->data, sizeof(UInt16));
+    v->version = version;
+    if (v->size == 0 || v->size > e->size - sizeof(UInt16)) v->size = e->size - sizeof(UInt16);
+    if (v->prefs && v->size) MemMove(v->prefs, (UInt8 *)e->data + sizeof(UInt16), v->size);
+  }
+
+  return e->size;
+}
+
 void AppRegistrySet(AppRegistryType *ar, UInt32 creator, AppRegistryID id, UInt16 seq, void *p) {
   switch (id) {
     case appRegistryCompat:
@@ -312,6 +676,9 @@ void AppRegistrySet(AppRegistryType *ar, UInt32 creator, AppRegistryID id, UInt1
     case appRegistryNotification:
       AppRegistryProcess(ar, creator, id, seq, AppRegistryNotificationCallback, p, sizeof(AppRegistryNotification), true);
       break;
+    case appRegistryAlarm:
+      AppRegistryProcess(ar, creator, id, seq, AppRegistryAlarmCallback, p, sizeof(AppRegistryAlarm), true);
+      break;
     default:
       break;
   }
@@ -334,6 +701,9 @@ Boolean AppRegistryGet(AppRegistryType *ar, UInt32 creator, AppRegistryID id, UI
     case appRegistryPosition:
       r = AppRegistryProcess(ar, creator, id, seq, AppRegistryPositionCallback, p, sizeof(AppRegistryPosition), false);
       break;
+    case appRegistryAlarm:
+      r = AppRegistryProcess(ar, creator, id, seq, AppRegistryAlarmCallback, p, sizeof(AppRegistryAlarm), false);
+      break;
     default:
       break;
   }
@@ -345,6 +715,29 @@ UInt16 AppRegistryGetPreference(AppRegistryType *ar, UInt32 creator, UInt16 seq,
   return AppRegistryProcess(ar, creator, saved ? appRegistrySavedPref : appRegistryUnsavedPref, seq, AppRegistryPreferenceCallback, p, size, false);
 }
 
+Int16 AppRegistryGetVersionedPreference(AppRegistryType *ar, UInt32 creator, UInt16 seq, void *prefs, UInt16 *size, Boolean saved) {
+  AppRegistryVersionedPref v;
+
+  v.version = noPreferenceFound;
+  v.prefs = prefs;
+  v.size = *size;
+
+  AppRegistryProcess(ar, creator, saved ? appRegistrySavedPref : appRegistryUnsavedPref, seq, AppRegistryVersionedPreferenceCallback, &v, 0, false);
+  if (v.version != noPreferenceFound) *size = v.size;
+
+  return v.version;
+}
+
+void AppRegistrySetVersionedPreference(AppRegistryType *ar, UInt32 creator, UInt16 seq, Int16 version, const void *prefs, UInt16 size, Boolean saved) {
+  AppRegistryVersionedPref v;
+
+  v.version = version;
+  v.prefs = (void *)prefs;
+  v.size = size;
+
+  AppRegistryProcess(ar, creator, saved ? appRegistrySavedPref : appRegistryUnsavedPref, seq, AppRegistryVersionedPreferenceCallback, &v, sizeof(UInt16) + size, true);
+}
+
 static Int32 compare_entry(void *e1, void *e2, void *otherP) {
   AppRegistryEntry *r1, *r2;
   Int32 r;
@@ -363,43 +756,108 @@ static Int32 compare_entry(void *e1, void *e2, void *otherP) {
   return r;
 }
 
-void AppRegistryEnum(AppRegistryType *ar, void (*callback)(UInt32 creator, UInt16 index, UInt16 id, void *p, void *data), UInt32 creator, AppRegistryID id, void *data) {
-  AppRegistryNotification *n;
-  int i, j, num, index;
+// One callback of AppRegistryEnum, with its own copy of the entry data.
+// Copies are kept 8 byte aligned, like the entries they come from.
+#define ENUM_ALIGN(n) (((n) + 7) & ~7)
 
-  if (ar && callback && mutex_lock(ar->mutex) == 0) {
+typedef struct {
+  UInt32 creator;
+  UInt16 index, id;
+  void *p;
+} AppRegistryItem;
+
+// The matching entries are copied under the lock and the callbacks are called
+// after it is released, so they may get or set registry entries themselves.
+void AppRegistryEnum(AppRegistryType *ar, void (*callback)(UInt32 creator, UInt16 index, UInt16 id, void *p, void *data), UInt32 creator, AppRegistryID id, void *data) {
+  AppRegistryEntry *e;
+  AppRegistryItem *items;
+  UInt8 *copy;
+  UInt32 size;
+  int i, j, num, index, nitems;
+
+  if (ar == NULL || callback == NULL || rwlock_rdlock(ar->lock) != 0) return;
+
+  if (!ar->ordered) {
+    // sorting moves the entries, so it needs the write lock
+    rwlock_unlock(ar->lock);
+    if (rwlock_wrlock(ar->lock) != 0) return;
     if (!ar->ordered) {
       SysQSortP(ar->registry, ar->num, sizeof(AppRegistryEntry), compare_entry, NULL);
+      AppRegistryIndex(ar);
       ar->ordered = true;
     }
+  }
+
+  for (i = 0, nitems = 0, size = 0; i < ar->num; i++) {
+    e = &ar->registry[i];
+    if (creator && e->creator != creator) continue;
+    if (id && e->id != id) continue;
+
+    switch (e->id) {
+      case appRegistryCompat:
+      case appRegistrySize:
+      case appRegistryPosition:
+      case appRegistryAlarm:
+        nitems++;
+        size += ENUM_ALIGN(e->size);
+        break;
+      case appRegistryNotification:
+        nitems += e->size / sizeof(AppRegistryNotification);
+        size += ENUM_ALIGN(e->size);
+        break;
+      default:
+        break;
+    }
+  }
+
+  items = nitems ? xmalloc(nitems * sizeof(AppRegistryItem) + size) : NULL;
 
-    for (i = 0, index = 0; i < ar->num; i++) {
-      if (i > 0 && ar->registry[i].creator != ar->registry[i-1].creator) index++;
+  if (items) {
+    copy = (UInt8 *)(items + nitems);
+    for (i = 0, index = 0, nitems = 0; i < ar->num; i++) {
+      e = &ar->registry[i];
+      if (i > 0 && e->creator != ar->registry[i-1].creator) index++;
 
-      if (creator && ar->registry[i].creator != creator) continue;
-      if (id && ar->registry[i].id != id) continue;
+      if (creator && e->creator != creator) continue;
+      if (id && e->id != id) continue;
 
-      switch (ar->registry[i].id) {
+      switch (e->id) {
         case appRegistryCompat:
-          callback(ar->registry[i].creator, index, appRegistryCompat, ar->registry[i].data, data);
-          break;
         case appRegistrySize:
-          callback(ar->registry[i].creator, index, appRegistrySize, ar->registry[i].data, data);
-          break;
         case appRegistryPosition:
-          callback(ar->registry[i].creator, index, appRegistryPosition, ar->registry[i].data, data);
+        case appRegistryAlarm:
+          items[nitems].creator = e->creator;
+          items[nitems].index = index;
+          items[nitems].id = e->id;
+          items[nitems].p = e->data ? copy : NULL;
+          if (e->data) xmemcpy(copy, e->data, e->size);
+          copy += ENUM_ALIGN(e->size);
+          nitems++;
           break;
         case appRegistryNotification:
-          num = ar->registry[i].size / sizeof(AppRegistryNotification);
-          n = (AppRegistryNotification *)ar->registry[i].data;
+          num = e->size / sizeof(AppRegistryNotification);
+          if (num) xmemcpy(copy, e->data, num * sizeof(AppRegistryNotification));
           for (j = 0; j < num; j++) {
-            callback(ar->registry[i].creator, index, appRegistryNotification, &n[j], data);
+            items[nitems].creator = e->creator;
+            items[nitems].index = index;
+            items[nitems].id = appRegistryNotification;
+            items[nitems].p = copy + j * sizeof(AppRegistryNotification);
+            nitems++;
           }
+          copy += ENUM_ALIGN(e->size);
           break;
         default:
           break;
       }
     }
-    mutex_unlock(ar->mutex);
+  }
+
+  rwlock_unlock(ar->lock);
+
+  if (items) {
+    for (i = 0; i < nitems; i++) {
+      callback(items[i].creator, items[i].index, items[i].id, items[i].p, data);
+    }
+    xfree(items);
   }
 }
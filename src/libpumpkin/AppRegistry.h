@@ -7,6 +7,7 @@ typedef enum {
   appRegistryNotification,
   appRegistrySavedPref,
   appRegistryUnsavedPref,
+  appRegistryAlarm,
   appRegistryLast
 } AppRegistryID;
 
@@ -29,6 +30,11 @@ typedef struct {
   UInt32 priority;
 } AppRegistryNotification;
 
+typedef struct {
+  UInt32 alarmSeconds;
+  UInt32 ref;
+} AppRegistryAlarm;
+
 enum {
   appCompatUnknown,
   appCompatOk,
@@ -39,9 +45,14 @@ enum {
 
 AppRegistryType *AppRegistryInit(char *regname);
 void AppRegistryFinish(AppRegistryType *ar);
+void AppRegistryFlush(AppRegistryType *ar);
+void AppRegistryIdle(AppRegistryType *ar);
+void AppRegistrySetFlushInterval(AppRegistryType *ar, UInt32 ms);
 
 void AppRegistrySet(AppRegistryType *ar, UInt32 creator, AppRegistryID id, UInt16 seq, void *p);
 Boolean AppRegistryGet(AppRegistryType *ar, UInt32 creator, AppRegistryID id, UInt16 seq, void *p);
 void AppRegistrySetPreference(AppRegistryType *ar, UInt32 creator, UInt16 seq, void *p, UInt16 size, Boolean saved);
 UInt16 AppRegistryGetPreference(AppRegistryType *ar, UInt32 creator, UInt16 seq, void *p, UInt16 size, Boolean saved);
+Int16 AppRegistryGetVersionedPreference(AppRegistryType *ar, UInt32 creator, UInt16 seq, void *prefs, UInt16 *size, Boolean saved);
+void AppRegistrySetVersionedPreference(AppRegistryType *ar, UInt32 creator, UInt16 seq, Int16 version, const void *prefs, UInt16 size, Boolean saved);
 void AppRegistryEnum(AppRegistryType *ar, void (*callback)(UInt32 creator, UInt16 index, UInt16 id, void *p, void *data), UInt32 creator, AppRegistryID id, void *data);
@@ -1,21 +1,260 @@
 #include <PalmOS.h>
 
-#include "debug.h"
+#include "sys.h"
 
-Err EncDES(UInt8 *srcP, UInt8 *keyP, UInt8 *dstP, Boolean encrypt) {
-  // not documented
-  debug(DEBUG_ERROR, "PALMOS", "EncDES not implemented");
-  return sysErrParamErr;
+// MD4 (RFC 1320) and MD5 (RFC 1321) share the padding and the little endian
+// block layout, only the compression functions differ.
+
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+typedef void (*md_block_f)(UInt32 *h, const UInt8 *p);
+
+static UInt32 EncGet32(const UInt8 *p) {
+  return (UInt32)p[0] | ((UInt32)p[1] << 8) | ((UInt32)p[2] << 16) | ((UInt32)p[3] << 24);
+}
+
+static void EncPut32(UInt8 *p, UInt32 v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static void EncMD4Block(UInt32 *h, const UInt8 *p) {
+  static const UInt8 r2[16] = { 0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15 };
+  static const UInt8 r3[16] = { 0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15 };
+  static const UInt8 s1[4] = { 3, 7, 11, 19 }, s2[4] = { 3, 5, 9, 13 }, s3[4] = { 3, 9, 11, 15 };
+  UInt32 x[16], a, b, c, d, t;
+  int i;
+
+  for (i = 0; i < 16; i++) x[i] = EncGet32(p + 4*i);
+  a = h[0]; b = h[1]; c = h[2]; d = h[3];
+
+  for (i = 0; i < 48; i++) {
+    if (i < 16) {
+      t = a + ((b & c) | (~b & d)) + x[i];
+      t = ROTL32(t, s1[i & 3]);
+    } else if (i < 32) {
+      t = a + ((b & c) | (b & d) | (c & d)) + x[r2[i - 16]] + 0x5A827999;
+      t = ROTL32(t, s2[i & 3]);
+    } else {
+      t = a + (b ^ c ^ d) + x[r3[i - 32]] + 0x6ED9EBA1;
+      t = ROTL32(t, s3[i & 3]);
+    }
+    a = d; d = c; c = b; b = t;
+  }
+
+  h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+}
+
+static void EncMD5Block(UInt32 *h, const UInt8 *p) {
+  static const UInt32 k[64] = {
+    0xD76AA478, 0xE8C7B756, 0x242070DB, 0xC1BDCEEE, 0xF57C0FAF, 0x4787C62A, 0xA8304613, 0xFD469501,
+    0x698098D8, 0x8B44F7AF, 0xFFFF5BB1, 0x895CD7BE, 0x6B901122, 0xFD987193, 0xA679438E, 0x49B40821,
+    0xF61E2562, 0xC040B340, 0x265E5A51, 0xE9B6C7AA, 0xD62F105D, 0x02441453, 0xD8A1E681, 0xE7D3FBC8,
+    0x21E1CDE6, 0xC33707D6, 0xF4D50D87, 0x455A14ED, 0xA9E3E905, 0xFCEFA3F8, 0x676F02D9, 0x8D2A4C8A,
+    0xFFFA3942, 0x8771F681, 0x6D9D6122, 0xFDE5380C, 0xA4BEEA44, 0x4BDECFA9, 0xF6BB4B60, 0xBEBFBC70,
+    0x289B7EC6, 0xEAA127FA, 0xD4EF3085, 0x04881D05, 0xD9D4D039, 0xE6DB99E5, 0x1FA27CF8, 0xC4AC5665,
+    0xF4292244, 0x432AFF97, 0xAB9423A7, 0xFC93A039, 0x655B59C3, 0x8F0CCC92, 0xFFEFF47D, 0x85845DD1,
+    0x6FA87E4F, 0xFE2CE6E0, 0xA3014314, 0x4E0811A1, 0xF7537E82, 0xBD3AF235, 0x2AD7D2BB, 0xEB86D391
+  };
+  static const UInt8 s[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+  UInt32 x[16], a, b, c, d, f, t;
+  int i, g;
+
+  for (i = 0; i < 16; i++) x[i] = EncGet32(p + 4*i);
+  a = h[0]; b = h[1]; c = h[2]; d = h[3];
+
+  for (i = 0; i < 64; i++) {
+    switch (i >> 4) {
+      case 0:  f = (b & c) | (~b & d); g = i; break;
+      case 1:  f = (d & b) | (~d & c); g = (5*i + 1) & 15; break;
+      case 2:  f = b ^ c ^ d; g = (3*i + 5) & 15; break;
+      default: f = c ^ (b | ~d); g = (7*i) & 15; break;
+    }
+    t = a + f + k[i] + x[g];
+    a = d; d = c; c = b;
+    b += ROTL32(t, s[((i >> 4) << 2) | (i & 3)]);
+  }
+
+  h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+}
+
+static void EncDigest(md_block_f block, UInt8 *strP, UInt16 strLen, UInt8 *digestP) {
+  UInt32 h[4] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476 };
+  UInt8 tail[128];
+  UInt32 i, n, bits;
+
+  for (i = 0; i + 64 <= strLen; i += 64) {
+    block(h, strP + i);
+  }
+
+  // the rest of the message, the 0x80 marker and the bit length fill one or two blocks
+  n = strLen - i;
+  sys_memset(tail, 0, sizeof(tail));
+  if (n) sys_memcpy(tail, strP + i, n);
+  tail[n] = 0x80;
+  n = (n < 56) ? 64 : 128;
+  bits = (UInt32)strLen << 3;
+  EncPut32(tail + n - 8, bits);
+  block(h, tail);
+  if (n == 128) block(h, tail + 64);
+
+  for (i = 0; i < 4; i++) EncPut32(digestP + 4*i, h[i]);
 }
 
 Err EncDigestMD4(UInt8 *strP, UInt16 strLen, UInt8 digestP[16]) {
-  // not documented
-  debug(DEBUG_ERROR, "PALMOS", "EncDigestMD4 not implemented");
-  return sysErrParamErr;
+  if ((strP == NULL && strLen) || digestP == NULL) return sysErrParamErr;
+  EncDigest(EncMD4Block, strP, strLen, digestP);
+
+  return errNone;
 }
 
 Err EncDigestMD5(UInt8 *strP, UInt16 strLen, UInt8 digestP[16]) {
-  // not documented
-  debug(DEBUG_ERROR, "PALMOS", "EncDigestMD5 not implemented");
-  return sysErrParamErr;
+  if ((strP == NULL && strLen) || digestP == NULL) return sysErrParamErr;
+  EncDigest(EncMD5Block, strP, strLen, digestP);
+
+  return errNone;
+}
+
+// DES (FIPS 46-3) of a single 8 byte block. Permutation tables use the
+// 1-based bit numbering of the standard, bit 1 being the MSB.
+
+static const UInt8 desIP[64] = {
+  58, 50, 42, 34, 26, 18, 10, 2, 60, 52, 44, 36, 28, 20, 12, 4,
+  62, 54, 46, 38, 30, 22, 14, 6, 64, 56, 48, 40, 32, 24, 16, 8,
+  57, 49, 41, 33, 25, 17,  9, 1, 59, 51, 43, 35, 27, 19, 11, 3,
+  61, 53, 45, 37, 29, 21, 13, 5, 63, 55, 47, 39, 31, 23, 15, 7
+};
+
+static const UInt8 desFP[64] = {
+  40, 8, 48, 16, 56, 24, 64, 32, 39, 7, 47, 15, 55, 23, 63, 31,
+  38, 6, 46, 14, 54, 22, 62, 30, 37, 5, 45, 13, 53, 21, 61, 29,
+  36, 4, 44, 12, 52, 20, 60, 28, 35, 3, 43, 11, 51, 19, 59, 27,
+  34, 2, 42, 10, 50, 18, 58, 26, 33, 1, 41,  9, 49, 17, 57, 25
+};
+
+static const UInt8 desE[48] = {
+  32,  1,  2,  3,  4,  5,  4,  5,  6,  7,  8,  9,  8,  9, 10, 11,
+  12, 13, 12, 13, 14, 15, 16, 17, 16, 17, 18, 19, 20, 21, 20, 21,
+  22, 23, 24, 25, 24, 25, 26, 27, 28, 29, 28, 29, 30, 31, 32,  1
+};
+
+static const UInt8 desP[32] = {
+  16,  7, 20, 21, 29, 12, 28, 17,  1, 15, 23, 26,  5, 18, 31, 10,
+   2,  8, 24, 14, 32, 27,  3,  9, 19, 13, 30,  6, 22, 11,  4, 25
+};
+
+static const UInt8 desPC1[56] = {
+  57, 49, 41, 33, 25, 17,  9,  1, 58, 50, 42, 34, 26, 18,
+  10,  2, 59, 51, 43, 35, 27, 19, 11,  3, 60, 52, 44, 36,
+  63, 55, 47, 39, 31, 23, 15,  7, 62, 54, 46, 38, 30, 22,
+  14,  6, 61, 53, 45, 37, 29, 21, 13,  5, 28, 20, 12,  4
+};
+
+static const UInt8 desPC2[48] = {
+  14, 17, 11, 24,  1,  5,  3, 28, 15,  6, 21, 10,
+  23, 19, 12,  4, 26,  8, 16,  7, 27, 20, 13,  2,
+  41, 52, 31, 37, 47, 55, 30, 40, 51, 45, 33, 48,
+  44, 49, 39, 56, 34, 53, 46, 42, 50, 36, 29, 32
+};
+
+static const UInt8 desShifts[16] = { 1, 1, 2, 2, 2, 2, 2, 2, 1, 2, 2, 2, 2, 2, 2, 1 };
+
+static const UInt8 desS[8][64] = {
+  { 14,  4, 13,  1,  2, 15, 11,  8,  3, 10,  6, 12,  5,  9,  0,  7,
+     0, 15,  7,  4, 14,  2, 13,  1, 10,  6, 12, 11,  9,  5,  3,  8,
+     4,  1, 14,  8, 13,  6,  2, 11, 15, 12,  9,  7,  3, 10,  5,  0,
+    15, 12,  8,  2,  4,  9,  1,  7,  5, 11,  3, 14, 10,  0,  6, 13 },
+  { 15,  1,  8, 14,  6, 11,  3,  4,  9,  7,  2, 13, 12,  0,  5, 10,
+     3, 13,  4,  7, 15,  2,  8, 14, 12,  0,  1, 10,  6,  9, 11,  5,
+     0, 14,  7, 11, 10,  4, 13,  1,  5,  8, 12,  6,  9,  3,  2, 15,
+    13,  8, 10,  1,  3, 15,  4,  2, 11,  6,  7, 12,  0,  5, 14,  9 },
+  { 10,  0,  9, 14,  6,  3, 15,  5,  1, 13, 12,  7, 11,  4,  2,  8,
+    13,  7,  0,  9,  3,  4,  6, 10,  2,  8,  5, 14, 12, 11, 15,  1,
+    13,  6,  4,  9,  8, 15,  3,  0, 11,  1,  2, 12,  5, 10, 14,  7,
+     1, 10, 13,  0,  6,  9,  8,  7,  4, 15, 14,  3, 11,  5,  2, 12 },
+  {  7, 13, 14,  3,  0,  6,  9, 10,  1,  2,  8,  5, 11, 12,  4, 15,
+    13,  8, 11,  5,  6, 15,  0,  3,  4,  7,  2, 12,  1, 10, 14,  9,
+    10,  6,  9,  0, 12, 11,  7, 13, 15,  1,  3, 14,  5,  2,  8,  4,
+     3, 15,  0,  6, 10,  1, 13,  8,  9,  4,  5, 11, 12,  7,  2, 14 },
+  {  2, 12,  4,  1,  7, 10, 11,  6,  8,  5,  3, 15, 13,  0, 14,  9,
+    14, 11,  2, 12,  4,  7, 13,  1,  5,  0, 15, 10,  3,  9,  8,  6,
+     4,  2,  1, 11, 10, 13,  7,  8, 15,  9, 12,  5,  6,  3,  0, 14,
+    11,  8, 12,  7,  1, 14,  2, 13,  6, 15,  0,  9, 10,  4,  5,  3 },
+  { 12,  1, 10, 15,  9,  2,  6,  8,  0, 13,  3,  4, 14,  7,  5, 11,
+    10, 15,  4,  2,  7, 12,  9,  5,  6,  1, 13, 14,  0, 11,  3,  8,
+     9, 14, 15,  5,  2,  8, 12,  3,  7,  0,  4, 10,  1, 13, 11,  6,
+     4,  3,  2, 12,  9,  5, 15, 10, 11, 14,  1,  7,  6,  0,  8, 13 },
+  {  4, 11,  2, 14, 15,  0,  8, 13,  3, 12,  9,  7,  5, 10,  6,  1,
+    13,  0, 11,  7,  4,  9,  1, 10, 14,  3,  5, 12,  2, 15,  8,  6,
+     1,  4, 11, 13, 12,  3,  7, 14, 10, 15,  6,  8,  0,  5,  9,  2,
+     6, 11, 13,  8,  1,  4, 10,  7,  9,  5,  0, 15, 14,  2,  3, 12 },
+  { 13,  2,  8,  4,  6, 15, 11,  1, 10,  9,  3, 14,  5,  0, 12,  7,
+     1, 15, 13,  8, 10,  3,  7,  4, 12,  5,  6, 11,  0, 14,  9,  2,
+     7, 11,  4,  1,  9, 12, 14,  2,  0,  6, 10, 13, 15,  3,  5,  8,
+     2,  1, 14,  7,  4, 10,  8, 13, 15, 12,  9,  0,  3,  5,  6, 11 }
+};
+
+// permutes the n bit input (right aligned in in, width bits) with table t
+static uint64_t EncPermute(uint64_t in, UInt32 width, const UInt8 *t, UInt32 n) {
+  uint64_t out = 0;
+  UInt32 i;
+
+  for (i = 0; i < n; i++) {
+    out = (out << 1) | ((in >> (width - t[i])) & 1);
+  }
+
+  return out;
+}
+
+static UInt32 EncDESf(UInt32 r, uint64_t k) {
+  uint64_t e;
+  UInt32 out, b, i;
+
+  e = EncPermute(r, 32, desE, 48) ^ k;
+  for (out = 0, i = 0; i < 8; i++) {
+    b = (e >> (42 - 6*i)) & 0x3F;
+    // the outer bits select the row, the inner four the column
+    out = (out << 4) | desS[i][((b & 0x20) | ((b & 1) << 4)) | ((b >> 1) & 0x0F)];
+  }
+
+  return (UInt32)EncPermute(out, 32, desP, 32);
+}
+
+Err EncDES(UInt8 *srcP, UInt8 *keyP, UInt8 *dstP, Boolean encrypt) {
+  uint64_t block, key, cd, sub[16];
+  UInt32 c, d, l, r, t, i;
+
+  if (srcP == NULL || keyP == NULL || dstP == NULL) return sysErrParamErr;
+
+  for (block = key = 0, i = 0; i < 8; i++) {
+    block = (block << 8) | srcP[i];
+    key = (key << 8) | keyP[i];
+  }
+
+  cd = EncPermute(key, 64, desPC1, 56);
+  c = (cd >> 28) & 0x0FFFFFFF;
+  d = cd & 0x0FFFFFFF;
+  for (i = 0; i < 16; i++) {
+    c = ((c << desShifts[i]) | (c >> (28 - desShifts[i]))) & 0x0FFFFFFF;
+    d = ((d << desShifts[i]) | (d >> (28 - desShifts[i]))) & 0x0FFFFFFF;
+    sub[i] = EncPermute(((uint64_t)c << 28) | d, 56, desPC2, 48);
+  }
+
+  block = EncPermute(block, 64, desIP, 64);
+  l = block >> 32;
+  r = (UInt32)block;
+  for (i = 0; i < 16; i++) {
+    t = r;
+    r = l ^ EncDESf(r, sub[encrypt ? i : 15 - i]);
+    l = t;
+  }
+  block = EncPermute(((uint64_t)r << 32) | l, 64, desFP, 64);
+
+  for (i = 0; i < 8; i++) {
+    dstP[i] = block >> (56 - 8*i);
+  }
+
+  return errNone;
 }
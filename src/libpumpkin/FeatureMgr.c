@@ -3,27 +3,216 @@
 
 #include "sys.h"
 #include "thread.h"
+#include "mutex.h"
 #include "pwindow.h"
 #include "vfs.h"
 #include "pumpkin.h"
 #include "debug.h"
 #include "xalloc.h"
 
-#define MAX_FEATURES 32
+#define TABLE_INC 32
+
+// Features are kept in tables indexed by a hash of (creator, featureNum).
+// The ROM table holds the system features, computed once per task. The RAM
+// table is shared by all tasks and survives application launches, like on
+// a device. Feature pointers are chunks with no owner, so they are not
+// released when the application that allocated them exits. They must be
+// writable with DmWrite and addressable by 68K code, so they live in the
+// heap of the task that allocated them. When that is a private task heap
+// (multi window mode) they are removed with it by FtrFinishModule.
 
 typedef struct {
   UInt32 creator;
   UInt16 featureNum;
   UInt32 value;
+  void *ptr;
+  void *heap;
 } feature_t;
 
 typedef struct {
-  feature_t features[MAX_FEATURES];
-  UInt32 numFeatures;
+  feature_t *features;
+  UInt32 num, size;
+  UInt32 *hash, hashSize;
+} ftr_table_t;
+
+typedef struct {
+  ftr_table_t rom;
 } ftr_module_t;
 
+typedef struct {
+  mutex_t *mutex;
+  ftr_table_t ram;
+  void *heap;
+} ftr_global_t;
+
 extern thread_key_t *ftr_key;
 
+static ftr_global_t global;
+
+static UInt32 FtrHash(UInt32 creator, UInt16 featureNum) {
+  UInt32 h;
+
+  h = (creator ^ ((UInt32)featureNum << 7)) * 0x9E3779B1;
+  h ^= h >> 16;
+
+  return h;
+}
+
+// slots hold feature index + 1, 0 is an empty slot
+static void FtrIndex(ftr_table_t *t) {
+  UInt32 i, j, size;
+
+  for (size = 2 * TABLE_INC; size < t->size * 2; size <<= 1);
+
+  if (size != t->hashSize) {
+    if (t->hash) xfree(t->hash);
+    t->hash = xcalloc(size, sizeof(UInt32));
+    t->hashSize = t->hash ? size : 0;
+  } else {
+    sys_memset(t->hash, 0, size * sizeof(UInt32));
+  }
+
+  for (i = 0; i < t->num && t->hash; i++) {
+    j = FtrHash(t->features[i].creator, t->features[i].featureNum) & (t->hashSize - 1);
+    while (t->hash[j]) j = (j + 1) & (t->hashSize - 1);
+    t->hash[j] = i + 1;
+  }
+}
+
+static feature_t *FtrFind(ftr_table_t *t, UInt32 creator, UInt16 featureNum) {
+  feature_t *f;
+  UInt32 j, k;
+
+  if (t->hash == NULL) return NULL;
+
+  j = FtrHash(creator, featureNum) & (t->hashSize - 1);
+  for (; (k = t->hash[j]) != 0; j = (j + 1) & (t->hashSize - 1)) {
+    f = &t->features[k - 1];
+    if (f->creator == creator && f->featureNum == featureNum) return f;
+  }
+
+  return NULL;
+}
+
+static feature_t *FtrAdd(ftr_table_t *t, UInt32 creator, UInt16 featureNum, UInt32 value) {
+  feature_t *f;
+  UInt32 j;
+
+  if (t->num == t->size) {
+    if ((f = xrealloc(t->features, (t->size + TABLE_INC) * sizeof(feature_t))) == NULL) {
+      return NULL;
+    }
+    t->features = f;
+    t->size += TABLE_INC;
+    FtrIndex(t);
+  }
+  if (t->hash == NULL) return NULL;
+
+  f = &t->features[t->num];
+  f->creator = creator;
+  f->featureNum = featureNum;
+  f->value = value;
+  f->ptr = NULL;
+  f->heap = NULL;
+
+  j = FtrHash(creator, featureNum) & (t->hashSize - 1);
+  while (t->hash[j]) j = (j + 1) & (t->hashSize - 1);
+  t->hash[j] = ++t->num;
+
+  return f;
+}
+
+static void FtrRemove(ftr_table_t *t, feature_t *f) {
+  UInt32 i = f - t->features;
+
+  if (i < t->num - 1) {
+    t->features[i] = t->features[t->num - 1];
+  }
+  t->num--;
+  FtrIndex(t);
+}
+
+static void FtrTableFree(ftr_table_t *t) {
+  if (t->features) xfree(t->features);
+  if (t->hash) xfree(t->hash);
+  sys_memset(t, 0, sizeof(ftr_table_t));
+}
+
+// 68K code sees a feature pointer as an address in its heap
+static UInt32 FtrValue(feature_t *f) {
+  if (f->ptr) {
+    return pumpkin_is_m68k() ? (UInt8 *)f->ptr - (UInt8 *)f->heap : (UInt32)(uintptr_t)f->ptr;
+  }
+
+  return f->value;
+}
+
+// A feature pointer is only valid in the heap it was allocated from.
+static feature_t *FtrFindRAM(UInt32 creator, UInt16 featureNum) {
+  feature_t *f;
+
+  f = FtrFind(&global.ram, creator, featureNum);
+  if (f && f->ptr && f->heap != pumpkin_heap_base()) f = NULL;
+
+  return f;
+}
+
+// Frees the chunk of a feature pointer, which can only be done from the heap it was allocated from.
+static Boolean FtrDropPtr(feature_t *f) {
+  if (f->ptr) {
+    if (f->heap != pumpkin_heap_base()) return false;
+    MemPtrFree(f->ptr);
+    f->ptr = NULL;
+    f->heap = NULL;
+  }
+
+  return true;
+}
+
+static void FtrInitROM(ftr_table_t *t) {
+  FtrAdd(t, sysFileCSystem, sysFtrNumROMVersion, pumpkin_default_density() == kDensityDouble ?
+    sysMakeROMVersion(5, 0, 0, sysROMStageRelease, 0) : sysMakeROMVersion(4, 0, 0, sysROMStageRelease, 0));
+#if SYS_CPU == 1
+  FtrAdd(t, sysFileCSystem, sysFtrNumProcessorID, sysFtrNumProcessorARM720T);
+#elif SYS_CPU == 2
+  FtrAdd(t, sysFileCSystem, sysFtrNumProcessorID, sysFtrNumProcessorx86);
+#elif SYS_CPU == 3
+  FtrAdd(t, sysFileCSystem, sysFtrNumProcessorID, sysFtrNumProcessorPPC64LE);
+#endif
+  FtrAdd(t, sysFileCSystem, sysFtrNumLanguage, lEnglish);
+  FtrAdd(t, sysFileCSystem, sysFtrNumNotifyMgrVersion, sysNotifyVersionNum);
+  FtrAdd(t, sysFileCSystem, sysFtrNumBacklight, 0);
+  FtrAdd(t, sysFileCSystem, sysFtrNumWinVersion, pumpkin_default_density() == kDensityDouble ? 4 : 3);
+  FtrAdd(t, sysFileCSystem, sysFtrNumOEMCompanyID, 1);
+  FtrAdd(t, sysFileCSystem, sysFtrNumOEMDeviceID, 1);
+  FtrAdd(t, sysFileCSystem, sysFtrNumAccessorTrapPresent, 1);
+  FtrAdd(t, sysFileCSerialMgr, sysFtrNewSerialPresent, 1);
+  FtrAdd(t, sysFileCExpansionMgr, expFtrIDVersion, expMgrVersionNum);
+  FtrAdd(t, sysFileCVFSMgr, vfsFtrIDVersion, vfsMgrVersionNum);
+
+  if (pumpkin_dia_enabled()) {
+    FtrAdd(t, sysFileCSystem, sysFtrNumInputAreaFlags, grfFtrInputAreaFlagDynamic /*| grfFtrInputAreaFlagCollapsible*/);
+    FtrAdd(t, pinCreator, pinFtrAPIVersion, pinAPIVersion1_1);
+  }
+}
+
+int FtrInitGlobal(void) {
+  if ((global.mutex = mutex_create("feature")) == NULL) {
+    return -1;
+  }
+  global.heap = pumpkin_heap_base();
+
+  return 0;
+}
+
+int FtrFinishGlobal(void) {
+  FtrTableFree(&global.ram);
+  mutex_destroy(global.mutex);
+  sys_memset(&global, 0, sizeof(ftr_global_t));
+
+  return 0;
+}
+
 int FtrInitModule(void) {
   ftr_module_t *module;
 
@@ -31,6 +220,7 @@ int FtrInitModule(void) {
     return -1;
   }
 
+  FtrInitROM(&module->rom);
   thread_set(ftr_key, module);
 
   return 0;
@@ -38,8 +228,24 @@ int FtrInitModule(void) {
 
 int FtrFinishModule(void) {
   ftr_module_t *module = (ftr_module_t *)thread_get(ftr_key);
+  void *heap = pumpkin_heap_base();
+  char st[8];
+  UInt32 i;
+
+  // a private task heap is about to be destroyed, along with its feature pointers
+  if (heap != global.heap && mutex_lock(global.mutex) == 0) {
+    for (i = global.ram.num; i > 0; i--) {
+      if (global.ram.features[i-1].ptr && global.ram.features[i-1].heap == heap) {
+        pumpkin_id2s(global.ram.features[i-1].creator, st);
+        debug(DEBUG_INFO, "Feature", "feature pointer %s %d removed with its task heap", st, global.ram.features[i-1].featureNum);
+        FtrRemove(&global.ram, &global.ram.features[i-1]);
+      }
+    }
+    mutex_unlock(global.mutex);
+  }
 
   if (module) {
+    FtrTableFree(&module->rom);
     xfree(module);
   }
 
@@ -52,130 +258,20 @@ Err FtrInit(void) {
 
 Err FtrGet(UInt32 creator, UInt16 featureNum, UInt32 *valueP) {
   ftr_module_t *module = (ftr_module_t *)thread_get(ftr_key);
-  UInt32 i;
+  feature_t *f;
   Err err = ftrErrNoSuchFeature;
 
   *valueP = 0;
 
-  switch (creator) {
-    case sysFileCSystem:
-      switch (featureNum) {
-        case sysFtrNumROMVersion:
-          if (pumpkin_default_density() == kDensityDouble) {
-            *valueP = sysMakeROMVersion(5, 0, 0, sysROMStageRelease, 0);
-          } else {
-            *valueP = sysMakeROMVersion(4, 0, 0, sysROMStageRelease, 0);
-          }
-          err = errNone;
-          break;
-        case sysFtrNumProcessorID:
-#if SYS_CPU == 1
-          *valueP = sysFtrNumProcessorARM720T;
-          err = errNone;
-#elif SYS_CPU == 2
-          *valueP = sysFtrNumProcessorx86;
-          err = errNone;
-#elif SYS_CPU == 3
-          *valueP = sysFtrNumProcessorPPC64LE;
-          err = errNone;
-#endif
-          break;
-        case sysFtrNumLanguage:
-          *valueP = lEnglish;
-          err = errNone;
-          break;
-        case sysFtrNumNotifyMgrVersion:
-          *valueP = sysNotifyVersionNum;
-          err = errNone;
-          break;
-        case sysFtrNumBacklight:
-          *valueP = 0;
-          err = errNone;
-          break;
-        case sysFtrNumWinVersion:
-          *valueP = pumpkin_default_density() == kDensityDouble ? 4 : 3;
-          err = errNone;
-          break;
-        case sysFtrNumOEMCompanyID:
-          *valueP = 1;
-          err = errNone;
-          break;
-        case sysFtrNumOEMDeviceID:
-          *valueP = 1;
-          err = errNone;
-          break;
-        case sysFtrNumInputAreaFlags:
-          if (pumpkin_dia_enabled()) {
-            *valueP = grfFtrInputAreaFlagDynamic /*| grfFtrInputAreaFlagCollapsible*/;
-            err = errNone;
-          }
-          break;
-        case sysFtrNumAccessorTrapPresent:
-          *valueP = 1;
-          err = errNone;
-          break;
-        default:
-          err = ftrErrNoSuchFeature;
-          break;
-      }
-      break;
-    case sysFileCSerialMgr:
-      switch (featureNum) {
-        case sysFtrNewSerialPresent:
-          *valueP = 1;
-          err = errNone;
-          break;
-        default:
-          err = ftrErrNoSuchFeature;
-          break;
-      }
-      break;
-    case sysFileCExpansionMgr:
-      switch (featureNum) {
-        case expFtrIDVersion:
-          *valueP = expMgrVersionNum;
-          err = errNone;
-          break;
-        default:
-          err = ftrErrNoSuchFeature;
-          break;
-      }
-      break;
-    case sysFileCVFSMgr:
-      switch (featureNum) {
-        case vfsFtrIDVersion:
-          *valueP = vfsMgrVersionNum;
-          err = errNone;
-          break;
-        default:
-          err = ftrErrNoSuchFeature;
-          break;
-      }
-      break;
-    case pinCreator:
-      if (pumpkin_dia_enabled()) {
-        switch (featureNum) {
-          case pinFtrAPIVersion:
-            *valueP = pinAPIVersion1_1;
-            err = errNone;
-            break;
-          default:
-            err = ftrErrNoSuchFeature;
-            break;
-        }
-      }
-      break;
-    default:
-      if (module->numFeatures > 0) {
-        for (i = 0; i < module->numFeatures; i++) {
-          if (module->features[i].creator == creator && module->features[i].featureNum == featureNum) {
-            *valueP = module->features[i].value;
-            err = errNone;
-            break;
-          }
-        }
-      }
-      break;
+  if ((f = FtrFind(&module->rom, creator, featureNum)) != NULL) {
+    *valueP = f->value;
+    err = errNone;
+  } else if (mutex_lock(global.mutex) == 0) {
+    if ((f = FtrFindRAM(creator, featureNum)) != NULL) {
+      *valueP = FtrValue(f);
+      err = errNone;
+    }
+    mutex_unlock(global.mutex);
   }
 
   return err;
@@ -185,68 +281,149 @@ Err FtrGet(UInt32 creator, UInt16 featureNum, UInt32 *valueP) {
 // next system reset or until you explicitly undefine the feature with FtrUnregister.
 
 Err FtrSet(UInt32 creator, UInt16 featureNum, UInt32 newValue) {
-  ftr_module_t *module = (ftr_module_t *)thread_get(ftr_key);
-  UInt32 i;
+  feature_t *f;
   Err err = memErrNotEnoughSpace;
 
-  for (i = 0; i < module->numFeatures; i++) {
-    if (module->features[i].creator == creator && module->features[i].featureNum == featureNum) {
-      module->features[i].value = newValue;
+  if (mutex_lock(global.mutex) == 0) {
+    if ((f = FtrFind(&global.ram, creator, featureNum)) != NULL) {
+      if (FtrDropPtr(f)) {
+        f->value = newValue;
+        err = errNone;
+      } else {
+        err = memErrInvalidParam;
+      }
+    } else if (FtrAdd(&global.ram, creator, featureNum, newValue) != NULL) {
       err = errNone;
-      break;
     }
-  }
-
-  if (i == module->numFeatures && module->numFeatures < MAX_FEATURES) {
-    module->features[i].creator = creator;
-    module->features[i].featureNum = featureNum;
-    module->features[i].value = newValue;
-    module->numFeatures++;
-    err = errNone;
+    mutex_unlock(global.mutex);
   }
 
   return err;
 }
 
 Err FtrUnregister(UInt32 creator, UInt16 featureNum) {
-  ftr_module_t *module = (ftr_module_t *)thread_get(ftr_key);
-  UInt32 i;
+  feature_t *f;
   Err err = ftrErrNoSuchFeature;
 
-  if (module->numFeatures > 0) {
-    for (i = 0; i < module->numFeatures; i++) {
-      if (module->features[i].creator == creator && module->features[i].featureNum == featureNum) {
-        if (module->numFeatures > 1 && i < module->numFeatures-1) {
-          module->features[i].creator = module->features[module->numFeatures-1].creator;
-          module->features[i].featureNum = module->features[module->numFeatures-1].featureNum;
-          module->features[i].value = module->features[module->numFeatures-1].value;
-        }
-        module->numFeatures++;
+  if (mutex_lock(global.mutex) == 0) {
+    if ((f = FtrFind(&global.ram, creator, featureNum)) != NULL) {
+      if (FtrDropPtr(f)) {
+        FtrRemove(&global.ram, f);
         err = errNone;
-        break;
+      } else {
+        err = memErrInvalidParam;
       }
     }
+    mutex_unlock(global.mutex);
   }
 
   return err;
 }
 
 Err FtrGetByIndex(UInt16 index, Boolean romTable, UInt32 *creatorP, UInt16 *numP, UInt32 *valueP) {
-  debug(DEBUG_ERROR, "PALMOS", "FtrGetByIndex not implemented");
-  return sysErrParamErr;
+  ftr_module_t *module = (ftr_module_t *)thread_get(ftr_key);
+  feature_t *f;
+  Err err = ftrErrNoSuchFeature;
+
+  if (romTable) {
+    if (index < module->rom.num) {
+      f = &module->rom.features[index];
+      if (creatorP) *creatorP = f->creator;
+      if (numP) *numP = f->featureNum;
+      if (valueP) *valueP = f->value;
+      err = errNone;
+    }
+  } else if (mutex_lock(global.mutex) == 0) {
+    if (index < global.ram.num) {
+      f = &global.ram.features[index];
+      if (creatorP) *creatorP = f->creator;
+      if (numP) *numP = f->featureNum;
+      if (valueP) *valueP = FtrValue(f);
+      err = errNone;
+    }
+    mutex_unlock(global.mutex);
+  }
+
+  return err;
+}
+
+static void *FtrPtrAlloc(UInt32 size) {
+  void *p;
+
+  if ((p = MemPtrNew(size)) != NULL) {
+    MemPtrSetOwner(p, 0);
+  }
+
+  return p;
 }
 
 Err FtrPtrNew(UInt32 creator, UInt16 featureNum, UInt32 size, void **newPtrP) {
-  debug(DEBUG_ERROR, "PALMOS", "FtrPtrNew not implemented");
-  return sysErrParamErr;
+  feature_t *f;
+  void *p;
+  Err err = memErrInvalidParam;
+
+  if (size && newPtrP && mutex_lock(global.mutex) == 0) {
+    if (FtrFind(&global.ram, creator, featureNum) != NULL) {
+      err = ftrErrAlreadyExists;
+    } else if ((p = FtrPtrAlloc(size)) == NULL) {
+      err = memErrNotEnoughSpace;
+    } else if ((f = FtrAdd(&global.ram, creator, featureNum, 0)) == NULL) {
+      MemPtrFree(p);
+      err = memErrNotEnoughSpace;
+    } else {
+      f->ptr = p;
+      f->heap = pumpkin_heap_base();
+      *newPtrP = p;
+      err = errNone;
+    }
+    mutex_unlock(global.mutex);
+  }
+
+  return err;
 }
 
 Err FtrPtrFree(UInt32 creator, UInt16 featureNum) {
-  debug(DEBUG_ERROR, "PALMOS", "FtrPtrFree not implemented");
-  return sysErrParamErr;
+  feature_t *f;
+  Err err = ftrErrNoSuchFeature;
+
+  if (mutex_lock(global.mutex) == 0) {
+    if ((f = FtrFindRAM(creator, featureNum)) != NULL) {
+      if (f->ptr) MemPtrFree(f->ptr);
+      FtrRemove(&global.ram, f);
+      err = errNone;
+    }
+    mutex_unlock(global.mutex);
+  }
+
+  return err;
 }
 
+// The chunk may move, the new pointer is returned in newPtrP.
 Err FtrPtrResize(UInt32 creator, UInt16 featureNum, UInt32 newSize, void **newPtrP) {
-  debug(DEBUG_ERROR, "PALMOS", "FtrPtrResize not implemented");
-  return sysErrParamErr;
+  feature_t *f;
+  UInt32 size;
+  void *p;
+  Err err = ftrErrNoSuchFeature;
+
+  if (mutex_lock(global.mutex) == 0) {
+    if ((f = FtrFindRAM(creator, featureNum)) != NULL && f->ptr) {
+      if (newSize == 0) {
+        err = memErrInvalidParam;
+      } else if ((size = MemPtrSize(f->ptr)) == newSize) {
+        if (newPtrP) *newPtrP = f->ptr;
+        err = errNone;
+      } else if ((p = FtrPtrAlloc(newSize)) == NULL) {
+        err = memErrNotEnoughSpace;
+      } else {
+        MemMove(p, f->ptr, size < newSize ? size : newSize);
+        MemPtrFree(f->ptr);
+        f->ptr = p;
+        if (newPtrP) *newPtrP = p;
+        err = errNone;
+      }
+    }
+    mutex_unlock(global.mutex);
+  }
+
+  return err;
 }
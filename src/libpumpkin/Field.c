@@ -250,6 +250,7 @@ void FldFreeMemory(FieldType *fldP) {
       debug(DEBUG_TRACE, PALMOS_MODULE, "FldFreeMemory free lines %p", fldP->lines);
       xfree(fldP->lines);
       fldP->lines = NULL;
+      fldP->allocLines = 0;
     }
     if (fldP->textHandle) {
       debug(DEBUG_TRACE, PALMOS_MODULE, "FldFreeMemory free text handle");
@@ -521,35 +522,149 @@ void FldPaste(FieldType *fldP) {
   OUTV;
 }
 
+// Line info grows on demand, doubling the allocated number of lines.
+
+static Boolean FldReserveLines(FieldType *fldP, UInt32 n) {
+  LineInfoType *lines;
+  UInt32 size;
+
+  if (n > 0xFFFF) return false;
+  if (n > fldP->allocLines) {
+    size = fldP->allocLines ? fldP->allocLines : 16;
+    while (size < n) size <<= 1;
+    if (size > 0xFFFF) size = 0xFFFF;
+    if ((lines = xrealloc(fldP->lines, size * sizeof(LineInfoType))) == NULL) return false;
+    debug(DEBUG_TRACE, PALMOS_MODULE, "FldReserveLines %d lines at %p", size, lines);
+    fldP->lines = lines;
+    fldP->allocLines = size;
+  }
+
+  return true;
+}
+
+static void FldCountUsedLines(FieldType *fldP) {
+  UInt16 th, visible;
+
+  th = FntCharHeight();
+  visible = (th > 0 && fldP->rect.extent.y > 0) ? fldP->rect.extent.y / th : 0;
+  fldP->numUsedLines = fldP->totalLines < visible ? fldP->totalLines : visible;
+}
+
 static void FldCalcLineInfo(FieldType *fldP) {
-  UInt16 drawnLines, totalLines;
+  UInt16 start, length;
+  FontID old;
 
   IN;
   if (fldP) {
-    if (fldP->lines) {
-      debug(DEBUG_TRACE, PALMOS_MODULE, "FldCalcLineInfo freeing lines %p", fldP->lines);
-      xfree(fldP->lines);
-      fldP->lines = NULL;
-    }
     fldP->numUsedLines = 0;
     fldP->totalLines = 0;
 
     if (fldP->text && fldP->textLen) {
       debug(DEBUG_TRACE, PALMOS_MODULE, "FldCalcLineInfo text %p len %d", fldP->text, fldP->textLen);
-      fldP->totalLines = 1000;
-      fldP->lines = xcalloc(fldP->totalLines, sizeof(LineInfoType));
-      debug(DEBUG_TRACE, PALMOS_MODULE, "FldCalcLineInfo alloc lines %p", fldP->lines);
-      WinDrawCharBox(fldP->text, fldP->textLen, fldP->fontID, &fldP->rect, false, &drawnLines, &totalLines, NULL, fldP->lines, fldP->totalLines);
-      fldP->numUsedLines = drawnLines;
-      fldP->totalLines = totalLines;
-      fldP->lines = xrealloc(fldP->lines, fldP->totalLines * sizeof(LineInfoType));
-      debug(DEBUG_TRACE, PALMOS_MODULE, "FldCalcLineInfo realloc lines %p", fldP->lines);
+      old = FntSetFont(fldP->fontID);
+      for (start = 0; start < fldP->textLen;) {
+        if (!FldReserveLines(fldP, fldP->totalLines + 1)) break;
+        fldP->lines[fldP->totalLines].start = start;
+        start = WinWrapLine(fldP->text, fldP->textLen, start, fldP->rect.extent.x, &length);
+        fldP->lines[fldP->totalLines].length = length;
+        fldP->totalLines++;
+      }
+      FldCountUsedLines(fldP);
+      FntSetFont(old);
       FldSetInsertionPoint(fldP, FldGetInsPtPosition(fldP));
+
+    } else if (fldP->lines) {
+      debug(DEBUG_TRACE, PALMOS_MODULE, "FldCalcLineInfo freeing lines %p", fldP->lines);
+      xfree(fldP->lines);
+      fldP->lines = NULL;
+      fldP->allocLines = 0;
     }
   }
   OUTV;
 }
 
+#define MAX_RELAYOUT_LINES 32
+
+// The text in [pos,pos+delLen) was replaced by [pos,pos+insLen). Line starts
+// only depend on the text from the previous line start onwards, so rewrap
+// from the line before the edit until a new line start matches an old one
+// (shifted by the edit), and reuse the old lines from there.
+
+static void FldRelayout(FieldType *fldP, UInt16 pos, UInt16 insLen, UInt16 delLen) {
+  LineInfoType aux[MAX_RELAYOUT_LINES];
+  UInt16 lo, hi, mid, first, start, length, n, m, oldTotal, i;
+  Int32 delta;
+  Boolean sync;
+  FontID old;
+
+  if (fldP->lines == NULL || fldP->totalLines == 0 || fldP->text == NULL || fldP->textLen == 0) {
+    FldCalcLineInfo(fldP);
+    return;
+  }
+
+  // find the last line starting at or before pos
+  for (lo = 0, hi = fldP->totalLines - 1; lo < hi;) {
+    mid = (lo + hi + 1) / 2;
+    if (fldP->lines[mid].start <= pos) lo = mid;
+    else hi = mid - 1;
+  }
+  first = lo > 0 ? lo - 1 : 0;
+
+  oldTotal = fldP->totalLines;
+  delta = (Int32)insLen - (Int32)delLen;
+  sync = false;
+  m = first + 1;
+  n = 0;
+
+  old = FntSetFont(fldP->fontID);
+  for (start = fldP->lines[first].start; start < fldP->textLen;) {
+    if (n == MAX_RELAYOUT_LINES) {
+      // too many lines changed, it is cheaper to start over
+      FntSetFont(old);
+      FldCalcLineInfo(fldP);
+      return;
+    }
+    aux[n].start = start;
+    start = WinWrapLine(fldP->text, fldP->textLen, start, fldP->rect.extent.x, &length);
+    aux[n].length = length;
+    n++;
+
+    if (start >= pos + insLen) {
+      while (m < oldTotal && (fldP->lines[m].start < pos + delLen || (Int32)fldP->lines[m].start + delta < start)) m++;
+      if (m < oldTotal && (Int32)fldP->lines[m].start + delta == start) {
+        sync = true;
+        break;
+      }
+    }
+  }
+
+  if (sync) {
+    if (!FldReserveLines(fldP, (UInt32)first + n + (oldTotal - m))) {
+      FntSetFont(old);
+      FldCalcLineInfo(fldP);
+      return;
+    }
+    MemMove(&fldP->lines[first + n], &fldP->lines[m], (oldTotal - m) * sizeof(LineInfoType));
+    fldP->totalLines = first + n + (oldTotal - m);
+    for (i = first + n; i < fldP->totalLines; i++) {
+      fldP->lines[i].start += delta;
+    }
+  } else {
+    if (!FldReserveLines(fldP, (UInt32)first + n)) {
+      FntSetFont(old);
+      FldCalcLineInfo(fldP);
+      return;
+    }
+    fldP->totalLines = first + n;
+  }
+  MemMove(&fldP->lines[first], aux, n * sizeof(LineInfoType));
+  debug(DEBUG_TRACE, PALMOS_MODULE, "FldRelayout rewrapped %d lines from line %d, total %d", n, first, fldP->totalLines);
+
+  FldCountUsedLines(fldP);
+  FntSetFont(old);
+  FldSetInsertionPoint(fldP, FldGetInsPtPosition(fldP));
+}
+
 void FldRecalculateField(FieldType *fldP, Boolean redraw) {
   IN;
   FldCalcLineInfo(fldP);
@@ -1039,8 +1154,6 @@ void FldSetMaxChars(FieldType *fldP, UInt16 maxChars) {
 }
 
 static void FldInsertOneChar(FieldType *fldP, Char c, UInt16 offset) {
-  Int16 i;
-
   IN;
   debug(DEBUG_TRACE, PALMOS_MODULE, "FldInsertOneChar 0x%02X at %d", (UInt8)c, offset);
   if (fldP->textBuf == NULL) {
@@ -1056,12 +1169,9 @@ static void FldInsertOneChar(FieldType *fldP, Char c, UInt16 offset) {
       debug(DEBUG_TRACE, PALMOS_MODULE, "FldInsertOneChar offset (%d) > textLen (%d)", offset, fldP->textLen);
       offset = fldP->textLen;
     }
-    if (fldP->textLen) {
-      debug(DEBUG_TRACE, PALMOS_MODULE, "FldInsertOneChar textLen (%d) > 0", fldP->textLen);
-      for (i = fldP->textLen-1; i >= offset; i--) {
-        debug(DEBUG_TRACE, PALMOS_MODULE, "FldInsertOneChar text[%d] (%d) = text[%d] (%d)", i+1, fldP->text[i+1], i, fldP->text[i]);
-        fldP->text[i+1] = fldP->text[i];
-      }
+    if (offset < fldP->textLen) {
+      debug(DEBUG_TRACE, PALMOS_MODULE, "FldInsertOneChar moving %d chars", fldP->textLen - offset);
+      MemMove(&fldP->text[offset+1], &fldP->text[offset], fldP->textLen - offset);
     }
     fldP->text[offset] = c;
     fldP->textLen++;
@@ -1098,7 +1208,7 @@ Boolean FldInsert(FieldType *fldP, const Char *insertChars, UInt16 insertLen) {
 //debug(1, "XXX", "insert0 x=%d y=%d", fldP->insPtXPos, fldP->insPtYPos);
         FldInsertOneChar(fldP, insertChars[i], offset+i);
 //debug(1, "XXX", "insert1 x=%d y=%d", fldP->insPtXPos, fldP->insPtYPos);
-        FldCalcLineInfo(fldP);
+        FldRelayout(fldP, offset+i, 1, 0);
 //debug(1, "XXX", "insert2 x=%d y=%d", fldP->insPtXPos, fldP->insPtYPos);
         FldGrabFocusEx(fldP, false);
 //debug(1, "XXX", "insert3 x=%d y=%d", fldP->insPtXPos, fldP->insPtYPos);
@@ -1118,33 +1228,12 @@ Boolean FldInsert(FieldType *fldP, const Char *insertChars, UInt16 insertLen) {
   return r;
 }
 
-static void FldDeleteOneChar(FieldType *fldP, UInt16 offset) {
-  UInt16 i;
-
-  IN;
-  debug(DEBUG_TRACE, PALMOS_MODULE, "FldDeleteOneChar at %d", offset);
-  for (i = offset; i < fldP->textLen-1; i++) {
-    debug(DEBUG_TRACE, PALMOS_MODULE, "FldDeleteOneChar text[%d] = text[%d] (%d)", i, i+1, fldP->text[i+1]);
-    fldP->text[i] = fldP->text[i+1];
-  }
-  fldP->text[i] = 0;
-  fldP->textLen--;
-  if (fldP->insPtXPos) {
-    fldP->insPtXPos--;
-  } else if (fldP->insPtYPos) {
-    fldP->insPtYPos--;
-    fldP->insPtXPos = fldP->lines[fldP->top + fldP->insPtYPos].length - 1;
-  }
-  debug(DEBUG_TRACE, PALMOS_MODULE, "FldDeleteOneChar text[%d] = 0, textLen %d", i, fldP->textLen);
-  OUTV;
-}
-
 /*
 end param: if you pass a value that is greater than the number of bytes in
 the field, all characters in the field are deleted.
 */
 void FldDelete(FieldType *fldP, UInt16 start, UInt16 end) {
-  UInt16 i, len;
+  UInt16 len;
 
   IN;
   debug(DEBUG_TRACE, PALMOS_MODULE, "FldDelete %d to %d", start, end);
@@ -1154,9 +1243,7 @@ void FldDelete(FieldType *fldP, UInt16 start, UInt16 end) {
     if (start == 0 && end == fldP->textLen) {
 //debug(1, "XXX", "delete2 x=%d y=%d", fldP->insPtXPos, fldP->insPtYPos);
       debug(DEBUG_TRACE, PALMOS_MODULE, "FldDelete all");
-      for (i = 0; i < fldP->textLen; i++) {
-        fldP->text[i] = 0;
-      }
+      MemSet(fldP->text, fldP->textLen, 0);
       fldP->textLen = 0;
       fldP->insPtXPos = 0;
       FldCalcLineInfo(fldP);
@@ -1165,15 +1252,12 @@ void FldDelete(FieldType *fldP, UInt16 start, UInt16 end) {
       if (end > fldP->textLen) end = fldP->textLen;
       len = end - start;
       debug(DEBUG_TRACE, PALMOS_MODULE, "FldDelete %d chars", len);
-      for (i = 0; i < len; i++) {
-//debug(1, "XXX", "delete3 x=%d y=%d", fldP->insPtXPos, fldP->insPtYPos);
-        FldDeleteOneChar(fldP, start + i);
-//debug(1, "XXX", "delete4 x=%d y=%d", fldP->insPtXPos, fldP->insPtYPos);
-        FldCalcLineInfo(fldP);
-//debug(1, "XXX", "delete5 x=%d y=%d", fldP->insPtXPos, fldP->insPtYPos);
-        FldGrabFocusEx(fldP, false);
-//debug(1, "XXX", "delete6 x=%d y=%d", fldP->insPtXPos, fldP->insPtYPos);
-      }
+      MemMove(&fldP->text[start], &fldP->text[end], fldP->textLen - end);
+      MemSet(&fldP->text[fldP->textLen - len], len, 0);
+      fldP->textLen -= len;
+      FldRelayout(fldP, start, 0, len);
+      FldSetInsertionPoint(fldP, start);
+      FldGrabFocusEx(fldP, false);
     }
     FldUpdateHandle(fldP);
     FldSetDirty(fldP, true);
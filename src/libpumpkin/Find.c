@@ -7,11 +7,277 @@
 #include "pwindow.h"
 #include "vfs.h"
 #include "pumpkin.h"
+#include "findindex.h"
 #include "debug.h"
 #include "xalloc.h"
 
+#define MAX_FIND_APPS 256
+
+typedef struct {
+  FindIndexMatchType m[maxFinds];
+  UInt16 n, next;
+  UInt32 cursor;
+  UInt32 creator; // creator of the last header drawn
+  Boolean done;
+} find_index_t;
+
+// Draws the indexed matches that fit in the results. Returns false if it stopped because the results are full.
+static Boolean FindIndexed(FindParamsType *params, find_index_t *fi, Boolean showSecret) {
+  FindIndexMatchType *m;
+  DmSearchStateType state;
+  RectangleType rect;
+  Char name[dmDBNameLength];
+  LocalID appID;
+  UInt16 cardNo;
+
+  while (!fi->done) {
+    if (fi->next == fi->n) {
+      fi->n = FindIndexSearch(params->strAsTyped, showSecret, fi->m, maxFinds, &fi->cursor);
+      fi->next = 0;
+      if (fi->n == 0) {
+        fi->done = true;
+        break;
+      }
+    }
+
+    m = &fi->m[fi->next];
+    if (DmGetNextDatabaseByTypeCreator(true, &state, sysFileTApplication, m->creator, true, &cardNo, &appID) != errNone) {
+      // there is no application to go to
+      fi->next++;
+      continue;
+    }
+    if (m->creator != fi->creator) {
+      // a header needs room for at least one match below it
+      if (params->lineNumber + 2 > maxFinds) return false;
+      name[0] = 0;
+      DmDatabaseInfo(0, appID, name, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+      FindDrawHeader(params, name);
+      fi->creator = m->creator;
+    }
+    if (params->lineNumber >= maxFinds || params->numMatches >= maxFinds) return false;
+
+    FindSaveMatch(params, m->recordNum, m->matchPos, m->fieldNum, 0, 0, m->dbID);
+    params->match[params->numMatches - 1].appDbID = appID;
+    FindGetLineBounds(params, &rect);
+    WinDrawTruncChars(m->text, StrLen(m->text), rect.topLeft.x, rect.topLeft.y, rect.extent.x);
+    params->lineNumber++;
+    fi->next++;
+  }
+
+  return true;
+}
+
+// Returns the native applications whose records are not indexed, starting with the caller.
+// The m68k applications are left out because they receive no parameter block for sysAppLaunchCmdFind.
+static UInt16 FindApps(LocalID caller, LocalID *apps, UInt16 max) {
+  DmSearchStateType state;
+  DmOpenRef dbRef;
+  LocalID dbID;
+  UInt32 creator;
+  UInt16 cardNo, n;
+  Boolean newSearch, native;
+
+  for (n = 0, newSearch = true; n < max; newSearch = false) {
+    if (DmGetNextDatabaseByTypeCreator(newSearch, &state, sysFileTApplication, 0, true, &cardNo, &dbID) != errNone) break;
+    if (DmDatabaseInfo(0, dbID, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &creator) != errNone) continue;
+    if (FindIndexHasCreator(creator)) continue;
+    if ((dbRef = DmOpenDatabase(0, dbID, dmModeReadOnly)) == NULL) continue;
+    native = DmFindResourceType(dbRef, sysRsrcTypeDlib, 0) != 0xFFFF;
+    DmCloseDatabase(dbRef);
+    if (!native) continue;
+
+    if (dbID == caller && n > 0) {
+      apps[n++] = apps[0];
+      apps[0] = dbID;
+    } else {
+      apps[n++] = dbID;
+    }
+  }
+
+  return n;
+}
+
+// The records of the indexed applications are searched first, then sysAppLaunchCmdFind is sent to the other
+// applications. When the user selects a match, the application is launched with sysAppLaunchCmdGoTo.
+
 void Find(GoToParamsPtr goToP) {
-  debug(DEBUG_ERROR, "PALMOS", "Find not implemented");
+  FindParamsType params;
+  find_index_t fi;
+  FormType *frm, *previous;
+  FieldType *fld;
+  TableType *tbl;
+  EventType event;
+  GoToParamsType gotoParam;
+  LocalID apps[MAX_FIND_APPS], caller, appID;
+  MemHandle h;
+  Char *s;
+  Char label[32];
+  UInt16 index, row, numApps, before, i, j;
+  UInt32 result, wait;
+  Boolean ok, stop, full, paused, showSecret;
+  Err err;
+
+  MemSet(&params, sizeof(FindParamsType), 0);
+  ok = false;
+  row = 0;
+
+  if ((frm = FrmInitForm(10500)) != NULL) {
+    previous = FrmGetActiveForm();
+    index = FrmGetObjectIndex(frm, 10503);
+    FrmSetFocus(frm, index);
+
+    if (FrmDoDialog(frm) == 10504) {
+      if ((fld = (FieldType *)FrmGetObjectPtr(frm, index)) != NULL) {
+        if ((h = FldGetTextHandle(fld)) != NULL) {
+          if ((s = MemHandleLock(h)) != NULL) {
+            StrNCopy(params.strAsTyped, s, maxFindStrLen);
+            MemHandleUnlock(h);
+            ok = params.strAsTyped[0] != 0;
+          }
+        }
+      }
+    }
+    FrmDeleteForm(frm);
+    FrmSetActiveForm(previous);
+  }
+
+  if (!ok) return;
+  ok = false;
+
+  if ((frm = FrmInitForm(10600)) != NULL) {
+    previous = FrmGetActiveForm();
+    FrmSetActiveForm(frm);
+    FrmDrawForm(frm);
+
+    index = FrmGetObjectIndex(frm, 10602);
+    FrmHideObject(frm, index);
+    StrPrintF(label, "Matches for \"%s\"", params.strAsTyped);
+    FrmCopyLabel(frm, 10602, label);
+    FrmShowObject(frm, index);
+
+    index = FrmGetObjectIndex(frm, 10603);
+    FrmGetObjectBounds(frm, index, &params.rect);
+    tbl = (TableType *)FrmGetObjectPtr(frm, index);
+
+    showSecret = PrefGetPreference(prefShowPrivateRecords) == showPrivateRecords;
+    params.dbAccesMode = dmModeReadOnly | (showSecret ? dmModeShowSecret : 0);
+    StrToLower(params.strToFind, params.strAsTyped);
+    for (i = 0; i < maxFinds; i++) {
+      params.idx[i] = 0xFFFF;
+    }
+
+    MemSet(&fi, sizeof(find_index_t), 0);
+    caller = pumpkin_get_app_localid();
+    numApps = FindApps(caller, apps, MAX_FIND_APPS);
+    debug(DEBUG_INFO, "PALMOS", "Find \"%s\" in the index and %d application(s)", params.strAsTyped, numApps);
+
+    for (i = 0, stop = false, full = false, paused = false, wait = 0;;) {
+      EvtGetEvent(&event, wait);
+      if (SysHandleEvent(&event)) continue;
+      if (MenuHandleEvent(NULL, &event, &err)) continue;
+
+      if (!FrmDispatchEvent(&event)) {
+        switch (event.eType) {
+          case ctlSelectEvent:
+            if (event.data.ctlSelect.pControl->style == buttonCtl) {
+              switch (event.data.ctlSelect.controlID) {
+                case 10606:  // Find More
+                  WinEraseRectangle(&params.rect, 0);
+                  params.numMatches = 0;
+                  params.lineNumber = 0;
+                  for (j = 0; j < maxFinds; j++) {
+                    params.idx[j] = 0xFFFF;
+                    TblSetRowUsable(tbl, j, false);
+                  }
+                  fi.creator = 0;
+                  full = false;
+                  paused = false;
+                  wait = 0;
+                  FrmHideObject(frm, FrmGetObjectIndex(frm, 10606));
+                  break;
+                case 10605:  // Cancel
+                case 10607:  // Stop
+                  stop = true;
+                  break;
+              }
+            }
+            break;
+          case tblEnterEvent:
+            row = event.data.tblSelect.row;
+            if (row < maxFinds && params.idx[row] < maxFinds) {
+              row = params.idx[row];
+              ok = true;
+              stop = true;
+            }
+            break;
+          case appStopEvent:
+            EvtAddEventToQueue(&event);
+            stop = true;
+            break;
+          default:
+            break;
+        }
+      }
+      if (stop) break;
+
+      if (!fi.done || i < numApps) {
+        if (!full) {
+          if (!fi.done) {
+            full = !FindIndexed(&params, &fi, showSecret);
+          } else {
+            appID = apps[i];
+            before = params.numMatches;
+            params.continuation = params.more;
+            params.more = false;
+            if (SysAppLaunch(0, appID, 0, sysAppLaunchCmdFind, &params, &result) != errNone || !params.more) {
+              params.recordNum = 0;
+              i++;
+            }
+            // FindSaveMatch records the application that called Find
+            for (j = before; j < params.numMatches; j++) {
+              params.match[j].appDbID = appID;
+              params.match[j].foundInCaller = appID == caller;
+            }
+          }
+          if (params.more || params.numMatches >= maxFinds || params.lineNumber >= maxFinds) full = true;
+        } else if (!paused) {
+          for (j = 0; j < maxFinds; j++) {
+            TblSetRowUsable(tbl, j, params.idx[j] < maxFinds);
+          }
+          TblSetColumnUsable(tbl, 0, true);
+          FrmShowObject(frm, FrmGetObjectIndex(frm, 10606));
+          paused = true;
+          wait = evtWaitForever;
+        }
+      } else if (i == numApps) {
+        for (j = 0; j < maxFinds; j++) {
+          TblSetRowUsable(tbl, j, params.idx[j] < maxFinds);
+        }
+        TblSetColumnUsable(tbl, 0, true);
+        FrmHideObject(frm, FrmGetObjectIndex(frm, 10607));
+        FrmShowObject(frm, FrmGetObjectIndex(frm, 10605));
+        wait = evtWaitForever;
+        i++;
+      }
+    }
+
+    FrmEraseForm(frm);
+    FrmDeleteForm(frm);
+    FrmSetActiveForm(previous);
+  }
+
+  if (ok) {
+    gotoParam.searchStrLen = StrLen(params.strAsTyped);
+    gotoParam.dbCardNo = params.match[row].dbCardNo;
+    gotoParam.dbID = params.match[row].dbID;
+    gotoParam.recordNum = params.match[row].recordNum;
+    gotoParam.matchPos = params.match[row].matchPos;
+    gotoParam.matchFieldNum = params.match[row].matchFieldNum;
+    gotoParam.matchCustom = params.match[row].matchCustom;
+    if (goToP) MemMove(goToP, &gotoParam, sizeof(GoToParamsType));
+    debug(DEBUG_INFO, "PALMOS", "Find goto record %d of database 0x%08X", gotoParam.recordNum, gotoParam.dbID);
+    SysAppLaunch(0, params.match[row].appDbID, 0, sysAppLaunchCmdGoTo, &gotoParam, &result);
+  }
 }
 
 // Returns the bounds of the next available line for displaying a match in the Find results dialog.
@@ -31,7 +297,11 @@ Boolean FindDrawHeader(FindParamsPtr findParams, Char const *title) {
   UInt16 len, dx, x;
   Boolean full = false;
 
-  if (findParams && title) {
+  if (findParams && findParams->lineNumber + 2 > maxFinds) {
+    // no room for the header and a match below it, the application is searched again on Find More
+    findParams->more = true;
+    full = true;
+  } else if (findParams && title) {
     FindGetLineBounds(findParams, &rect);
     WinDrawLine(rect.topLeft.x, rect.topLeft.y + rect.extent.y / 2, rect.topLeft.x + rect.extent.x, rect.topLeft.y + rect.extent.y / 2);
     len = StrLen(title);
@@ -75,7 +345,7 @@ Boolean FindSaveMatch(FindParamsPtr findParams, UInt16 recordNum, UInt16 pos, UI
   Boolean r = false;
 
   if (findParams) {
-    if (findParams->numMatches < maxFinds) {
+    if (findParams->numMatches < maxFinds && findParams->lineNumber < maxFinds) {
       findParams->idx[findParams->lineNumber] = findParams->numMatches;
       findParams->match[findParams->numMatches].appCardNo = 0;            // card number of the database record was found in
       findParams->match[findParams->numMatches].appDbID = pumpkin_get_app_localid(); // LocalID of the application
@@ -87,9 +357,12 @@ Boolean FindSaveMatch(FindParamsPtr findParams, UInt16 recordNum, UInt16 pos, UI
       findParams->match[findParams->numMatches].matchFieldNum = fieldNum;  // field number
       findParams->match[findParams->numMatches].matchCustom = appCustom;   // app specific data
       findParams->numMatches++;
+    } else {
+      // no room to display the match, the search resumes from this record on Find More
+      findParams->more = true;
+      r = true;
     }
     findParams->recordNum = recordNum;
-    r = findParams->numMatches == maxFinds;
   }
 
   return r;
@@ -0,0 +1,1124 @@
+#include <PalmOS.h>
+
+#include "sys.h"
+#include "mutex.h"
+#include "pumpkin.h"
+#include "findindex.h"
+#include "xalloc.h"
+#include "debug.h"
+
+// Each indexed record is a document holding the ids of its distinct words,
+// and each word holds the sorted ids of the documents where it appears.
+// Prefix queries walk a sorted copy of the dictionary. Candidates are then
+// checked against the record with FindStrInStr, so the index only has to
+// return a superset of the real matches. Hooks in the Data Manager keep the
+// index up to date, and databases are indexed the first time they are
+// searched. The index is saved on finish, and the saved file is removed on
+// load, so an index left by a session that did not finish is not trusted.
+
+#define INDEX_FILE    "findindex"
+#define INDEX_MAGIC   'FIDX'
+#define INDEX_VERSION 1
+#define MAX_TERM      32
+#define MAX_DBS       16
+#define MAX_PASSES    3
+#define TABLE_INC     1024
+
+// same separators used by FindStrInStr
+#define IS_SEP(c) ((Char)(c) <= 32)
+
+typedef void (*fidx_field_f)(UInt16 fieldNum, Char *s, UInt32 len, void *data);
+typedef void (*fidx_extract_f)(UInt8 *rec, UInt32 size, fidx_field_f f, void *data);
+
+typedef struct {
+  UInt32 creator, type;
+  fidx_extract_f extract;
+} fidx_extractor_t;
+
+typedef struct {
+  char *s;
+  UInt32 *post;  // sorted document ids
+  UInt32 npost, size;
+} fidx_word_t;
+
+typedef struct {
+  Int32 db;      // -1 for a free document
+  UInt32 uniqueID;
+  UInt32 *words;
+  UInt32 nwords;
+  UInt32 stamp, hits;
+} fidx_doc_t;
+
+typedef struct {
+  UInt32 uniqueID, doc;
+} fidx_ref_t;
+
+// A database is identified by name, type and creator. A LocalID is an offset
+// in the storage mapping of a task, so it is only valid in the task that
+// resolved it, and the hooks, the searches and the global init and finish
+// all run on different tasks.
+typedef struct {
+  char name[dmDBNameLength];
+  UInt32 type;
+  fidx_extractor_t *ex; // NULL for a free slot
+  UInt32 gen;           // incremented by every change made by the hooks
+  Boolean indexed;      // false while the database is being indexed
+  fidx_ref_t *refs;     // sorted by uniqueID
+  UInt32 nrefs, size;
+} fidx_db_t;
+
+typedef struct {
+  char (*w)[MAX_TERM+1];
+  UInt32 n, size;
+} fidx_terms_t;
+
+typedef struct {
+  const Char *str;
+  Boolean found;
+  UInt16 fieldNum, pos;
+  Char text[32];
+} fidx_verify_t;
+
+typedef struct {
+  Int32 db;
+  char name[dmDBNameLength];
+  UInt32 creator, uniqueID;
+} fidx_cand_t;
+
+typedef struct {
+  mutex_t *mutex;
+  char path[256];
+  fidx_db_t db[MAX_DBS];
+  fidx_word_t *words;
+  UInt32 nwords, wsize;
+  UInt32 *hash, hashSize;
+  UInt32 *sorted, nsorted; // word ids sorted by string
+  fidx_doc_t *docs;
+  UInt32 ndocs, dsize, freeDoc;
+  UInt32 stamp;
+} fidx_t;
+
+static fidx_t fidx;
+
+static UInt32 FindIndexString(UInt8 *rec, UInt32 size, UInt32 offset, fidx_field_f f, UInt16 fieldNum, void *data) {
+  UInt32 len;
+
+  if (offset >= size) return size;
+  for (len = 0; offset + len < size && rec[offset + len]; len++);
+  if (len) f(fieldNum, (Char *)&rec[offset], len, data);
+
+  return offset + len + 1;
+}
+
+// MemoPad: the memo text
+static void FindIndexMemo(UInt8 *rec, UInt32 size, fidx_field_f f, void *data) {
+  FindIndexString(rec, size, 0, f, 0, data);
+}
+
+// ToDo: due date (2 bytes), priority (1 byte), description, note
+static void FindIndexToDo(UInt8 *rec, UInt32 size, fidx_field_f f, void *data) {
+  UInt32 offset;
+
+  offset = FindIndexString(rec, size, 3, f, 0, data);
+  FindIndexString(rec, size, offset, f, 1, data);
+}
+
+// Address: options (4 bytes), flags (4 bytes), company offset (1 byte), then
+// a string for each field present in flags, see BitAtPosition in AddressDB.c
+static void FindIndexAddress(UInt8 *rec, UInt32 size, fidx_field_f f, void *data) {
+  static const UInt8 bitPos[19] = { 24, 25, 26, 27, 28, 29, 30, 31, 16, 17, 18, 19, 20, 21, 22, 23, 8, 9, 10 };
+  UInt32 flags, offset;
+  UInt16 i;
+
+  if (size < 9) return;
+  xmemcpy(&flags, &rec[4], sizeof(UInt32));
+
+  for (i = 0, offset = 9; i < 19 && offset < size; i++) {
+    if (flags & (1U << bitPos[i])) {
+      offset = FindIndexString(rec, size, offset, f, i, data);
+    }
+  }
+}
+
+// Datebook: start time, end time, date and flags (2 bytes each), then the
+// optional alarm (1 word), repeat (3 words), exceptions (count and 1 word
+// each), description (padded to a word) and note, see ApptUnpack in DateDB.c
+static void FindIndexDatebook(UInt8 *rec, UInt32 size, fidx_field_f f, void *data) {
+  UInt32 offset, start;
+  UInt16 flags, n;
+
+  if (size < 8) return;
+  xmemcpy(&flags, &rec[6], sizeof(UInt16));
+  offset = 8;
+
+  if (flags & 0x02) offset += 2;
+  if (flags & 0x04) offset += 6;
+  if (flags & 0x10) {
+    if (offset + 2 > size) return;
+    xmemcpy(&n, &rec[offset], sizeof(UInt16));
+    offset += 2 + (n > 16 ? 16 : n) * 2;
+  }
+  if (flags & 0x20) {
+    start = offset;
+    offset = FindIndexString(rec, size, offset, f, 0, data);
+    if ((offset - start) & 1) offset++;
+  }
+  if (flags & 0x08) {
+    FindIndexString(rec, size, offset, f, 1, data);
+  }
+}
+
+static fidx_extractor_t extractors[] = {
+  { sysFileCMemo,     'DATA', FindIndexMemo     },
+  { sysFileCToDo,     'DATA', FindIndexToDo     },
+  { sysFileCAddress,  'DATA', FindIndexAddress  },
+  { sysFileCDatebook, 'DATA', FindIndexDatebook },
+  { 0, 0, NULL }
+};
+
+static fidx_extractor_t *FindIndexExtractor(UInt32 creator, UInt32 type) {
+  fidx_extractor_t *ex;
+
+  for (ex = extractors; ex->extract; ex++) {
+    if (ex->creator == creator && ex->type == type) return ex;
+  }
+
+  return NULL;
+}
+
+Boolean FindIndexHasCreator(UInt32 creator) {
+  fidx_extractor_t *ex;
+
+  for (ex = extractors; ex->extract; ex++) {
+    if (ex->creator == creator) return true;
+  }
+
+  return false;
+}
+
+static void FindIndexTokenize(UInt16 fieldNum, Char *s, UInt32 len, void *data) {
+  fidx_terms_t *t = (fidx_terms_t *)data;
+  void *w;
+  UInt32 i, j;
+
+  for (i = 0; i < len;) {
+    for (; i < len && IS_SEP(s[i]); i++);
+    if (i == len) break;
+
+    if (t->n == t->size) {
+      if ((w = xrealloc(t->w, (t->size + 256) * (MAX_TERM+1))) == NULL) return;
+      t->w = w;
+      t->size += 256;
+    }
+
+    // longer words are truncated, searches check the full string in the record
+    for (j = 0; i < len && !IS_SEP(s[i]); i++) {
+      if (j < MAX_TERM) t->w[t->n][j++] = sys_tolower((UInt8)s[i]);
+    }
+    t->w[t->n++][j] = 0;
+  }
+}
+
+static int FindIndexCompareTerms(const void *e1, const void *e2) {
+  return sys_strcmp((const char *)e1, (const char *)e2);
+}
+
+static void FindIndexUnique(fidx_terms_t *t) {
+  UInt32 i, j;
+
+  if (t->n > 1) {
+    sys_qsort(t->w, t->n, MAX_TERM+1, FindIndexCompareTerms);
+    for (i = 1, j = 1; i < t->n; i++) {
+      if (sys_strcmp(t->w[i], t->w[j-1])) {
+        if (i != j) sys_strcpy(t->w[j], t->w[i]);
+        j++;
+      }
+    }
+    t->n = j;
+  }
+}
+
+static UInt32 FindIndexHash(const char *s) {
+  UInt32 h = 0x811C9DC5;
+
+  for (; *s; s++) {
+    h ^= (UInt8)*s;
+    h *= 0x01000193;
+  }
+
+  return h;
+}
+
+// slots hold word id + 1, 0 is an empty slot
+static void FindIndexRehash(void) {
+  UInt32 i, j, size;
+
+  for (size = 2 * TABLE_INC; size < fidx.wsize * 2; size <<= 1);
+
+  if (size != fidx.hashSize) {
+    if (fidx.hash) xfree(fidx.hash);
+    fidx.hash = xcalloc(size, sizeof(UInt32));
+    fidx.hashSize = fidx.hash ? size : 0;
+  } else {
+    sys_memset(fidx.hash, 0, size * sizeof(UInt32));
+  }
+
+  for (i = 0; i < fidx.nwords && fidx.hash; i++) {
+    j = FindIndexHash(fidx.words[i].s) & (fidx.hashSize - 1);
+    while (fidx.hash[j]) j = (j + 1) & (fidx.hashSize - 1);
+    fidx.hash[j] = i + 1;
+  }
+}
+
+// Returns the word id, or -1 if the word is not in the dictionary and create is false.
+static Int32 FindIndexWord(const char *s, Boolean create) {
+  fidx_word_t *w;
+  UInt32 j, k;
+
+  if (fidx.hash) {
+    j = FindIndexHash(s) & (fidx.hashSize - 1);
+    for (; (k = fidx.hash[j]) != 0; j = (j + 1) & (fidx.hashSize - 1)) {
+      if (!sys_strcmp(fidx.words[k - 1].s, s)) return k - 1;
+    }
+  }
+
+  if (!create) return -1;
+
+  if (fidx.nwords == fidx.wsize) {
+    if ((w = xrealloc(fidx.words, (fidx.wsize + TABLE_INC) * sizeof(fidx_word_t))) == NULL) return -1;
+    fidx.words = w;
+    fidx.wsize += TABLE_INC;
+    FindIndexRehash();
+  }
+  if (fidx.hash == NULL) return -1;
+
+  w = &fidx.words[fidx.nwords];
+  sys_memset(w, 0, sizeof(fidx_word_t));
+  if ((w->s = xstrdup(s)) == NULL) return -1;
+
+  j = FindIndexHash(s) & (fidx.hashSize - 1);
+  while (fidx.hash[j]) j = (j + 1) & (fidx.hashSize - 1);
+  fidx.hash[j] = ++fidx.nwords;
+
+  // the sorted dictionary is rebuilt by the next search
+  fidx.nsorted = 0;
+
+  return fidx.nwords - 1;
+}
+
+// first position in a sorted array of ids where id could be inserted
+static UInt32 FindIndexLowerBound(UInt32 *a, UInt32 n, UInt32 id) {
+  UInt32 lo, hi, mid;
+
+  for (lo = 0, hi = n; lo < hi;) {
+    mid = (lo + hi) / 2;
+    if (a[mid] < id) lo = mid + 1;
+    else hi = mid;
+  }
+
+  return lo;
+}
+
+static void FindIndexPostAdd(fidx_word_t *w, UInt32 doc) {
+  UInt32 *post, i;
+
+  i = FindIndexLowerBound(w->post, w->npost, doc);
+  if (i < w->npost && w->post[i] == doc) return;
+
+  if (w->npost == w->size) {
+    if ((post = xrealloc(w->post, (w->size ? w->size * 2 : 4) * sizeof(UInt32))) == NULL) return;
+    w->post = post;
+    w->size = w->size ? w->size * 2 : 4;
+  }
+
+  if (i < w->npost) {
+    MemMove(&w->post[i + 1], &w->post[i], (w->npost - i) * sizeof(UInt32));
+  }
+  w->post[i] = doc;
+  w->npost++;
+}
+
+static void FindIndexPostRemove(fidx_word_t *w, UInt32 doc) {
+  UInt32 i;
+
+  i = FindIndexLowerBound(w->post, w->npost, doc);
+  if (i < w->npost && w->post[i] == doc) {
+    w->npost--;
+    if (i < w->npost) {
+      MemMove(&w->post[i], &w->post[i + 1], (w->npost - i) * sizeof(UInt32));
+    }
+  }
+}
+
+static Int32 FindIndexDb(const char *name, UInt32 type, UInt32 creator) {
+  Int32 i;
+
+  for (i = 0; i < MAX_DBS; i++) {
+    if (fidx.db[i].ex && fidx.db[i].type == type && fidx.db[i].ex->creator == creator && !sys_strncmp(fidx.db[i].name, name, dmDBNameLength)) return i;
+  }
+
+  return -1;
+}
+
+// position of uniqueID in the references of a database, or where it would be inserted
+static UInt32 FindIndexRef(fidx_db_t *db, UInt32 uniqueID) {
+  UInt32 lo, hi, mid;
+
+  for (lo = 0, hi = db->nrefs; lo < hi;) {
+    mid = (lo + hi) / 2;
+    if (db->refs[mid].uniqueID < uniqueID) lo = mid + 1;
+    else hi = mid;
+  }
+
+  return lo;
+}
+
+static void FindIndexDocFree(UInt32 doc) {
+  fidx_doc_t *d = &fidx.docs[doc];
+  UInt32 i;
+
+  for (i = 0; i < d->nwords; i++) {
+    FindIndexPostRemove(&fidx.words[d->words[i]], doc);
+  }
+  if (d->words) xfree(d->words);
+  d->words = NULL;
+  d->nwords = 0;
+  d->db = -1;
+
+  // free documents are linked through uniqueID
+  d->uniqueID = fidx.freeDoc;
+  fidx.freeDoc = doc + 1;
+}
+
+static Int32 FindIndexDocNew(Int32 db, UInt32 uniqueID) {
+  fidx_doc_t *d;
+  UInt32 doc;
+
+  if (fidx.freeDoc) {
+    doc = fidx.freeDoc - 1;
+    fidx.freeDoc = fidx.docs[doc].uniqueID;
+  } else {
+    if (fidx.ndocs == fidx.dsize) {
+      if ((d = xrealloc(fidx.docs, (fidx.dsize + TABLE_INC) * sizeof(fidx_doc_t))) == NULL) return -1;
+      fidx.docs = d;
+      fidx.dsize += TABLE_INC;
+    }
+    doc = fidx.ndocs++;
+  }
+
+  d = &fidx.docs[doc];
+  sys_memset(d, 0, sizeof(fidx_doc_t));
+  d->db = db;
+  d->uniqueID = uniqueID;
+
+  return doc;
+}
+
+static void FindIndexDrop(Int32 db, UInt32 uniqueID) {
+  fidx_db_t *p = &fidx.db[db];
+  UInt32 i;
+
+  i = FindIndexRef(p, uniqueID);
+  if (i < p->nrefs && p->refs[i].uniqueID == uniqueID) {
+    FindIndexDocFree(p->refs[i].doc);
+    p->nrefs--;
+    if (i < p->nrefs) {
+      MemMove(&p->refs[i], &p->refs[i + 1], (p->nrefs - i) * sizeof(fidx_ref_t));
+    }
+  }
+}
+
+// Replaces the document of a record with the given word ids.
+static void FindIndexPutIds(Int32 db, UInt32 uniqueID, UInt32 *ids, UInt32 n) {
+  fidx_db_t *p = &fidx.db[db];
+  fidx_ref_t *refs;
+  fidx_doc_t *d;
+  Int32 doc;
+  UInt32 i;
+
+  FindIndexDrop(db, uniqueID);
+  if (n == 0) return;
+
+  if (p->nrefs == p->size) {
+    if ((refs = xrealloc(p->refs, (p->size + TABLE_INC) * sizeof(fidx_ref_t))) == NULL) return;
+    p->refs = refs;
+    p->size += TABLE_INC;
+  }
+  if ((doc = FindIndexDocNew(db, uniqueID)) == -1) return;
+
+  d = &fidx.docs[doc];
+  if ((d->words = xmalloc(n * sizeof(UInt32))) == NULL) {
+    FindIndexDocFree(doc);
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    d->words[i] = ids[i];
+    FindIndexPostAdd(&fidx.words[ids[i]], doc);
+  }
+  d->nwords = n;
+
+  i = FindIndexRef(p, uniqueID);
+  if (i < p->nrefs) {
+    MemMove(&p->refs[i + 1], &p->refs[i], (p->nrefs - i) * sizeof(fidx_ref_t));
+  }
+  p->refs[i].uniqueID = uniqueID;
+  p->refs[i].doc = doc;
+  p->nrefs++;
+}
+
+static void FindIndexPut(Int32 db, UInt32 uniqueID, fidx_terms_t *t) {
+  UInt32 *ids, i, n;
+  Int32 id;
+
+  FindIndexUnique(t);
+
+  if (t->n == 0) {
+    FindIndexDrop(db, uniqueID);
+    return;
+  }
+  if ((ids = xmalloc(t->n * sizeof(UInt32))) == NULL) return;
+
+  for (i = 0, n = 0; i < t->n; i++) {
+    if ((id = FindIndexWord(t->w[i], true)) != -1) ids[n++] = id;
+  }
+  FindIndexPutIds(db, uniqueID, ids, n);
+  xfree(ids);
+}
+
+static Int32 FindIndexNewDb(const char *name, UInt32 type, fidx_extractor_t *ex, Boolean indexed) {
+  Int32 i;
+
+  for (i = 0; i < MAX_DBS; i++) {
+    if (fidx.db[i].ex == NULL) {
+      sys_memset(&fidx.db[i], 0, sizeof(fidx_db_t));
+      sys_strncpy(fidx.db[i].name, name, dmDBNameLength-1);
+      fidx.db[i].type = type;
+      fidx.db[i].ex = ex;
+      fidx.db[i].indexed = indexed;
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static void FindIndexDropDb(Int32 db) {
+  fidx_db_t *p = &fidx.db[db];
+  UInt32 i;
+
+  for (i = 0; i < p->nrefs; i++) {
+    FindIndexDocFree(p->refs[i].doc);
+  }
+  if (p->refs) xfree(p->refs);
+  sys_memset(p, 0, sizeof(fidx_db_t));
+}
+
+void FindIndexPutRecord(const char *name, UInt32 type, UInt32 creator, UInt32 uniqueID, void *data, UInt32 size) {
+  fidx_terms_t t;
+  Int32 db;
+
+  if (fidx.mutex && data && mutex_lock(fidx.mutex) == 0) {
+    if ((db = FindIndexDb(name, type, creator)) != -1) {
+      sys_memset(&t, 0, sizeof(t));
+      fidx.db[db].ex->extract(data, size, FindIndexTokenize, &t);
+      FindIndexPut(db, uniqueID, &t);
+      fidx.db[db].gen++;
+      if (t.w) xfree(t.w);
+    }
+    mutex_unlock(fidx.mutex);
+  }
+}
+
+void FindIndexRemoveRecord(const char *name, UInt32 type, UInt32 creator, UInt32 uniqueID) {
+  Int32 db;
+
+  if (fidx.mutex && mutex_lock(fidx.mutex) == 0) {
+    if ((db = FindIndexDb(name, type, creator)) != -1) {
+      FindIndexDrop(db, uniqueID);
+      fidx.db[db].gen++;
+    }
+    mutex_unlock(fidx.mutex);
+  }
+}
+
+void FindIndexRemoveDatabase(const char *name, UInt32 type, UInt32 creator) {
+  Int32 db;
+
+  if (fidx.mutex && mutex_lock(fidx.mutex) == 0) {
+    if ((db = FindIndexDb(name, type, creator)) != -1) {
+      FindIndexDropDb(db);
+    }
+    mutex_unlock(fidx.mutex);
+  }
+}
+
+// Indexes all records of a database. Changes made by the hooks while a
+// record is being read are detected by the generation counter, and the
+// database is read again if that happens.
+static void FindIndexBuild(LocalID dbID, fidx_extractor_t *ex) {
+  DmOpenRef dbRef;
+  fidx_terms_t t;
+  MemHandle h;
+  UInt8 *p;
+  UInt32 uniqueID, gen, start;
+  UInt16 attr, i, n, pass;
+  Boolean changed;
+  char name[dmDBNameLength];
+  Int32 db;
+
+  sys_memset(name, 0, dmDBNameLength);
+  if (DmDatabaseInfo(0, dbID, name, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL) != errNone) return;
+  if (mutex_lock(fidx.mutex) != 0) return;
+  db = FindIndexNewDb(name, ex->type, ex, false);
+  mutex_unlock(fidx.mutex);
+
+  if (db == -1) {
+    debug(DEBUG_ERROR, "FIND", "too many databases to index");
+    return;
+  }
+
+  if ((dbRef = DmOpenDatabase(0, dbID, dmModeReadOnly | dmModeShowSecret)) == NULL) {
+    if (mutex_lock(fidx.mutex) == 0) {
+      FindIndexDropDb(db);
+      mutex_unlock(fidx.mutex);
+    }
+    return;
+  }
+
+  sys_memset(&t, 0, sizeof(t));
+  n = DmNumRecords(dbRef);
+  debug(DEBUG_INFO, "FIND", "indexing database \"%s\" with %u records", name, n);
+
+  for (pass = 0; pass < MAX_PASSES; pass++) {
+    if (mutex_lock(fidx.mutex) != 0) break;
+    start = fidx.db[db].gen;
+    mutex_unlock(fidx.mutex);
+    changed = false;
+
+    n = DmNumRecords(dbRef);
+    for (i = 0; i < n; i++) {
+      if (mutex_lock(fidx.mutex) != 0) break;
+      gen = fidx.db[db].gen;
+      mutex_unlock(fidx.mutex);
+
+      if (DmRecordInfo(dbRef, i, &attr, &uniqueID, NULL) != errNone) continue;
+      if (attr & dmRecAttrDelete) continue;
+      if ((h = DmQueryRecord(dbRef, i)) == NULL) continue;
+      if ((p = MemHandleLock(h)) == NULL) continue;
+      t.n = 0;
+      ex->extract(p, MemHandleSize(h), FindIndexTokenize, &t);
+      MemHandleUnlock(h);
+
+      if (mutex_lock(fidx.mutex) == 0) {
+        if (fidx.db[db].gen == gen) {
+          FindIndexPut(db, uniqueID, &t);
+        } else {
+          changed = true;
+        }
+        mutex_unlock(fidx.mutex);
+      }
+    }
+
+    if (mutex_lock(fidx.mutex) == 0) {
+      if (fidx.db[db].gen != start) changed = true;
+      mutex_unlock(fidx.mutex);
+    }
+    if (!changed) break;
+  }
+  DmCloseDatabase(dbRef);
+
+  if (mutex_lock(fidx.mutex) == 0) {
+    fidx.db[db].indexed = true;
+    mutex_unlock(fidx.mutex);
+  }
+  if (t.w) xfree(t.w);
+}
+
+// Indexes the databases of the built-in applications that are not indexed yet.
+static void FindIndexScan(void) {
+  DmSearchStateType state;
+  fidx_extractor_t *ex;
+  LocalID dbID;
+  char name[dmDBNameLength];
+  Boolean newSearch, found;
+
+  for (ex = extractors; ex->extract; ex++) {
+    for (newSearch = true; DmGetNextDatabaseByTypeCreator(newSearch, &state, ex->type, ex->creator, false, NULL, &dbID) == errNone; newSearch = false) {
+      sys_memset(name, 0, dmDBNameLength);
+      if (DmDatabaseInfo(0, dbID, name, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL) != errNone) continue;
+      found = false;
+      if (mutex_lock(fidx.mutex) == 0) {
+        found = FindIndexDb(name, ex->type, ex->creator) != -1;
+        mutex_unlock(fidx.mutex);
+      }
+      if (!found) FindIndexBuild(dbID, ex);
+    }
+  }
+}
+
+static int FindIndexCompareWords(const void *e1, const void *e2) {
+  UInt32 w1 = *(UInt32 *)e1;
+  UInt32 w2 = *(UInt32 *)e2;
+
+  return sys_strcmp(fidx.words[w1].s, fidx.words[w2].s);
+}
+
+static void FindIndexSort(void) {
+  UInt32 i;
+
+  if (fidx.nsorted != fidx.nwords) {
+    if (fidx.sorted) xfree(fidx.sorted);
+    fidx.nsorted = 0;
+    if ((fidx.sorted = xmalloc((fidx.nwords + 1) * sizeof(UInt32))) != NULL) {
+      for (i = 0; i < fidx.nwords; i++) fidx.sorted[i] = i;
+      sys_qsort(fidx.sorted, fidx.nwords, sizeof(UInt32), FindIndexCompareWords);
+      fidx.nsorted = fidx.nwords;
+    }
+  }
+}
+
+static int FindIndexCompareCandidates(const void *e1, const void *e2) {
+  fidx_cand_t *c1 = (fidx_cand_t *)e1;
+  fidx_cand_t *c2 = (fidx_cand_t *)e2;
+
+  if (c1->db != c2->db) return c1->db < c2->db ? -1 : 1;
+  if (c1->uniqueID != c2->uniqueID) return c1->uniqueID < c2->uniqueID ? -1 : 1;
+  return 0;
+}
+
+// Returns the documents having a word starting with each term, sorted by database and uniqueID.
+static fidx_cand_t *FindIndexCandidates(fidx_terms_t *q, UInt32 *ncand) {
+  fidx_cand_t *cand;
+  fidx_word_t *w;
+  fidx_doc_t *d;
+  UInt32 *docs, ndocs, size, lo, hi, mid, i, j, k, len;
+
+  docs = NULL;
+  ndocs = size = 0;
+  fidx.stamp++;
+  FindIndexSort();
+
+  for (k = 0; k < q->n; k++) {
+    len = sys_strlen(q->w[k]);
+
+    for (lo = 0, hi = fidx.nsorted; lo < hi;) {
+      mid = (lo + hi) / 2;
+      if (sys_strcmp(fidx.words[fidx.sorted[mid]].s, q->w[k]) < 0) lo = mid + 1;
+      else hi = mid;
+    }
+
+    for (i = lo; i < fidx.nsorted; i++) {
+      w = &fidx.words[fidx.sorted[i]];
+      if (sys_strncmp(w->s, q->w[k], len)) break;
+
+      for (j = 0; j < w->npost; j++) {
+        d = &fidx.docs[w->post[j]];
+        if (k == 0) {
+          if (d->stamp != fidx.stamp) {
+            d->stamp = fidx.stamp;
+            d->hits = 1;
+            if (ndocs == size) {
+              size = size ? size * 2 : 256;
+              if ((docs = xrealloc(docs, size * sizeof(UInt32))) == NULL) {
+                *ncand = 0;
+                return NULL;
+              }
+            }
+            docs[ndocs++] = w->post[j];
+          }
+        } else if (d->stamp == fidx.stamp && d->hits == k) {
+          d->hits = k + 1;
+        }
+      }
+    }
+  }
+
+  cand = ndocs ? xmalloc(ndocs * sizeof(fidx_cand_t)) : NULL;
+  for (i = 0, j = 0; i < ndocs && cand; i++) {
+    d = &fidx.docs[docs[i]];
+    if (d->hits == q->n && fidx.db[d->db].indexed) {
+      cand[j].db = d->db;
+      sys_strncpy(cand[j].name, fidx.db[d->db].name, dmDBNameLength-1);
+      cand[j].creator = fidx.db[d->db].ex->creator;
+      cand[j].uniqueID = d->uniqueID;
+      j++;
+    }
+  }
+  if (docs) xfree(docs);
+  if (cand) sys_qsort(cand, j, sizeof(fidx_cand_t), FindIndexCompareCandidates);
+  *ncand = cand ? j : 0;
+
+  return cand;
+}
+
+static void FindIndexVerify(UInt16 fieldNum, Char *s, UInt32 len, void *data) {
+  fidx_verify_t *v = (fidx_verify_t *)data;
+  UInt32 i;
+  UInt16 pos;
+  Char *buf;
+
+  if (!v->found && (buf = xmalloc(len + 1)) != NULL) {
+    xmemcpy(buf, s, len);
+    buf[len] = 0;
+    if (FindStrInStr(buf, v->str, &pos)) {
+      v->found = true;
+      v->fieldNum = fieldNum;
+      v->pos = pos;
+      for (i = 0; i < len && i < sizeof(v->text) - 1 && buf[i] != '\n'; i++) {
+        v->text[i] = buf[i];
+      }
+      v->text[i] = 0;
+    }
+    xfree(buf);
+  }
+}
+
+UInt16 FindIndexSearch(const Char *str, Boolean showSecret, FindIndexMatchType *matches, UInt16 max, UInt32 *cursor) {
+  fidx_terms_t q;
+  fidx_cand_t *cand;
+  fidx_extractor_t *ex;
+  fidx_verify_t v;
+  DmOpenRef dbRef;
+  LocalID dbID;
+  MemHandle h;
+  UInt8 *p;
+  UInt32 ncand, i;
+  UInt16 index, attr, num;
+  Int32 db;
+
+  if (fidx.mutex == NULL || str == NULL || matches == NULL || cursor == NULL || max == 0) return 0;
+
+  FindIndexScan();
+
+  sys_memset(&q, 0, sizeof(q));
+  FindIndexTokenize(0, (Char *)str, sys_strlen(str), &q);
+  FindIndexUnique(&q);
+  if (q.n == 0) {
+    if (q.w) xfree(q.w);
+    return 0;
+  }
+
+  cand = NULL;
+  ncand = 0;
+  if (mutex_lock(fidx.mutex) == 0) {
+    cand = FindIndexCandidates(&q, &ncand);
+    mutex_unlock(fidx.mutex);
+  }
+  xfree(q.w);
+
+  dbRef = NULL;
+  db = -1;
+  ex = NULL;
+  num = 0;
+
+  for (i = *cursor; i < ncand && num < max; i++) {
+    if (cand[i].db != db) {
+      if (dbRef) DmCloseDatabase(dbRef);
+      // resolved here, the LocalID is only valid in this task
+      dbID = DmFindDatabase(0, cand[i].name);
+      dbRef = dbID ? DmOpenDatabase(0, dbID, dmModeReadOnly | (showSecret ? dmModeShowSecret : 0)) : NULL;
+      ex = dbRef ? FindIndexExtractor(cand[i].creator, 'DATA') : NULL;
+      db = cand[i].db;
+    }
+    if (dbRef == NULL || ex == NULL) continue;
+
+    // the record may have changed since the candidates were taken
+    if (DmFindRecordByID(dbRef, cand[i].uniqueID, &index) != errNone) continue;
+    if (DmRecordInfo(dbRef, index, &attr, NULL, NULL) != errNone) continue;
+    if (attr & dmRecAttrDelete) continue;
+    if ((attr & dmRecAttrSecret) && !showSecret) continue;
+    if ((h = DmQueryRecord(dbRef, index)) == NULL) continue;
+    if ((p = MemHandleLock(h)) == NULL) continue;
+
+    v.str = str;
+    v.found = false;
+    ex->extract(p, MemHandleSize(h), FindIndexVerify, &v);
+    MemHandleUnlock(h);
+
+    if (v.found) {
+      matches[num].creator = cand[i].creator;
+      matches[num].dbID = dbID;
+      matches[num].uniqueID = cand[i].uniqueID;
+      matches[num].recordNum = index;
+      matches[num].fieldNum = v.fieldNum;
+      matches[num].matchPos = v.pos;
+      xmemcpy(matches[num].text, v.text, sizeof(v.text));
+      num++;
+    }
+  }
+  if (dbRef) DmCloseDatabase(dbRef);
+  if (cand) xfree(cand);
+  *cursor = i;
+
+  return num;
+}
+
+// Saved index: header (magic, version, number of databases, words and
+// documents), then for each database its name, creator, type, creation and
+// modification dates and number of records, then each word as a length and
+// its characters, then each document as database, uniqueID, number of words
+// and word numbers. All numbers are 32 bits in host order.
+
+typedef struct {
+  UInt8 *buf;
+  UInt32 len, pos;
+  Boolean err;
+} fidx_io_t;
+
+static UInt32 FindIndexGet(fidx_io_t *io) {
+  UInt32 n = 0;
+
+  if (io->pos + sizeof(UInt32) <= io->len) {
+    xmemcpy(&n, &io->buf[io->pos], sizeof(UInt32));
+    io->pos += sizeof(UInt32);
+  } else {
+    io->err = true;
+  }
+
+  return n;
+}
+
+static void FindIndexSet(fidx_io_t *io, UInt32 n) {
+  xmemcpy(&io->buf[io->pos], &n, sizeof(UInt32));
+  io->pos += sizeof(UInt32);
+}
+
+static void FindIndexLoad(void) {
+  fidx_io_t io;
+  Int32 dbmap[MAX_DBS];
+  UInt32 *wordmap, *ids;
+  UInt32 ndbs, nwords, ndocs, i, j, n, len, uniqueID, creator, type, crDate, modDate, numRecs;
+  UInt32 curCrDate, curModDate, curNumRecs, curType, curCreator;
+  Int32 db;
+  LocalID dbID;
+  char name[dmDBNameLength];
+  int64_t size;
+  int fd;
+
+  if ((fd = sys_open(fidx.path, SYS_READ)) == -1) return;
+  sys_memset(&io, 0, sizeof(io));
+
+  if ((size = sys_seek(fd, 0, SYS_SEEK_END)) > 0 && sys_seek(fd, 0, SYS_SEEK_SET) != -1) {
+    if ((io.buf = xmalloc(size)) != NULL) {
+      if (sys_read(fd, io.buf, size) == size) {
+        io.len = size;
+      }
+    }
+  }
+  sys_close(fd);
+
+  // from now on the index is only valid until it is saved again
+  sys_unlink(fidx.path);
+
+  if (FindIndexGet(&io) != INDEX_MAGIC || FindIndexGet(&io) != INDEX_VERSION) {
+    if (io.buf) xfree(io.buf);
+    return;
+  }
+
+  ndbs = FindIndexGet(&io);
+  nwords = FindIndexGet(&io);
+  ndocs = FindIndexGet(&io);
+  if (io.err || ndbs > MAX_DBS || nwords > io.len || ndocs > io.len) {
+    xfree(io.buf);
+    return;
+  }
+
+  for (i = 0; i < ndbs && !io.err; i++) {
+    dbmap[i] = -1;
+    if (io.pos + dmDBNameLength > io.len) {
+      io.err = true;
+      break;
+    }
+    xmemcpy(name, &io.buf[io.pos], dmDBNameLength);
+    name[dmDBNameLength-1] = 0;
+    io.pos += dmDBNameLength;
+    creator = FindIndexGet(&io);
+    type = FindIndexGet(&io);
+    crDate = FindIndexGet(&io);
+    modDate = FindIndexGet(&io);
+    numRecs = FindIndexGet(&io);
+
+    // the database must not have changed while the index was not running
+    if ((dbID = DmFindDatabase(0, name)) == 0) continue;
+    if (DmDatabaseInfo(0, dbID, NULL, NULL, NULL, &curCrDate, &curModDate, NULL, NULL, NULL, NULL, &curType, &curCreator) != errNone) continue;
+    if (DmDatabaseSize(0, dbID, &curNumRecs, NULL, NULL) != errNone) continue;
+    if (curCreator != creator || curType != type || curCrDate != crDate || curModDate != modDate || curNumRecs != numRecs) {
+      debug(DEBUG_INFO, "FIND", "database \"%s\" changed, it will be indexed again", name);
+      continue;
+    }
+    if (FindIndexExtractor(creator, type) == NULL) continue;
+    dbmap[i] = FindIndexNewDb(name, type, FindIndexExtractor(creator, type), true);
+  }
+
+  wordmap = nwords ? xcalloc(nwords, sizeof(UInt32)) : NULL;
+  for (i = 0; i < nwords && wordmap && !io.err; i++) {
+    len = FindIndexGet(&io);
+    if (len > MAX_TERM || io.pos + len > io.len) {
+      io.err = true;
+      break;
+    }
+    xmemcpy(name, &io.buf[io.pos], len);
+    name[len] = 0;
+    io.pos += len;
+    wordmap[i] = FindIndexWord(name, true);
+  }
+
+  ids = NULL;
+  for (i = 0; i < ndocs && wordmap && !io.err; i++) {
+    db = FindIndexGet(&io);
+    uniqueID = FindIndexGet(&io);
+    n = FindIndexGet(&io);
+    if (io.err || db < 0 || db >= (Int32)ndbs || n > (io.len - io.pos) / sizeof(UInt32)) {
+      io.err = true;
+      break;
+    }
+    if ((ids = xrealloc(ids, (n + 1) * sizeof(UInt32))) == NULL) break;
+    for (j = 0; j < n; j++) {
+      ids[j] = FindIndexGet(&io);
+      if (ids[j] >= nwords || wordmap[ids[j]] == (UInt32)-1) {
+        io.err = true;
+        break;
+      }
+      ids[j] = wordmap[ids[j]];
+    }
+    if (!io.err && dbmap[db] != -1) {
+      FindIndexPutIds(dbmap[db], uniqueID, ids, n);
+    }
+  }
+
+  if (io.err) {
+    debug(DEBUG_ERROR, "FIND", "invalid index file, it will be built again");
+    for (i = 0; i < MAX_DBS; i++) {
+      if (fidx.db[i].ex) FindIndexDropDb(i);
+    }
+  } else {
+    debug(DEBUG_INFO, "FIND", "index loaded with %u words and %u documents", fidx.nwords, ndocs);
+  }
+
+  if (ids) xfree(ids);
+  if (wordmap) xfree(wordmap);
+  xfree(io.buf);
+}
+
+static void FindIndexSave(void) {
+  fidx_io_t io;
+  UInt32 crDate[MAX_DBS], modDate[MAX_DBS], numRecs[MAX_DBS], type[MAX_DBS], creator[MAX_DBS];
+  char name[MAX_DBS][dmDBNameLength];
+  Int32 dbmap[MAX_DBS];
+  UInt32 *wordmap, ndbs, nwords, ndocs, i, j, len;
+  fidx_doc_t *d;
+  LocalID dbID;
+  int fd;
+
+  for (i = 0, ndbs = 0; i < MAX_DBS; i++) {
+    dbmap[i] = -1;
+    if (fidx.db[i].ex == NULL || !fidx.db[i].indexed) continue;
+    if ((dbID = DmFindDatabase(0, fidx.db[i].name)) == 0) continue;
+    sys_memset(name[ndbs], 0, dmDBNameLength);
+    if (DmDatabaseInfo(0, dbID, name[ndbs], NULL, NULL, &crDate[ndbs], &modDate[ndbs], NULL, NULL, NULL, NULL, &type[ndbs], &creator[ndbs]) != errNone) continue;
+    if (DmDatabaseSize(0, dbID, &numRecs[ndbs], NULL, NULL) != errNone) continue;
+    dbmap[i] = ndbs++;
+  }
+
+  if ((wordmap = xcalloc(fidx.nwords + 1, sizeof(UInt32))) == NULL) return;
+
+  len = 5 * sizeof(UInt32) + ndbs * (dmDBNameLength + 5 * sizeof(UInt32));
+  for (i = 0, nwords = 0; i < fidx.nwords; i++) {
+    if (fidx.words[i].npost) {
+      wordmap[i] = nwords++;
+      len += sizeof(UInt32) + sys_strlen(fidx.words[i].s);
+    }
+  }
+  for (i = 0, ndocs = 0; i < fidx.ndocs; i++) {
+    d = &fidx.docs[i];
+    if (d->db != -1 && dbmap[d->db] != -1) {
+      ndocs++;
+      len += (3 + d->nwords) * sizeof(UInt32);
+    }
+  }
+
+  sys_memset(&io, 0, sizeof(io));
+  if ((io.buf = xmalloc(len)) != NULL) {
+    FindIndexSet(&io, INDEX_MAGIC);
+    FindIndexSet(&io, INDEX_VERSION);
+    FindIndexSet(&io, ndbs);
+    FindIndexSet(&io, nwords);
+    FindIndexSet(&io, ndocs);
+
+    for (i = 0; i < ndbs; i++) {
+      xmemcpy(&io.buf[io.pos], name[i], dmDBNameLength);
+      io.pos += dmDBNameLength;
+      FindIndexSet(&io, creator[i]);
+      FindIndexSet(&io, type[i]);
+      FindIndexSet(&io, crDate[i]);
+      FindIndexSet(&io, modDate[i]);
+      FindIndexSet(&io, numRecs[i]);
+    }
+
+    for (i = 0; i < fidx.nwords; i++) {
+      if (fidx.words[i].npost) {
+        j = sys_strlen(fidx.words[i].s);
+        FindIndexSet(&io, j);
+        xmemcpy(&io.buf[io.pos], fidx.words[i].s, j);
+        io.pos += j;
+      }
+    }
+
+    for (i = 0; i < fidx.ndocs; i++) {
+      d = &fidx.docs[i];
+      if (d->db != -1 && dbmap[d->db] != -1) {
+        FindIndexSet(&io, dbmap[d->db]);
+        FindIndexSet(&io, d->uniqueID);
+        FindIndexSet(&io, d->nwords);
+        for (j = 0; j < d->nwords; j++) {
+          FindIndexSet(&io, wordmap[d->words[j]]);
+        }
+      }
+    }
+
+    if ((fd = sys_create(fidx.path, SYS_WRITE | SYS_TRUNC, 0644)) != -1) {
+      if (sys_write(fd, io.buf, io.pos) != io.pos) {
+        debug(DEBUG_ERROR, "FIND", "error writing index");
+      }
+      sys_close(fd);
+    }
+    xfree(io.buf);
+  }
+  xfree(wordmap);
+}
+
+int FindIndexInitGlobal(char *path) {
+  sys_memset(&fidx, 0, sizeof(fidx));
+
+  if ((fidx.mutex = mutex_create("findindex")) == NULL) {
+    return -1;
+  }
+  sys_snprintf(fidx.path, sizeof(fidx.path) - 1, "%s%s", path, INDEX_FILE);
+  FindIndexLoad();
+
+  return 0;
+}
+
+int FindIndexFinishGlobal(void) {
+  UInt32 i;
+
+  if (fidx.mutex == NULL) return -1;
+
+  FindIndexSave();
+
+  for (i = 0; i < MAX_DBS; i++) {
+    if (fidx.db[i].ex) FindIndexDropDb(i);
+  }
+  for (i = 0; i < fidx.nwords; i++) {
+    xfree(fidx.words[i].s);
+    if (fidx.words[i].post) xfree(fidx.words[i].post);
+  }
+  if (fidx.words) xfree(fidx.words);
+  if (fidx.hash) xfree(fidx.hash);
+  if (fidx.sorted) xfree(fidx.sorted);
+  if (fidx.docs) xfree(fidx.docs);
+  mutex_destroy(fidx.mutex);
+  sys_memset(&fidx, 0, sizeof(fidx));
+
+  return 0;
+}
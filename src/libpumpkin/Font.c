@@ -12,10 +12,26 @@
 #include "debug.h"
 #include "xalloc.h"
 
+#define WRAP_SETS 64
+#define WRAP_WAYS 4
+
+// A remembered FntWordWrap result. It stays valid while the characters
+// examined by the layout (scan bytes, plus the terminator when the text
+// ended before a break) hash to the same value.
+typedef struct {
+  Char const *chars;
+  FontPtr font;
+  UInt32 hash, stamp;
+  UInt16 maxWidth, coord, scan, length;
+  Boolean end;
+} fnt_wrap_t;
+
 typedef struct {
   FontType *fonts[256];
   FontTypeV2 *fontsv2[256];
   FontID currentFont;
+  fnt_wrap_t wrap[WRAP_SETS * WRAP_WAYS];
+  UInt32 stamp;
 } fnt_module_t;
 
 extern thread_key_t *fnt_key;
@@ -132,41 +148,43 @@ Int16 FntAverageCharWidth(void) {
   return r;
 }
 
+// Every decoded font carries a flat advance table indexed by character code,
+// with the missing symbol width already filled in for characters outside the font.
+
+static uint8_t *FntGetAdvance(fnt_module_t *module) {
+  if (module->fonts[module->currentFont]) {
+    return module->fonts[module->currentFont]->advance;
+  }
+  if (module->fontsv2[module->currentFont]) {
+    return module->fontsv2[module->currentFont]->advance;
+  }
+  return NULL;
+}
+
+static void FntBuildAdvance(uint8_t *advance, Int16 firstChar, Int16 lastChar, uint8_t *width) {
+  int c;
+
+  for (c = 0; c < 256; c++) {
+    advance[c] = (c >= firstChar && c <= lastChar) ? width[c - firstChar] : MISSING_SYMBOL_WIDTH;
+  }
+}
+
 Int16 FntCharWidth(Char ch) {
   fnt_module_t *module = (fnt_module_t *)thread_get(fnt_key);
-  UInt8 uc = (UInt8)ch;
-  Int16 r = MISSING_SYMBOL_WIDTH;
-  if (module->fonts[module->currentFont] && uc >= module->fonts[module->currentFont]->firstChar && uc <= module->fonts[module->currentFont]->lastChar) {
-    r = module->fonts[module->currentFont]->width[uc - module->fonts[module->currentFont]->firstChar];
-  } else if (module->fontsv2[module->currentFont] && uc >= module->fontsv2[module->currentFont]->firstChar && uc <= module->fontsv2[module->currentFont]->lastChar) {
-    r = module->fontsv2[module->currentFont]->width[uc - module->fontsv2[module->currentFont]->firstChar];
-  }
+  uint8_t *advance = FntGetAdvance(module);
+  Int16 r = advance ? advance[(UInt8)ch] : MISSING_SYMBOL_WIDTH;
   adjust(&r);
   return r;
 }
 
 Int16 FntCharsWidth(Char const *chars, Int16 len) {
   fnt_module_t *module = (fnt_module_t *)thread_get(fnt_key);
-  UInt8 uc;
+  uint8_t *advance = FntGetAdvance(module);
   Int16 i, r = 0;
 
-  if (module->fonts[module->currentFont]) {
+  if (advance) {
     for (i = 0; i < len; i++) {
-      uc = (UInt8)chars[i];
-      if (uc >= module->fonts[module->currentFont]->firstChar && uc <= module->fonts[module->currentFont]->lastChar) {
-        r += module->fonts[module->currentFont]->width[uc - module->fonts[module->currentFont]->firstChar];
-      } else {
-        r += MISSING_SYMBOL_WIDTH;
-      }
-    }
-  } else if (module->fontsv2[module->currentFont]) {
-    for (i = 0; i < len; i++) {
-      uc = (UInt8)chars[i];
-      if (uc >= module->fontsv2[module->currentFont]->firstChar && uc <= module->fontsv2[module->currentFont]->lastChar) {
-        r += module->fontsv2[module->currentFont]->width[uc - module->fontsv2[module->currentFont]->firstChar];
-      } else {
-        r += MISSING_SYMBOL_WIDTH;
-      }
+      r += advance[(UInt8)chars[i]];
     }
   }
   adjust(&r);
@@ -179,13 +197,9 @@ Int16 FntCharsWidth(Char const *chars, Int16 len) {
 
 Int16 FntWCharWidth(WChar iChar) {
   fnt_module_t *module = (fnt_module_t *)thread_get(fnt_key);
+  uint8_t *advance = FntGetAdvance(module);
   UInt8 uc = (UInt16)iChar; // XXX
-  Int16 r = MISSING_SYMBOL_WIDTH;
-  if (module->fonts[module->currentFont] && uc >= module->fonts[module->currentFont]->firstChar && uc <= module->fonts[module->currentFont]->lastChar) {
-    r = module->fonts[module->currentFont]->width[uc - module->fonts[module->currentFont]->firstChar];
-  } else if (module->fontsv2[module->currentFont] && uc >= module->fontsv2[module->currentFont]->firstChar && uc <= module->fontsv2[module->currentFont]->lastChar) {
-    r = module->fontsv2[module->currentFont]->width[uc - module->fontsv2[module->currentFont]->firstChar];
-  }
+  Int16 r = advance ? advance[uc] : MISSING_SYMBOL_WIDTH;
   adjust(&r);
   return r;
 }
@@ -216,20 +230,60 @@ Int16 FntLineWidth(Char const *pChars, UInt16 length) {
 // Given a string, determines how many bytes of text can be displayed
 // within the specified width with a line break at a tab or space character.
 
+static UInt32 FntWrapHash(Char const *chars, UInt16 len) {
+  UInt32 h = 2166136261U;
+  UInt16 i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ (UInt8)chars[i]) * 16777619U;
+  }
+
+  return h;
+}
+
+// Apps lay out long text by calling FntWordWrap once per line, and again on
+// every redraw. The results are kept in a small set associative LRU keyed by
+// the text pointer, font, width and coordinate system, so laying out the
+// same text again only hashes each line instead of measuring the rest of it.
+
 UInt16 FntWordWrap(Char const *chars, UInt16 maxWidth) {
-  LineInfoType lineInfo[8];
-  RectangleType rect;
-  UInt16 totalLines, r = 0;
-
-  if (chars) {
-    RctSetRectangle(&rect, 0, 0, maxWidth, FntCharHeight());
-    WinDrawCharBox((char *)chars, StrLen(chars), FntGetFont(), &rect, false, NULL, &totalLines, NULL, lineInfo, 8);
-    if (totalLines > 0) {
-      r = lineInfo[0].length;
+  fnt_module_t *module = (fnt_module_t *)thread_get(fnt_key);
+  fnt_wrap_t *set, *e;
+  FontPtr font;
+  UInt16 coord, len, scan, length, i;
+
+  if (chars == NULL) return 0;
+
+  font = FntGetFontPtr();
+  coord = WinGetRealCoordinateSystem();
+  set = &module->wrap[(((uintptr_t)chars ^ maxWidth) % WRAP_SETS) * WRAP_WAYS];
+
+  for (i = 0; i < WRAP_WAYS; i++) {
+    e = &set[i];
+    if (e->chars == chars && e->font == font && e->maxWidth == maxWidth && e->coord == coord &&
+        (!e->end || chars[e->scan] == 0) && FntWrapHash(chars, e->scan) == e->hash) {
+      e->stamp = ++module->stamp;
+      return e->length;
     }
   }
 
-  return r;
+  len = StrLen(chars);
+  WinWrapLineEx((Char *)chars, len, 0, maxWidth, &length, &scan);
+
+  for (i = 1, e = &set[0]; i < WRAP_WAYS; i++) {
+    if (set[i].stamp < e->stamp) e = &set[i];
+  }
+  e->chars = chars;
+  e->font = font;
+  e->maxWidth = maxWidth;
+  e->coord = coord;
+  e->scan = scan;
+  e->end = scan == len;
+  e->length = length;
+  e->hash = FntWrapHash(chars, scan);
+  e->stamp = ++module->stamp;
+
+  return length;
 }
 
 FontPtr FntCopyFont(FontPtr f) {
@@ -244,6 +298,7 @@ FontPtr FntCopyFont(FontPtr f) {
   if (f->v == 1) {
     f1 = xcalloc(1, sizeof(FontType));
     xmemcpy(f1, f, sizeof(FontType));
+    f1->glyphs = NULL;
     f1->column = xcalloc(f->lastChar - f->firstChar + 1, sizeof(uint16_t));
     xmemcpy(f1->column, f->column, (f->lastChar - f->firstChar + 1) * sizeof(uint16_t));
     f1->width = xcalloc(f->lastChar - f->firstChar + 1, sizeof(uint8_t));
@@ -258,6 +313,7 @@ FontPtr FntCopyFont(FontPtr f) {
     ff = (FontTypeV2 *)f;
     f2 = xcalloc(1, sizeof(FontTypeV2));
     xmemcpy(f2, ff, sizeof(FontTypeV2));
+    f2->glyphs = NULL;
     f2->densities = xcalloc(ff->densityCount, sizeof(FontDensityType));
     xmemcpy(f2->densities, ff->densities, ff->densityCount * sizeof(FontDensityType));
     f2->pitch = xcalloc(ff->densityCount, sizeof(uint16_t));
@@ -304,6 +360,7 @@ void FntFreeFont(FontPtr f) {
 
   if (f) {
     if (f->v == 1) {
+      WinFreeGlyphs(f->glyphs);
       BmpDelete(f->bmp);
       xfree(f->column);
       xfree(f->width);
@@ -311,6 +368,7 @@ void FntFreeFont(FontPtr f) {
       xfree(f);
     } else {
       ff = (FontTypeV2 *)f;
+      WinFreeGlyphs(ff->glyphs);
       for (j = 0; j < ff->densityCount; j++) {
         BmpDelete(ff->bmp[j]);
         xfree(ff->data[j]);
@@ -472,6 +530,7 @@ FontType *pumpkin_create_font(void *h, uint8_t *p, uint32_t size, uint32_t *dsiz
     font->descent = descent;
     font->leading = leading;
     font->rowWords = rowWords;
+    font->glyphs = NULL;
     font->column = xcalloc(lastChar - firstChar + 1, sizeof(uint16_t));
     font->width = xcalloc(lastChar - firstChar + 1, sizeof(uint8_t));
     debug(DEBUG_TRACE, "Font", "font chars %d to %d, maxWidth %d, rectWidth %d, rectheight %d, rowWords %d",
@@ -505,6 +564,7 @@ FontType *pumpkin_create_font(void *h, uint8_t *p, uint32_t size, uint32_t *dsiz
       }
     }
     debug(DEBUG_TRACE, "Font", "totalWidth %d", font->totalWidth);
+    FntBuildAdvance(font->advance, firstChar, lastChar, font->width);
 
     font->bmp = BmpCreate3(font->pitch*8, font->fRectHeight, kDensityLow, 1, true, 0, NULL, &err);
     bits = BmpGetBits(font->bmp);
@@ -520,6 +580,7 @@ void pumpkin_destroy_font(void *p) {
 
   font = (FontType *)p;
   if (font) {
+    WinFreeGlyphs(font->glyphs);
     if (font->bmp) BmpDelete(font->bmp);
     MemChunkFree(font);
   }
@@ -587,6 +648,7 @@ FontTypeV2 *pumpkin_create_fontv2(void *h, uint8_t *p, uint32_t size, uint32_t *
     font->rowWords = rowWords;
     font->version = version;
     font->densityCount = densityCount;
+    font->glyphs = NULL;
     font->densities = xcalloc(densityCount, sizeof(FontDensityType));
     font->pitch = xcalloc(densityCount, sizeof(uint16_t));
     font->column = xcalloc(lastChar - firstChar + 1, sizeof(uint16_t));
@@ -625,6 +687,7 @@ FontTypeV2 *pumpkin_create_fontv2(void *h, uint8_t *p, uint32_t size, uint32_t *
       }
     }
     debug(DEBUG_TRACE, "Font", "totalWidth %d", font->totalWidth);
+    FntBuildAdvance(font->advance, firstChar, lastChar, font->width);
 
     for (j = 0; j < densityCount; j++) {
       glyph_offset = font->densities[j].glyphBitsOffset;
@@ -664,6 +727,7 @@ void pumpkin_destroy_fontv2(void *p) {
 
   font = (FontTypeV2 *)p;
   if (font) {
+    WinFreeGlyphs(font->glyphs);
     if (font->densities) xfree(font->densities);
     if (font->pitch) xfree(font->pitch);
     if (font->column) xfree(font->column);
@@ -1,24 +1,518 @@
 #include <PalmOS.h>
 
+#include "sys.h"
+#include "pumpkin.h"
+#include "bytes.h"
+#include "Lz77Mgr.h"
 #include "debug.h"
 
+// See Lz77Mgr.h for the stream format. The compressor keeps the last
+// WINDOW bytes of input plus the pending lookahead in buf, and finds
+// matches with hash chains over 3 byte prefixes. Input is only encoded
+// while at least MAX_MATCH bytes of lookahead are available (or on close),
+// so the output does not depend on how the source is split in chunks.
+
+#define HEADER_SIZE 8
+#define WINDOW      4096
+#define MIN_MATCH   3
+#define MAX_MATCH   18
+#define BUF_SIZE    (3*WINDOW)
+#define HASH_BITS   12
+#define HASH_SIZE   (1 << HASH_BITS)
+#define MAX_CHAIN   64
+#define NIL         0xFFFF
+
+typedef struct {
+  Boolean compress;
+  Err err;
+  MemHandle destH;
+  UInt8 *dest;
+  UInt32 destSize, destOffset;
+  UInt32 sourceSize, consumed, produced;
+
+  // compression
+  UInt32 cur, end, hashed;
+  UInt8 gflags, gcount, glen;
+  UInt8 group[2*8];
+  UInt16 head[HASH_SIZE];
+  UInt16 prev[BUF_SIZE];
+  UInt8 buf[BUF_SIZE];
+
+  // expansion
+  UInt8 header[HEADER_SIZE];
+  UInt32 hlen, history, wpos;
+  UInt8 flags, nbits, pending, hasPending;
+  UInt8 window[WINDOW];
+} lz77_t;
+
+static Err lz77_grow(lz77_t *lz, UInt32 size) {
+  UInt32 newSize;
+
+  if (size <= lz->destSize) return errNone;
+
+  newSize = lz->destSize * 2;
+  if (newSize < size) newSize = size;
+  if (newSize < 256) newSize = 256;
+
+  if (lz->dest) MemHandleUnlock(lz->destH);
+  lz->dest = NULL;
+  if (MemHandleResize(lz->destH, newSize) != errNone) {
+    debug(DEBUG_ERROR, "Lz77", "could not grow destination to %u bytes", newSize);
+    lz->dest = MemHandleLock(lz->destH);
+    return lz77ErrNoMem;
+  }
+  lz->destSize = newSize;
+  lz->dest = MemHandleLock(lz->destH);
+
+  return lz->dest ? errNone : lz77ErrNoMem;
+}
+
+static Err lz77_write(lz77_t *lz, UInt8 *p, UInt32 len) {
+  Err err;
+
+  if ((err = lz77_grow(lz, lz->destOffset + len)) != errNone) {
+    return err;
+  }
+  MemMove(lz->dest + lz->destOffset, p, len);
+  lz->destOffset += len;
+
+  return errNone;
+}
+
+static UInt32 lz77_hash(UInt8 *p) {
+  return ((((UInt32)p[0] << 16) | ((UInt32)p[1] << 8) | p[2]) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static Err lz77_flush_group(lz77_t *lz) {
+  Err err = errNone;
+
+  if (lz->gcount) {
+    if ((err = lz77_write(lz, &lz->gflags, 1)) == errNone) {
+      err = lz77_write(lz, lz->group, lz->glen);
+    }
+    lz->gflags = lz->gcount = lz->glen = 0;
+  }
+
+  return err;
+}
+
+static Err lz77_literal(lz77_t *lz, UInt8 b) {
+  lz->group[lz->glen++] = b;
+  return ++lz->gcount == 8 ? lz77_flush_group(lz) : errNone;
+}
+
+static Err lz77_match(lz77_t *lz, UInt32 dist, UInt32 len) {
+  lz->gflags |= 1 << lz->gcount;
+  lz->group[lz->glen++] = (dist - 1) >> 4;
+  lz->group[lz->glen++] = ((dist - 1) << 4) | (len - MIN_MATCH);
+  return ++lz->gcount == 8 ? lz77_flush_group(lz) : errNone;
+}
+
+// encodes buf from cur, keeping MAX_MATCH bytes of lookahead unless final
+static Err lz77_deflate(lz77_t *lz, Boolean final) {
+  UInt32 limit, stop, best, dist, len, chain, p, h;
+  UInt8 *s;
+  Err err = errNone;
+
+  stop = final ? lz->end : (lz->end > MAX_MATCH ? lz->end - MAX_MATCH : 0);
+
+  while (lz->cur < stop && err == errNone) {
+    for (; lz->hashed < lz->cur && lz->hashed + 2 < lz->end; lz->hashed++) {
+      h = lz77_hash(&lz->buf[lz->hashed]);
+      lz->prev[lz->hashed] = lz->head[h];
+      lz->head[h] = lz->hashed;
+    }
+
+    best = dist = 0;
+    limit = lz->end - lz->cur;
+    if (limit > MAX_MATCH) limit = MAX_MATCH;
+
+    if (limit >= MIN_MATCH) {
+      s = &lz->buf[lz->cur];
+      p = lz->head[lz77_hash(s)];
+      for (chain = MAX_CHAIN; p != NIL && chain > 0 && lz->cur - p <= WINDOW; chain--) {
+        if (lz->buf[p + best] == s[best]) {
+          for (len = 0; len < limit && lz->buf[p + len] == s[len]; len++);
+          if (len > best) {
+            best = len;
+            dist = lz->cur - p;
+            if (best == limit) break;
+          }
+        }
+        p = lz->prev[p];
+      }
+    }
+
+    if (best >= MIN_MATCH) {
+      err = lz77_match(lz, dist, best);
+      lz->cur += best;
+    } else {
+      err = lz77_literal(lz, lz->buf[lz->cur]);
+      lz->cur++;
+    }
+  }
+
+  return err;
+}
+
+static UInt16 lz77_rebase(UInt16 p, UInt32 shift) {
+  return (p == NIL || p < shift) ? NIL : p - shift;
+}
+
+// drops everything older than WINDOW bytes before cur
+static void lz77_slide(lz77_t *lz) {
+  UInt32 shift, i;
+
+  if (lz->cur <= WINDOW) return;
+  shift = lz->cur - WINDOW;
+
+  MemMove(lz->buf, lz->buf + shift, lz->end - shift);
+  for (i = 0; i < lz->end - shift; i++) {
+    lz->prev[i] = lz77_rebase(lz->prev[i + shift], shift);
+  }
+  for (i = 0; i < HASH_SIZE; i++) {
+    lz->head[i] = lz77_rebase(lz->head[i], shift);
+  }
+
+  lz->cur -= shift;
+  lz->end -= shift;
+  lz->hashed = lz->hashed > shift ? lz->hashed - shift : 0;
+}
+
+static Err lz77_compress(lz77_t *lz, UInt8 *src, UInt32 size) {
+  UInt32 n;
+  Err err = errNone;
+
+  while (size > 0 && err == errNone) {
+    if (lz->end == BUF_SIZE) {
+      lz77_slide(lz);
+    }
+    n = BUF_SIZE - lz->end;
+    if (n > size) n = size;
+    MemMove(lz->buf + lz->end, src, n);
+    lz->end += n;
+    src += n;
+    size -= n;
+    err = lz77_deflate(lz, false);
+  }
+
+  return err;
+}
+
+static Err lz77_output(lz77_t *lz, UInt8 b) {
+  if (lz->destOffset == lz->destSize && lz77_grow(lz, lz->destOffset + 1) != errNone) {
+    return lz77ErrNoMem;
+  }
+  lz->dest[lz->destOffset++] = b;
+  lz->window[lz->wpos] = b;
+  lz->wpos = (lz->wpos + 1) & (WINDOW - 1);
+  if (lz->history < WINDOW) lz->history++;
+  lz->produced++;
+
+  return errNone;
+}
+
+static Err lz77_expand(lz77_t *lz, UInt8 *src, UInt32 size) {
+  UInt32 i, dist, len, total;
+  UInt8 b;
+  Err err = errNone;
+
+  for (i = 0; i < size && err == errNone; i++) {
+    b = src[i];
+
+    if (lz->hlen < HEADER_SIZE) {
+      lz->header[lz->hlen++] = b;
+      if (lz->hlen == HEADER_SIZE) {
+        if (lz->header[0] != 'L' || lz->header[1] != 'Z') {
+          err = lz77ErrBadData;
+        } else if (lz->header[2] > lz77VersionMajor) {
+          err = lz77ErrVersion;
+        } else {
+          get4b(&total, lz->header, 4);
+          lz->sourceSize = total;
+          // the whole output size is known now, so the destination grows only once
+          err = lz77_grow(lz, lz->destOffset + total);
+        }
+      }
+      continue;
+    }
+
+    if (lz->produced == lz->sourceSize) {
+      break;
+    }
+
+    if (lz->nbits == 0) {
+      lz->flags = b;
+      lz->nbits = 8;
+      continue;
+    }
+
+    if (!(lz->flags & 1)) {
+      err = lz77_output(lz, b);
+    } else if (!lz->hasPending) {
+      lz->pending = b;
+      lz->hasPending = 1;
+      continue;
+    } else {
+      lz->hasPending = 0;
+      dist = (((UInt32)lz->pending << 4) | (b >> 4)) + 1;
+      len = (b & 0x0F) + MIN_MATCH;
+      if (dist > lz->history || lz->produced + len > lz->sourceSize) {
+        err = lz77ErrBadData;
+        break;
+      }
+      for (; len > 0 && err == errNone; len--) {
+        err = lz77_output(lz, lz->window[(lz->wpos - dist) & (WINDOW - 1)]);
+      }
+    }
+
+    lz->flags >>= 1;
+    lz->nbits--;
+  }
+
+  return err;
+}
+
+static lz77_t *lz77_lock(MemHandle lz77Handle) {
+  lz77_t *lz;
+
+  if (lz77Handle == NULL || MemHandleSize(lz77Handle) != sizeof(lz77_t)) {
+    return NULL;
+  }
+
+  if ((lz = MemHandleLock(lz77Handle)) != NULL) {
+    lz->dest = lz->destH ? MemHandleLock(lz->destH) : NULL;
+  }
+
+  return lz;
+}
+
+static void lz77_unlock(MemHandle lz77Handle, lz77_t *lz) {
+  if (lz->dest) MemHandleUnlock(lz->destH);
+  lz->dest = NULL;
+  MemHandleUnlock(lz77Handle);
+}
+
+// A destination handle allocated by Lz77LibOpen is not returned to the caller if the open fails.
+static void lz77_discard(MemHandle *destHP, UInt32 *destSizeP, Boolean allocated) {
+  if (allocated) {
+    MemHandleFree(*destHP);
+    *destHP = NULL;
+    if (destSizeP) *destSizeP = 0;
+  }
+}
+
 Err Lz77LibOpen(UInt16 libRefnum, MemHandle *lz77HandleP, Boolean compressFlag, UInt32 sourceSize, MemHandle *destHP,
   UInt32 *destSizeP, UInt16 useVerNum, UInt8 *primerP, UInt32 primerL, UInt32 processedPrimerL) {
-  debug(DEBUG_ERROR, "PALMOS", "Lz77LibOpen not implemented");
-  return 0;
+
+  MemHandle h;
+  lz77_t *lz;
+  UInt32 size, i;
+  Boolean allocated;
+  Err err;
+
+  if (lz77HandleP == NULL || destHP == NULL) {
+    return lz77ErrParam;
+  }
+  *lz77HandleP = NULL;
+
+  if (useVerNum > lz77VersionMajor) {
+    debug(DEBUG_ERROR, "Lz77", "version %d not supported", useVerNum);
+    return lz77ErrVersion;
+  }
+
+  allocated = false;
+  if (*destHP == NULL) {
+    Lz77LibMaxBufferSize(libRefnum, compressFlag, sourceSize, NULL, &size);
+    if (!compressFlag && size > sourceSize * 2) size = sourceSize * 2;
+    if (size < 256) size = 256;
+    if ((*destHP = MemHandleNew(size)) == NULL) {
+      return lz77ErrNoMem;
+    }
+    allocated = true;
+  } else {
+    size = (destSizeP && *destSizeP) ? *destSizeP : MemHandleSize(*destHP);
+  }
+  if (destSizeP) *destSizeP = size;
+
+  if ((h = MemHandleNew(sizeof(lz77_t))) == NULL) {
+    lz77_discard(destHP, destSizeP, allocated);
+    return lz77ErrNoMem;
+  }
+  lz = MemHandleLock(h);
+  MemSet(lz, sizeof(lz77_t), 0);
+  lz->compress = compressFlag;
+  lz->destH = *destHP;
+  lz->destSize = size;
+  lz->sourceSize = compressFlag ? sourceSize : 0;
+  lz->dest = MemHandleLock(lz->destH);
+
+  // only the last WINDOW bytes of the primer can be referenced
+  if (primerP && primerL > WINDOW) {
+    primerP += primerL - WINDOW;
+    primerL = WINDOW;
+  }
+  if (primerP == NULL) primerL = 0;
+
+  if (compressFlag) {
+    for (i = 0; i < HASH_SIZE; i++) lz->head[i] = NIL;
+    if (primerL) MemMove(lz->buf, primerP, primerL);
+    lz->cur = lz->end = primerL;
+    lz->group[0] = 'L';
+    lz->group[1] = 'Z';
+    lz->group[2] = lz77VersionMajor;
+    lz->group[3] = 0;
+    put4b(sourceSize, lz->group, 4);
+    err = lz77_write(lz, lz->group, HEADER_SIZE);
+  } else {
+    if (primerL) MemMove(lz->window, primerP, primerL);
+    lz->wpos = primerL & (WINDOW - 1);
+    lz->history = primerL;
+    err = errNone;
+  }
+
+  lz77_unlock(h, lz);
+
+  if (err != errNone) {
+    MemHandleFree(h);
+    lz77_discard(destHP, destSizeP, allocated);
+    return err;
+  }
+
+  *lz77HandleP = h;
+  debug(DEBUG_TRACE, "Lz77", "open %s size %u primer %u", compressFlag ? "compress" : "expand", sourceSize, primerL);
+
+  return errNone;
+}
+
+Err Lz77LibChunk(UInt16 libRefnum, MemHandle lz77Handle, UInt8 *sourceP, UInt32 sourceSize) {
+  lz77_t *lz;
+  Err err;
+
+  if (sourceP == NULL && sourceSize) {
+    return lz77ErrParam;
+  }
+  if ((lz = lz77_lock(lz77Handle)) == NULL) {
+    return lz77ErrParam;
+  }
+
+  if ((err = lz->err) == errNone) {
+    if (lz->compress) {
+      if (lz->consumed + sourceSize > lz->sourceSize) {
+        err = lz77ErrOverflow;
+      } else {
+        err = lz77_compress(lz, sourceP, sourceSize);
+      }
+    } else {
+      err = lz77_expand(lz, sourceP, sourceSize);
+    }
+    lz->consumed += sourceSize;
+    lz->err = err;
+  }
+
+  lz77_unlock(lz77Handle, lz);
+
+  return err;
 }
 
 Err Lz77LibClose(UInt16 libRefnum, MemHandle lz77Handle, UInt32 *ResultingSizeP) {
-  debug(DEBUG_ERROR, "PALMOS", "Lz77LibClose not implemented");
-  return 0;
+  lz77_t *lz;
+  Err err;
+
+  if ((lz = lz77_lock(lz77Handle)) == NULL) {
+    return lz77ErrParam;
+  }
+
+  if ((err = lz->err) == errNone) {
+    if (lz->compress) {
+      if ((err = lz77_deflate(lz, true)) == errNone) {
+        err = lz77_flush_group(lz);
+      }
+      if (err == errNone && lz->consumed != lz->sourceSize) {
+        debug(DEBUG_ERROR, "Lz77", "compressed %u bytes but %u were declared", lz->consumed, lz->sourceSize);
+        err = lz77ErrParam;
+      }
+    } else if (lz->hlen < HEADER_SIZE || lz->produced != lz->sourceSize) {
+      err = lz77ErrBadData;
+    }
+  }
+
+  if (ResultingSizeP) *ResultingSizeP = lz->destOffset;
+  debug(DEBUG_TRACE, "Lz77", "close %u -> %u bytes: %d", lz->consumed, lz->destOffset, err);
+  lz77_unlock(lz77Handle, lz);
+  MemHandleFree(lz77Handle);
+
+  return err;
 }
 
 Err Lz77LibSleep(UInt16 libRefnum) {
-  debug(DEBUG_ERROR, "PALMOS", "Lz77LibSleep not implemented");
-  return 0;
+  return errNone;
 }
 
 Err Lz77LibWake(UInt16 libRefnum) {
-  debug(DEBUG_ERROR, "PALMOS", "Lz77LibWake not implemented");
-  return 0;
+  return errNone;
+}
+
+Err Lz77LibMaxBufferSize(UInt16 libRefnum, Boolean compressFlag, UInt32 sourceSize, UInt8 *sourceP, UInt32 *maxBufferSizeP) {
+  UInt32 size;
+
+  if (maxBufferSizeP == NULL) {
+    return lz77ErrParam;
+  }
+
+  if (compressFlag) {
+    // every item can be a literal, plus one flag byte for each 8 items
+    size = HEADER_SIZE + sourceSize + (sourceSize + 7) / 8;
+  } else if (sourceP && sourceSize >= HEADER_SIZE && sourceP[0] == 'L' && sourceP[1] == 'Z') {
+    get4b(&size, sourceP, 4);
+  } else {
+    // a flag byte and 8 matches (17 bytes) expand to at most 144 bytes
+    size = sourceSize * 9;
+  }
+
+  *maxBufferSizeP = size;
+
+  return errNone;
+}
+
+Err Lz77LibBufferGetInfo(UInt16 libRefnum, MemHandle lz77Handle, Boolean *compressFlagP, MemHandle *destHP, UInt32 *destSizeP, UInt32 *destOffsetP) {
+  lz77_t *lz;
+
+  if ((lz = lz77_lock(lz77Handle)) == NULL) {
+    return lz77ErrParam;
+  }
+
+  if (compressFlagP) *compressFlagP = lz->compress;
+  if (destHP) *destHP = lz->destH;
+  if (destSizeP) *destSizeP = lz->destSize;
+  if (destOffsetP) *destOffsetP = lz->destOffset;
+  lz77_unlock(lz77Handle, lz);
+
+  return errNone;
+}
+
+Err Lz77LibBufferSetInfo(UInt16 libRefnum, MemHandle lz77Handle, MemHandle destH, UInt32 destSize, UInt32 destOffset) {
+  lz77_t *lz;
+  Err err = errNone;
+
+  if (destH == NULL) {
+    return lz77ErrParam;
+  }
+  if ((lz = lz77_lock(lz77Handle)) == NULL) {
+    return lz77ErrParam;
+  }
+
+  if (destSize == 0) destSize = MemHandleSize(destH);
+  if (destOffset > destSize) {
+    err = lz77ErrParam;
+  } else {
+    if (lz->dest) MemHandleUnlock(lz->destH);
+    lz->destH = destH;
+    lz->destSize = destSize;
+    lz->destOffset = destOffset;
+    lz->dest = MemHandleLock(destH);
+  }
+  lz77_unlock(lz77Handle, lz);
+
+  return err;
 }
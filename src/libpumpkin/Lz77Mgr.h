@@ -0,0 +1,95 @@
+#ifndef LZ77MGR_H
+#define LZ77MGR_H
+
+// Lz77 compression library.
+//
+// The API follows the Palm OS Lz77 library, but the stream format, the trap
+// numbers and the error codes are private to this implementation. Streams
+// are not interchangeable with those produced or accepted by Palm's Lz77.lib,
+// so the library is registered under its own name and creator: applications
+// looking for Lz77.lib or sysFileCLz77Lib do not find it.
+//
+// A compressed stream starts with an 8 byte header: 'L', 'Z', the format
+// version, a reserved byte and the uncompressed size (big endian). It is
+// followed by groups of up to 8 items, each group preceded by a flag byte
+// whose bits (LSB first) tell whether the item is a literal byte (0) or a
+// match (1). A match is 2 bytes: a 12 bit distance minus 1 and a 4 bit
+// length minus 3, so matches reach 4096 bytes back and are 3 to 18 bytes
+// long. The optional primer is a dictionary that is considered to precede
+// the data, on both compression and expansion.
+//
+// Usage:
+//
+//   err = SysLibFind(lz77LibName, &refNum);
+//   if (err == sysErrLibNotFound) err = SysLibLoad(sysFileTLibrary, lz77LibCreator, &refNum);
+//   destH = NULL;
+//   err = Lz77LibOpen(refNum, &lz77H, lz77Compress, srcSize, &destH, &destSize, lz77VersionMajor, NULL, 0, 0);
+//   err = Lz77LibChunk(refNum, lz77H, srcP, chunkSize);   // as many times as needed
+//   err = Lz77LibClose(refNum, lz77H, &resultSize);        // destH now holds resultSize bytes
+
+#define lz77LibName         "PumpkinLz77.lib"
+#define lz77LibCreator      'PLz7'
+#define lz77VersionMajor    1
+
+#define lz77Compress        true
+#define lz77Expand          false
+
+#define lz77ErrNonPalmOS    (lz77ErrorClass | 1)
+#define lz77ErrParam        (lz77ErrorClass | 2)
+#define lz77ErrNoMem        (lz77ErrorClass | 3)
+#define lz77ErrBadData      (lz77ErrorClass | 4)
+#define lz77ErrVersion      (lz77ErrorClass | 5)
+#define lz77ErrOverflow     (lz77ErrorClass | 6)
+
+#define lz77LibTrapChunk          (sysLibTrapCustom)
+#define lz77LibTrapMaxBufferSize  (sysLibTrapCustom+1)
+#define lz77LibTrapBufferGetInfo  (sysLibTrapCustom+2)
+#define lz77LibTrapBufferSetInfo  (sysLibTrapCustom+3)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Starts a compression or expansion of sourceSize bytes. If *destHP is NULL
+// a destination handle is allocated, otherwise *destSizeP is the usable size
+// of *destHP (0 for all of it), which is grown as needed. On return
+// *destSizeP is the size of the destination handle.
+Err Lz77LibOpen(UInt16 libRefnum, MemHandle *lz77HandleP, Boolean compressFlag, UInt32 sourceSize, MemHandle *destHP,
+  UInt32 *destSizeP, UInt16 useVerNum, UInt8 *primerP, UInt32 primerL, UInt32 processedPrimerL)
+  SYS_TRAP(sysLibTrapOpen);
+
+// Finishes the operation, returning the number of bytes written to the
+// destination handle, and releases lz77Handle. The destination handle is
+// owned by the caller.
+Err Lz77LibClose(UInt16 libRefnum, MemHandle lz77Handle, UInt32 *ResultingSizeP)
+  SYS_TRAP(sysLibTrapClose);
+
+Err Lz77LibSleep(UInt16 libRefnum)
+  SYS_TRAP(sysLibTrapSleep);
+
+Err Lz77LibWake(UInt16 libRefnum)
+  SYS_TRAP(sysLibTrapWake);
+
+// Feeds the next sourceSize bytes of the source.
+Err Lz77LibChunk(UInt16 libRefnum, MemHandle lz77Handle, UInt8 *sourceP, UInt32 sourceSize)
+  SYS_TRAP(lz77LibTrapChunk);
+
+// Returns the destination size needed for a source of sourceSize bytes.
+// For expansion sourceP, when not NULL, points to the stream header and
+// the exact size is returned.
+Err Lz77LibMaxBufferSize(UInt16 libRefnum, Boolean compressFlag, UInt32 sourceSize, UInt8 *sourceP, UInt32 *maxBufferSizeP)
+  SYS_TRAP(lz77LibTrapMaxBufferSize);
+
+Err Lz77LibBufferGetInfo(UInt16 libRefnum, MemHandle lz77Handle, Boolean *compressFlagP, MemHandle *destHP, UInt32 *destSizeP, UInt32 *destOffsetP)
+  SYS_TRAP(lz77LibTrapBufferGetInfo);
+
+// Replaces the destination handle, for example to send the output produced
+// so far and continue writing at offset 0.
+Err Lz77LibBufferSetInfo(UInt16 libRefnum, MemHandle lz77Handle, MemHandle destH, UInt32 destSize, UInt32 destOffset)
+  SYS_TRAP(lz77LibTrapBufferSetInfo);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
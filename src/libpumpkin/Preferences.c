@@ -887,22 +887,13 @@ void PrefSetPreference(SystemPreferencesChoice choice, UInt32 value) {
 
 Int16 PrefGetAppPreferences(UInt32 creator, UInt16 id, void *prefs, UInt16 *prefsSize, Boolean saved) {
   Int16 version = noPreferenceFound;
-  UInt16 size, *p;
+  UInt16 size;
 
   if (prefsSize) {
-    size = pumpkin_get_preference(creator, id, NULL, 0, saved);
-    if (size >= 2) {
-      if ((p = xcalloc(1, size)) != NULL) {
-        pumpkin_get_preference(creator, id, p, size, saved);
-        if (*prefsSize == 0) {
-          *prefsSize = size - 2;
-        }
-        if (prefs) {
-          MemMove(prefs, &p[1], *prefsSize);
-        }
-        version = p[0];
-        xfree(p);
-      }
+    size = *prefsSize;
+    version = pumpkin_get_app_preference(creator, id, prefs, &size, saved);
+    if (version != noPreferenceFound && *prefsSize == 0) {
+      *prefsSize = size;
     }
   }
 
@@ -910,15 +901,8 @@ Int16 PrefGetAppPreferences(UInt32 creator, UInt16 id, void *prefs, UInt16 *pref
 }
 
 void PrefSetAppPreferences(UInt32 creator, UInt16 id, Int16 version, const void *prefs, UInt16 prefsSize, Boolean saved) {
-  UInt16 *p;
-
   if (prefs && prefsSize) {
-    if ((p = xcalloc(1, 2 + prefsSize)) != NULL) {
-      p[0] = version;
-      MemMove(&p[1], prefs, prefsSize);
-      pumpkin_set_preference(creator, id, p, 2 + prefsSize, saved);
-      xfree(p);
-    }
+    pumpkin_set_app_preference(creator, id, version, prefs, prefsSize, saved);
   }
 }
 
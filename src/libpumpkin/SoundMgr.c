@@ -8,9 +8,11 @@
 #include "media.h"
 #include "vfs.h"
 #include "wav.h"
+#include "midi.h"
 #include "bytes.h"
 #include "ptr.h"
 #include "heap.h"
+#include "mutex.h"
 #include "emupalmosinc.h"
 #include "pumpkin.h"
 #include "debug.h"
@@ -25,6 +27,7 @@ typedef struct {
   UInt16 alarmAmp;
   UInt16 sysAmp;
   UInt16 defAmp;
+  SndStreamRef smf, beep, tone;
 } snd_module_t;
 
 extern thread_key_t *snd_key;
@@ -39,14 +42,36 @@ typedef struct {
   Int32 pan;
   int pcm, channels, rate;
   Boolean started, stopped;
-  audio_t audio;
-  Boolean first;
+  UInt32 step, frac;
+  void (*release)(void *data);
+  void *owned;
   heap_t *heap;
 } SndStreamType;
 
+// All streams are mixed into a single device stream with a fixed format.
+// Each stream is converted to 16 bits once per buffer, then resampled and
+// added to a 32 bit accumulator with fixed point gains (1024 is unity).
+
+#define MIXER_PCM       PCM_S16
+#define MIXER_CHANNELS  2
+#define MIXER_RATE      44100
+#define MIXER_FRAMES    1024
+#define MAX_VOICES      32
+
 typedef struct {
-  int ptr;
-} SndStreamArg;
+  audio_provider_t *ap;
+  mutex_t *mutex;
+  audio_t audio;
+  Boolean running, stopping, stopped;
+  int voices[MAX_VOICES];
+  int nvoices;
+  Int32 mix[MIXER_FRAMES * MIXER_CHANNELS];
+  UInt8 *raw;
+  Int16 *stage;
+  UInt32 rawSize, stageSize;
+} snd_mixer_t;
+
+static snd_mixer_t mixer;
 
 typedef struct {
   FileRef f;
@@ -57,6 +82,48 @@ typedef struct {
   Boolean finished;
 } snd_param_t;
 
+// Sound rendered inside SoundMgr: a MIDI sequence or PCM, mono 16 bit.
+typedef struct {
+  midi_t *midi;
+  UInt8 *smf;
+  Int16 *pcm;
+  UInt32 size, pos;
+  Boolean ownsPcm, notify, finished;
+  SndComplFuncPtr completion;
+  UInt32 completionData;
+} snd_play_t;
+
+// System sounds are rendered once and kept as PCM.
+typedef struct {
+  const midi_tone_t *tones;
+  UInt32 n;
+} snd_beep_t;
+
+static const midi_tone_t toneInfo[] = { { 1760, 60, 90 } };
+static const midi_tone_t toneWarning[] = { { 1320, 80, 100 }, { 0, 40, 0 }, { 1320, 80, 100 } };
+static const midi_tone_t toneError[] = { { 440, 160, 110 }, { 0, 30, 0 }, { 330, 220, 110 } };
+static const midi_tone_t toneStartUp[] = { { 523, 70, 90 }, { 659, 70, 90 }, { 784, 70, 90 }, { 1047, 140, 90 } };
+static const midi_tone_t toneAlarm[] = { { 1760, 120, 120 }, { 0, 60, 0 }, { 1760, 120, 120 }, { 0, 60, 0 }, { 1760, 120, 120 }, { 0, 300, 0 },
+                                         { 1760, 120, 120 }, { 0, 60, 0 }, { 1760, 120, 120 }, { 0, 60, 0 }, { 1760, 120, 120 } };
+static const midi_tone_t toneConfirmation[] = { { 1047, 60, 90 }, { 1568, 90, 90 } };
+static const midi_tone_t toneClick[] = { { 2000, 4, 70 } };
+
+static const snd_beep_t beeps[] = {
+  { NULL, 0 },
+  { toneInfo, sizeof(toneInfo) / sizeof(midi_tone_t) },
+  { toneWarning, sizeof(toneWarning) / sizeof(midi_tone_t) },
+  { toneError, sizeof(toneError) / sizeof(midi_tone_t) },
+  { toneStartUp, sizeof(toneStartUp) / sizeof(midi_tone_t) },
+  { toneAlarm, sizeof(toneAlarm) / sizeof(midi_tone_t) },
+  { toneConfirmation, sizeof(toneConfirmation) / sizeof(midi_tone_t) },
+  { toneClick, sizeof(toneClick) / sizeof(midi_tone_t) }
+};
+
+#define NUM_BEEPS (sizeof(beeps) / sizeof(snd_beep_t))
+
+static Int16 *beepCache[NUM_BEEPS];
+static UInt32 beepFrames[NUM_BEEPS];
+
 int SndInitModule(audio_provider_t *ap) {
   snd_module_t *module;
 
@@ -74,6 +141,9 @@ int SndFinishModule(void) {
   snd_module_t *module = (snd_module_t *)thread_get(snd_key);
 
   if (module) {
+    if (module->smf > 0) SndStreamDelete(module->smf);
+    if (module->beep > 0) SndStreamDelete(module->beep);
+    if (module->tone > 0) SndStreamDelete(module->tone);
     xfree(module);
   }
 
@@ -100,6 +170,125 @@ void SndGetDefaultVolume(UInt16 *alarmAmpP, UInt16 *sysAmpP, UInt16 *masterAmpP)
   if (masterAmpP) *masterAmpP = module->defAmp; // XXX is this correct ?
 }
 
+static void SndPlayRelease(void *data) {
+  snd_play_t *play = (snd_play_t *)data;
+
+  if (play) {
+    if (play->midi) MidiDestroy(play->midi);
+    if (play->smf) xfree(play->smf);
+    if (play->pcm && play->ownsPcm) xfree(play->pcm);
+    xfree(play);
+  }
+}
+
+static Err SndPlayCallback(void *userdata, SndStreamRef sound, void *buffer, UInt32 numberofframes) {
+  snd_play_t *play = (snd_play_t *)userdata;
+  UInt32 n;
+
+  if (play == NULL || buffer == NULL) return sndErrBadParam;
+
+  if (play->midi) {
+    n = MidiRender(play->midi, (Int16 *)buffer, numberofframes);
+  } else {
+    n = numberofframes;
+    if (n > play->size - play->pos) n = play->size - play->pos;
+    sys_memcpy(buffer, &play->pcm[play->pos], n * sizeof(Int16));
+    play->pos += n;
+  }
+
+  if (n < numberofframes) {
+    sys_memset((Int16 *)buffer + n, 0, (numberofframes - n) * sizeof(Int16));
+  }
+
+  // the completion routine is called by SndPlayNotify, outside the stream lock
+  if (n == 0) {
+    play->finished = true;
+    return sndErrBadParam;
+  }
+
+  return errNone;
+}
+
+// Plays a rendered sound on a new stream, which takes ownership of play.
+// amp is in the range [0, sndMaxAmp].
+static Err SndPlayStart(snd_play_t *play, UInt16 amp, SndStreamRef *sound) {
+  SndStreamType *snd;
+  Err err;
+
+  if ((err = SndStreamCreate(sound, sndOutput, MIXER_RATE, sndInt16, sndMono, SndPlayCallback, play, 0, false)) != errNone) {
+    *sound = 0;
+    SndPlayRelease(play);
+    return err;
+  }
+
+  if ((snd = ptr_lock(*sound, TAG_SOUND)) != NULL) {
+    snd->release = SndPlayRelease;
+    snd->owned = play;
+    ptr_unlock(*sound, TAG_SOUND);
+  }
+
+  SndStreamSetVolume(*sound, amp >= sndMaxAmp ? sndUnityGain : (amp * sndUnityGain) / sndMaxAmp);
+
+  if ((err = SndStreamStart(*sound)) != errNone) {
+    SndStreamDelete(*sound);
+    *sound = 0;
+  }
+
+  return err;
+}
+
+// Calls the completion routine of a sound that ended while nobody was waiting
+// for it. Runs on the audio thread after the mixer has unlocked the stream.
+static void SndPlayNotify(int ptr) {
+  SndStreamType *snd;
+  snd_play_t *play;
+  SndComplFuncPtr completion = NULL;
+  UInt32 completionData = 0;
+
+  if ((snd = ptr_lock(ptr, TAG_SOUND)) != NULL) {
+    if (snd->release == SndPlayRelease && (play = snd->owned) != NULL && play->finished && play->notify) {
+      completion = play->completion;
+      completionData = play->completionData;
+      play->notify = false;
+    }
+    ptr_unlock(ptr, TAG_SOUND);
+  }
+
+  if (completion) completion(NULL, completionData);
+}
+
+static void SndPlayStop(SndStreamRef *sound) {
+  if (*sound > 0) {
+    SndStreamDelete(*sound);
+    *sound = 0;
+  }
+}
+
+static Boolean SndPlayWait(snd_play_t *play, SndBlockingFuncPtr blocking, UInt32 blockingData, Boolean interruptible) {
+  for (; !play->finished && !thread_must_end();) {
+    if (blocking && !blocking(NULL, blockingData, 1)) return false;
+    if (interruptible && EvtSysEventAvail(true)) return false;
+    SysTaskDelay(1);
+  }
+
+  return play->finished;
+}
+
+static snd_play_t *SndPlayTones(const midi_tone_t *tones, UInt32 n) {
+  snd_play_t *play;
+
+  if ((play = xcalloc(1, sizeof(snd_play_t))) != NULL) {
+    if ((play->pcm = MidiRenderTones(tones, n, MIXER_RATE, &play->size)) != NULL) {
+      play->ownsPcm = true;
+    } else {
+      xfree(play);
+      play = NULL;
+    }
+  }
+
+  return play;
+}
+
 // The Sound Manager only supports one channel
 // of sound synthesis: You must pass NULL as the value of channelP.
 //   typedef struct SndCommandType {
@@ -111,11 +300,18 @@ void SndGetDefaultVolume(UInt16 *alarmAmpP, UInt16 *sysAmpP, UInt16 *masterAmpP)
 //  } SndCommandType;
 
 Err SndDoCmd(void * /*SndChanPtr*/ channelP, SndCommandPtr cmdP, Boolean noWait) {
+  snd_module_t *module = (snd_module_t *)thread_get(snd_key);
+  midi_tone_t tone;
+  snd_play_t *play;
   Err err = sndErrBadParam;
 
   if (channelP == NULL && cmdP != NULL) {
     debug(DEBUG_INFO, "Sound", "SndDoCmd %d", cmdP->cmd);
 
+    tone.freq = cmdP->param1;
+    tone.ms = cmdP->param2;
+    tone.amp = cmdP->param3 >= sndMaxAmp ? 127 : cmdP->param3 * 2;
+
     switch (cmdP->cmd) {
       case sndCmdFreqDurationAmp:
         // Play a tone. SndDoCmd blocks until the tone has finished.
@@ -123,7 +319,6 @@ Err SndDoCmd(void * /*SndChanPtr*/ channelP, SndCommandPtr cmdP, Boolean noWait)
         // param2 is its duration in milliseconds
         // param3 is its amplitude in the range [0, sndMaxAmp].
         // If the amplitude is 0, the sound isn’t played and the function returns immediately.
-        break;
       case sndCmdFrqOn:
         // Initiate a tone. SndDoCmd returns immediately while the tone plays
         // in the background. Subsequent sound playback requests interrupt the tone.
@@ -131,7 +326,6 @@ Err SndDoCmd(void * /*SndChanPtr*/ channelP, SndCommandPtr cmdP, Boolean noWait)
         // param2 is its duration in milliseconds
         // param3 is its amplitude in the range [0, sndMaxAmp].
         // If the amplitude is 0, the sound isn’t played and the function returns immediately.
-        break;
       case sndCmdNoteOn:
         // Initiate a MIDI-defined tone. SndDoCmd returns immediately
         // while the tone plays in the background. Subsequent sound
@@ -139,10 +333,24 @@ Err SndDoCmd(void * /*SndChanPtr*/ channelP, SndCommandPtr cmdP, Boolean noWait)
         // param1 is the tone’s pitch given as a MIDI key number in the range [0, 127].
         // param2 is the tone’s duration in milliseconds
         // param3 is its amplitude given as MIDI velocity [0, 127].
+        if (cmdP->cmd == sndCmdNoteOn) {
+          tone.freq = MidiKeyFrequency(cmdP->param1);
+          tone.amp = cmdP->param3 & 0x7F;
+        }
+        SndPlayStop(&module->tone);
+        err = errNone;
+        if (tone.amp > 0 && tone.freq > 0 && mixer.ap && mixer.ap->create && (play = SndPlayTones(&tone, 1)) != NULL) {
+          if ((err = SndPlayStart(play, sndMaxAmp, &module->tone)) == errNone && cmdP->cmd == sndCmdFreqDurationAmp) {
+            SndPlayWait(play, NULL, 0, false);
+            SndPlayStop(&module->tone);
+          }
+        }
         break;
       case sndCmdQuiet:
         // Stop the playback of the currently generated tone.
         // All parameter values are ignored.
+        SndPlayStop(&module->tone);
+        err = errNone;
         break;
     }
   }
@@ -159,17 +367,32 @@ SndPlaySystemSound blocks until the sound has been played.
 All other sounds are played asynchronously.
 */
 void SndPlaySystemSound(SndSysBeepType beepID) {
+  snd_module_t *module = (snd_module_t *)thread_get(snd_key);
+  snd_play_t *play;
+  UInt16 amp;
+
   debug(DEBUG_INFO, "Sound", "SndPlaySystemSound %d", beepID);
 
-  switch (beepID) {
-    case sndInfo:
-    case sndWarning:
-    case sndError:
-    case sndStartUp:
-    case sndAlarm:
-    case sndConfirmation:
-    case sndClick:
-      break;
+  if (beepID == 0 || beepID >= NUM_BEEPS || mixer.ap == NULL || mixer.ap->create == NULL) return;
+
+  amp = PrefGetPreference(beepID == sndAlarm ? prefAlarmSoundVolume : prefSysSoundVolume);
+  if (amp == 0) return;
+
+  if (mutex_lock(mixer.mutex) == 0) {
+    if (beepCache[beepID] == NULL) {
+      beepCache[beepID] = MidiRenderTones(beeps[beepID].tones, beeps[beepID].n, MIXER_RATE, &beepFrames[beepID]);
+    }
+    mutex_unlock(mixer.mutex);
+  }
+
+  if (beepCache[beepID] && (play = xcalloc(1, sizeof(snd_play_t))) != NULL) {
+    play->pcm = beepCache[beepID];
+    play->size = beepFrames[beepID];
+    SndPlayStop(&module->beep);
+    if (SndPlayStart(play, amp, &module->beep) == errNone && beepID == sndAlarm) {
+      SndPlayWait(play, NULL, 0, false);
+      SndPlayStop(&module->beep);
+    }
   }
 }
 
@@ -297,60 +520,119 @@ Boolean SndCreateMidiList(UInt32 creator, Boolean multipleDBs, UInt16 *wCountP,
   return i > 0;
 }
 
+// Returns the size of a SMF, 0 if the header is not valid.
+static UInt32 SndSmfSize(UInt8 *smfP) {
+  UInt32 i, j, id, len;
+  UInt16 mthd[3];
+
+  i = get4b(&id, smfP, 0);
+  i += get4b(&len, smfP, i);
+  if (id != 'MThd' || len != 6) {
+    debug(DEBUG_ERROR, "Sound", "SndPlaySmf wrong header id 0x%08X or length %d", id, len);
+    return 0;
+  }
+
+  i += get2b(&mthd[0], smfP, i);
+  i += get2b(&mthd[1], smfP, i);
+  i += get2b(&mthd[2], smfP, i);
+  debug(DEBUG_INFO, "Sound", "SndPlaySmf format %d, ntrks %d, division 0x%04X", mthd[0], mthd[1], mthd[2]);
+
+  for (j = 0; j < mthd[1]; j++) {
+    i += get4b(&id, smfP, i);
+    i += get4b(&len, smfP, i);
+    if (id == 'MTrk') {
+      debug(DEBUG_INFO, "Sound", "SndPlaySmf track %d length %d", j, len);
+    } else {
+      debug(DEBUG_INFO, "Sound", "SndPlaySmf unknown id 0x%08X", id);
+    }
+    i += len;
+  }
+
+  return i;
+}
+
+// The SMF is rendered by the built in synthesizer. Only when the audio
+// provider has no streams it is handed to the provider MIDI player, which
+// ignores the selection, channel range and callbacks.
+
 Err SndPlaySmf(void *chanP, SndSmfCmdEnum cmd, UInt8 *smfP, SndSmfOptionsType *selP, SndSmfChanRangeType *chanRangeP, SndSmfCallbacksType *callbacksP, Boolean bNoWait) {
   snd_module_t *module = (snd_module_t *)thread_get(snd_key);
-  UInt32 i, j, id, len;
-  UInt16 volume, mthd[3];
+  SndBlockingFuncPtr blocking;
+  SndComplFuncPtr completion;
+  UInt32 size, blockingData, completionData;
+  UInt16 volume;
+  Boolean interruptible;
+  snd_play_t *play;
   Err err = sndErrBadParam;
 
-  if (smfP != NULL) {
-    debug(DEBUG_INFO, "Sound", "SndPlaySmf cmd %d, noWait %d", cmd, bNoWait);
-    if (selP) {
-      debug(DEBUG_INFO, "Sound", "SndPlaySmf start %d, end %d, amp %d, int %d", selP->dwStartMilliSec, selP->dwEndMilliSec, selP->amplitude, selP->interruptible);
-      if (selP->dwStartMilliSec != 0) {
-        debug(DEBUG_ERROR, "Sound", "SndPlaySmf start %d not supported", selP->dwStartMilliSec);
-      }
-      if (selP->dwEndMilliSec != sndSmfPlayAllMilliSec) {
-        debug(DEBUG_ERROR, "Sound", "SndPlaySmf end %d not supported", selP->dwEndMilliSec);
-      }
-      volume = selP->amplitude;
-    } else {
-      volume = sndMaxAmp;
+  if (smfP == NULL) return err;
+
+  debug(DEBUG_INFO, "Sound", "SndPlaySmf cmd %d, noWait %d", cmd, bNoWait);
+
+  if (cmd == sndSmfCmdDuration) {
+    if (selP && (size = SndSmfSize(smfP)) > 0) {
+      selP->dwStartMilliSec = 0;
+      selP->dwEndMilliSec = MidiDuration(smfP, size);
+      err = errNone;
     }
+    return err;
+  }
 
-    i = get4b(&id, smfP, 0);
-    i += get4b(&len, smfP, i);
-    if (id == 'MThd' && len == 6) {
-      i += get2b(&mthd[0], smfP, i);
-      i += get2b(&mthd[1], smfP, i);
-      i += get2b(&mthd[2], smfP, i);
-      debug(DEBUG_INFO, "Sound", "SndPlaySmf format %d, ntrks %d, division 0x%04X", mthd[0], mthd[1], mthd[2]);
-
-      for (j = 0; j < mthd[1]; j++) {
-        i += get4b(&id, smfP, i);
-        i += get4b(&len, smfP, i);
-        if (id == 'MTrk') {
-          debug(DEBUG_INFO, "Sound", "SndPlaySmf track %d length %d", j, len);
-        } else {
-          debug(DEBUG_INFO, "Sound", "SndPlaySmf unknown id 0x%08X", id);
-        }
-        i += len;
-      }
+  if (selP) {
+    debug(DEBUG_INFO, "Sound", "SndPlaySmf start %d, end %d, amp %d, int %d", selP->dwStartMilliSec, selP->dwEndMilliSec, selP->amplitude, selP->interruptible);
+    volume = selP->amplitude;
+    interruptible = selP->interruptible;
+  } else {
+    volume = sndMaxAmp;
+    interruptible = true;
+  }
 
-      if (module->ap && module->ap->mixer_play) {
-        debug(DEBUG_INFO, "Sound", "SndPlaySmf playing %d bytes", i);
-        if (volume >= sndMaxAmp) {
-          volume = 128;
-        } else if (volume > 0) {
-          volume <<= 1; // PalmOS: 0-64, SDL: 0-128
-        }
-        module->ap->mixer_play(smfP, i, volume);
-      }
+  if ((size = SndSmfSize(smfP)) == 0) return err;
+  if (volume == 0) return errNone;
+
+  if (mixer.ap && mixer.ap->create) {
+    SndPlayStop(&module->smf);
+    if ((play = xcalloc(1, sizeof(snd_play_t))) == NULL) return sndErrMemory;
+    // the synthesizer keeps pointers into the SMF, which the caller may free
+    // before a bNoWait playback ends
+    if ((play->smf = xmalloc(size)) == NULL) {
+      xfree(play);
+      return sndErrMemory;
+    }
+    sys_memcpy(play->smf, smfP, size);
+    if ((play->midi = MidiCreate(play->smf, size, MIXER_RATE, chanRangeP ? chanRangeP->bFirstChan : 0, chanRangeP ? chanRangeP->bLastChan : 15)) == NULL) {
+      SndPlayRelease(play);
+      return sndErrFormat;
+    }
+    if (selP) {
+      if (selP->dwStartMilliSec) MidiSeek(play->midi, selP->dwStartMilliSec);
+      MidiSetEnd(play->midi, selP->dwEndMilliSec);
+    }
 
-    } else {
-      debug(DEBUG_ERROR, "Sound", "SndPlaySmf wrong header id 0x%08X or length %d", id, len);
+    completion = callbacksP ? (SndComplFuncPtr)callbacksP->completion.funcP : NULL;
+    completionData = callbacksP ? callbacksP->completion.dwUserData : 0;
+    blocking = callbacksP ? (SndBlockingFuncPtr)callbacksP->blocking.funcP : NULL;
+    blockingData = callbacksP ? callbacksP->blocking.dwUserData : 0;
+    play->completion = completion;
+    play->completionData = completionData;
+    play->notify = bNoWait;
+
+    if ((err = SndPlayStart(play, volume, &module->smf)) == errNone && !bNoWait) {
+      SndPlayWait(play, blocking, blockingData, interruptible);
+      SndPlayStop(&module->smf);
+      if (completion) completion(chanP, completionData);
     }
 
+  } else if (module->ap && module->ap->mixer_play) {
+    debug(DEBUG_INFO, "Sound", "SndPlaySmf playing %d bytes", size);
+    if (volume >= sndMaxAmp) {
+      volume = 128;
+    } else if (volume > 0) {
+      volume <<= 1; // PalmOS: 0-64, SDL: 0-128
+    }
+    module->ap->mixer_play(smfP, size, volume);
+    err = errNone;
+  } else {
     err = errNone;
   }
 
@@ -421,6 +703,8 @@ Err SndPlaySmfResourceIrregardless(UInt32 resType, Int16 resID, SystemPreference
 Err SndInterruptSmfIrregardless(void) {
   snd_module_t *module = (snd_module_t *)thread_get(snd_key);
 
+  SndPlayStop(&module->smf);
+
   if (module->ap && module->ap->mixer_stop) {
     module->ap->mixer_stop();
   }
@@ -428,10 +712,68 @@ Err SndInterruptSmfIrregardless(void) {
   return errNone;
 }
 
+int SndMixerInit(audio_provider_t *ap) {
+  xmemset(&mixer, 0, sizeof(snd_mixer_t));
+  mixer.ap = ap;
+  mixer.audio = -1;
+
+  return (mixer.mutex = mutex_create("sound")) != NULL ? 0 : -1;
+}
+
+int SndMixerFinish(void) {
+  Boolean running;
+  int i;
+
+  // the device stream is retired by its own callback, and only then destroyed
+  running = false;
+  if (mixer.mutex && mutex_lock(mixer.mutex) == 0) {
+    running = mixer.running;
+    mixer.stopping = true;
+    mutex_unlock(mixer.mutex);
+  }
+  for (i = 0; running && i < 100; i++) {
+    sys_usleep(10000);
+    if (mutex_lock(mixer.mutex) == 0) {
+      running = !mixer.stopped;
+      mutex_unlock(mixer.mutex);
+    }
+  }
+  if (mixer.ap && mixer.audio != -1) {
+    if (running) debug(DEBUG_ERROR, "Sound", "device stream did not stop");
+    mixer.ap->destroy(mixer.audio);
+  }
+  for (i = 0; i < NUM_BEEPS; i++) {
+    if (beepCache[i]) xfree(beepCache[i]);
+    beepCache[i] = NULL;
+  }
+  if (mixer.raw) xfree(mixer.raw);
+  if (mixer.stage) xfree(mixer.stage);
+  if (mixer.mutex) mutex_destroy(mixer.mutex);
+  xmemset(&mixer, 0, sizeof(snd_mixer_t));
+  mixer.audio = -1;
+
+  return 0;
+}
+
+static void SndMixerRemove(int ptr) {
+  int i;
+
+  if (mutex_lock(mixer.mutex) == 0) {
+    for (i = 0; i < mixer.nvoices; i++) {
+      if (mixer.voices[i] == ptr) {
+        mixer.voices[i] = mixer.voices[--mixer.nvoices];
+        break;
+      }
+    }
+    mutex_unlock(mixer.mutex);
+  }
+}
+
 Err SndStreamDelete(SndStreamRef channel) {
   Err err = sndErrBadParam;
 
   if (channel > 0) {
+    SndMixerRemove(channel);
     ptr_free(channel, TAG_SOUND);
     err = errNone;
   }
@@ -439,215 +781,331 @@ Err SndStreamDelete(SndStreamRef channel) {
   return err;
 }
 
-static float getSample(int pcm, void *buffer, UInt32 i) {
-  Int8 *s8;
-  UInt8 *u8;
-  Int16 *s16;
-  Int32 *s32;
-  float *flt;
-  float sample = 0;
-
-  switch (pcm) {
-    case PCM_S8:
-      s8 = (Int8 *)buffer;
-      sample = s8[i];
-      break;
-    case PCM_U8:
-      u8 = (UInt8 *)buffer;
-      sample = u8[i];
-      break;
-    case PCM_S16:
-      s16 = (Int16 *)buffer;
-      sample = s16[i];
-      break;
-    case PCM_S32:
-      s32 = (Int32 *)buffer;
-      sample = s32[i];
-      break;
-    case PCM_FLT:
-      flt = (float *)buffer;
-      sample = flt[i];
-      break;
-  }
-
-  return sample;
-}
-
-void putSample(int pcm, void *buffer, UInt32 i, float sample) {
-  Int8 *s8;
-  UInt8 *u8;
-  Int16 *s16;
-  Int32 *s32;
-  float *flt;
-
-  switch (pcm) {
-    case PCM_S8:
-      s8 = (Int8 *)buffer;
-      if (sample < -128) sample = -128;
-      else if (sample > 127) sample = 127;
-      s8[i] = (Int8)sample;
-      break;
-    case PCM_U8:
-      u8 = (UInt8 *)buffer;
-      if (sample < 0) sample = 0;
-      else if (sample > 255) sample = 255;
-      u8[i] = (UInt8)sample;
-      break;
-    case PCM_S16:
-      s16 = (Int16 *)buffer;
-      if (sample < -32768) sample = -32768;
-      else if (sample > 32767) sample = 32767;
-      s16[i] = (Int16)sample;
-      break;
-    case PCM_S32:
-      s32 = (Int32 *)buffer;
-      if (sample < INT32_MIN) sample = INT32_MIN;
-      else if (sample > INT32_MAX) sample = INT32_MAX;
-      s32[i] = (Int32)sample;
-      break;
-    case PCM_FLT:
-      flt = (float *)buffer;
-      flt[i] = sample;
-      break;
-  }
-}
-
-static int SndGetAudio(void *buffer, int len, void *data) {
-  SndStreamArg *arg = (SndStreamArg *)data;
+// Conversion kernels, n is the number of samples (frames * channels).
+
+static void SndConvertS8(Int16 *dst, Int8 *src, UInt32 n) {
+  UInt32 i;
+
+  for (i = 0; i < n; i++) {
+    dst[i] = (Int16)(src[i] << 8);
+  }
+}
+
+static void SndConvertU8(Int16 *dst, UInt8 *src, UInt32 n) {
+  UInt32 i;
+
+  for (i = 0; i < n; i++) {
+    dst[i] = (Int16)((src[i] - 128) << 8);
+  }
+}
+
+static void SndConvertS32(Int16 *dst, Int32 *src, UInt32 n) {
+  UInt32 i;
+
+  for (i = 0; i < n; i++) {
+    dst[i] = (Int16)(src[i] >> 16);
+  }
+}
+
+static void SndConvertFloat(Int16 *dst, float *src, UInt32 n) {
+  float sample;
+  UInt32 i;
+
+  for (i = 0; i < n; i++) {
+    sample = src[i] * 32767.0f;
+    if (sample < -32768.0f) sample = -32768.0f;
+    else if (sample > 32767.0f) sample = 32767.0f;
+    dst[i] = (Int16)sample;
+  }
+}
+
+// Mixing kernels. Output frame k lies between source frames j = (frac + k * step) >> 16
+// and j + 1, and is linearly interpolated from them. Only nsrc frames are fetched
+// for each buffer, so the last one is held when j + 1 falls past them.
+
+#define SndLerp(a, b, f) ((a) + ((((Int32)(b) - (Int32)(a)) * (Int32)((f) >> 1)) >> 15))
+
+static void SndMixMono(Int32 *mix, Int16 *src, UInt32 n, UInt32 nsrc, UInt32 frac, UInt32 step, Int32 left, Int32 right) {
+  UInt32 i, j, k, pos;
+  Int32 sample;
+
+  if (step == 0x10000) {
+    for (i = 0; i < n; i++) {
+      sample = src[i];
+      mix[2*i] += (sample * left) >> 10;
+      mix[2*i+1] += (sample * right) >> 10;
+    }
+  } else {
+    for (i = 0, pos = frac; i < n; i++, pos += step) {
+      j = pos >> 16;
+      if (j >= nsrc) j = nsrc - 1;
+      k = j + 1 < nsrc ? j + 1 : j;
+      sample = SndLerp(src[j], src[k], pos & 0xFFFF);
+      mix[2*i] += (sample * left) >> 10;
+      mix[2*i+1] += (sample * right) >> 10;
+    }
+  }
+}
+
+static void SndMixStereo(Int32 *mix, Int16 *src, UInt32 n, UInt32 nsrc, UInt32 frac, UInt32 step, Int32 left, Int32 right) {
+  UInt32 i, j, k, pos;
+  Int32 l, r;
+
+  if (step == 0x10000) {
+    for (i = 0; i < 2*n; i += 2) {
+      mix[i] += (src[i] * left) >> 10;
+      mix[i+1] += (src[i+1] * right) >> 10;
+    }
+  } else {
+    for (i = 0, pos = frac; i < n; i++, pos += step) {
+      j = pos >> 16;
+      if (j >= nsrc) j = nsrc - 1;
+      k = j + 1 < nsrc ? j + 1 : j;
+      j <<= 1;
+      k <<= 1;
+      l = SndLerp(src[j], src[k], pos & 0xFFFF);
+      r = SndLerp(src[j+1], src[k+1], pos & 0xFFFF);
+      mix[2*i] += (l * left) >> 10;
+      mix[2*i+1] += (r * right) >> 10;
+    }
+  }
+}
+
+static Boolean SndMixerBuffers(UInt32 rawSize, UInt32 stageSize) {
+  UInt8 *raw;
+  Int16 *stage;
+
+  if (rawSize > mixer.rawSize) {
+    if ((raw = xrealloc(mixer.raw, rawSize)) == NULL) return false;
+    mixer.raw = raw;
+    mixer.rawSize = rawSize;
+  }
+  if (stageSize > mixer.stageSize) {
+    if ((stage = xrealloc(mixer.stage, stageSize)) == NULL) return false;
+    mixer.stage = stage;
+    mixer.stageSize = stageSize;
+  }
+
+  return true;
+}
+
+// Adds n output frames of stream ptr to the accumulator. Returns false when
+// the stream has ended.
+static Boolean SndMixVoice(int ptr, UInt32 n) {
   SndStreamType *snd;
-  UInt32 nsamples, i, j;
-  Int32 volume, pan;
+  UInt32 nsamples, navail, pos, i;
+  Int32 volume, pan, left, right;
+  Boolean r = true;
   Err err;
-  Boolean freeArg = false;
-  int pcm, channels;
-  float sample, gain, leftGain, rightGain;
-  char tname[16];
-  int r = -1;
 
-  if (buffer && len > 0) {
-    if ((snd = ptr_lock(arg->ptr, TAG_SOUND)) != NULL) {
-      thread_get_name(tname, sizeof(tname)-1);
-      if (tname[0] == '?') {
-        thread_set_name("Audio");
-        debug(DEBUG_INFO, "Sound", "pumpkin_sound_init");
-        pumpkin_sound_init();
-        snd->first = false;
-      }
+  if ((snd = ptr_lock(ptr, TAG_SOUND)) == NULL) {
+    return false;
+  }
 
-      nsamples = 0;
-      volume = sndUnityGain;
-      pan = sndPanCenter;
-      pcm = channels = 0;
+  if (snd->started && !snd->stopped) {
+    pos = snd->frac + n * snd->step;
+    nsamples = pos >> 16;
+    if (nsamples == 0) {
+      snd->frac = pos;
+    } else if (SndMixerBuffers(nsamples * snd->samplesize, nsamples * snd->channels * sizeof(Int16))) {
+      navail = nsamples;
+      if (snd->func) {
+        err = snd->func(snd->userdata, ptr, mixer.raw, nsamples);
+      } else {
+        err = snd->vfunc(snd->userdata, ptr, mixer.raw, &navail);
+        if (navail > nsamples) navail = nsamples;
+      }
 
-      if (snd->started && !snd->stopped) {
-        nsamples = len / snd->samplesize;
-        if (snd->func) {
-          err = snd->func(snd->userdata, arg->ptr, buffer, nsamples);
-        } else {
-          err = snd->vfunc(snd->userdata, arg->ptr, buffer, &nsamples);
-          len = nsamples * snd->samplesize;
+      if (err == errNone) {
+        // frames not supplied by a variable buffer callback are silence
+        if (navail < nsamples) sys_memset(mixer.raw + navail * snd->samplesize, snd->pcm == PCM_U8 ? 0x80 : 0, (nsamples - navail) * snd->samplesize);
+        i = nsamples * snd->channels;
+        switch (snd->pcm) {
+          case PCM_S8:  SndConvertS8(mixer.stage, (Int8 *)mixer.raw, i); break;
+          case PCM_U8:  SndConvertU8(mixer.stage, mixer.raw, i); break;
+          case PCM_S16: sys_memcpy(mixer.stage, mixer.raw, i * sizeof(Int16)); break;
+          case PCM_S32: SndConvertS32(mixer.stage, (Int32 *)mixer.raw, i); break;
+          case PCM_FLT: SndConvertFloat(mixer.stage, (float *)mixer.raw, i); break;
         }
-        if (err == errNone) {
-          channels = snd->channels;
-          pcm = snd->pcm;
-          pan = snd->pan;
-          volume = snd->volume;
-          r = len;
-        } else {
-          nsamples = 0;
-          snd->started = false;
-          snd->userdata = NULL;
-          freeArg = true;
+
+        volume = snd->volume;
+        pan = snd->pan;
+        left = right = volume;
+        if (pan > sndPanCenter) left = (volume * (1024 - pan)) >> 10;
+        else if (pan < sndPanCenter) right = (volume * (1024 + pan)) >> 10;
+
+        if (volume > 0) {
+          if (snd->channels == 1) {
+            SndMixMono(mixer.mix, mixer.stage, n, nsamples, snd->frac, snd->step, left, right);
+          } else {
+            SndMixStereo(mixer.mix, mixer.stage, n, nsamples, snd->frac, snd->step, left, right);
+          }
         }
+        snd->frac = pos & 0xFFFF;
       } else {
-        r = 0;
+        snd->started = false;
+        snd->userdata = NULL;
+        r = false;
       }
+    }
+  }
 
-      ptr_unlock(arg->ptr, TAG_SOUND);
+  ptr_unlock(ptr, TAG_SOUND);
 
-      if (nsamples > 0) {
-        if ((volume != sndUnityGain || (pan != sndPanCenter && channels == 2))) {
-          if (volume == 0) {
-            debug(DEBUG_INFO, "Sound", "%d samples (zero volume)", nsamples);
-            sys_memset(buffer, 0, len);
-          } else {
-            if (channels == 1) {
-              gain = (float)volume / (float)sndUnityGain;
-              debug(DEBUG_INFO, "Sound", "%d samples (mono gain %.3f)", nsamples, gain);
-              for (i = 0, j = 0; i < nsamples; i++) {
-                sample = getSample(pcm, buffer, i);
-                putSample(pcm, buffer, i, sample * gain);
-              }
-            } else {
-              leftGain = (float)volume / (float)sndUnityGain;
-              if (pan > sndPanCenter) {
-                leftGain *= (float)(1024 - pan) / 1024.0f;
-              }
-              rightGain = (float)volume / (float)sndUnityGain;
-              if (pan < sndPanCenter) {
-                pan = -pan;
-                rightGain *= (float)(1024 - pan) / 1024.0f;
-              }
-              debug(DEBUG_INFO, "Sound", "%d samples (left gain %.3f, right gain %.3f)", nsamples, leftGain, rightGain);
-              for (i = 0, j = 0; i < nsamples; i++, j += 2) {
-                sample = getSample(pcm, buffer, j);
-                putSample(pcm, buffer, j, sample * leftGain);
-                sample = getSample(pcm, buffer, j);
-                putSample(pcm, buffer, j+1, sample * rightGain);
-              }
-            }
-          }
-        } else {
-          debug(DEBUG_INFO, "Sound", "%d samples", nsamples);
+  return r;
+}
+
+static int SndMixerGetAudio(void *buffer, int len, void *data) {
+  int voices[MAX_VOICES], ended[MAX_VOICES];
+  int nvoices, nended, i, j;
+  UInt32 nframes, n, k;
+  Int16 *out;
+  Int32 sample;
+  Boolean stopping;
+  char tname[16];
+  int r = -1;
+
+  if (buffer && len > 0) {
+    thread_get_name(tname, sizeof(tname)-1);
+    if (tname[0] == '?') {
+      thread_set_name("Audio");
+      debug(DEBUG_INFO, "Sound", "pumpkin_sound_init");
+      pumpkin_sound_init();
+    }
+
+    // stream callbacks are called without holding the mixer mutex
+    nvoices = 0;
+    stopping = false;
+    if (mutex_lock(mixer.mutex) == 0) {
+      nvoices = mixer.nvoices;
+      sys_memcpy(voices, mixer.voices, nvoices * sizeof(int));
+      if (mixer.stopping) {
+        mixer.stopped = true;
+        stopping = true;
+      }
+      mutex_unlock(mixer.mutex);
+    }
+
+    if (stopping) {
+      debug(DEBUG_INFO, "Sound", "pumpkin_sound_finish");
+      pumpkin_sound_finish();
+      return -1;
+    }
+
+    out = (Int16 *)buffer;
+    nframes = len / (MIXER_CHANNELS * sizeof(Int16));
+    nended = 0;
+
+    for (k = 0; k < nframes; k += n) {
+      n = nframes - k;
+      if (n > MIXER_FRAMES) n = MIXER_FRAMES;
+      sys_memset(mixer.mix, 0, n * MIXER_CHANNELS * sizeof(Int32));
+
+      for (i = 0; i < nvoices; i++) {
+        if (voices[i] != -1 && !SndMixVoice(voices[i], n)) {
+          ended[nended++] = voices[i];
+          voices[i] = -1;
         }
       }
 
-      if (freeArg) {
-        debug(DEBUG_INFO, "Sound", "pumpkin_sound_finish");
-        pumpkin_sound_finish();
-        xfree(arg);
+      for (j = 0; j < n * MIXER_CHANNELS; j++) {
+        sample = mixer.mix[j];
+        if (sample < -32768) sample = -32768;
+        else if (sample > 32767) sample = 32767;
+        out[j] = (Int16)sample;
       }
+      out += n * MIXER_CHANNELS;
+    }
+
+    for (i = 0; i < nended; i++) {
+      SndMixerRemove(ended[i]);
+      SndPlayNotify(ended[i]);
     }
+
+    // the device stream keeps playing silence when there are no voices
+    r = nframes * MIXER_CHANNELS * sizeof(Int16);
   }
 
   return r;
 }
 
-Err SndStreamStart(SndStreamRef channel) {
-  snd_module_t *module = (snd_module_t *)thread_get(snd_key);
-  SndStreamType *snd;
-  SndStreamArg *arg;
+// Adds a stream to the mixer, starting the device stream on first use. The
+// device stream is not stopped when the mixer goes idle: a stream whose
+// callback has just returned cannot be safely destroyed from another thread.
+static Err SndMixerAdd(int ptr) {
+  Boolean start = false;
+  audio_t audio;
+  int i;
   Err err = sndErrBadParam;
 
-  if (channel > 0 && (snd = ptr_lock(channel, TAG_SOUND)) != NULL) {
-    if (snd->started) {
-      snd->stopped = false;
+  if (mutex_lock(mixer.mutex) == 0) {
+    for (i = 0; i < mixer.nvoices; i++) {
+      if (mixer.voices[i] == ptr) break;
+    }
+    if (i < mixer.nvoices) {
+      err = errNone;
+    } else if (mixer.nvoices < MAX_VOICES) {
+      mixer.voices[mixer.nvoices++] = ptr;
+      if (!mixer.running && !mixer.stopping) {
+        mixer.running = true;
+        start = true;
+      }
       err = errNone;
     } else {
-      if ((arg = xcalloc(1, sizeof(SndStreamArg))) != NULL) {
-        snd->first = true;
-        snd->heap = heap_get();
-        arg->ptr = channel;
-        snd->started = true;
-        snd->stopped = false;
-        if (module->ap->start(snd->audio, SndGetAudio, arg) == 0) {
-          err = errNone;
-        } else {
-          snd->started = false;
-          xfree(arg);
-        }
+      debug(DEBUG_ERROR, "Sound", "max streams reached");
+    }
+    mutex_unlock(mixer.mutex);
+  }
+
+  if (start) {
+    if ((audio = mixer.ap->create(MIXER_PCM, MIXER_CHANNELS, MIXER_RATE, mixer.ap->data)) != -1) {
+      mixer.audio = audio;
+      if (mixer.ap->start(audio, SndMixerGetAudio, &mixer) != 0) {
+        err = sndErrBadParam;
+      }
+    } else {
+      err = sndErrBadParam;
+    }
+    if (err != errNone) {
+      debug(DEBUG_ERROR, "Sound", "could not start device stream");
+      if (mixer.audio != -1) {
+        mixer.ap->destroy(mixer.audio);
+        mixer.audio = -1;
+      }
+      SndMixerRemove(ptr);
+      if (mutex_lock(mixer.mutex) == 0) {
+        mixer.running = false;
+        mutex_unlock(mixer.mutex);
       }
     }
-    ptr_unlock(channel, TAG_SOUND);
   }
 
   return err;
 }
 
-// Currently, SndStreamPause simply calls SndStreamStop() (if pause is true) or
-// SndStreamStart() (if pause is false).
-// You can’t nest pauses; a single resume request is effective,
-// regardless of the number of times the stream has been told to pause.
+Err SndStreamStart(SndStreamRef channel) {
+  SndStreamType *snd;
+  Err err = sndErrBadParam;
+
+  if (channel > 0 && (snd = ptr_lock(channel, TAG_SOUND)) != NULL) {
+    if (!snd->started) {
+      snd->heap = heap_get();
+      snd->frac = 0;
+    }
+    snd->started = true;
+    snd->stopped = false;
+    ptr_unlock(channel, TAG_SOUND);
+
+    if ((err = SndMixerAdd(channel)) != errNone) {
+      if ((snd = ptr_lock(channel, TAG_SOUND)) != NULL) {
+        snd->started = false;
+        ptr_unlock(channel, TAG_SOUND);
+      }
+    }
+  }
+
+  return err;
+}
 
 Err SndStreamPause(SndStreamRef channel, Boolean pause) {
   Err err;
@@ -668,6 +1126,7 @@ Err SndStreamStop(SndStreamRef channel) {
   if (channel > 0 && (snd = ptr_lock(channel, TAG_SOUND)) != NULL) {
     snd->stopped = true;
     ptr_unlock(channel, TAG_SOUND);
+    SndMixerRemove(channel);
     err = errNone;
   }
 
@@ -894,13 +1353,10 @@ Err SndStreamDeviceControl(SndStreamRef channel, Int32 cmd, void* param, Int32 s
 }
 
 void SndStreamRefDestructor(void *p) {
-  snd_module_t *module = (snd_module_t *)thread_get(snd_key);
   SndStreamType *snd = (SndStreamType *)p;
 
   if (snd) {
-    if (snd->audio) {
-      module->ap->destroy(snd->audio);
-    }
+    if (snd->release) snd->release(snd->owned);
     xfree(snd);
   }
 }
@@ -918,12 +1374,11 @@ static Err SndStreamCreateInternal(
   UInt32 buffsize,              /* preferred buffersize in frames, not guaranteed, use 0 for default */
   Boolean armNative)            /* true if callback is arm native */ {
 
-  snd_module_t *module = (snd_module_t *)thread_get(snd_key);
   SndStreamType *snd;
   int ptr, pcm, samplesize;
   Err err = sndErrBadParam;
 
-  if (module->ap && channel && format == sndFormatPCM && (func || vfunc) && mode == sndOutput) {
+  if (mixer.ap && mixer.ap->create && channel && format == sndFormatPCM && (func || vfunc) && mode == sndOutput) {
     switch (type) {
       case sndInt8:
         pcm = PCM_S8;
@@ -971,15 +1426,11 @@ static Err SndStreamCreateInternal(
 
         snd->volume = sndUnityGain;
         snd->pan = sndPanCenter;
+        snd->step = ((uint64_t)snd->rate << 16) / MIXER_RATE;
 
-        if ((snd->audio = module->ap->create(snd->pcm, snd->channels, snd->rate, module->ap->data)) != -1) {
-          if ((ptr = ptr_new(snd, SndStreamRefDestructor)) != -1) {
-            *channel = ptr;
-            err = errNone;
-          } else {
-            module->ap->destroy(snd->audio);
-            xfree(snd);
-          }
+        if (snd->rate > 0 && snd->rate <= 8 * MIXER_RATE && (ptr = ptr_new(snd, SndStreamRefDestructor)) != -1) {
+          *channel = ptr;
+          err = errNone;
         } else {
           xfree(snd);
         }
@@ -8,6 +8,7 @@
 #include "pwindow.h"
 #include "vfs.h"
 #include "pumpkin.h"
+#include "Lz77Mgr.h"
 #include "debug.h"
 #include "xalloc.h"
 
@@ -261,6 +262,8 @@ Err SysLibLoad(UInt32 libType, UInt32 libCreator, UInt16 *refNumP) {
     *refNumP = GPDLibRefNum;
   } else if (libType == sysFileTLibrary && libCreator == gpsLibCreator) {
     *refNumP = GPSLibRefNum;
+  } else if (libType == sysFileTLibrary && libCreator == lz77LibCreator) {
+    *refNumP = Lz77LibRefNum;
   } else {
     *refNumP = 0;
   }
@@ -280,6 +283,8 @@ Err SysLibFind(const Char *nameP, UInt16 *refNumP) {
     *refNumP = GPDLibRefNum;
   } else if (nameP && !StrCompare(nameP, gpsLibName)) {
     *refNumP = GPSLibRefNum;
+  } else if (nameP && !StrCompare(nameP, lz77LibName)) {
+    *refNumP = Lz77LibRefNum;
   } else {
     *refNumP = 0;
   }
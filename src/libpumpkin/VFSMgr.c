@@ -3,9 +3,13 @@
 
 #include "sys.h"
 #include "thread.h"
+#include "mutex.h"
 #include "pwindow.h"
 #include "vfs.h"
 #include "pumpkin.h"
+#include "AppRegistry.h"
+#include "storage.h"
+#include "bytes.h"
 #include "debug.h"
 #include "xalloc.h"
 
@@ -596,13 +600,120 @@ Err VFSRemoveFSLib(UInt16 fsLibRefNum) {
   return errNone;
 }
 
+// Reads the header of the PDB/PRC file f. The entry table follows the header.
+static Err VFSFileDBHeader(vfs_file_t *f, UInt8 *hdr, UInt32 *fileSizeP, UInt32 *entrySizeP, UInt16 *numRecsP) {
+  UInt16 attr;
+
+  *fileSizeP = vfs_seek(f, 0, 1);
+  if (*fileSizeP == 0xFFFFFFFF || *fileSizeP < PDB_HEADER_SIZE) return vfsErrBadData;
+  if (vfs_seek(f, 0, 0) != 0 || vfs_read(f, hdr, PDB_HEADER_SIZE) != PDB_HEADER_SIZE) return vfsErrBadData;
+
+  get2b(&attr, hdr, dmDBNameLength);
+  get2b(numRecsP, hdr, PDB_HEADER_SIZE - 2);
+  *entrySizeP = (attr & dmHdrAttrResDB) ? PDB_RES_ENTRY : PDB_REC_ENTRY;
+
+  return errNone;
+}
+
+// Reads entry index of the table and returns the offset and size of its data,
+// which ends where the next entry starts (or at the end of the file).
+static Err VFSFileDBEntry(vfs_file_t *f, UInt32 fileSize, UInt32 entrySize, UInt16 numRecs, UInt16 index, UInt8 *entry, UInt32 *offsetP, UInt32 *sizeP) {
+  UInt8 next[PDB_RES_ENTRY];
+  UInt32 pos, end, n;
+
+  if (index >= numRecs) return dmErrIndexOutOfRange;
+
+  pos = PDB_HEADER_SIZE + index * entrySize;
+  n = index < numRecs - 1 ? 2 * entrySize : entrySize;
+  if (vfs_seek(f, pos, 0) != pos || vfs_read(f, entry, entrySize) != entrySize) return vfsErrBadData;
+  if (n > entrySize && vfs_read(f, next, entrySize) != entrySize) return vfsErrBadData;
+
+  get4b(offsetP, entry, entrySize == PDB_RES_ENTRY ? 6 : 0);
+  if (n > entrySize) {
+    get4b(&end, next, entrySize == PDB_RES_ENTRY ? 6 : 0);
+  } else {
+    end = fileSize;
+  }
+  if (*offsetP > end || end > fileSize) return vfsErrBadData;
+  *sizeP = end - *offsetP;
+
+  return errNone;
+}
+
+static Err VFSFileDBRead(vfs_file_t *f, UInt32 offset, UInt32 size, MemHandle *hP) {
+  MemHandle h;
+  void *p;
+  Err err = memErrNotEnoughSpace;
+
+  *hP = NULL;
+  if (size == 0) return errNone;
+
+  if ((h = MemHandleNew(size)) != NULL) {
+    if ((p = MemHandleLock(h)) != NULL) {
+      err = (vfs_seek(f, offset, 0) == offset && vfs_read(f, p, size) == size) ? errNone : vfsErrBadData;
+      MemHandleUnlock(h);
+    }
+    if (err == errNone) {
+      *hP = h;
+    } else {
+      MemHandleFree(h);
+    }
+  }
+
+  return err;
+}
+
 Err VFSFileDBGetResource(FileRef ref, DmResType type, DmResID resID, MemHandle *resHP) {
-  debug(DEBUG_ERROR, PALMOS_MODULE, "VFSFileDBGetResource not implemented");
-  return sysErrParamErr;
+  vfs_file_t *f;
+  UInt8 hdr[PDB_HEADER_SIZE], entry[PDB_RES_ENTRY];
+  UInt32 fileSize, entrySize, resType, offset, size;
+  UInt16 numRecs, id, i;
+  Err err;
+
+  if (ref == NULL || vfs_type(ref) != VFS_FILE) return vfsErrFileBadRef;
+  if (resHP == NULL) return sysErrParamErr;
+  f = (vfs_file_t *)ref;
+
+  if ((err = VFSFileDBHeader(f, hdr, &fileSize, &entrySize, &numRecs)) != errNone) return err;
+  if (entrySize != PDB_RES_ENTRY) return dmErrNotResourceDB;
+
+  // the table is scanned sequentially, so the file buffer serves most reads
+  for (i = 0; i < numRecs; i++) {
+    if (vfs_read(f, entry, PDB_RES_ENTRY) != PDB_RES_ENTRY) return vfsErrBadData;
+    get4b(&resType, entry, 0);
+    get2b(&id, entry, 4);
+    if (resType == type && id == resID) {
+      if ((err = VFSFileDBEntry(f, fileSize, entrySize, numRecs, i, entry, &offset, &size)) != errNone) return err;
+      return VFSFileDBRead(f, offset, size, resHP);
+    }
+  }
+
+  return dmErrResourceNotFound;
 }
 
 Err VFSExportDatabaseToFileCustom(UInt16 volRefNum, const Char *pathNameP, UInt16 cardNo, LocalID dbID, VFSExportProcPtr exportProcP, void *userDataP) {
-  return vfsErrBadName;
+  vfs_module_t *module = (vfs_module_t *)thread_get(vfs_key);
+  vfs_file_t *f;
+  Err err = vfsErrBadName;
+
+  if (volRefNum != VOLREF) {
+    return vfsErrVolumeBadRef;
+  }
+
+  if (pathNameP && pathNameP[0]) {
+    buildpath(module, module->path, (char *)pathNameP);
+    if (vfs_checktype(module->session, module->path) != -1) {
+      err = vfsErrFileAlreadyExists;
+    } else if ((f = vfs_open(module->session, module->path, VFS_WRITE | VFS_TRUNC)) != NULL) {
+      err = StoExportDatabase(dbID, f, exportProcP, userDataP);
+      vfs_close(f);
+      if (err != errNone) {
+        vfs_unlink(module->session, module->path);
+      }
+    }
+  }
+
+  return err;
 }
 
 Err VFSExportDatabaseToFile(UInt16 volRefNum, const Char *pathNameP, UInt16 cardNo, LocalID dbID) {
@@ -610,8 +721,29 @@ Err VFSExportDatabaseToFile(UInt16 volRefNum, const Char *pathNameP, UInt16 card
 }
 
 Err VFSImportDatabaseFromFileCustom(UInt16 volRefNum, const Char *pathNameP, UInt16 *cardNoP, LocalID *dbIDP, VFSImportProcPtr importProcP, void *userDataP) {
-  debug(DEBUG_ERROR, PALMOS_MODULE, "VFSImportDatabaseFromFileCustom not implemented");
-  return sysErrParamErr;
+  vfs_module_t *module = (vfs_module_t *)thread_get(vfs_key);
+  vfs_file_t *f;
+  LocalID dbID;
+  Err err = vfsErrBadName;
+
+  if (volRefNum != VOLREF) {
+    return vfsErrVolumeBadRef;
+  }
+
+  if (pathNameP && pathNameP[0]) {
+    buildpath(module, module->path, (char *)pathNameP);
+    if ((f = vfs_open(module->session, module->path, VFS_READ)) != NULL) {
+      err = StoImportDatabase(f, false, &dbID, importProcP, userDataP);
+      vfs_close(f);
+      // the existing database is also returned when err is dmErrAlreadyExists
+      if (cardNoP) *cardNoP = 0;
+      if (dbIDP) *dbIDP = dbID;
+    } else {
+      err = vfsErrFileNotFound;
+    }
+  }
+
+  return err;
 }
 
 Err VFSImportDatabaseFromFile(UInt16 volRefNum, const Char *pathNameP, UInt16 *cardNoP, LocalID *dbIDP) {
@@ -619,8 +751,23 @@ Err VFSImportDatabaseFromFile(UInt16 volRefNum, const Char *pathNameP, UInt16 *c
 }
 
 Err VFSFileDBGetRecord(FileRef ref, UInt16 recIndex, MemHandle *recHP, UInt8 *recAttrP, UInt32 *uniqueIDP) {
-  debug(DEBUG_ERROR, PALMOS_MODULE, "VFSFileDBGetRecord not implemented");
-  return sysErrParamErr;
+  vfs_file_t *f;
+  UInt8 hdr[PDB_HEADER_SIZE], entry[PDB_REC_ENTRY];
+  UInt32 fileSize, entrySize, offset, size;
+  UInt16 numRecs;
+  Err err;
+
+  if (ref == NULL || vfs_type(ref) != VFS_FILE) return vfsErrFileBadRef;
+  f = (vfs_file_t *)ref;
+
+  if ((err = VFSFileDBHeader(f, hdr, &fileSize, &entrySize, &numRecs)) != errNone) return err;
+  if (entrySize != PDB_REC_ENTRY) return dmErrNotRecordDB;
+  if ((err = VFSFileDBEntry(f, fileSize, entrySize, numRecs, recIndex, entry, &offset, &size)) != errNone) return err;
+
+  if (recAttrP) *recAttrP = entry[4];
+  if (uniqueIDP) *uniqueIDP = ((UInt32)entry[5] << 16) | ((UInt32)entry[6] << 8) | entry[7];
+
+  return recHP ? VFSFileDBRead(f, offset, size, recHP) : errNone;
 }
 
 Err VFSFileDBInfo(FileRef ref, Char *nameP,
@@ -629,8 +776,58 @@ Err VFSFileDBInfo(FileRef ref, Char *nameP,
           UInt32 *modNumP, MemHandle *appInfoHP,
           MemHandle *sortInfoHP, UInt32 *typeP,
           UInt32 *creatorP, UInt16 *numRecordsP) {
-  debug(DEBUG_ERROR, PALMOS_MODULE, "VFSFileDBInfo not implemented");
-  return sysErrParamErr;
+  vfs_file_t *f;
+  UInt8 hdr[PDB_HEADER_SIZE], entry[PDB_RES_ENTRY];
+  UInt32 fileSize, entrySize, appInfo, sortInfo, firstOffset, size;
+  UInt16 numRecs;
+  Err err;
+
+  if (ref == NULL || vfs_type(ref) != VFS_FILE) return vfsErrFileBadRef;
+  f = (vfs_file_t *)ref;
+
+  if (appInfoHP) *appInfoHP = NULL;
+  if (sortInfoHP) *sortInfoHP = NULL;
+  if ((err = VFSFileDBHeader(f, hdr, &fileSize, &entrySize, &numRecs)) != errNone) return err;
+
+  if (nameP) {
+    MemMove(nameP, hdr, dmDBNameLength - 1);
+    nameP[dmDBNameLength - 1] = 0;
+  }
+  if (attributesP) get2b(attributesP, hdr, dmDBNameLength);
+  if (versionP) get2b(versionP, hdr, dmDBNameLength + 2);
+  if (crDateP) get4b(crDateP, hdr, dmDBNameLength + 4);
+  if (modDateP) get4b(modDateP, hdr, dmDBNameLength + 8);
+  if (bckUpDateP) get4b(bckUpDateP, hdr, dmDBNameLength + 12);
+  if (modNumP) get4b(modNumP, hdr, dmDBNameLength + 16);
+  if (typeP) get4b(typeP, hdr, dmDBNameLength + 28);
+  if (creatorP) get4b(creatorP, hdr, dmDBNameLength + 32);
+  if (numRecordsP) *numRecordsP = numRecs;
+
+  if (appInfoHP || sortInfoHP) {
+    get4b(&appInfo, hdr, dmDBNameLength + 20);
+    get4b(&sortInfo, hdr, dmDBNameLength + 24);
+    // appInfo and sortInfo end where the next block starts
+    firstOffset = fileSize;
+    if (numRecs && VFSFileDBEntry(f, fileSize, entrySize, numRecs, 0, entry, &firstOffset, &size) != errNone) return vfsErrBadData;
+
+    if (appInfoHP && appInfo) {
+      size = (sortInfo > appInfo ? sortInfo : firstOffset);
+      if (size < appInfo) return vfsErrBadData;
+      if ((err = VFSFileDBRead(f, appInfo, size - appInfo, appInfoHP)) != errNone) return err;
+    }
+    if (sortInfoHP && sortInfo) {
+      if (firstOffset < sortInfo) return vfsErrBadData;
+      if ((err = VFSFileDBRead(f, sortInfo, firstOffset - sortInfo, sortInfoHP)) != errNone) {
+        if (appInfoHP && *appInfoHP) {
+          MemHandleFree(*appInfoHP);
+          *appInfoHP = NULL;
+        }
+        return err;
+      }
+    }
+  }
+
+  return errNone;
 }
 
 Err VFSChangeDir(UInt16 volRefNum, char *path) {
@@ -1397,26 +1397,70 @@ void WinInvertRectangleFrame(FrameType frame, const RectangleType *rP) {
   }
 }
 
+// 4 bpp bitmaps keep the even pixel on the low nibble, so their bytes are
+// swapped to turn a row into a plain MSB first bit stream.
+#define WinRowByte(b, swap) ((swap) ? (UInt8)(((b) << 4) | ((b) >> 4)) : (UInt8)(b))
+
+// Copies n bits of a row of a 1/2/4 bpp bitmap. Source and destination may
+// overlap, because the source bits are gathered into tmp before being written.
+static void WinCopyRowBits(UInt8 *dst, UInt32 dstBit, UInt8 *src, UInt32 srcBit, UInt32 n, UInt8 *tmp, Boolean swap) {
+  UInt32 k, nb, s, bits;
+  UInt8 *p, mask, v, b;
+
+  if ((srcBit & 7) == 0 && (dstBit & 7) == 0 && (n & 7) == 0) {
+    MemMove(dst + (dstBit >> 3), src + (srcBit >> 3), n >> 3);
+    return;
+  }
+
+  p = src + (srcBit >> 3);
+  s = srcBit & 7;
+  nb = (n + 7) >> 3;
+  for (k = 0; k < nb; k++) {
+    b = WinRowByte(p[k], swap) << s;
+    if (s && k*8 + 8 - s < n) b |= WinRowByte(p[k+1], swap) >> (8 - s);
+    tmp[k] = b;
+  }
+
+  s = dstBit & 7;
+  for (k = 0; k < n; k += 8) {
+    bits = (n - k) < 8 ? (n - k) : 8;
+    mask = (UInt8)(0xFF << (8 - bits));
+    v = tmp[k >> 3] & mask;
+    p = dst + ((dstBit + k) >> 3);
+    b = WinRowByte(p[0], swap);
+    b = (b & ~(mask >> s)) | (v >> s);
+    p[0] = WinRowByte(b, swap);
+    if (s + bits > 8) {
+      b = WinRowByte(p[1], swap);
+      b = (b & ~(UInt8)(mask << (8 - s))) | (UInt8)(v << (8 - s));
+      p[1] = WinRowByte(b, swap);
+    }
+  }
+}
+
 void WinCopyBitmap(BitmapType *srcBmp, WinHandle dst, RectangleType *srcRect, Coord dstX, Coord dstY) {
   win_module_t *module = (win_module_t *)thread_get(win_key);
   BitmapType *dstBmp;
-  UInt32 srcSize, dstSize, pixelSize, srcLineSize, dstLineSize, srcOffset, dstOffset, len;
+  UInt32 srcSize, dstSize, srcOffset, dstOffset, len;
   RectangleType dstRect, aux, clip, intersection, *dirtyRect;
-  UInt16 depth;
+  UInt16 depth, srcLineSize, dstLineSize;
+  Int32 srcInc, dstInc;
   Boolean clipping;
   Coord srcWidth, srcHeight, dstWidth, dstHeight, dx, dy, y;
-  UInt8 *srcBits, *dstBits;
+  UInt8 *srcBits, *dstBits, *tmp;
 
   dstBmp = WinGetBitmap(dst);
   depth = BmpGetBitDepth(srcBmp);
   dirtyRect = NULL;
 
   switch (depth) {
+    case  1:
+    case  2:
+    case  4:
     case  8:
     case 16:
     case 24:
     case 32:
-      pixelSize = depth >> 3;
       break;
     default:
       // not supported
@@ -1429,8 +1473,8 @@ void WinCopyBitmap(BitmapType *srcBmp, WinHandle dst, RectangleType *srcRect, Co
     BmpGetSizes(dstBmp, &dstSize, NULL);
     srcBits = BmpGetBits(srcBmp);
     dstBits = BmpGetBits(dstBmp);
-    BmpGetDimensions(srcBmp, &srcWidth, &srcHeight, NULL);
-    BmpGetDimensions(dstBmp, &dstWidth, &dstHeight, NULL);
+    BmpGetDimensions(srcBmp, &srcWidth, &srcHeight, &srcLineSize);
+    BmpGetDimensions(dstBmp, &dstWidth, &dstHeight, &dstLineSize);
     clipping = (dst->clippingBounds.right > dst->clippingBounds.left) && (dst->clippingBounds.bottom > dst->clippingBounds.top);
 
     if (srcRect == NULL && dstX == 0 && dstY == 0 && srcSize == dstSize && !clipping) {
@@ -1488,32 +1532,49 @@ void WinCopyBitmap(BitmapType *srcBmp, WinHandle dst, RectangleType *srcRect, Co
       if (dstRect.extent.x > 0 && dstRect.extent.y > 0) {
         dirtyRect = &dstRect;
 
-        if (srcWidth == dstWidth &&
+        if (srcWidth == dstWidth && srcLineSize == dstLineSize &&
             srcRect->topLeft.x == 0 && srcRect->extent.x == srcWidth &&
             dstRect.topLeft.x == 0 && dstRect.extent.x == dstWidth) {
 
           // copy a full width rectangle (2nd best case)
-          srcLineSize = srcWidth * pixelSize;
           srcOffset = srcRect->topLeft.y * srcLineSize;
           dstOffset = dstRect.topLeft.y * srcLineSize;
-          srcBits += srcOffset;
-          dstBits += dstOffset;
           len = srcRect->extent.y * srcLineSize;
-          MemMove(dstBits, srcBits, len);
+          MemMove(dstBits + dstOffset, srcBits + srcOffset, len);
 
         } else {
           // copy an arbitraty rectangle (generic case)
-          srcLineSize = srcWidth * pixelSize;
-          dstLineSize = dstWidth * pixelSize;
-          srcOffset = srcRect->topLeft.y * srcLineSize + srcRect->topLeft.x * pixelSize;
-          dstOffset = dstRect.topLeft.y * dstLineSize + dstRect.topLeft.x * pixelSize;
+          srcInc = srcLineSize;
+          dstInc = dstLineSize;
+          srcOffset = srcRect->topLeft.y * srcLineSize;
+          dstOffset = dstRect.topLeft.y * dstLineSize;
+          if (srcBits == dstBits && dstRect.topLeft.y > srcRect->topLeft.y) {
+            // scrolling down on the same bitmap, copy the rows from the bottom up
+            srcOffset += (srcRect->extent.y - 1) * srcLineSize;
+            dstOffset += (srcRect->extent.y - 1) * dstLineSize;
+            srcInc = -srcInc;
+            dstInc = -dstInc;
+          }
           srcBits += srcOffset;
           dstBits += dstOffset;
-          len = srcRect->extent.x * pixelSize;
-          for (y = 0; y < srcRect->extent.y; y++) {
-            MemMove(dstBits, srcBits, len);
-            srcBits += srcLineSize;
-            dstBits += dstLineSize;
+
+          if (depth >= 8) {
+            len = srcRect->extent.x * (depth >> 3);
+            srcBits += srcRect->topLeft.x * (depth >> 3);
+            dstBits += dstRect.topLeft.x * (depth >> 3);
+            for (y = 0; y < srcRect->extent.y; y++) {
+              MemMove(dstBits, srcBits, len);
+              srcBits += srcInc;
+              dstBits += dstInc;
+            }
+          } else if ((tmp = xcalloc(1, srcLineSize + 1)) != NULL) {
+            len = srcRect->extent.x * depth;
+            for (y = 0; y < srcRect->extent.y; y++) {
+              WinCopyRowBits(dstBits, dstRect.topLeft.x * depth, srcBits, srcRect->topLeft.x * depth, len, tmp, depth == 4);
+              srcBits += srcInc;
+              dstBits += dstInc;
+            }
+            xfree(tmp);
           }
         }
       }
@@ -1556,8 +1617,8 @@ void WinBlitBitmap(BitmapType *bitmapP, WinHandle wh, const RectangleType *rect,
 //debug(1, "XXX", "WinBlitBitmap %d,%d text %d bitmap density %d window density %d", x, y, text, bitmapDensity, windowDensity);
 
 #ifndef ANDROID
-      if (bitmapDensity == windowDensity && bitmapDepth == windowDepth && bitmapDepth >= 8 && !bitmapTransp && mode == winPaint && !text) {
-        // it is possible to use fast copy
+      if (bitmapDensity == windowDensity && bitmapDepth == windowDepth && (bitmapDepth >= 8 || best == windowBitmap) && !bitmapTransp && mode == winPaint && !text) {
+        // it is possible to use fast copy (at any depth when scrolling inside the same bitmap)
         RctCopyRectangle(rect, &srcRect);
         coordSys = module->coordSys;
         if (bitmapDensity == kDensityDouble && coordSys == kCoordinatesStandard) {
@@ -1806,6 +1867,283 @@ void WinDrawBitmap(BitmapType *bitmapP, Coord x, Coord y) {
   WinSetDrawMode(prev);
 }
 
+// Glyph masks are the 1bpp strip of a font bitmap expanded to one byte per
+// pixel, already scaled to the density of the destination window (a low
+// density font drawn on a double density window gets a 2x mask). They hang
+// from the font (glyphs field) and live as long as the font does.
+
+typedef struct win_glyphs_t {
+  BitmapType *bmp;
+  UInt16 density;
+  UInt16 scale;
+  Coord width, height;
+  UInt8 *mask;
+  struct win_glyphs_t *next;
+} win_glyphs_t;
+
+// State of a text run: destination, clipping and colors are resolved once
+// per WinDrawChars call instead of once per pixel.
+
+typedef struct {
+  WinHandle wh;
+  WinDrawOperation mode;
+  Boolean fast, mirror, dirty;
+  UInt16 density, coordSys;
+  BitmapType *windowBitmap, *displayBitmap;
+  Coord x1, y1, x2, y2, x3, y3, x4, y4, ax, ay;
+  UInt32 tc, bc, tcd, bcd;
+  Coord dx1, dy1, dx2, dy2;
+} win_text_t;
+
+void WinFreeGlyphs(void *glyphs) {
+  win_glyphs_t *g, *next;
+
+  for (g = (win_glyphs_t *)glyphs; g; g = next) {
+    next = g->next;
+    xfree(g->mask);
+    xfree(g);
+  }
+}
+
+static win_glyphs_t *WinGetGlyphs(void **head, BitmapType *bmp, UInt16 density, UInt16 scale) {
+  win_glyphs_t *g, *first, *aux;
+  UInt8 *bits, *row, b;
+  Coord width, height, x, y, i;
+  UInt16 rowBytes;
+
+  for (g = (win_glyphs_t *)(*head); g; g = g->next) {
+    if (g->bmp == bmp && g->density == density && g->scale == scale) return g;
+  }
+
+  if (BmpGetBitDepth(bmp) != 1 || (bits = BmpGetBits(bmp)) == NULL) return NULL;
+  BmpGetDimensions(bmp, &width, &height, &rowBytes);
+  if (width <= 0 || height <= 0) return NULL;
+
+  if ((g = xcalloc(1, sizeof(win_glyphs_t))) == NULL) return NULL;
+  if ((g->mask = xcalloc(width * scale * height * scale, 1)) == NULL) {
+    xfree(g);
+    return NULL;
+  }
+  g->bmp = bmp;
+  g->density = density;
+  g->scale = scale;
+  g->width = width * scale;
+  g->height = height * scale;
+
+  for (y = 0; y < height; y++) {
+    row = &g->mask[y * scale * g->width];
+    for (x = 0; x < width; x++) {
+      b = (bits[y * rowBytes + (x >> 3)] >> (7 - (x & 0x07))) & 1;
+      for (i = 0; i < scale; i++) row[x * scale + i] = b;
+    }
+    for (i = 1; i < scale; i++) {
+      MemMove(row + i * g->width, row, g->width);
+    }
+  }
+
+  // fonts are shared by all tasks, so publish the new mask without a lock
+  for (;;) {
+    first = (win_glyphs_t *)(*head);
+    for (aux = first; aux; aux = aux->next) {
+      if (aux->bmp == bmp && aux->density == density && aux->scale == scale) {
+        // another task built the same mask in the meantime
+        WinFreeGlyphs(g);
+        return aux;
+      }
+    }
+    g->next = first;
+    if (__sync_bool_compare_and_swap(head, first, g)) break;
+  }
+
+  return g;
+}
+
+static void WinBeginText(win_module_t *module, win_text_t *t) {
+  UInt16 windowDepth, displayDepth;
+
+  t->wh = module->drawWindow;
+  t->mode = module->transferMode;
+  t->windowBitmap = WinGetBitmap(t->wh);
+  t->displayBitmap = WinGetBitmap(module->displayWindow);
+  t->density = BmpGetDensity(t->windowBitmap);
+  t->coordSys = module->coordSys;
+  t->mirror = t->wh == module->activeWindow && t->wh != module->displayWindow;
+  t->dirty = false;
+
+  windowDepth = BmpGetBitDepth(t->windowBitmap);
+  displayDepth = BmpGetBitDepth(t->displayBitmap);
+
+  // only the common case is composed directly, everything else goes through WinBlitBitmap
+  t->fast = t->mode == winPaint && BmpGetBits(t->windowBitmap) != NULL &&
+            (windowDepth == 8 || windowDepth == 16 || windowDepth == 32) &&
+            (!t->mirror || displayDepth == 8 || displayDepth == 16 || displayDepth == 32);
+  if (!t->fast) return;
+
+  t->x1 = t->wh->clippingBounds.left;
+  t->x2 = t->wh->clippingBounds.right;
+  t->y1 = t->wh->clippingBounds.top;
+  t->y2 = t->wh->clippingBounds.bottom;
+  if (!(t->x1 == 0 && t->x2 == 0) && t->density == kDensityLow) {
+    t->x1 = t->x1 >> 1;
+    t->y1 = t->y1 >> 1;
+    t->x2 = t->x2 >> 1;
+    t->y2 = t->y2 >> 1;
+  }
+
+  t->x3 = module->displayWindow->clippingBounds.left;
+  t->x4 = module->displayWindow->clippingBounds.right;
+  t->y3 = module->displayWindow->clippingBounds.top;
+  t->y4 = module->displayWindow->clippingBounds.bottom;
+
+  t->ax = t->wh->windowBounds.topLeft.x;
+  t->ay = t->wh->windowBounds.topLeft.y;
+  if (t->density == kDensityDouble) {
+    t->ax <<= 1;
+    t->ay <<= 1;
+  }
+
+  t->tc = windowDepth == 16 ? module->textColor565 : module->textColor;
+  t->bc = windowDepth == 16 ? module->backColor565 : module->backColor;
+  t->tcd = displayDepth == 16 ? module->textColor565 : module->textColor;
+  t->bcd = displayDepth == 16 ? module->backColor565 : module->backColor;
+}
+
+// Writes one glyph row from the mask into a bitmap, using the same pixel
+// encoding as BmpCopyBit in winPaint mode.
+
+static void WinPutGlyphRow(BitmapType *dst, Coord dx, Coord dy, UInt8 *mask, Coord n, Coord x1, Coord x2, Coord y1, Coord y2, UInt32 tc, UInt32 bc) {
+  UInt8 *bits, on[4], off[4];
+  Coord j, j0, j1;
+
+  if (dy < 0 || dy >= dst->height) return;
+  if (!(x1 == 0 && x2 == 0) && (dy < y1 || dy > y2)) return;
+
+  // clip [dx, dx+n) to the bitmap and to the clipping bounds
+  j0 = dx < 0 ? -dx : 0;
+  j1 = (dx + n > dst->width) ? dst->width - dx : n;
+  if (!(x1 == 0 && x2 == 0)) {
+    if (dx + j0 < x1) j0 = x1 - dx;
+    if (dx + j1 - 1 > x2) j1 = x2 - dx + 1;
+  }
+  if (j0 >= j1) return;
+
+  bits = (UInt8 *)BmpGetBits(dst) + dy * dst->rowBytes;
+
+  switch (BmpGetBitDepth(dst)) {
+    case 8:
+      bits += dx;
+      for (j = j0; j < j1; j++) {
+        bits[j] = mask[j] ? tc : bc;
+      }
+      break;
+    case 16:
+      put2b(tc, on, 0);
+      put2b(bc, off, 0);
+      bits += dx * 2;
+      for (j = j0; j < j1; j++) {
+        bits[j*2]   = mask[j] ? on[0] : off[0];
+        bits[j*2+1] = mask[j] ? on[1] : off[1];
+      }
+      break;
+    case 32:
+      put4l(tc, on, 0);
+      put4l(bc, off, 0);
+      bits += dx * 4;
+      for (j = j0; j < j1; j++) {
+        MemMove(&bits[j*4], mask[j] ? on : off, 4);
+      }
+      break;
+  }
+}
+
+static void WinDrawGlyph(win_text_t *t, void **glyphs, BitmapType *bmp, RectangleType *rect, Coord x, Coord y) {
+  win_glyphs_t *g;
+  UInt16 bitmapDensity, scale;
+  Coord srcX, srcY, w, h, dstX, dstY, i;
+  UInt8 *mask;
+
+  if (t->fast) {
+    bitmapDensity = BmpGetDensity(bmp);
+
+    if (!(bitmapDensity == kDensityDouble && t->density == kDensityLow)) {
+      scale = (bitmapDensity == kDensityLow && t->density == kDensityDouble) ? 2 : 1;
+
+      if ((g = WinGetGlyphs(glyphs, bmp, t->density, scale)) != NULL) {
+        srcX = rect->topLeft.x;
+        srcY = rect->topLeft.y;
+        w = rect->extent.x;
+        h = rect->extent.y;
+        dstX = x;
+        dstY = y;
+
+        // same coordinate adjustments done by WinBlitBitmap
+        if (bitmapDensity == kDensityLow && t->coordSys == kCoordinatesDouble) {
+          srcX >>= 1;
+          srcY >>= 1;
+          w >>= 1;
+          h >>= 1;
+        } else if (bitmapDensity == kDensityDouble && t->coordSys == kCoordinatesStandard) {
+          srcX <<= 1;
+          srcY <<= 1;
+          w <<= 1;
+          h <<= 1;
+        }
+
+        if (t->density == kDensityLow && t->coordSys == kCoordinatesDouble) {
+          dstX >>= 1;
+          dstY >>= 1;
+        } else if (t->density == kDensityDouble && t->coordSys == kCoordinatesStandard) {
+          dstX <<= 1;
+          dstY <<= 1;
+        }
+
+        srcX *= scale;
+        srcY *= scale;
+        w *= scale;
+        h *= scale;
+        if (srcX < 0 || srcY < 0) return;
+        if (srcX + w > g->width) w = g->width - srcX;
+        if (srcY + h > g->height) h = g->height - srcY;
+        if (w <= 0 || h <= 0) return;
+
+        for (i = 0; i < h; i++) {
+          mask = &g->mask[(srcY + i) * g->width + srcX];
+          WinPutGlyphRow(t->windowBitmap, dstX, dstY + i, mask, w, t->x1, t->x2, t->y1, t->y2, t->tc, t->bc);
+          if (t->mirror) {
+            WinPutGlyphRow(t->displayBitmap, t->ax + dstX, t->ay + dstY + i, mask, w, t->x3, t->x4, t->y3, t->y4, t->tcd, t->bcd);
+          }
+        }
+
+        if (t->dirty) {
+          if (dstX < t->dx1) t->dx1 = dstX;
+          if (dstY < t->dy1) t->dy1 = dstY;
+          if (dstX + w > t->dx2) t->dx2 = dstX + w;
+          if (dstY + h > t->dy2) t->dy2 = dstY + h;
+        } else {
+          t->dx1 = dstX;
+          t->dy1 = dstY;
+          t->dx2 = dstX + w;
+          t->dy2 = dstY + h;
+          t->dirty = true;
+        }
+        return;
+      }
+    }
+  }
+
+  WinBlitBitmap(bmp, t->wh, rect, x, y, t->mode, true);
+}
+
+static void WinEndText(win_module_t *module, win_text_t *t) {
+  if (t->dirty) {
+    dbg_update(t->windowBitmap);
+    if (t->mirror) dbg_update(t->displayBitmap);
+    if (t->wh == module->activeWindow || t->wh == module->displayWindow) {
+      pumpkin_screen_dirty(t->wh, t->dx1, t->dy1, t->dx2 - t->dx1, t->dy2 - t->dy1);
+    }
+  }
+}
+
 static void WinDrawCharsC(uint8_t *chars, Int16 len, Coord x, Coord y, int max) {
   win_module_t *module = (win_module_t *)thread_get(win_key);
   FontType *f;
@@ -1816,6 +2154,7 @@ static void WinDrawCharsC(uint8_t *chars, Int16 len, Coord x, Coord y, int max)
   UInt16 prev, wch;
   Boolean v10;
   RectangleType rect;
+  win_text_t t;
   uint16_t ch;
   uint32_t i, col, mult;
   int32_t index;
@@ -1857,6 +2196,7 @@ static void WinDrawCharsC(uint8_t *chars, Int16 len, Coord x, Coord y, int max)
 */
       }
 
+      WinBeginText(module, &t);
       for (i = 0; i < len;) {
         i += pumpkin_next_char(chars, i, &wch);
         ch = pumpkin_map_char(wch, &f);
@@ -1865,13 +2205,14 @@ static void WinDrawCharsC(uint8_t *chars, Int16 len, Coord x, Coord y, int max)
           col = f->column[ch - f->firstChar];
           RctSetRectangle(&rect, col, 0, f->width[ch - f->firstChar], f->fRectHeight);
 //debug(1, "XXX", "WinDrawCharsC '%c' rect %d,%d %d,%d at %d,%d", ch, rect.topLeft.x, rect.topLeft.y, rect.extent.x, rect.extent.y, x, y);
-          WinBlitBitmap(f->bmp, module->drawWindow, &rect, x, y, module->transferMode, true);
+          WinDrawGlyph(&t, &f->glyphs, f->bmp, &rect, x, y);
           x += f->width[ch - f->firstChar];
         } else {
           debug(DEBUG_ERROR, "Window", "missing symbol 0x%04X", wch);
           x += MISSING_SYMBOL_WIDTH;
         }
       }
+      WinEndText(module, &t);
     } else {
       f2 = (FontTypeV2 *)f;
       density = BmpGetDensity(WinGetBitmap(module->drawWindow));
@@ -1916,6 +2257,7 @@ static void WinDrawCharsC(uint8_t *chars, Int16 len, Coord x, Coord y, int max)
         }
 
         if (index >= 0) {
+          WinBeginText(module, &t);
           for (i = 0; i < len;) {
             i += pumpkin_next_char(chars, i, &wch);
             ch = pumpkin_map_char(wch, &f);
@@ -1925,13 +2267,14 @@ static void WinDrawCharsC(uint8_t *chars, Int16 len, Coord x, Coord y, int max)
               col = f2->column[ch - f2->firstChar]*mult;
               RctSetRectangle(&rect, col, 0, f2->width[ch - f2->firstChar]*mult, f2->fRectHeight*mult);
 //debug(1, "XXX", "WinDrawCharsC '%c' rect %d,%d %d,%d at %d,%d", ch, rect.topLeft.x, rect.topLeft.y, rect.extent.x, rect.extent.y, x, y);
-              WinBlitBitmap(f2->bmp[index], module->drawWindow, &rect, x, y, module->transferMode, true);
+              WinDrawGlyph(&t, &f2->glyphs, f2->bmp[index], &rect, x, y);
               x += f2->width[ch - f2->firstChar]*mult;
             } else {
               debug(DEBUG_ERROR, "Window", "missing symbol 0x%04X", wch);
               x += MISSING_SYMBOL_WIDTH;
             }
           }
+          WinEndText(module, &t);
           WinSetCoordinateSystem(prev);
         }
     }
@@ -2740,7 +3083,7 @@ void WinScrollRectangle(const RectangleType *rP, WinDirectionType direction, Coo
           RctSetRectangle(vacatedP, rP->topLeft.x + rP->extent.x - distance, rP->topLeft.y, distance, rP->extent.y);
           break;
         case winRight:
-          RctSetRectangle(&rect, rP->topLeft.y, rP->topLeft.x, rP->extent.x - distance, rP->extent.y);
+          RctSetRectangle(&rect, rP->topLeft.x, rP->topLeft.y, rP->extent.x - distance, rP->extent.y);
           WinCopyRectangle(module->drawWindow, module->drawWindow, &rect, rP->topLeft.x + distance, rP->topLeft.y, winPaint);
           RctSetRectangle(vacatedP, rP->topLeft.x, rP->topLeft.y, distance, rP->extent.y);
           break;
@@ -3097,78 +3440,85 @@ static Boolean isLineBreak(Char c) {
   return c == '\r' || c == '\n';
 }
 
-void WinDrawCharBox(Char *text, UInt16 len, FontID font, RectangleType *bounds, Boolean draw, UInt16 *drawnLines, UInt16 *totalLines, UInt16 *maxWidth, LineInfoType *lineInfo, UInt16 maxLines) {
-  UInt16 drawn, total, start, span;
-  UInt16 i, tw, th, x, y;
-  UInt16 lastSpaceOffset, width;
+// Wraps a single line of text starting at offset start, using the current font.
+// Returns the offset where the next line starts and stores the line length in *length.
+// If scanned is not NULL, it gets the offset just past the last character examined.
+
+UInt16 WinWrapLineEx(Char *text, UInt16 len, UInt16 start, Coord width, UInt16 *length, UInt16 *scanned) {
+  UInt16 i, tw, x, span, lastSpaceOffset;
   Boolean hasSpace;
-  FontID old;
   Char c;
 
+  x = 0;
+  lastSpaceOffset = 0;
+  hasSpace = false;
+
+  for (i = start; i < len;) {
+    c = text[i];
+    debug(DEBUG_TRACE, "Window", "WinWrapLine: char %d \'%c\'", i, c);
+    tw = FntCharWidth(c);
+    if (isSpace(c)) {
+      lastSpaceOffset = i;
+      hasSpace = true;
+    }
+    i++;
+    if (isLineBreak(c) || x + tw >= width) {
+      debug(DEBUG_TRACE, "Window", "WinWrapLine: line break x=%d tw=%d bounds=%d", x, tw, width);
+      if (!isLineBreak(c) && hasSpace) {
+        span = lastSpaceOffset - start;
+      } else {
+        // XXX fica uma caracter a mais no fim da linha. com -1 resolve, mas da crash com ENTER
+        span = i /*- 1*/ - start;
+      }
+      *length = span;
+      if (scanned) *scanned = i;
+      for (start += span; start < len && isSpace(text[start]); start++);
+      return start;
+    }
+    if (!isLineBreak(c)) x += tw;
+  }
+
+  *length = i - start;
+  if (scanned) *scanned = i;
+  return i;
+}
+
+UInt16 WinWrapLine(Char *text, UInt16 len, UInt16 start, Coord width, UInt16 *length) {
+  return WinWrapLineEx(text, len, start, width, length, NULL);
+}
+
+void WinDrawCharBox(Char *text, UInt16 len, FontID font, RectangleType *bounds, Boolean draw, UInt16 *drawnLines, UInt16 *totalLines, UInt16 *maxWidth, LineInfoType *lineInfo, UInt16 maxLines) {
+  UInt16 drawn, total, start, next, span;
+  UInt16 i, th, y;
+  UInt16 width;
+  FontID old;
+
   old = FntSetFont(font);
   th = FntCharHeight();
   drawn = 0;
   total = 0;
   start = 0;
-  x = 0;
   y = 0;
-  lastSpaceOffset = 0;
-  hasSpace = false;
   if (maxWidth) *maxWidth = 0;
 
   if (text && len && bounds) {
     debug(DEBUG_TRACE, "Window", "WinDrawCharBox: text \"%.*s\"", len, text);
 
-    for (i = 0; i < len && (!lineInfo || total < maxLines);) {
-      c = text[i];
-      debug(DEBUG_TRACE, "Window", "WinDrawCharBox: char %d \'%c\'", i, c);
-      tw = FntCharWidth(c);
-      if (isSpace(c)) {
-        lastSpaceOffset = i;
-        hasSpace = true;
-      }
-      i++;
-      if (isLineBreak(c) || x + tw >= bounds->extent.x) {
-        debug(DEBUG_TRACE, "Window", "WinDrawCharBox: line break x=%d tw=%d bounds=%d", x, tw, bounds->extent.x);
-        if (!isLineBreak(c) && hasSpace) {
-          span = lastSpaceOffset - start;
-        } else {
-          // XXX fica uma caracter a mais no fim da linha. com -1 resolve, mas da crash com ENTER
-          span = i /*- 1*/ - start;
-        }
-        if ((y + th) <= bounds->extent.y) {
-          if (draw) WinDrawChars(&text[start], span, bounds->topLeft.x, bounds->topLeft.y + y);
-          width = FntCharsWidth(&text[start], span);
-          if (maxWidth && width > *maxWidth) *maxWidth = width;
-          drawn++;
-        }
-        if (lineInfo) {
-          lineInfo[total].start = start;
-          lineInfo[total].length = span;
-        }
-        for (start += span; isSpace(text[start]) && start < len; start++);
-        i = start;
-        debug(DEBUG_TRACE, "Window", "WinDrawCharBox: i=start=%d", i);
-        x = 0;
-        y += th;
-        lastSpaceOffset = 0;
-        hasSpace = false;
-        total++;
-      }
-      if (!isLineBreak(c)) x += tw;
-    }
-    debug(DEBUG_TRACE, "Window", "WinDrawCharBox: end loop len=%d i=%d start=%d", len, i, start);
-    if (i > start) {
+    while (start < len && (!lineInfo || total < maxLines)) {
+      next = WinWrapLine(text, len, start, bounds->extent.x, &span);
       if ((y + th) <= bounds->extent.y) {
-        if (draw) WinDrawChars(&text[start], i - start, bounds->topLeft.x, bounds->topLeft.y + y);
-        width = FntCharsWidth(&text[start], i - start);
+        if (draw) WinDrawChars(&text[start], span, bounds->topLeft.x, bounds->topLeft.y + y);
+        width = FntCharsWidth(&text[start], span);
         if (maxWidth && width > *maxWidth) *maxWidth = width;
         drawn++;
       }
       if (lineInfo) {
         lineInfo[total].start = start;
-        lineInfo[total].length = i - start;
+        lineInfo[total].length = span;
       }
+      debug(DEBUG_TRACE, "Window", "WinDrawCharBox: next line at %d", next);
+      start = next;
+      y += th;
       total++;
     }
   }
@@ -0,0 +1,8 @@
+// System-wide alarm scheduler. Alarms are kept in a min-heap ordered by
+// time and persisted in the app registry. A timer thread waits for the
+// earliest alarm and flags it as pending, the event loop of the launcher
+// (or of the single task) then calls AlmAlarmCallback to deliver it.
+
+int AlmInitGlobal(AppRegistryType *ar);
+int AlmFinishGlobal(void);
+int AlmPending(void);
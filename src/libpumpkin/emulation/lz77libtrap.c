@@ -0,0 +1,151 @@
+#include <PalmOS.h>
+#include <VFSMgr.h>
+
+#include "sys.h"
+#ifdef ARMEMU
+#include "armemu.h"
+#endif
+#include "pumpkin.h"
+#include "Lz77Mgr.h"
+#include "m68k.h"
+#include "m68kcpu.h"
+#include "emupalmos.h"
+#include "debug.h"
+
+void palmos_lz77libtrap(uint16_t trap) {
+  uint32_t sp;
+  uint16_t idx;
+  char buf[256];
+  Err err;
+
+  sp = m68k_get_reg(NULL, M68K_REG_SP);
+  idx = 0;
+
+  switch (trap) {
+    case sysLibTrapOpen: {
+      // Err Lz77LibOpen(UInt16 libRefnum, MemHandle *lz77HandleP, Boolean compressFlag, UInt32 sourceSize, MemHandle *destHP,
+      //   UInt32 *destSizeP, UInt16 useVerNum, UInt8 *primerP, UInt32 primerL, UInt32 processedPrimerL)
+      uint16_t refNum = ARG16;
+      uint32_t lz77HandleP = ARG32;
+      uint8_t compressFlag = ARG8;
+      uint32_t sourceSize = ARG32;
+      uint32_t destHP = ARG32;
+      uint32_t destSizeP = ARG32;
+      uint16_t useVerNum = ARG16;
+      uint32_t primerP = ARG32;
+      uint32_t primerL = ARG32;
+      uint32_t processedPrimerL = ARG32;
+      emupalmos_trap_in(lz77HandleP, trap, 1);
+      emupalmos_trap_in(destHP, trap, 4);
+      emupalmos_trap_in(destSizeP, trap, 5);
+      UInt8 *primer = emupalmos_trap_in(primerP, trap, 7);
+      MemHandle lz77Handle = NULL;
+      MemHandle destH = destHP ? emupalmos_trap_in(m68k_read_memory_32(destHP), trap, 4) : NULL;
+      UInt32 destSize = destSizeP ? m68k_read_memory_32(destSizeP) : 0;
+      err = Lz77LibOpen(refNum, lz77HandleP ? &lz77Handle : NULL, compressFlag, sourceSize, destHP ? &destH : NULL,
+        &destSize, useVerNum, primer, primerL, processedPrimerL);
+      if (lz77HandleP) m68k_write_memory_32(lz77HandleP, emupalmos_trap_out(lz77Handle));
+      if (destHP) m68k_write_memory_32(destHP, emupalmos_trap_out(destH));
+      if (destSizeP) m68k_write_memory_32(destSizeP, destSize);
+      debug(DEBUG_TRACE, "EmuPalmOS", "Lz77LibOpen(refNum=%d, lz77HandleP=0x%08X, compressFlag=%d, sourceSize=%u, destHP=0x%08X, destSizeP=0x%08X, useVerNum=%d, primerP=0x%08X, primerL=%u, processedPrimerL=%u): %d",
+        refNum, lz77HandleP, compressFlag, sourceSize, destHP, destSizeP, useVerNum, primerP, primerL, processedPrimerL, err);
+      m68k_set_reg(M68K_REG_D0, err);
+      }
+      break;
+    case sysLibTrapClose: {
+      // Err Lz77LibClose(UInt16 libRefnum, MemHandle lz77Handle, UInt32 *ResultingSizeP)
+      uint16_t refNum = ARG16;
+      uint32_t lz77Handle = ARG32;
+      uint32_t resultingSizeP = ARG32;
+      emupalmos_trap_in(resultingSizeP, trap, 2);
+      UInt32 resultingSize = 0;
+      err = Lz77LibClose(refNum, emupalmos_trap_in(lz77Handle, trap, 1), &resultingSize);
+      if (resultingSizeP) m68k_write_memory_32(resultingSizeP, resultingSize);
+      debug(DEBUG_TRACE, "EmuPalmOS", "Lz77LibClose(refNum=%d, lz77Handle=0x%08X, ResultingSizeP=0x%08X): %d", refNum, lz77Handle, resultingSizeP, err);
+      m68k_set_reg(M68K_REG_D0, err);
+      }
+      break;
+    case sysLibTrapSleep: {
+      uint16_t refNum = ARG16;
+      err = Lz77LibSleep(refNum);
+      m68k_set_reg(M68K_REG_D0, err);
+      }
+      break;
+    case sysLibTrapWake: {
+      uint16_t refNum = ARG16;
+      err = Lz77LibWake(refNum);
+      m68k_set_reg(M68K_REG_D0, err);
+      }
+      break;
+    case lz77LibTrapChunk: {
+      // Err Lz77LibChunk(UInt16 libRefnum, MemHandle lz77Handle, UInt8 *sourceP, UInt32 sourceSize)
+      uint16_t refNum = ARG16;
+      uint32_t lz77Handle = ARG32;
+      uint32_t sourceP = ARG32;
+      uint32_t sourceSize = ARG32;
+      UInt8 *source = emupalmos_trap_in(sourceP, trap, 2);
+      err = Lz77LibChunk(refNum, emupalmos_trap_in(lz77Handle, trap, 1), source, sourceSize);
+      debug(DEBUG_TRACE, "EmuPalmOS", "Lz77LibChunk(refNum=%d, lz77Handle=0x%08X, sourceP=0x%08X, sourceSize=%u): %d", refNum, lz77Handle, sourceP, sourceSize, err);
+      m68k_set_reg(M68K_REG_D0, err);
+      }
+      break;
+    case lz77LibTrapMaxBufferSize: {
+      // Err Lz77LibMaxBufferSize(UInt16 libRefnum, Boolean compressFlag, UInt32 sourceSize, UInt8 *sourceP, UInt32 *maxBufferSizeP)
+      uint16_t refNum = ARG16;
+      uint8_t compressFlag = ARG8;
+      uint32_t sourceSize = ARG32;
+      uint32_t sourceP = ARG32;
+      uint32_t maxBufferSizeP = ARG32;
+      UInt8 *source = emupalmos_trap_in(sourceP, trap, 3);
+      emupalmos_trap_in(maxBufferSizeP, trap, 4);
+      UInt32 maxBufferSize;
+      err = Lz77LibMaxBufferSize(refNum, compressFlag, sourceSize, source, maxBufferSizeP ? &maxBufferSize : NULL);
+      if (maxBufferSizeP && err == errNone) m68k_write_memory_32(maxBufferSizeP, maxBufferSize);
+      debug(DEBUG_TRACE, "EmuPalmOS", "Lz77LibMaxBufferSize(refNum=%d, compressFlag=%d, sourceSize=%u, sourceP=0x%08X, maxBufferSizeP=0x%08X): %d", refNum, compressFlag, sourceSize, sourceP, maxBufferSizeP, err);
+      m68k_set_reg(M68K_REG_D0, err);
+      }
+      break;
+    case lz77LibTrapBufferGetInfo: {
+      // Err Lz77LibBufferGetInfo(UInt16 libRefnum, MemHandle lz77Handle, Boolean *compressFlagP, MemHandle *destHP, UInt32 *destSizeP, UInt32 *destOffsetP)
+      uint16_t refNum = ARG16;
+      uint32_t lz77Handle = ARG32;
+      uint32_t compressFlagP = ARG32;
+      uint32_t destHP = ARG32;
+      uint32_t destSizeP = ARG32;
+      uint32_t destOffsetP = ARG32;
+      emupalmos_trap_in(compressFlagP, trap, 2);
+      emupalmos_trap_in(destHP, trap, 3);
+      emupalmos_trap_in(destSizeP, trap, 4);
+      emupalmos_trap_in(destOffsetP, trap, 5);
+      Boolean compressFlag;
+      MemHandle destH;
+      UInt32 destSize, destOffset;
+      err = Lz77LibBufferGetInfo(refNum, emupalmos_trap_in(lz77Handle, trap, 1), &compressFlag, &destH, &destSize, &destOffset);
+      if (err == errNone) {
+        if (compressFlagP) m68k_write_memory_8(compressFlagP, compressFlag);
+        if (destHP) m68k_write_memory_32(destHP, emupalmos_trap_out(destH));
+        if (destSizeP) m68k_write_memory_32(destSizeP, destSize);
+        if (destOffsetP) m68k_write_memory_32(destOffsetP, destOffset);
+      }
+      debug(DEBUG_TRACE, "EmuPalmOS", "Lz77LibBufferGetInfo(refNum=%d, lz77Handle=0x%08X): %d", refNum, lz77Handle, err);
+      m68k_set_reg(M68K_REG_D0, err);
+      }
+      break;
+    case lz77LibTrapBufferSetInfo: {
+      // Err Lz77LibBufferSetInfo(UInt16 libRefnum, MemHandle lz77Handle, MemHandle destH, UInt32 destSize, UInt32 destOffset)
+      uint16_t refNum = ARG16;
+      uint32_t lz77Handle = ARG32;
+      uint32_t destH = ARG32;
+      uint32_t destSize = ARG32;
+      uint32_t destOffset = ARG32;
+      err = Lz77LibBufferSetInfo(refNum, emupalmos_trap_in(lz77Handle, trap, 1), emupalmos_trap_in(destH, trap, 2), destSize, destOffset);
+      debug(DEBUG_TRACE, "EmuPalmOS", "Lz77LibBufferSetInfo(refNum=%d, lz77Handle=0x%08X, destH=0x%08X, destSize=%u, destOffset=%u): %d", refNum, lz77Handle, destH, destSize, destOffset, err);
+      m68k_set_reg(M68K_REG_D0, err);
+      }
+      break;
+    default:
+      sys_snprintf(buf, sizeof(buf)-1, "Lz77Lib trap 0x%04X not mapped", trap);
+      emupalmos_panic(buf, EMUPALMOS_INVALID_TRAP);
+      break;
+  }
+}
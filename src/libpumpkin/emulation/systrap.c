@@ -6,6 +6,7 @@
 #include "sys.h"
 #include "mutex.h"
 #include "AppRegistry.h"
+#include "Lz77Mgr.h"
 #include "storage.h"
 #include "pumpkin.h"
 #include "bytes.h"
@@ -31,6 +32,9 @@ static void palmos_libtrap(uint16_t refNum, uint16_t trap) {
     case NetLibRefNum:
       palmos_netlibtrap(trap);
       break;
+    case Lz77LibRefNum:
+      palmos_lz77libtrap(trap);
+      break;
     default:
       sys_snprintf(buf, sizeof(buf)-1, "trap 0x%04X refNum %d not mapped", trap, refNum);
       emupalmos_panic(buf, EMUPALMOS_INVALID_TRAP);
@@ -123,6 +127,8 @@ uint32_t palmos_systrap(uint16_t trap) {
       UInt16 refNum;
       if (name && !StrCompare(name, NetLibName)) {
         refNum = NetLibRefNum;
+      } else if (name && !StrCompare(name, lz77LibName)) {
+        refNum = Lz77LibRefNum;
       } else {
         refNum = SysLibFind68K(name);
       }
@@ -140,8 +146,15 @@ uint32_t palmos_systrap(uint16_t trap) {
       emupalmos_trap_in(refNumP, trap, 2);
       pumpkin_id2s(libType, buf);
       pumpkin_id2s(libCreator, buf2);
-      debug(DEBUG_INFO, "EmuPalmOS", "SysLibLoad('%s', '%s', 0x%08X) native", buf, buf2, refNumP);
-      r = state->SysLibLoad_addr;
+      if (libType == sysFileTLibrary && libCreator == lz77LibCreator) {
+        // built in library, there is no database to load
+        if (refNumP) m68k_write_memory_16(refNumP, Lz77LibRefNum);
+        debug(DEBUG_INFO, "EmuPalmOS", "SysLibLoad('%s', '%s', 0x%08X) builtin", buf, buf2, refNumP);
+        m68k_set_reg(M68K_REG_D0, errNone);
+      } else {
+        debug(DEBUG_INFO, "EmuPalmOS", "SysLibLoad('%s', '%s', 0x%08X) native", buf, buf2, refNumP);
+        r = state->SysLibLoad_addr;
+      }
       }
       break;
     case sysTrapSysLibNewRefNum68K: {
@@ -446,14 +459,9 @@ uint32_t palmos_systrap(uint16_t trap) {
       uint32_t size = ARG32;
       uint32_t newPtrP = ARG32;
       emupalmos_trap_in(newPtrP, trap, 3);
-      uint8_t *p = MemPtrNew(size);
-      if (p) {
-        uint32_t a = emupalmos_trap_out(p);
-        if (newPtrP) m68k_write_memory_32(newPtrP, a);
-        err = FtrSet(creator, featureNum, a);
-      } else {
-        err = memErrNotEnoughSpace;
-      }
+      void *p = NULL;
+      err = FtrPtrNew(creator, featureNum, size, &p);
+      if (err == errNone && newPtrP) m68k_write_memory_32(newPtrP, emupalmos_trap_out(p));
       pumpkin_id2s(creator, buf);
       debug(DEBUG_TRACE, "EmuPalmOS", "FtrPtrNew('%s', %d, %d, 0x%08X): %d", buf, featureNum, size, newPtrP, err);
       m68k_set_reg(M68K_REG_D0, err);
@@ -463,17 +471,49 @@ uint32_t palmos_systrap(uint16_t trap) {
       // Err FtrPtrFree(UInt32 creator, UInt16 featureNum)
       uint32_t creator = ARG32;
       uint16_t featureNum = ARG16;
-      uint32_t a;
-      err = FtrGet(creator, featureNum, &a);
-      if (err == errNone && a) {
-        uint8_t *p = emupalmos_trap_in(a, trap, -1);
-        MemPtrFree(p);
-      }
+      err = FtrPtrFree(creator, featureNum);
       pumpkin_id2s(creator, buf);
       debug(DEBUG_TRACE, "EmuPalmOS", "FtrPtrFree('%s', %d): %d", buf, featureNum, err);
       m68k_set_reg(M68K_REG_D0, err);
       }
       break;
+    case sysTrapFtrPtrResize: {
+      // Err FtrPtrResize(UInt32 creator, UInt16 featureNum, UInt32 newSize, void **newPtrP)
+      uint32_t creator = ARG32;
+      uint16_t featureNum = ARG16;
+      uint32_t newSize = ARG32;
+      uint32_t newPtrP = ARG32;
+      emupalmos_trap_in(newPtrP, trap, 3);
+      void *p = NULL;
+      err = FtrPtrResize(creator, featureNum, newSize, &p);
+      if (err == errNone && newPtrP) m68k_write_memory_32(newPtrP, emupalmos_trap_out(p));
+      pumpkin_id2s(creator, buf);
+      debug(DEBUG_TRACE, "EmuPalmOS", "FtrPtrResize('%s', %d, %d, 0x%08X): %d", buf, featureNum, newSize, newPtrP, err);
+      m68k_set_reg(M68K_REG_D0, err);
+      }
+      break;
+    case sysTrapFtrGetByIndex: {
+      // Err FtrGetByIndex(UInt16 index, Boolean romTable, UInt32 *creatorP, UInt16 *numP, UInt32 *valueP)
+      uint16_t index = ARG16;
+      uint8_t romTable = ARG8;
+      uint32_t creatorP = ARG32;
+      uint32_t numP = ARG32;
+      uint32_t valueP = ARG32;
+      emupalmos_trap_in(creatorP, trap, 2);
+      emupalmos_trap_in(numP, trap, 3);
+      emupalmos_trap_in(valueP, trap, 4);
+      UInt32 creator, value;
+      UInt16 num;
+      err = FtrGetByIndex(index, romTable, &creator, &num, &value);
+      if (err == errNone) {
+        if (creatorP) m68k_write_memory_32(creatorP, creator);
+        if (numP) m68k_write_memory_16(numP, num);
+        if (valueP) m68k_write_memory_32(valueP, value);
+      }
+      debug(DEBUG_TRACE, "EmuPalmOS", "FtrGetByIndex(%d, %d, 0x%08X, 0x%08X, 0x%08X): %d", index, romTable, creatorP, numP, valueP, err);
+      m68k_set_reg(M68K_REG_D0, err);
+      }
+      break;
     case sysTrapFtrUnregister: {
       // Err FtrUnregister(UInt32 creator, UInt16 featureNum)
       uint32_t creator = ARG32;
@@ -2367,8 +2407,17 @@ uint32_t palmos_systrap(uint16_t trap) {
       emupalmos_trap_in(chanRangeP, trap, 4);
       emupalmos_trap_in(callbacksP, trap, 5);
       SndSmfOptionsType options;
+      SndSmfChanRangeType chanRange;
       decode_smfoptions(selP, &options);
-      Err res = SndPlaySmf(NULL, cmd, (UInt8 *)emupalmos_trap_in(smfP, trap, 2), selP ? &options : NULL, NULL, NULL, bNoWait);
+      if (chanRangeP) {
+        chanRange.bFirstChan = m68k_read_memory_8(chanRangeP);
+        chanRange.bLastChan = m68k_read_memory_8(chanRangeP + 1);
+      }
+      Err res = SndPlaySmf(NULL, cmd, (UInt8 *)emupalmos_trap_in(smfP, trap, 2), selP ? &options : NULL, chanRangeP ? &chanRange : NULL, NULL, bNoWait);
+      if (selP && cmd == sndSmfCmdDuration && res == errNone) {
+        m68k_write_memory_32(selP, options.dwStartMilliSec);
+        m68k_write_memory_32(selP + 4, options.dwEndMilliSec);
+      }
       debug(DEBUG_TRACE, "EmuPalmOS", "SndPlaySmf(0x%08X, %d, 0x%08X, 0x%08X, 0x%08X, 0x%08X, %d): %d", chanP, cmd, smfP, selP, chanRangeP, callbacksP, bNoWait, res);
       m68k_set_reg(M68K_REG_D0, res);
       }
@@ -678,7 +678,7 @@ static const trap_t traps[] = {
   { 0xA27A, "FtrUnregister", "W", 2, "L", "W", NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL },
   { 0xA27B, "FtrGet", "W", 3, "4", "W", "Lp", NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL },
   { 0xA27C, "FtrSet", "W", 3, "4", "W", "L", NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL },
-  { 0xA27D, "FtrGetByIndex", "?", 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL },
+  { 0xA27D, "FtrGetByIndex", "W", 5, "W", "B", "Lp", "Wp", "Lp", NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL },
   { 0xA27E, "GrfInit", "?", 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL },
   { 0xA27F, "GrfFree", "?", 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL },
   { 0xA280, "GrfGetState", "?", 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL },
@@ -901,7 +901,7 @@ static const trap_t traps[] = {
   { 0xA359, "SysWantEvent", "?", 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL },
   { 0xA35A, "FtrPtrNew", "W", 4, "L", "W", "L", "p", NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL },
   { 0xA35B, "FtrPtrFree", "W", 2, "L", "W", NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL },
-  { 0xA35C, "FtrPtrResize", "?", 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL },
+  { 0xA35C, "FtrPtrResize", "W", 4, "L", "W", "L", "p", NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL },
   { 0xA35D, "SysReserved31Trap1", "?", 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL },
   { 0xA35E, "HwrNVPrefSet", "?", 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL },
   { 0xA35F, "HwrNVPrefGet", "?", 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL },
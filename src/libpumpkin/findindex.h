@@ -0,0 +1,31 @@
+// System text index for the global Find. The records of the built-in
+// applications are indexed by word prefix, so a search does not need to
+// launch them with sysAppLaunchCmdFind.
+
+typedef struct {
+  UInt32 creator;
+  LocalID dbID;      // valid in the task that called FindIndexSearch
+  UInt32 uniqueID;
+  UInt16 recordNum;
+  UInt16 fieldNum;   // same numbering used by the application in FindSaveMatch
+  UInt16 matchPos;
+  Char text[32];     // first line of the field, to show in the results
+} FindIndexMatchType;
+
+int FindIndexInitGlobal(char *path);
+int FindIndexFinishGlobal(void);
+
+// Returns true if the records of this application are indexed. Find must
+// still use sysAppLaunchCmdFind for the other applications.
+Boolean FindIndexHasCreator(UInt32 creator);
+
+// Returns up to max matches of str, with the same semantics of FindStrInStr.
+// *cursor must be 0 on the first call, and is updated so that the next call
+// continues the same search.
+UInt16 FindIndexSearch(const Char *str, Boolean showSecret, FindIndexMatchType *matches, UInt16 max, UInt32 *cursor);
+
+// Called by the Data Manager with the storage mutex locked. Databases are
+// given by name, type and creator because a LocalID depends on the task.
+void FindIndexPutRecord(const char *name, UInt32 type, UInt32 creator, UInt32 uniqueID, void *data, UInt32 size);
+void FindIndexRemoveRecord(const char *name, UInt32 type, UInt32 creator, UInt32 uniqueID);
+void FindIndexRemoveDatabase(const char *name, UInt32 type, UInt32 creator);
@@ -0,0 +1,601 @@
+#include <PalmOS.h>
+
+#include "sys.h"
+#include "midi.h"
+#include "bytes.h"
+#include "debug.h"
+#include "xalloc.h"
+
+#define MThd_id 0x4D546864
+#define MTrk_id 0x4D54726B
+
+#define MAX_TRACKS    16
+#define NUM_CHANNELS  16
+#define DRUM_CHANNEL  9
+#define CHUNK         256
+
+#define WAVE_BITS     8
+#define WAVE_SIZE     (1 << WAVE_BITS)
+#define WAVE_SINE     0
+#define WAVE_SQUARE   1
+#define WAVE_SAW      2
+#define WAVE_TRIANGLE 3
+#define NUM_WAVES     4
+
+#define ENV_OFF       0
+#define ENV_ATTACK    1
+#define ENV_DECAY     2
+#define ENV_SUSTAIN   3
+#define ENV_RELEASE   4
+#define ENV_MAX       65536
+
+#define SEMITONE      1.0594630943592953
+
+#define NEXT(t)       ((t)->p < (t)->end ? *(t)->p++ : 0)
+
+typedef struct {
+  UInt8 *p, *end;
+  UInt32 tick;
+  UInt8 status;
+  Boolean ended;
+} midi_track_t;
+
+typedef struct {
+  UInt8 program, volume, expression;
+  Int16 bend;
+} midi_channel_t;
+
+typedef struct {
+  UInt8 stage, chan, key, velocity;
+  Int16 *wave;
+  Boolean noise;
+  UInt32 phase, inc, lfsr, age;
+  Int32 env, amp, sustain, decay;
+} midi_voice_t;
+
+struct midi_t {
+  UInt32 rate;
+  UInt16 division;
+  UInt32 tempo;
+  uint64_t tickLen;   // samples per tick, 16.16
+  uint64_t time;      // sample time of the current tick, 16.16
+  uint64_t pos, end;  // samples
+  UInt32 tick, age;
+  UInt8 firstChan, lastChan;
+  int ntracks;
+  midi_track_t tracks[MAX_TRACKS];
+  midi_channel_t channels[NUM_CHANNELS];
+  midi_voice_t voices[MIDI_MAX_VOICES];
+  UInt32 keyInc[128];
+  Int32 attack, decay, sustainDecay, release, drumDecay;
+  Int16 waves[NUM_WAVES][WAVE_SIZE];
+  Int32 mix[CHUNK];
+};
+
+// waveform of each General MIDI instrument family (program / 8)
+static const UInt8 familyWave[16] = {
+  WAVE_TRIANGLE, WAVE_SINE, WAVE_SQUARE, WAVE_SAW, WAVE_TRIANGLE, WAVE_SAW, WAVE_SAW, WAVE_SQUARE,
+  WAVE_SQUARE, WAVE_SINE, WAVE_SQUARE, WAVE_TRIANGLE, WAVE_SINE, WAVE_SAW, WAVE_SINE, WAVE_SINE
+};
+
+static double MidiKeyFreq(UInt8 key) {
+  double f = 440.0;
+  int k;
+
+  for (k = 69; k < key; k++) f *= SEMITONE;
+  for (k = 69; k > key; k--) f /= SEMITONE;
+
+  return f;
+}
+
+UInt32 MidiKeyFrequency(UInt8 key) {
+  return (UInt32)(MidiKeyFreq(key & 0x7F) + 0.5);
+}
+
+static UInt32 MidiPhaseInc(double freq, UInt32 rate) {
+  double inc = freq * 4294967296.0 / rate;
+
+  return inc < 2147483647.0 ? (UInt32)inc : 0x7FFFFFFF;
+}
+
+static Int32 MidiEnvRate(Int32 range, UInt32 rate, UInt32 ms) {
+  UInt32 n = rate * ms / 1000;
+
+  return n > 0 && range / (Int32)n > 0 ? range / (Int32)n : 1;
+}
+
+static void MidiTempo(midi_t *m) {
+  UInt32 fps, tpf;
+
+  if (m->division & 0x8000) {
+    // SMPTE time: negative frames per second and ticks per frame
+    fps = 256 - (m->division >> 8);
+    tpf = m->division & 0xFF;
+    m->tickLen = ((uint64_t)m->rate << 16) / (fps * (tpf ? tpf : 1));
+  } else {
+    m->tickLen = (((uint64_t)m->tempo * m->rate) << 16) / (1000000ULL * m->division);
+  }
+}
+
+static UInt32 MidiVarLen(midi_track_t *t) {
+  UInt32 v = 0;
+  UInt8 b;
+  int i;
+
+  for (i = 0; i < 4 && t->p < t->end; i++) {
+    b = *t->p++;
+    v = (v << 7) | (b & 0x7F);
+    if (!(b & 0x80)) break;
+  }
+
+  return v;
+}
+
+static void MidiSkip(midi_track_t *t, UInt32 len) {
+  t->p = len < (UInt32)(t->end - t->p) ? t->p + len : t->end;
+}
+
+midi_t *MidiCreate(UInt8 *smf, UInt32 size, UInt32 rate, UInt8 firstChan, UInt8 lastChan) {
+  midi_t *m;
+  midi_track_t *t;
+  UInt32 id, len, i;
+  UInt16 format, ntrks, division, j;
+  double s;
+
+  if (smf == NULL || size < 14 || rate == 0) return NULL;
+
+  i = get4b(&id, smf, 0);
+  i += get4b(&len, smf, i);
+  if (id != MThd_id || len < 6 || len > size - 8) {
+    debug(DEBUG_ERROR, "MIDI", "invalid header id 0x%08X or length %u", id, len);
+    return NULL;
+  }
+  i += get2b(&format, smf, i);
+  i += get2b(&ntrks, smf, i);
+  i += get2b(&division, smf, i);
+  if (division == 0 || format > 1) {
+    debug(DEBUG_ERROR, "MIDI", "unsupported format %d or division 0x%04X", format, division);
+    return NULL;
+  }
+
+  if ((m = xcalloc(1, sizeof(midi_t))) == NULL) return NULL;
+
+  m->rate = rate;
+  m->division = division;
+  m->tempo = 500000;
+  m->end = (uint64_t)-1;
+  m->firstChan = firstChan & 0x0F;
+  m->lastChan = lastChan & 0x0F;
+  MidiTempo(m);
+
+  // ntrks counts every chunk, foreign ones included, as SndSmfSize does
+  for (i = 8 + len, j = 0; j < ntrks && m->ntracks < MAX_TRACKS && size - i >= 8; j++) {
+    i += get4b(&id, smf, i);
+    i += get4b(&len, smf, i);
+    if (len > size - i) {
+      debug(DEBUG_ERROR, "MIDI", "chunk %d length %u past the end", j, len);
+      break;
+    }
+    if (id == MTrk_id) {
+      t = &m->tracks[m->ntracks++];
+      t->p = smf + i;
+      t->end = t->p + len;
+      t->tick = MidiVarLen(t);
+      t->ended = t->p >= t->end;
+    }
+    i += len;
+  }
+
+  for (j = 0; j < NUM_CHANNELS; j++) {
+    m->channels[j].volume = 100;
+    m->channels[j].expression = 127;
+  }
+
+  for (j = 0; j < 128; j++) {
+    m->keyInc[j] = MidiPhaseInc(MidiKeyFreq(j), rate);
+  }
+
+  for (j = 0; j < WAVE_SIZE; j++) {
+    s = sys_sin(2.0 * sys_pi() * j / WAVE_SIZE);
+    m->waves[WAVE_SINE][j] = (Int16)(s * 32767.0);
+    m->waves[WAVE_SQUARE][j] = j < WAVE_SIZE/2 ? 24576 : -24576;
+    m->waves[WAVE_SAW][j] = (Int16)(j * (65536 / WAVE_SIZE) - 32768);
+    m->waves[WAVE_TRIANGLE][j] = (Int16)(j < WAVE_SIZE/2 ? -32767 + j * (131072 / WAVE_SIZE) : 32767 - (j - WAVE_SIZE/2) * (131072 / WAVE_SIZE));
+  }
+
+  m->attack = MidiEnvRate(ENV_MAX, rate, 4);
+  m->decay = MidiEnvRate(ENV_MAX / 2, rate, 200);
+  m->sustainDecay = MidiEnvRate(ENV_MAX, rate, 4000);
+  m->release = MidiEnvRate(ENV_MAX, rate, 80);
+  m->drumDecay = MidiEnvRate(ENV_MAX, rate, 150);
+
+  debug(DEBUG_INFO, "MIDI", "format %d, %d track(s), division 0x%04X", format, m->ntracks, division);
+
+  return m;
+}
+
+void MidiDestroy(midi_t *m) {
+  if (m) xfree(m);
+}
+
+static UInt32 MidiVoiceInc(midi_t *m, UInt8 key, Int16 bend) {
+  UInt32 inc = m->keyInc[key];
+  UInt8 k;
+
+  // pitch bend range is 2 semitones
+  if (bend > 0) {
+    k = key < 126 ? key + 2 : 127;
+    inc += (UInt32)(((uint64_t)(m->keyInc[k] - inc) * bend) >> 13);
+  } else if (bend < 0) {
+    k = key > 1 ? key - 2 : 0;
+    inc -= (UInt32)(((uint64_t)(inc - m->keyInc[k]) * -bend) >> 13);
+  }
+
+  return inc;
+}
+
+static Int32 MidiVoiceAmp(midi_channel_t *c, UInt8 velocity) {
+  return (Int32)velocity * c->volume * c->expression * 2 / 127;
+}
+
+static midi_voice_t *MidiVoiceAlloc(midi_t *m) {
+  midi_voice_t *v, *best = NULL;
+  int i;
+
+  for (i = 0; i < MIDI_MAX_VOICES; i++) {
+    v = &m->voices[i];
+    if (v->stage == ENV_OFF) return v;
+    // steal the oldest voice, preferring the ones being released
+    if (best == NULL || (v->stage == ENV_RELEASE) > (best->stage == ENV_RELEASE) ||
+        ((v->stage == ENV_RELEASE) == (best->stage == ENV_RELEASE) && v->age < best->age)) {
+      best = v;
+    }
+  }
+
+  return best;
+}
+
+static void MidiNoteOn(midi_t *m, UInt8 chan, UInt8 key, UInt8 velocity) {
+  midi_channel_t *c = &m->channels[chan];
+  midi_voice_t *v;
+
+  if ((v = MidiVoiceAlloc(m)) == NULL) return;
+
+  v->chan = chan;
+  v->key = key;
+  v->velocity = velocity;
+  v->amp = MidiVoiceAmp(c, velocity);
+  v->env = 0;
+  v->phase = 0;
+  v->age = m->age++;
+  v->stage = ENV_ATTACK;
+  v->noise = false;
+
+  if (chan == DRUM_CHANNEL) {
+    // bass drums are a low sine, everything else is noise
+    v->sustain = 0;
+    v->decay = m->drumDecay;
+    if (key == 35 || key == 36) {
+      v->wave = m->waves[WAVE_SINE];
+      v->inc = m->keyInc[33];
+    } else {
+      v->wave = NULL;
+      v->noise = true;
+      v->lfsr = 0x12345678 ^ (key << 8) ^ v->age;
+      v->inc = 0;
+    }
+  } else {
+    v->sustain = ENV_MAX / 2;
+    v->decay = m->decay;
+    v->wave = m->waves[familyWave[c->program >> 3]];
+    v->inc = MidiVoiceInc(m, key, c->bend);
+  }
+}
+
+static void MidiNoteOff(midi_t *m, UInt8 chan, UInt8 key) {
+  midi_voice_t *v;
+  int i;
+
+  if (chan == DRUM_CHANNEL) return;
+
+  for (i = 0; i < MIDI_MAX_VOICES; i++) {
+    v = &m->voices[i];
+    if (v->stage != ENV_OFF && v->stage != ENV_RELEASE && v->chan == chan && v->key == key) {
+      v->stage = ENV_RELEASE;
+    }
+  }
+}
+
+static void MidiChannelEvent(midi_t *m, UInt8 type, UInt8 chan, UInt8 d1, UInt8 d2, Boolean render) {
+  midi_channel_t *c = &m->channels[chan];
+  midi_voice_t *v;
+  int i;
+
+  switch (type) {
+    case 0x90:
+      if (d2 > 0) {
+        if (render) MidiNoteOn(m, chan, d1, d2);
+        break;
+      }
+      // fall through, a note on with velocity 0 is a note off
+    case 0x80:
+      MidiNoteOff(m, chan, d1);
+      break;
+    case 0xB0:
+      switch (d1) {
+        case 7:   c->volume = d2; break;
+        case 11:  c->expression = d2; break;
+        case 121: c->expression = 127; c->bend = 0; break;
+        case 120:
+        case 123:
+          for (i = 0; i < MIDI_MAX_VOICES; i++) {
+            v = &m->voices[i];
+            if (v->chan == chan && v->stage != ENV_OFF) v->stage = d1 == 120 ? ENV_OFF : ENV_RELEASE;
+          }
+          break;
+      }
+      if (d1 == 7 || d1 == 11 || d1 == 121) {
+        for (i = 0; i < MIDI_MAX_VOICES; i++) {
+          v = &m->voices[i];
+          if (v->chan == chan && v->stage != ENV_OFF) v->amp = MidiVoiceAmp(c, v->velocity);
+        }
+      }
+      break;
+    case 0xC0:
+      c->program = d1 & 0x7F;
+      break;
+    case 0xE0:
+      c->bend = (Int16)(((d2 << 7) | d1) - 8192);
+      if (chan != DRUM_CHANNEL) {
+        for (i = 0; i < MIDI_MAX_VOICES; i++) {
+          v = &m->voices[i];
+          if (v->chan == chan && v->stage != ENV_OFF) v->inc = MidiVoiceInc(m, v->key, c->bend);
+        }
+      }
+      break;
+  }
+}
+
+// Processes the next event of track t and reads the delta time of the following one.
+static void MidiEvent(midi_t *m, midi_track_t *t, Boolean render) {
+  UInt8 status, type, d1, d2;
+  UInt32 len;
+
+  if (t->p >= t->end) {
+    t->ended = true;
+    return;
+  }
+
+  status = *t->p;
+  if (status & 0x80) {
+    t->p++;
+    if (status < 0xF0) t->status = status;
+    else if (status < 0xF8) t->status = 0;
+  } else {
+    status = t->status;
+  }
+
+  if (status == 0xFF) {
+    type = NEXT(t);
+    len = MidiVarLen(t);
+    if (type == 0x2F) {
+      t->ended = true;
+    } else if (type == 0x51 && len == 3 && t->end - t->p >= 3) {
+      m->tempo = (t->p[0] << 16) | (t->p[1] << 8) | t->p[2];
+      if (m->tempo == 0) m->tempo = 500000;
+      MidiTempo(m);
+    }
+    MidiSkip(t, len);
+  } else if (status == 0xF0 || status == 0xF7) {
+    MidiSkip(t, MidiVarLen(t));
+  } else if (status < 0x80 || status >= 0xF0) {
+    debug(DEBUG_ERROR, "MIDI", "invalid status 0x%02X", status);
+    t->ended = true;
+  } else {
+    d1 = NEXT(t) & 0x7F;
+    type = status & 0xF0;
+    d2 = (type != 0xC0 && type != 0xD0) ? NEXT(t) & 0x7F : 0;
+    if ((status & 0x0F) >= m->firstChan && (status & 0x0F) <= m->lastChan) {
+      MidiChannelEvent(m, type, status & 0x0F, d1, d2, render);
+    }
+  }
+
+  if (!t->ended) {
+    if (t->p >= t->end) {
+      t->ended = true;
+    } else {
+      t->tick += MidiVarLen(t);
+    }
+  }
+}
+
+// Returns the track with the next event, or NULL at the end of the sequence.
+static midi_track_t *MidiNext(midi_t *m, uint64_t *time) {
+  midi_track_t *t, *best = NULL;
+  int i;
+
+  for (i = 0; i < m->ntracks; i++) {
+    t = &m->tracks[i];
+    if (!t->ended && (best == NULL || t->tick < best->tick)) best = t;
+  }
+
+  if (best) {
+    *time = m->time + (uint64_t)(best->tick - m->tick) * m->tickLen;
+  }
+
+  return best;
+}
+
+static uint64_t MidiSamples(midi_t *m, UInt32 ms) {
+  return ms == 0xFFFFFFFF ? (uint64_t)-1 : (uint64_t)ms * m->rate / 1000;
+}
+
+void MidiSeek(midi_t *m, UInt32 ms) {
+  midi_track_t *t;
+  uint64_t target, time;
+
+  if (m) {
+    target = MidiSamples(m, ms);
+    while ((t = MidiNext(m, &time)) != NULL && (time >> 16) < target) {
+      m->time = time;
+      m->tick = t->tick;
+      MidiEvent(m, t, false);
+    }
+    m->pos = target;
+  }
+}
+
+void MidiSetEnd(midi_t *m, UInt32 ms) {
+  if (m) m->end = MidiSamples(m, ms);
+}
+
+UInt32 MidiDuration(UInt8 *smf, UInt32 size) {
+  midi_t *m;
+  UInt32 ms = 0;
+
+  // at 1000 samples per second a sample is a millisecond
+  if ((m = MidiCreate(smf, size, 1000, 0, NUM_CHANNELS - 1)) != NULL) {
+    MidiSeek(m, 0xFFFFFFFF);
+    ms = (UInt32)(m->time >> 16);
+    MidiDestroy(m);
+  }
+
+  return ms;
+}
+
+// Adds n samples of voice v to mix. The envelope is linear, so each stage is
+// rendered as a run of samples without per sample stage checks.
+static void MidiRenderVoice(midi_t *m, midi_voice_t *v, Int32 *mix, UInt32 n) {
+  Int32 env, rate, target, amp, s;
+  UInt32 i, j, k, phase, inc, lfsr;
+  Int16 *wave;
+
+  amp = v->amp;
+  phase = v->phase;
+  inc = v->inc;
+  lfsr = v->lfsr;
+  wave = v->wave;
+  env = v->env;
+
+  for (i = 0; i < n && v->stage != ENV_OFF; i += k) {
+    switch (v->stage) {
+      case ENV_ATTACK:  rate = m->attack; target = ENV_MAX; break;
+      case ENV_DECAY:   rate = -v->decay; target = v->sustain; break;
+      case ENV_SUSTAIN: rate = -m->sustainDecay; target = 0; break;
+      default:          rate = -m->release; target = 0; break;
+    }
+
+    k = rate > 0 ? (target - env + rate - 1) / rate : (env - target - rate - 1) / -rate;
+    if (k > n - i) k = n - i;
+
+    if (v->noise) {
+      for (j = i; j < i + k; j++) {
+        lfsr ^= lfsr << 13;
+        lfsr ^= lfsr >> 17;
+        lfsr ^= lfsr << 5;
+        s = (Int16)(lfsr >> 16);
+        mix[j] += (((s * (env >> 2)) >> 14) * amp) >> 15;
+        env += rate;
+      }
+    } else {
+      for (j = i; j < i + k; j++) {
+        s = wave[phase >> (32 - WAVE_BITS)];
+        phase += inc;
+        mix[j] += (((s * (env >> 2)) >> 14) * amp) >> 15;
+        env += rate;
+      }
+    }
+
+    if (rate > 0 ? env >= target : env <= target) {
+      env = target;
+      switch (v->stage) {
+        case ENV_ATTACK:  v->stage = ENV_DECAY; break;
+        case ENV_DECAY:   v->stage = v->sustain > 0 ? ENV_SUSTAIN : ENV_OFF; break;
+        default:          v->stage = ENV_OFF; break;
+      }
+    }
+  }
+
+  v->phase = phase;
+  v->lfsr = lfsr;
+  v->env = env;
+}
+
+UInt32 MidiRender(midi_t *m, Int16 *buf, UInt32 nframes) {
+  midi_track_t *t;
+  uint64_t time;
+  UInt32 done, n, i;
+  Boolean active;
+  Int32 s;
+
+  if (m == NULL || buf == NULL) return 0;
+
+  for (done = 0; done < nframes && m->pos < m->end; done += n) {
+    while ((t = MidiNext(m, &time)) != NULL && (time >> 16) <= m->pos) {
+      m->time = time;
+      m->tick = t->tick;
+      MidiEvent(m, t, true);
+    }
+
+    for (i = 0, active = false; i < MIDI_MAX_VOICES && !active; i++) {
+      active = m->voices[i].stage != ENV_OFF;
+    }
+    if (t == NULL && !active) break;
+
+    n = nframes - done;
+    if (n > CHUNK) n = CHUNK;
+    if (t != NULL && (time >> 16) - m->pos < n) n = (UInt32)((time >> 16) - m->pos);
+    if (m->end - m->pos < n) n = (UInt32)(m->end - m->pos);
+
+    sys_memset(m->mix, 0, n * sizeof(Int32));
+    if (active) {
+      for (i = 0; i < MIDI_MAX_VOICES; i++) {
+        if (m->voices[i].stage != ENV_OFF) MidiRenderVoice(m, &m->voices[i], m->mix, n);
+      }
+    }
+
+    for (i = 0; i < n; i++) {
+      s = m->mix[i] >> 1;
+      if (s < -32768) s = -32768;
+      else if (s > 32767) s = 32767;
+      buf[done + i] = (Int16)s;
+    }
+
+    m->pos += n;
+  }
+
+  return done;
+}
+
+Int16 *MidiRenderTones(const midi_tone_t *tones, UInt32 n, UInt32 rate, UInt32 *nframes) {
+  UInt32 total, len, ramp, phase, inc, i, j;
+  Int32 a, s;
+  Int16 *buf, *p;
+
+  for (i = 0, total = 0; i < n; i++) {
+    total += tones[i].ms * rate / 1000;
+  }
+
+  if ((buf = xcalloc(total ? total : 1, sizeof(Int16))) == NULL) return NULL;
+
+  // 1ms ramps avoid clicks at the tone boundaries
+  ramp = rate / 1000;
+  if (ramp == 0) ramp = 1;
+
+  for (i = 0, p = buf; i < n; i++, p += len) {
+    len = tones[i].ms * rate / 1000;
+    if (tones[i].freq == 0 || tones[i].amp == 0) continue;
+    inc = MidiPhaseInc(tones[i].freq, rate);
+    a = (tones[i].amp & 0x7F) * 200;
+    for (j = 0, phase = 0; j < len; j++, phase += inc) {
+      s = (phase & 0x80000000) ? -a : a;
+      if (j < ramp) s = s * (Int32)j / (Int32)ramp;
+      else if (len - j < ramp) s = s * (Int32)(len - j) / (Int32)ramp;
+      p[j] = (Int16)s;
+    }
+  }
+
+  if (nframes) *nframes = total;
+
+  return buf;
+}
@@ -0,0 +1,33 @@
+// Standard MIDI File sequencer and wavetable synthesizer. Renders mono
+// 16 bit PCM at a given sample rate. Formats 0 and 1 are supported.
+
+#define MIDI_MAX_VOICES 24
+
+typedef struct midi_t midi_t;
+
+typedef struct {
+  UInt32 freq;    // Hz, 0 is a rest
+  UInt16 ms;
+  UInt8 amp;      // 0 - 127
+} midi_tone_t;
+
+// size is the length of the SMF in bytes, as given by its chunk headers.
+midi_t *MidiCreate(UInt8 *smf, UInt32 size, UInt32 rate, UInt8 firstChan, UInt8 lastChan);
+void MidiDestroy(midi_t *m);
+
+// Skips the events before ms without rendering them.
+void MidiSeek(midi_t *m, UInt32 ms);
+
+// Stops rendering at ms.
+void MidiSetEnd(midi_t *m, UInt32 ms);
+
+// Renders up to nframes frames, returns less than nframes at the end.
+UInt32 MidiRender(midi_t *m, Int16 *buf, UInt32 nframes);
+
+// Returns the duration of the sequence in milliseconds.
+UInt32 MidiDuration(UInt8 *smf, UInt32 size);
+
+UInt32 MidiKeyFrequency(UInt8 key);
+
+// Renders a sequence of square wave tones into a new buffer of *nframes frames.
+Int16 *MidiRenderTones(const midi_tone_t *tones, UInt32 n, UInt32 rate, UInt32 *nframes);
@@ -21,6 +21,8 @@
 #include "loadfile.h"
 #include "emupalmosinc.h"
 #include "AppRegistry.h"
+#include "alarm.h"
+#include "findindex.h"
 #include "language.h"
 #include "storage.h"
 #include "pumpkin.h"
@@ -42,7 +44,8 @@
 #endif
 
 #define MAX_SEARCH_ORDER   16
-#define MAX_NOTIF_QUEUE    8
+#define MAX_NOTIF_QUEUE    64
+#define MAX_NOTIF_RATES    16
 #define MAX_NOTIF_REGISTER 256
 #define MAX_TASKS          32
 #define MAX_HOST           256
@@ -114,8 +117,6 @@ typedef struct {
   int v10;
   int m68k;
   char name[dmDBNameLength];
-  uint32_t alarm_time;
-  uint32_t alarm_data;
   uint32_t eventKeyMask;
   texture_t *texture;
   LocalID dbID;
@@ -129,8 +130,6 @@ typedef struct {
   uint32_t taskId;
   void *exception;
   heap_t *heap;
-  int num_notifs;
-  SysNotifyParamType notify[MAX_NOTIF_QUEUE]; // for SysNotifyBroadcastDeferred
   void *data;
   char (*getchar)(void *iodata);
   void (*putchar)(void *iodata, char c);
@@ -167,8 +166,29 @@ typedef struct {
   UInt32 notifyType;
   UInt32 priority;
   int ptr;
+  LocalID dbID;
+  char name[dmDBNameLength]; // cached app name, empty if not resolved yet
 } notif_registration_t;
 
+typedef struct {
+  UInt32 notifyType;
+  notif_registration_t *reg; // sorted by priority
+  int num, size;
+} notif_index_t;
+
+typedef struct {
+  SysNotifyParamType notify;
+  uint8_t *details; // private copy of notifyDetailsP
+  UInt16 size;
+  int64_t t;        // time of the first deferral
+} notif_deferred_t;
+
+typedef struct {
+  UInt32 notifyType;
+  int64_t interval; // minimum time between deliveries
+  int64_t last;
+} notif_rate_t;
+
 typedef struct {
   int ev, arg1, arg2, arg3;
 } event_t;
@@ -214,8 +234,15 @@ typedef struct {
   pumpkin_plugin_t *plugin[MAX_PLUGINS];
   int num_plugins;
   AppRegistryType *registry;
-  notif_registration_t notif[MAX_NOTIF_REGISTER];
+  notif_index_t *notif; // sorted by notifyType
+  int num_notif_types, size_notif_types;
   int num_notif;
+  notif_deferred_t deferred[MAX_NOTIF_QUEUE]; // for SysNotifyBroadcastDeferred
+  int num_deferred, flushing;
+  notif_rate_t rate[MAX_NOTIF_RATES];
+  int num_rates;
+  notif_queue_stats_t notif_stats;
+  uint64_t total_latency;
   FontTypeV2 *fontPtr[128];
   event_t events[MAX_EVENTS];
   int nev, iev, oev;
@@ -461,19 +488,96 @@ void pumpkin_load_plugins(void) {
   }
 }
 
+static Int32 SysNotifyPriority(UInt32 priority) {
+  Int32 p = priority;
+
+  // XXX lower numbers mean higher priorities, but sysNotifyNormalPriority is 0.
+  // XXX adjust it so that priority 1 is higher than sysNotifyNormalPriority
+  return p == sysNotifyNormalPriority ? sysNotifyMediumPriority : p;
+}
+
+// must be called with the mutex locked
+static notif_index_t *SysNotifyIndex(UInt32 notifyType, Boolean create) {
+  notif_index_t *index;
+  int lo, hi, mid;
+
+  for (lo = 0, hi = pumpkin_module.num_notif_types; lo < hi;) {
+    mid = (lo + hi) / 2;
+    if (pumpkin_module.notif[mid].notifyType == notifyType) return &pumpkin_module.notif[mid];
+    if (pumpkin_module.notif[mid].notifyType < notifyType) lo = mid + 1;
+    else hi = mid;
+  }
+
+  if (!create) return NULL;
+
+  if (pumpkin_module.num_notif_types == pumpkin_module.size_notif_types) {
+    pumpkin_module.size_notif_types = pumpkin_module.size_notif_types ? pumpkin_module.size_notif_types * 2 : 16;
+    pumpkin_module.notif = xrealloc(pumpkin_module.notif, pumpkin_module.size_notif_types * sizeof(notif_index_t));
+  }
+  index = &pumpkin_module.notif[lo];
+  if (lo < pumpkin_module.num_notif_types) {
+    MemMove(index + 1, index, (pumpkin_module.num_notif_types - lo) * sizeof(notif_index_t));
+  }
+  xmemset(index, 0, sizeof(notif_index_t));
+  index->notifyType = notifyType;
+  pumpkin_module.num_notif_types++;
+
+  return index;
+}
+
+// must be called with the mutex locked
+static int SysNotifyFind(notif_index_t *index, UInt32 appCreator) {
+  int i;
+
+  if (index) {
+    for (i = 0; i < index->num; i++) {
+      if (index->reg[i].appCreator == appCreator) return i;
+    }
+  }
+
+  return -1;
+}
+
+// must be called with the mutex locked, registrations with the same priority keep their order
+static void SysNotifyAdd(notif_registration_t *reg) {
+  notif_index_t *index;
+  Int32 p;
+  int i;
+
+  index = SysNotifyIndex(reg->notifyType, true);
+  if (index->num == index->size) {
+    index->size = index->size ? index->size * 2 : 8;
+    index->reg = xrealloc(index->reg, index->size * sizeof(notif_registration_t));
+  }
+
+  p = SysNotifyPriority(reg->priority);
+  for (i = index->num; i > 0 && SysNotifyPriority(index->reg[i-1].priority) > p; i--);
+  if (i < index->num) {
+    MemMove(&index->reg[i+1], &index->reg[i], (index->num - i) * sizeof(notif_registration_t));
+  }
+  xmemcpy(&index->reg[i], reg, sizeof(notif_registration_t));
+  index->num++;
+  pumpkin_module.num_notif++;
+}
+
 static void SysNotifyLoadCallback(UInt32 creator, UInt16 index, UInt16 id, void *p, void *data) {
   AppRegistryNotification *n = (AppRegistryNotification *)p;
+  notif_registration_t reg;
   char stype[8], screator[8];
 
   pumpkin_id2s(n->appCreator, screator);
   pumpkin_id2s(n->notifyType, stype);
-  debug(DEBUG_INFO, PUMPKINOS, "load notification type '%s' creator '%s' priority %d: added", stype, screator, n->priority);
 
-  pumpkin_module.notif[pumpkin_module.num_notif].appCreator = n->appCreator;
-  pumpkin_module.notif[pumpkin_module.num_notif].notifyType = n->notifyType;
-  pumpkin_module.notif[pumpkin_module.num_notif].priority = n->priority;
-  pumpkin_module.notif[pumpkin_module.num_notif].ptr = 0;
-  pumpkin_module.num_notif++;
+  if (pumpkin_module.num_notif < MAX_NOTIF_REGISTER) {
+    debug(DEBUG_INFO, PUMPKINOS, "load notification type '%s' creator '%s' priority %d: added", stype, screator, n->priority);
+    xmemset(&reg, 0, sizeof(reg));
+    reg.appCreator = n->appCreator;
+    reg.notifyType = n->notifyType;
+    reg.priority = n->priority;
+    SysNotifyAdd(&reg);
+  } else {
+    debug(DEBUG_ERROR, PUMPKINOS, "load notification type '%s' creator '%s' priority %d: max reached", stype, screator, n->priority);
+  }
 }
 
 FontTypeV2 *pumpkin_get_font(FontID fontId) {
@@ -518,6 +622,7 @@ static void pumpkin_unload_fonts(void) {
 }
 
 int pumpkin_global_init(script_engine_t *engine, window_provider_t *wp, audio_provider_t *ap, bt_provider_t *bt, gps_parse_line_f gps_parse_line, uint16_t density, int battery) {
+  char *registry_dir;
   int fd;
 #if defined(DARWIN) || defined(BEEPY)
   vfs_session_t *vfs_session;
@@ -578,6 +683,7 @@ int pumpkin_global_init(script_engine_t *engine, window_provider_t *wp, audio_pr
   StoInit(APP_STORAGE, pumpkin_module.fs_mutex);
 
   SysUInitModule(); // sto calls SysQSortP
+  FtrInitGlobal();
 
 #if defined(DARWIN) || defined(BEEPY)
   if ((vfs_session = vfs_open_session()) != NULL) {
@@ -589,19 +695,30 @@ int pumpkin_global_init(script_engine_t *engine, window_provider_t *wp, audio_pr
 
   if (vfs_root != NULL) {
     sys_snprintf(buf, sizeof(buf)-1, "%s%s", vfs_root, REGISTRY_DB);
-    pumpkin_module.registry = AppRegistryInit(buf);
+    registry_dir = buf;
   } else {
-    pumpkin_module.registry = AppRegistryInit(REGISTRY_DB);
+    registry_dir = REGISTRY_DB;
   }
 #else
-  pumpkin_module.registry = AppRegistryInit(REGISTRY_DB);
+  registry_dir = REGISTRY_DB;
 #endif
+  pumpkin_module.registry = AppRegistryInit(registry_dir);
 
+  pumpkin_module.notif = NULL;
+  pumpkin_module.num_notif_types = 0;
+  pumpkin_module.size_notif_types = 0;
   pumpkin_module.num_notif = 0;
   AppRegistryEnum(pumpkin_module.registry, SysNotifyLoadCallback, 0, appRegistryNotification, NULL);
+  pumpkin_module.num_deferred = 0;
+  pumpkin_module.num_rates = 0;
+  SysNotifySetRateLimit(sysNotifyDisplayChangeEvent, 100);
+  SysNotifySetRateLimit(sysNotifyDisplayResizedEvent, 100);
+  AlmInitGlobal(pumpkin_module.registry);
+  FindIndexInitGlobal(registry_dir);
 
   emupalmos_init();
   if (ap && ap->mixer_init) ap->mixer_init();
+  SndMixerInit(ap);
 
 #if defined(DARWIN) || defined(BEEPY)
   if (vfs_root != NULL) {
@@ -896,7 +1013,20 @@ int pumpkin_global_finish(void) {
     xfree(pumpkin_module.plugin[i]);
   }
 
+  for (i = 0; i < pumpkin_module.num_notif_types; i++) {
+    xfree(pumpkin_module.notif[i].reg);
+  }
+  if (pumpkin_module.notif) xfree(pumpkin_module.notif);
+
+  for (i = 0; i < pumpkin_module.num_deferred; i++) {
+    if (pumpkin_module.deferred[i].details) xfree(pumpkin_module.deferred[i].details);
+  }
+
+  AlmFinishGlobal();
+  FindIndexFinishGlobal();
   AppRegistryFinish(pumpkin_module.registry);
+  SndMixerFinish();
+  FtrFinishGlobal();
 
   SysUFinishModule();
   StoFinish();
@@ -1185,7 +1315,6 @@ static int pumpkin_local_init(int i, texture_t *texture, char *name, int width,
   pumpkin_module.tasks[i].texture = texture;
   pumpkin_module.tasks[i].eventKeyMask = 0xFFFFFF;
   sys_strncpy(pumpkin_module.tasks[i].name, name, dmDBNameLength-1);
-  pumpkin_module.tasks[i].num_notifs = 0;
 
   pumpkin_module.task_order[pumpkin_module.num_tasks] = i;
   pumpkin_module.current_task = i;
@@ -1290,6 +1419,7 @@ static int pumpkin_local_finish(UInt32 creator) {
     pumpkin_module.render = 1;
   }
 
+  AppRegistryFlush(pumpkin_module.registry);
   SysFatalAlertFinish();
 
   pumpkin_module.tasks[task->task_index].task_index = 0;
@@ -1713,6 +1843,86 @@ static int pumpkin_resume_task(int handle) {
   return r;
 }
 
+// Pauses several tasks at once: all pause requests are sent before waiting for
+// the replies, so the tasks reach their event loops in parallel. A NULL name is
+// skipped. On return handles[i] is the port to resume, 0 if the task does not
+// need to be paused, or -1 if it could not be paused.
+static void pumpkin_pause_tasks(char **names, int n, int *handles) {
+  pumpkin_task_t *task = (pumpkin_task_t *)thread_get(task_key);
+  uint8_t *buf;
+  unsigned int len;
+  uint32_t msg;
+  int *waiting, i, k, client, pending, r;
+
+  if ((waiting = xcalloc(n, sizeof(int))) == NULL) {
+    for (k = 0; k < n; k++) handles[k] = -1;
+    return;
+  }
+
+  pending = 0;
+  for (k = 0; k < n; k++) handles[k] = names[k] ? 0 : -1;
+
+  if (mutex_lock(mutex) == 0) {
+    for (k = 0; k < n; k++) {
+      if (names[k] == NULL) continue;
+      if (task && !sys_strcmp(names[k], task->name)) continue;
+
+      for (i = 0; i < MAX_TASKS; i++) {
+        if (pumpkin_module.tasks[i].active && !sys_strncmp(pumpkin_module.tasks[i].name, names[k], dmDBNameLength-1)) {
+          handles[k] = pumpkin_module.tasks[i].handle;
+          break;
+        }
+      }
+
+      if (handles[k] > 0) {
+        debug(DEBUG_INFO, PUMPKINOS, "sending pause request to \"%s\" on port %d", names[k], handles[k]);
+        msg = MSG_PAUSE;
+        if (thread_client_write(handles[k], (uint8_t *)&msg, sizeof(uint32_t)) == sizeof(uint32_t)) {
+          waiting[k] = 1;
+          pending++;
+        } else {
+          handles[k] = -1;
+        }
+      } else {
+        handles[k] = 0;
+      }
+    }
+    mutex_unlock(mutex);
+  } else {
+    for (k = 0; k < n; k++) handles[k] = -1;
+  }
+
+  while (pending > 0 && !thread_must_end()) {
+    if ((r = thread_server_read_timeout_from(100000, &buf, &len, &client)) == -1) break;
+    if (r == 0 || buf == NULL) continue;
+
+    for (k = 0; k < n; k++) {
+      if (waiting[k] && handles[k] == client) break;
+    }
+    if (k < n) {
+      waiting[k] = 0;
+      pending--;
+      if (len == sizeof(uint32_t)) {
+        debug(DEBUG_INFO, PUMPKINOS, "pause reply received from \"%s\"", names[k]);
+      } else {
+        debug(DEBUG_ERROR, PUMPKINOS, "received %d bytes from %d but was expecting %d bytes", len, client, sizeof(uint32_t));
+        handles[k] = -1;
+      }
+    } else {
+      debug(DEBUG_ERROR, PUMPKINOS, "received reply from %d but was not expecting it", client);
+    }
+    xfree(buf);
+  }
+
+  for (k = 0; k < n; k++) {
+    if (waiting[k]) {
+      debug(DEBUG_ERROR, PUMPKINOS, "pause reply error from \"%s\"", names[k]);
+      handles[k] = -1;
+    }
+  }
+  xfree(waiting);
+}
+
 uint32_t pumpkin_launch_request(char *name, UInt16 cmd, UInt8 *param, UInt16 flags, PilotMainF pilotMain, UInt16 opendb) {
   pumpkin_task_t *task = (pumpkin_task_t *)thread_get(task_key);
   client_request_t creq;
@@ -2224,6 +2434,8 @@ int pumpkin_sys_event(void) {
     if (!paused) break;
   }
 
+  if (ev == 0) AppRegistryIdle(pumpkin_module.registry);
+
   if (mutex_lock(mutex) == 0) {
     now = sys_get_clock();
 
@@ -2609,7 +2821,6 @@ static int pumpkin_event_multi_thread(int *key, int *mods, int *buttons, uint8_t
       sys_set_finish(1);
     }
   }
-  pumpkin_alarm_check();
 
   if ((r = thread_server_read_timeout_from(usec, &buf, &len, &client)) == 1) {
     arg = (uint32_t *)buf;
@@ -2706,6 +2917,11 @@ static int pumpkin_event_multi_thread(int *key, int *mods, int *buttons, uint8_t
 }
 
 int pumpkin_event(int *key, int *mods, int *buttons, uint8_t *data, uint32_t *n, uint32_t usec) {
+  // alarms are delivered by the launcher, or by the only task
+  if (AlmPending() && (pumpkin_module.dia || pumpkin_module.single || pumpkin_is_spawner())) {
+    AlmAlarmCallback();
+  }
+
   return pumpkin_module.dia || pumpkin_module.single ?
     pumpkin_event_single_thread(key, mods, buttons, data, n, usec) :
     pumpkin_event_multi_thread(key, mods, buttons, data, n, usec);
@@ -3082,82 +3298,6 @@ int pumpkin_clipboard_add_bitmap(BitmapType *bmp, int size) {
   return r;
 }
 
-int pumpkin_alarm_check(void) {
-  pumpkin_task_t *task = (pumpkin_task_t *)thread_get(task_key);
-  SysAlarmTriggeredParamType triggerAlarm;
-  SysDisplayAlarmParamType displayAlarm;
-  launch_request_t request;
-  int r = 0;
-
-  if (task->alarm_time) {
-    // there is an alarm set
-    if (sys_time() >= task->alarm_time) {
-      debug(DEBUG_INFO, PUMPKINOS, "pumpkin_alarm_check: alarm time has arrived");
-      triggerAlarm.alarmSeconds = task->alarm_time;
-      triggerAlarm.ref = task->alarm_data;
-
-      xmemset(&request, 0, sizeof(request));
-      request.code = sysAppLaunchCmdAlarmTriggered;
-      request.param = &triggerAlarm;
-
-      if (pumpkin_launch_sub(&request, 0) == 0) {
-        xmemcpy(&triggerAlarm, request.param, sizeof(SysAlarmTriggeredParamType));
-        if (triggerAlarm.purgeAlarm) {
-          // application requested to cancel the alarm
-          debug(DEBUG_INFO, PUMPKINOS, "pumpkin_alarm_check: purge alarm");
-          task->alarm_time = 0;
-          task->alarm_data = 0;
-
-        } else {
-          // go ahead and send the alarm
-          displayAlarm.alarmSeconds = task->alarm_time;
-          displayAlarm.ref = task->alarm_data;
-          displayAlarm.soundAlarm = false; // not used
-          task->alarm_time = 0;
-          task->alarm_data = 0;
-
-          xmemset(&request, 0, sizeof(request));
-          request.code = sysAppLaunchCmdDisplayAlarm;
-          request.param = &displayAlarm;
-
-          debug(DEBUG_INFO, PUMPKINOS, "pumpkin_alarm_check: display alarm");
-          if (pumpkin_launch_sub(&request, 0) == 0) {
-            r = 1;
-          }
-        }
-      }
-    }
-  }
-
-  return r;
-}
-
-int pumpkin_alarm_set(LocalID dbID, uint32_t t, uint32_t data) {
-  pumpkin_task_t *task = (pumpkin_task_t *)thread_get(task_key);
-  int r = -1;
-
-  if (dbID == task->dbID) {
-    task->alarm_time = t;
-    task->alarm_data = data;
-    r = 0;
-  }
-
-  return r;
-}
-
-int pumpkin_alarm_get(LocalID dbID, uint32_t *t, uint32_t *data) {
-  pumpkin_task_t *task = (pumpkin_task_t *)thread_get(task_key);
-  int r = -1;
-
-  if (dbID == task->dbID) {
-    if (t) *t = task->alarm_time;
-    if (data) *data = task->alarm_data;
-    r = 0;
-  }
-
-  return r;
-}
-
 int pumpkin_add_serial(char *descr, uint32_t creator, char *host, uint32_t port) {
   int r = -1;
 
@@ -3722,20 +3862,21 @@ int pumpkin_is_m68k(void) {
   return task ? task->m68k : 0;
 }
 
+// the registry has its own lock
 void pumpkin_set_preference(UInt32 creator, UInt16 seq, void *p, UInt16 size, Boolean saved) {
-  if (mutex_lock(mutex) == 0) {
-    AppRegistrySetPreference(pumpkin_module.registry, creator, seq, p, size, saved);
-    mutex_unlock(mutex);
-  }
+  AppRegistrySetPreference(pumpkin_module.registry, creator, seq, p, size, saved);
 }
 
 UInt16 pumpkin_get_preference(UInt32 creator, UInt16 seq, void *p, UInt16 size, Boolean saved) {
-  if (mutex_lock(mutex) == 0) {
-    size = AppRegistryGetPreference(pumpkin_module.registry, creator, seq, p, size, saved);
-    mutex_unlock(mutex);
-  }
+  return AppRegistryGetPreference(pumpkin_module.registry, creator, seq, p, size, saved);
+}
 
-  return size;
+Int16 pumpkin_get_app_preference(UInt32 creator, UInt16 seq, void *prefs, UInt16 *size, Boolean saved) {
+  return AppRegistryGetVersionedPreference(pumpkin_module.registry, creator, seq, prefs, size, saved);
+}
+
+void pumpkin_set_app_preference(UInt32 creator, UInt16 seq, Int16 version, const void *prefs, UInt16 size, Boolean saved) {
+  AppRegistrySetVersionedPreference(pumpkin_module.registry, creator, seq, version, prefs, size, saved);
 }
 
 void pumpkin_save_bitmap(BitmapType *bmp, UInt16 density, Coord wWidth, Coord wHeight, Coord width, Coord height, char *filename) {
@@ -3843,12 +3984,10 @@ static int pumpkin_httpd_read(int pe) {
 
     if (len > 0) {
       if ((con = (http_connection_t *)ptr_lock(ptr, TAG_CONN)) != NULL) {
-        if (con->body_fd > 0) {
-          if (len > MAX_PACKET) len = MAX_PACKET;
-          len = sys_read(con->body_fd, (uint8_t *)con->body_buf, len);
-          if (len >= 0) {
-            r = script_push_lstring(pe, con->body_buf, len);
-          }
+        if (len > MAX_PACKET) len = MAX_PACKET;
+        len = httpd_body_read(con, (uint8_t *)con->body_buf, len);
+        if (len >= 0) {
+          r = script_push_lstring(pe, con->body_buf, len);
         }
         ptr_unlock(ptr, TAG_CONN);
       }
@@ -4257,28 +4396,24 @@ static void notif_ptr_destructor(void *p) {
 
 Err SysNotifyRegister(UInt16 cardNo, LocalID dbID, UInt32 notifyType, SysNotifyProcPtr callbackP, Int8 priority, void *userDataP) {
   AppRegistryNotification n;
+  notif_registration_t reg;
   UInt32 type, creator;
   notif_ptr_t *np;
-  char screator[8], stype[8];
-  int ptr, i;
+  char name[dmDBNameLength], screator[8], stype[8];
+  int ptr;
   Err err;
 
-  if ((err = DmDatabaseInfo(0, dbID, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &type, &creator)) == errNone) {
+  if ((err = DmDatabaseInfo(0, dbID, name, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &type, &creator)) == errNone) {
+    pumpkin_id2s(creator, screator);
+    pumpkin_id2s(notifyType, stype);
+
     if (type == sysFileTApplication) {
       if (mutex_lock(mutex) == 0) {
-        pumpkin_id2s(creator, screator);
-        pumpkin_id2s(notifyType, stype);
-
         if (pumpkin_module.num_notif < MAX_NOTIF_REGISTER) {
-          for (i = 0; i < pumpkin_module.num_notif; i++) {
-            if (pumpkin_module.notif[i].appCreator == creator && pumpkin_module.notif[i].notifyType == notifyType) {
-              debug(DEBUG_ERROR, PUMPKINOS, "register notification type '%s' creator '%s' priority %d: duplicate", stype, screator, priority);
-              err = sysNotifyErrDuplicateEntry;
-              break;
-            }
-          }
-
-          if (i == pumpkin_module.num_notif) {
+          if (SysNotifyFind(SysNotifyIndex(notifyType, false), creator) >= 0) {
+            debug(DEBUG_ERROR, PUMPKINOS, "register notification type '%s' creator '%s' priority %d: duplicate", stype, screator, priority);
+            err = sysNotifyErrDuplicateEntry;
+          } else {
             debug(DEBUG_INFO, PUMPKINOS, "register notification type '%s' creator '%s' priority %d: added", stype, screator, priority);
             if (callbackP || userDataP) {
               np = xcalloc(1, sizeof(notif_ptr_t));
@@ -4298,11 +4433,13 @@ Err SysNotifyRegister(UInt16 cardNo, LocalID dbID, UInt32 notifyType, SysNotifyP
               AppRegistrySet(pumpkin_module.registry, creator, appRegistryNotification, 0, &n);
               ptr = 0;
             }
-            pumpkin_module.notif[i].appCreator = creator;
-            pumpkin_module.notif[i].notifyType = notifyType;
-            pumpkin_module.notif[i].priority = priority;
-            pumpkin_module.notif[i].ptr = ptr;
-            pumpkin_module.num_notif++;
+            reg.appCreator = creator;
+            reg.notifyType = notifyType;
+            reg.priority = priority;
+            reg.ptr = ptr;
+            reg.dbID = dbID;
+            StrNCopy(reg.name, name, dmDBNameLength-1);
+            SysNotifyAdd(&reg);
             err = errNone;
           }
         } else {
@@ -4323,6 +4460,7 @@ Err SysNotifyRegister(UInt16 cardNo, LocalID dbID, UInt32 notifyType, SysNotifyP
 
 Err SysNotifyUnregister(UInt16 cardNo, LocalID dbID, UInt32 notifyType, Int8 priority) {
   AppRegistryNotification n;
+  notif_index_t *index;
   UInt32 creator;
   char screator[8], stype[8];
   int i;
@@ -4333,27 +4471,24 @@ Err SysNotifyUnregister(UInt16 cardNo, LocalID dbID, UInt32 notifyType, Int8 pri
       pumpkin_id2s(creator, screator);
       pumpkin_id2s(notifyType, stype);
 
-      for (i = 0; i < pumpkin_module.num_notif; i++) {
-        if (pumpkin_module.notif[i].appCreator == creator && pumpkin_module.notif[i].notifyType == notifyType) {
-          debug(DEBUG_INFO, PUMPKINOS, "unregister notification type '%s' creator '%s' priority %d: removed", stype, screator, pumpkin_module.notif[i].priority);
-          if (pumpkin_module.notif[i].ptr) {
-            ptr_free(pumpkin_module.notif[i].ptr, TAG_NOTIF);
-          } else {
-            n.appCreator = creator;
-            n.notifyType = notifyType;
-            n.priority = 0xFFFF; // invalid priority: remove (appCreator,notifyType)
-            AppRegistrySet(pumpkin_module.registry, creator, appRegistryNotification, 0, &n);
-          }
-          for (i++; i < pumpkin_module.num_notif; i++) {
-            MemMove(&pumpkin_module.notif[i-1], &pumpkin_module.notif[i], sizeof(notif_registration_t));
-          }
-          pumpkin_module.num_notif--;
-          err = errNone;
-          break;
+      index = SysNotifyIndex(notifyType, false);
+      if ((i = SysNotifyFind(index, creator)) >= 0) {
+        debug(DEBUG_INFO, PUMPKINOS, "unregister notification type '%s' creator '%s' priority %d: removed", stype, screator, index->reg[i].priority);
+        if (index->reg[i].ptr) {
+          ptr_free(index->reg[i].ptr, TAG_NOTIF);
+        } else {
+          n.appCreator = creator;
+          n.notifyType = notifyType;
+          n.priority = 0xFFFF; // invalid priority: remove (appCreator,notifyType)
+          AppRegistrySet(pumpkin_module.registry, creator, appRegistryNotification, 0, &n);
         }
-      }
-
-      if (i == pumpkin_module.num_notif) {
+        index->num--;
+        if (i < index->num) {
+          MemMove(&index->reg[i], &index->reg[i+1], (index->num - i) * sizeof(notif_registration_t));
+        }
+        pumpkin_module.num_notif--;
+        err = errNone;
+      } else {
         debug(DEBUG_ERROR, PUMPKINOS, "unregister notification type '%s' creator '%s': not found", stype, screator);
         err = sysNotifyErrEntryNotFound;
       }
@@ -4364,69 +4499,180 @@ Err SysNotifyUnregister(UInt16 cardNo, LocalID dbID, UInt32 notifyType, Int8 pri
   return err;
 }
 
-static Int32 compare_registration(void *e1, void *e2, void *otherP) {
-  notif_registration_t *r1, *r2;
-  Int32 p1, p2, r = 0;
+// Resolves the app names not cached yet and stores them back in the index.
+static void SysNotifyResolve(UInt32 notifyType, notif_registration_t *reg, int n) {
+  DmSearchStateType stateInfo;
+  notif_index_t *index;
+  int i, k, resolved = 0;
+
+  for (k = 0; k < n; k++) {
+    if (reg[k].name[0]) continue;
+    if (DmGetNextDatabaseByTypeCreator(true, &stateInfo, sysFileTApplication, reg[k].appCreator, false, NULL, &reg[k].dbID) != errNone) continue;
+    if (DmDatabaseInfo(0, reg[k].dbID, reg[k].name, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL) != errNone) {
+      reg[k].name[0] = 0;
+      continue;
+    }
+    resolved++;
+  }
+
+  if (resolved && mutex_lock(mutex) == 0) {
+    index = SysNotifyIndex(notifyType, false);
+    for (k = 0; k < n; k++) {
+      if (reg[k].name[0] && (i = SysNotifyFind(index, reg[k].appCreator)) >= 0 && index->reg[i].name[0] == 0) {
+        index->reg[i].dbID = reg[k].dbID;
+        StrNCopy(index->reg[i].name, reg[k].name, dmDBNameLength-1);
+      }
+    }
+    mutex_unlock(mutex);
+  }
+}
+
+// A deleted dbID may be reused by another database, so drop it from the name cache.
+static void SysNotifyForget(LocalID dbID) {
+  int i, k;
+
+  if (mutex_lock(mutex) == 0) {
+    for (i = 0; i < pumpkin_module.num_notif_types; i++) {
+      for (k = 0; k < pumpkin_module.notif[i].num; k++) {
+        if (pumpkin_module.notif[i].reg[k].dbID == dbID) {
+          pumpkin_module.notif[i].reg[k].dbID = 0;
+          pumpkin_module.notif[i].reg[k].name[0] = 0;
+        }
+      }
+    }
+    mutex_unlock(mutex);
+  }
+}
 
-  r1 = (notif_registration_t *)e1;
-  r2 = (notif_registration_t *)e2;
-  p1 = r1->priority;
-  p2 = r2->priority;
+// Snapshot of the registrations for a notification type, in delivery order.
+static notif_registration_t *SysNotifySelect(UInt32 notifyType, int *n) {
+  notif_index_t *index;
+  notif_registration_t *selected = NULL;
 
-  // XXX lower numbers mean higher priorities, but sysNotifyNormalPriority is 0.
-  // XXX adjust it so that priority 1 is higher than sysNotifyNormalPriority
-  if (p1 == sysNotifyNormalPriority) p1 = sysNotifyMediumPriority;
-  if (p2 == sysNotifyNormalPriority) p2 = sysNotifyMediumPriority;
+  *n = 0;
 
-  if (p1 < p2) {
-    r = -1;
-  } else if (p1 > p2) {
-    r = 1;
+  if (mutex_lock(mutex) == 0) {
+    if ((index = SysNotifyIndex(notifyType, false)) != NULL && index->num > 0) {
+      if ((selected = xcalloc(index->num, sizeof(notif_registration_t))) != NULL) {
+        xmemcpy(selected, index->reg, index->num * sizeof(notif_registration_t));
+        *n = index->num;
+      }
+    }
+    mutex_unlock(mutex);
   }
 
-  return r;
+  if (selected) {
+    SysNotifyResolve(notifyType, selected, *n);
+  }
+
+  return selected;
 }
 
-Err SysNotifyBroadcast(SysNotifyParamType *notify) {
-  notif_registration_t *selected;
-  DmSearchStateType stateInfo;
+// Adds the tasks owning native callbacks in reg to names, once each.
+static int SysNotifyTargets(notif_registration_t *reg, int n, char **names, int m) {
   notif_ptr_t *np;
-  LocalID dbID;
-  char name[dmDBNameLength], stype[8];
-  int i, j, n, handle, call;
+  int j, k, native;
 
-  if (notify == NULL) {
-    return sysErrParamErr;
-  }
+  for (k = 0; k < n; k++) {
+    if (reg[k].name[0] == 0 || reg[k].ptr == 0) continue;
+    if ((np = ptr_lock(reg[k].ptr, TAG_NOTIF)) == NULL) continue;
+    native = np->callback != NULL;
+    ptr_unlock(reg[k].ptr, TAG_NOTIF);
+    if (!native) continue;
 
-  pumpkin_id2s(notify->notifyType, stype);
-  debug(DEBUG_INFO, PUMPKINOS, "broadcast notification type '%s' begin", stype);
+    for (j = 0; j < m && sys_strcmp(names[j], reg[k].name); j++);
+    if (j == m) names[m++] = reg[k].name;
+  }
 
-  selected = NULL;
-  n = 0;
+  return m;
+}
 
-  if (mutex_lock(mutex) == 0) {
-    for (i = 0; i < pumpkin_module.num_notif; i++) {
-      if (pumpkin_module.notif[i].notifyType == notify->notifyType) {
-        n++;
-      }
+// Removes from names the tasks that are also reached by launch code or 68k
+// callback in reg: they must not be paused while that is delivered.
+static int SysNotifyExclude(notif_registration_t *reg, int n, char **names, int m) {
+  notif_ptr_t *np;
+  int j, k, native;
+
+  for (k = 0; k < n; k++) {
+    if (reg[k].name[0] == 0) continue;
+    native = 0;
+    if (reg[k].ptr && (np = ptr_lock(reg[k].ptr, TAG_NOTIF)) != NULL) {
+      native = np->callback != NULL;
+      ptr_unlock(reg[k].ptr, TAG_NOTIF);
     }
+    if (native) continue;
+
+    for (j = 0; j < m && sys_strcmp(names[j], reg[k].name); j++);
+    if (j < m) names[j] = names[--m];
+  }
 
-    if (n > 0) {
-      if ((selected = xcalloc(n, sizeof(notif_registration_t))) != NULL) {
-        for (i = 0, j = 0; i < pumpkin_module.num_notif && j < n; i++) {
-          if (pumpkin_module.notif[i].notifyType == notify->notifyType) {
-            MemMove(&selected[j++], &pumpkin_module.notif[i], sizeof(notif_registration_t));
+  return m;
+}
+
+// Delivers a notification in priority order. The tasks listed in names were
+// already paused by the caller, the other targets are paused one at a time.
+// Callbacks run one after another, so that each one sees the handled flag
+// set by the previous ones.
+static void SysNotifyDeliver(SysNotifyParamType *notify, notif_registration_t *reg, int n, char **names, int *handles, int m, char *stype) {
+  notif_ptr_t *np;
+  int handle, call, j, k;
+
+  for (k = 0; k < n; k++) {
+    if (reg[k].name[0] == 0) continue;
+
+    if (reg[k].ptr) {
+      if ((np = ptr_lock(reg[k].ptr, TAG_NOTIF)) != NULL) {
+        notify->userDataP = np->userData68k ? (uint8_t *)pumpkin_heap_base() + np->userData68k : np->userData;
+
+        if (np->callback) {
+          debug(DEBUG_INFO, PUMPKINOS, "send notification type '%s' priority %d to \"%s\" using callback %p", stype, reg[k].priority, reg[k].name, np->callback);
+          for (j = 0; j < m && sys_strcmp(names[j], reg[k].name); j++);
+          if (j < m) {
+            if (handles[j] >= 0) np->callback(notify);
+          } else {
+            handle = pumpkin_pause_task(reg[k].name, &call);
+            if (call) np->callback(notify);
+            pumpkin_resume_task(handle);
           }
+        } else if (np->callback68k) {
+          debug(DEBUG_INFO, PUMPKINOS, "send notification type '%s' priority %d to \"%s\" using 68k callback 0x%08X", stype, reg[k].priority, reg[k].name, np->callback68k);
+          handle = pumpkin_pause_task(reg[k].name, &call);
+          if (call) CallNotifyProc(np->callback68k, notify);
+          pumpkin_resume_task(handle);
+        } else {
+          debug(DEBUG_INFO, PUMPKINOS, "send notification type '%s' priority %d to \"%s\" using launch code", stype, reg[k].priority, reg[k].name);
+          pumpkin_launch_request(reg[k].name, sysAppLaunchCmdNotify, (UInt8 *)notify, 0, NULL, 1);
         }
+        ptr_unlock(reg[k].ptr, TAG_NOTIF);
       }
     } else {
-      debug(DEBUG_INFO, PUMPKINOS, "no app registered for this notification type");
+      notify->userDataP = NULL;
+      debug(DEBUG_INFO, PUMPKINOS, "send notification type '%s' priority %d to \"%s\" using launch code", stype, reg[k].priority, reg[k].name);
+      pumpkin_launch_request(reg[k].name, sysAppLaunchCmdNotify, (UInt8 *)notify, 0, NULL, 1);
     }
-    mutex_unlock(mutex);
+  }
+}
+
+Err SysNotifyBroadcast(SysNotifyParamType *notify) {
+  notif_registration_t *selected;
+  SysNotifyDBDeletedType *dbDeleted;
+  char **names, stype[8];
+  int *handles, b, e, j, m, n;
+  Int32 p;
+
+  if (notify == NULL) {
+    return sysErrParamErr;
   }
 
-  if (selected != NULL) {
+  pumpkin_id2s(notify->notifyType, stype);
+  debug(DEBUG_INFO, PUMPKINOS, "broadcast notification type '%s' begin", stype);
+
+  if (notify->notifyType == sysNotifyDBDeletedEvent && notify->notifyDetailsP) {
+    dbDeleted = (SysNotifyDBDeletedType *)notify->notifyDetailsP;
+    SysNotifyForget(dbDeleted->oldDBID);
+  }
+
+  if ((selected = SysNotifySelect(notify->notifyType, &n)) != NULL) {
     notify->handled = false;
     notify->reserved2 = 0;
 
@@ -4434,39 +4680,29 @@ Err SysNotifyBroadcast(SysNotifyParamType *notify) {
       notify->broadcaster = pumpkin_get_app_creator();
     }
 
-    SysQSortP(selected, n, sizeof(notif_registration_t *), compare_registration, NULL);
-
-    for (j = 0; j < n; j++) {
-      if (DmGetNextDatabaseByTypeCreator(true, &stateInfo, sysFileTApplication, selected[j].appCreator, false, NULL, &dbID) != errNone) continue;
-      if (DmDatabaseInfo(0, dbID, name, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL) != errNone) continue;
-
-      if (selected[j].ptr) {
-        if ((np = ptr_lock(selected[j].ptr, TAG_NOTIF)) != NULL) {
-          notify->userDataP = np->userData68k ? (uint8_t *)pumpkin_heap_base() + np->userData68k : np->userData;
-
-          if (np->callback) {
-            debug(DEBUG_INFO, PUMPKINOS, "send notification type '%s' priority %d to \"%s\" using callback %p", stype, selected[j].priority, name, np->callback);
-            handle = pumpkin_pause_task(name, &call);
-            if (call) np->callback(notify);
-            pumpkin_resume_task(handle);
-          } else if (np->callback68k) {
-            debug(DEBUG_INFO, PUMPKINOS, "send notification type '%s' priority %d to \"%s\" using 68k callback 0x%08X", stype, selected[j].priority, name, np->callback68k);
-            handle = pumpkin_pause_task(name, &call);
-            if (call) CallNotifyProc(np->callback68k, notify);
-            pumpkin_resume_task(handle);
-          } else {
-            debug(DEBUG_INFO, PUMPKINOS, "send notification type '%s' priority %d to \"%s\" using launch code", stype, selected[j].priority, name);
-            pumpkin_launch_request(name, sysAppLaunchCmdNotify, (UInt8 *)notify, 0, NULL, 1);
-          }
-          ptr_unlock(selected[j].ptr, TAG_NOTIF);
+    names = xcalloc(n, sizeof(char *));
+    handles = xcalloc(n, sizeof(int));
+
+    if (names && handles) {
+      // the index is sorted by priority, so each band is a contiguous range.
+      // The tasks of the native callbacks in a band are paused together.
+      for (b = 0; b < n; b = e) {
+        p = SysNotifyPriority(selected[b].priority);
+        for (e = b + 1; e < n && SysNotifyPriority(selected[e].priority) == p; e++);
+        m = SysNotifyTargets(&selected[b], e - b, names, 0);
+        pumpkin_pause_tasks(names, m, handles);
+        SysNotifyDeliver(notify, &selected[b], e - b, names, handles, m, stype);
+        for (j = 0; j < m; j++) {
+          pumpkin_resume_task(handles[j]);
         }
-      } else {
-        notify->userDataP = NULL;
-        debug(DEBUG_INFO, PUMPKINOS, "send notification type '%s' priority %d to \"%s\" using launch code", stype, selected[j].priority, name);
-        pumpkin_launch_request(name, sysAppLaunchCmdNotify, (UInt8 *)notify, 0, NULL, 1);
       }
     }
+
+    if (names) xfree(names);
+    if (handles) xfree(handles);
     xfree(selected);
+  } else {
+    debug(DEBUG_INFO, PUMPKINOS, "no app registered for this notification type");
   }
 
   debug(DEBUG_INFO, PUMPKINOS, "broadcast notification type '%s' end", stype);
@@ -4474,49 +4710,258 @@ Err SysNotifyBroadcast(SysNotifyParamType *notify) {
   return errNone;
 }
 
+// Part of the payload that identifies a deferred notification. Deferred
+// notifications with the same type, broadcaster and key are coalesced, and
+// the newest payload is delivered.
+static void SysNotifyKey(UInt32 notifyType, UInt16 size, UInt16 *offset, UInt16 *len) {
+  switch (notifyType) {
+    case sysNotifyDisplayChangeEvent:
+    case sysNotifyDisplayResizedEvent:
+      // only the current state of the display matters
+      *offset = 0;
+      *len = 0;
+      break;
+    case sysNotifyDBChangedEvent:
+      *offset = OffsetOf(SysNotifyDBChangedType, dbID);
+      *len = sizeof(LocalID);
+      break;
+    case sysNotifyDBCreatedEvent:
+      *offset = OffsetOf(SysNotifyDBCreatedType, newDBID);
+      *len = sizeof(LocalID);
+      break;
+    default:
+      *offset = 0;
+      *len = size;
+      break;
+  }
+
+  if (*offset + *len > size) {
+    *offset = 0;
+    *len = size;
+  }
+}
+
+// must be called with the mutex locked
+static notif_rate_t *SysNotifyRate(UInt32 notifyType) {
+  int i;
+
+  for (i = 0; i < pumpkin_module.num_rates; i++) {
+    if (pumpkin_module.rate[i].notifyType == notifyType) return &pumpkin_module.rate[i];
+  }
+
+  return NULL;
+}
+
+Err SysNotifySetRateLimit(UInt32 notifyType, UInt32 interval) {
+  notif_rate_t *rate;
+  Err err = errNone;
+
+  if (mutex_lock(mutex) == 0) {
+    if ((rate = SysNotifyRate(notifyType)) != NULL) {
+      if (interval) {
+        rate->interval = (int64_t)interval * 1000;
+      } else {
+        *rate = pumpkin_module.rate[--pumpkin_module.num_rates];
+      }
+    } else if (interval) {
+      if (pumpkin_module.num_rates < MAX_NOTIF_RATES) {
+        rate = &pumpkin_module.rate[pumpkin_module.num_rates++];
+        rate->notifyType = notifyType;
+        rate->interval = (int64_t)interval * 1000;
+        rate->last = 0;
+      } else {
+        err = sysErrParamErr;
+      }
+    }
+    mutex_unlock(mutex);
+  }
+
+  return err;
+}
+
+void SysNotifyQueueStats(notif_queue_stats_t *stats) {
+  if (stats && mutex_lock(mutex) == 0) {
+    xmemcpy(stats, &pumpkin_module.notif_stats, sizeof(notif_queue_stats_t));
+    stats->depth = pumpkin_module.num_deferred;
+    mutex_unlock(mutex);
+  }
+}
+
 Err SysNotifyBroadcastDeferred(SysNotifyParamType *notify, Int16 paramSize) {
-  pumpkin_task_t *task = (pumpkin_task_t *)thread_get(task_key);
+  notif_deferred_t *d;
+  UInt32 broadcaster;
+  UInt16 size, offset, len, doffset, dlen;
+  uint8_t *details;
   char stype[8];
+  int i;
   Err err = sysErrParamErr;
 
   if (notify) {
     pumpkin_id2s(notify->notifyType, stype);
+    broadcaster = notify->broadcaster ? notify->broadcaster : pumpkin_get_app_creator();
+    size = notify->notifyDetailsP && paramSize > 0 ? paramSize : 0;
+    details = NULL;
 
-    if (task->num_notifs < MAX_NOTIF_QUEUE) {
-      debug(DEBUG_INFO, PUMPKINOS, "defer notification type '%s'", stype);
-      MemMove(&task->notify[task->num_notifs], notify, sizeof(SysNotifyParamType));
-      if (notify->notifyDetailsP && paramSize) {
-        task->notify[task->num_notifs].notifyDetailsP = MemPtrNew(paramSize);
-        MemMove(task->notify[task->num_notifs].notifyDetailsP, notify->notifyDetailsP, paramSize);
+    if (size && (details = xmalloc(size)) == NULL) {
+      return memErrNotEnoughSpace;
+    }
+    if (details) xmemcpy(details, notify->notifyDetailsP, size);
+    SysNotifyKey(notify->notifyType, size, &offset, &len);
+
+    if (mutex_lock(mutex) == 0) {
+      pumpkin_module.notif_stats.deferred++;
+
+      for (i = 0; i < pumpkin_module.num_deferred; i++) {
+        d = &pumpkin_module.deferred[i];
+        if (d->notify.notifyType != notify->notifyType || d->notify.broadcaster != broadcaster) continue;
+        SysNotifyKey(d->notify.notifyType, d->size, &doffset, &dlen);
+        if (dlen == len && (len == 0 || !sys_memcmp(d->details + doffset, details + offset, len))) break;
       }
-      task->num_notifs++;
-      err = errNone;
-    } else {
-      debug(DEBUG_ERROR, PUMPKINOS, "defer notification type '%s' max reached", stype);
-      err = sysNotifyErrQueueFull;
+
+      if (i < pumpkin_module.num_deferred) {
+        debug(DEBUG_INFO, PUMPKINOS, "defer notification type '%s' coalesced", stype);
+        if (d->details) xfree(d->details);
+        d->details = details;
+        d->size = size;
+        d->notify.notifyDetailsP = details;
+        pumpkin_module.notif_stats.coalesced++;
+        err = errNone;
+      } else if (pumpkin_module.num_deferred < MAX_NOTIF_QUEUE) {
+        debug(DEBUG_INFO, PUMPKINOS, "defer notification type '%s'", stype);
+        d = &pumpkin_module.deferred[pumpkin_module.num_deferred++];
+        xmemcpy(&d->notify, notify, sizeof(SysNotifyParamType));
+        d->notify.broadcaster = broadcaster;
+        d->notify.notifyDetailsP = details;
+        d->details = details;
+        d->size = size;
+        d->t = sys_get_clock();
+        if (pumpkin_module.num_deferred > pumpkin_module.notif_stats.maxDepth) {
+          pumpkin_module.notif_stats.maxDepth = pumpkin_module.num_deferred;
+        }
+        err = errNone;
+      } else {
+        debug(DEBUG_ERROR, PUMPKINOS, "defer notification type '%s' max reached", stype);
+        pumpkin_module.notif_stats.dropped++;
+        err = sysNotifyErrQueueFull;
+      }
+      mutex_unlock(mutex);
     }
+
+    if (err != errNone && details) xfree(details);
   }
 
   return err;
 }
 
+// Delivers the due deferred notifications of all tasks. The tasks owning
+// native callbacks for any of them are paused only once for the whole batch.
 void SysNotifyBroadcastQueued(void) {
-  pumpkin_task_t *task = (pumpkin_task_t *)thread_get(task_key);
-  int i;
+  notif_deferred_t *batch;
+  notif_registration_t **selected;
+  notif_rate_t *rate;
+  uint32_t latency;
+  int64_t now;
+  char **names, stype[8];
+  int *num, *handles, i, j, m, nb, total;
+
+  batch = NULL;
+  nb = 0;
+
+  if (mutex_lock(mutex) == 0) {
+    if (!pumpkin_module.flushing && pumpkin_module.num_deferred > 0) {
+      if ((batch = xcalloc(pumpkin_module.num_deferred, sizeof(notif_deferred_t))) != NULL) {
+        now = sys_get_clock();
+        for (i = 0, j = 0; i < pumpkin_module.num_deferred; i++) {
+          rate = SysNotifyRate(pumpkin_module.deferred[i].notify.notifyType);
+          if (rate && now - rate->last < rate->interval) {
+            // too soon, keep it queued so that it can absorb more broadcasts
+            pumpkin_module.deferred[j++] = pumpkin_module.deferred[i];
+            continue;
+          }
+          if (rate) rate->last = now;
+          batch[nb++] = pumpkin_module.deferred[i];
+        }
+        pumpkin_module.num_deferred = j;
+        if (nb > 0) pumpkin_module.flushing = 1;
+      }
+    }
+    mutex_unlock(mutex);
+  }
+
+  if (nb == 0) {
+    if (batch) xfree(batch);
+    return;
+  }
+
+  debug(DEBUG_INFO, PUMPKINOS, "flush notification queue begin (%d notifications)", nb);
+  selected = xcalloc(nb, sizeof(notif_registration_t *));
+  num = xcalloc(nb, sizeof(int));
+
+  if (selected && num) {
+    for (i = 0, total = 0; i < nb; i++) {
+      selected[i] = SysNotifySelect(batch[i].notify.notifyType, &num[i]);
+      total += num[i];
+    }
+
+    names = xcalloc(total + 1, sizeof(char *));
+    handles = xcalloc(total + 1, sizeof(int));
+    m = 0;
+
+    if (names && handles) {
+      for (i = 0; i < nb; i++) {
+        m = SysNotifyTargets(selected[i], num[i], names, m);
+      }
+      for (i = 0; i < nb; i++) {
+        m = SysNotifyExclude(selected[i], num[i], names, m);
+      }
+      pumpkin_pause_tasks(names, m, handles);
+    }
 
-  if (task->num_notifs > 0) {
-    debug(DEBUG_INFO, PUMPKINOS, "flush notification queue begin");
+    for (i = 0; i < nb; i++) {
+      if (selected[i] && names && handles) {
+        pumpkin_id2s(batch[i].notify.notifyType, stype);
+        batch[i].notify.handled = false;
+        batch[i].notify.reserved2 = 0;
+        SysNotifyDeliver(&batch[i].notify, selected[i], num[i], names, handles, m, stype);
+      }
 
-    for (i = 0; i < task->num_notifs; i++) {
-      SysNotifyBroadcast(&task->notify[i]);
-      if (task->notify[i].notifyDetailsP) {
-        MemPtrFree(task->notify[i].notifyDetailsP);
+      latency = sys_get_clock() - batch[i].t;
+      if (mutex_lock(mutex) == 0) {
+        pumpkin_module.notif_stats.delivered++;
+        pumpkin_module.notif_stats.lastLatency = latency;
+        if (latency > pumpkin_module.notif_stats.maxLatency) pumpkin_module.notif_stats.maxLatency = latency;
+        pumpkin_module.total_latency += latency;
+        pumpkin_module.notif_stats.avgLatency = pumpkin_module.total_latency / pumpkin_module.notif_stats.delivered;
+        mutex_unlock(mutex);
       }
     }
 
-    MemSet(task->notify, sizeof(SysNotifyParamType) * MAX_NOTIF_QUEUE, 0);
-    task->num_notifs = 0;
-    debug(DEBUG_INFO, PUMPKINOS, "flush notification queue end");
+    if (names && handles) {
+      for (j = 0; j < m; j++) {
+        pumpkin_resume_task(handles[j]);
+      }
+    }
+
+    for (i = 0; i < nb; i++) {
+      if (selected[i]) xfree(selected[i]);
+    }
+    if (names) xfree(names);
+    if (handles) xfree(handles);
+  }
+
+  for (i = 0; i < nb; i++) {
+    if (batch[i].details) xfree(batch[i].details);
+  }
+  if (selected) xfree(selected);
+  if (num) xfree(num);
+  xfree(batch);
+
+  if (mutex_lock(mutex) == 0) {
+    pumpkin_module.flushing = 0;
+    debug(DEBUG_INFO, PUMPKINOS, "flush notification queue end (depth %d, coalesced %u, dropped %u, latency %u us avg, %u us max)",
+      pumpkin_module.num_deferred, pumpkin_module.notif_stats.coalesced, pumpkin_module.notif_stats.dropped,
+      pumpkin_module.notif_stats.avgLatency, pumpkin_module.notif_stats.maxLatency);
+    mutex_unlock(mutex);
   }
 }
 
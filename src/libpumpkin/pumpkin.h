@@ -30,6 +30,8 @@ extern "C" {
 
 #define GPSLibRefNum (MAX_SYSLIBS+3)
 
+#define Lz77LibRefNum (MAX_SYSLIBS+4)
+
 #define BUTTONS_HEIGHT 64
 
 #define MSG_KEY     1
@@ -271,12 +273,11 @@ int pumpkin_clipboard_append_text(char *text, int length);
 int pumpkin_clipboard_get_text(char *text, int *length);
 int pumpkin_clipboard_add_bitmap(BitmapType *bmp, int size);
 
-int pumpkin_alarm_check(void);
-int pumpkin_alarm_set(LocalID dbID, uint32_t t, uint32_t data);
-int pumpkin_alarm_get(LocalID dbID, uint32_t *t, uint32_t *data);
 
 void pumpkin_set_preference(UInt32 creator, UInt16 seq, void *p, UInt16 size, Boolean saved);
 UInt16 pumpkin_get_preference(UInt32 creator, UInt16 seq, void *p, UInt16 size, Boolean saved);
+Int16 pumpkin_get_app_preference(UInt32 creator, UInt16 seq, void *prefs, UInt16 *size, Boolean saved);
+void pumpkin_set_app_preference(UInt32 creator, UInt16 seq, Int16 version, const void *prefs, UInt16 size, Boolean saved);
 
 void pumpkin_set_v10(void);
 void pumpkin_set_m68k(int m68k);
@@ -309,6 +310,7 @@ Int16 StrVNPrintF(Char *s, UInt16 size, const Char *formatStr, sys_va_list arg);
 
 void WinCopyWindow(WinHandle src, WinHandle dst, RectangleType *rect, Coord dstX, Coord dstY);
 void WinBlitBitmap(BitmapType *bitmapP, WinHandle wh, const RectangleType *rect, Coord x, Coord y, WinDrawOperation mode, Boolean text);
+void WinFreeGlyphs(void *glyphs);
 void WinSaveRectangle(WinHandle dstWin, const RectangleType *srcRect);
 void WinRestoreRectangle(WinHandle srcWin, const RectangleType *dstRect);
 void WinSetClipingBounds(WinHandle win, const RectangleType *rP);
@@ -389,6 +391,8 @@ void FldReplaceText(FieldType *fldP, char *s, Boolean focus);
 IndexedColorType WinGetForeColor(void);
 IndexedColorType WinGetBackColor(void);
 void WinDrawCharBox(Char *text, UInt16 len, FontID font, RectangleType *bounds, Boolean draw, UInt16 *drawnLines, UInt16 *totalLines, UInt16 *maxWidth, LineInfoType *lineInfo, UInt16 maxLines);
+UInt16 WinWrapLine(Char *text, UInt16 len, UInt16 start, Coord width, UInt16 *length);
+UInt16 WinWrapLineEx(Char *text, UInt16 len, UInt16 start, Coord width, UInt16 *length, UInt16 *scanned);
 void WinInvertRect(RectangleType *rect, UInt16 corner, Boolean isInverted);
 void RctRectToAbs(const RectangleType *rP, AbsRectType *arP);
 void RctAbsToRect(const AbsRectType *arP, RectangleType *rP);
@@ -403,7 +407,20 @@ Err HwrGetROMToken(UInt16 cardNo, UInt32 token, UInt8 **dataP, UInt16 *sizeP);
 
 int SysUIAppSwitchCont(launch_request_t *request);
 
+typedef struct {
+  UInt32 depth, maxDepth;  // entries in the deferred queue
+  UInt32 deferred;         // calls to SysNotifyBroadcastDeferred
+  UInt32 coalesced;        // deferred notifications merged into a queued one
+  UInt32 dropped;          // deferred notifications rejected because the queue was full
+  UInt32 delivered;        // queued notifications delivered
+  UInt32 lastLatency, maxLatency, avgLatency; // from deferral to delivery, in microseconds
+} notif_queue_stats_t;
+
 void SysNotifyBroadcastQueued(void);
+void SysNotifyQueueStats(notif_queue_stats_t *stats);
+
+// Delivers queued notifications of this type at most once every interval milliseconds, 0 removes the limit.
+Err SysNotifySetRateLimit(UInt32 notifyType, UInt32 interval);
 
 Boolean SysLibNewRefNum68K(UInt32 type, UInt32 creator, UInt16 *refNum);
 Err SysLibRegister68K(UInt16 refNum, LocalID dbID, uint8_t *code, UInt32 size, UInt16 *dispatchTblP, UInt8 *globalsP);
@@ -475,10 +492,14 @@ int SrmInitModule(void);
 int SrmFinishModule(void);
 int FtrInitModule(void);
 int FtrFinishModule(void);
+int FtrInitGlobal(void);
+int FtrFinishGlobal(void);
 int KeyInitModule(void);
 int KeyFinishModule(void);
 int SndInitModule(audio_provider_t *ap);
 int SndFinishModule(void);
+int SndMixerInit(audio_provider_t *ap);
+int SndMixerFinish(void);
 int SelTimeInitModule(void);
 int SelTimeFinishModule(void);
 int GPSInitModule(gps_parse_line_f parse_line, bt_provider_t *bt);
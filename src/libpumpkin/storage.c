@@ -1,4 +1,5 @@
 #include <PalmOS.h>
+#include <VFSMgr.h>
 
 #include "sys.h"
 #include "thread.h"
@@ -12,6 +13,7 @@
 #include "xalloc.h"
 #include "debug.h"
 #include "storage.h"
+#include "findindex.h"
 
 #define MAX_STORAGE_PATH 256
 
@@ -314,7 +316,7 @@ static int StoWriteIndex(storage_t *sto, storage_db_t *db) {
       if (vfs_write(f, (uint8_t *)buf, 12) != 12) break;
     }
     r = 0;
-    vfs_close(f);
+    if (vfs_close(f) != 0) r = -1;
   } else {
     ErrFatalDisplayEx("create index failed", 1);
   }
@@ -335,7 +337,7 @@ static int StoWriteHeader(storage_t *sto, storage_db_t *db) {
     if (vfs_write(f, (uint8_t *)buf, n) == n) {
       r = 0;
     }
-    vfs_close(f);
+    if (vfs_close(f) != 0) r = -1;
   } else {
     ErrFatalDisplayEx("create header failed", 1);
   }
@@ -406,7 +408,7 @@ static int StoPutFileLocks(storage_t *sto, storage_db_t *db, int read_locks, int
     if (vfs_write(f, (uint8_t *)buf, n) == n) {
       r = 0;
     }
-    vfs_close(f);
+    if (vfs_close(f) != 0) r = -1;
   } else {
     ErrFatalDisplayEx("create lock failed", 1);
   }
@@ -551,7 +553,7 @@ static int StoWriteAppInfo(storage_t *sto, storage_db_t *db) {
           if (vfs_write(f, p, size) == size) {
             r = 0;
           }
-          vfs_close(f);
+          if (vfs_close(f) != 0) r = -1;
         } else {
           ErrFatalDisplayEx("create appInfo failed", 1);
         }
@@ -611,7 +613,7 @@ static int StoWriteSortInfo(storage_t *sto, storage_db_t *db) {
           if (vfs_write(f, p, size) == size) {
             r = 0;
           }
-          vfs_close(f);
+          if (vfs_close(f) != 0) r = -1;
         } else {
           ErrFatalDisplayEx("create sortInfo failed", 1);
         }
@@ -1136,6 +1138,7 @@ Err DmReleaseRecord(DmOpenRef dbP, UInt16 index, Boolean dirty) {
                 }
                 vfs_close(f);
               }
+              FindIndexPutRecord(db->name, db->type, db->creator, h->d.rec.uniqueID, h->buf, h->size);
               h->d.rec.attr &= ~dmRecAttrDirty;
             }
             if (h->buf) StoPtrFree(h->buf);
@@ -1750,6 +1753,7 @@ Err DmDeleteDatabase(UInt16 cardNo, LocalID dbID) {
           xmemset(db->name, 0, dmDBNameLength);
 
           sto->num_storage--;
+          FindIndexRemoveDatabase(dbDeleted.dbName, dbDeleted.type, dbDeleted.creator);
           err = errNone;
         }
       }
@@ -2964,6 +2968,7 @@ Err DmDeleteRecord(DmOpenRef dbP, UInt16 index) {
                     debug(DEBUG_ERROR, "STOR", "DmDeleteRecord database \"%s\" index %d useCount < 0", db->name, index);
                   }
                   db->modDate = TimGetSeconds();
+                  FindIndexRemoveRecord(db->name, db->type, db->creator, h->d.rec.uniqueID);
                   err = errNone;
                 }
               } else {
@@ -3010,6 +3015,7 @@ Err DmRemoveRecord(DmOpenRef dbP, UInt16 index) {
             storage_name(sto, db->name, STO_FILE_ELEMENT, index, 0, h->d.rec.attr & ATTR_MASK, h->d.rec.uniqueID, buf);
 //debug(1, "XXX", "DmRemoveRecord remove file [%s]", buf);
             StoVfsUnlink(sto->session, buf);
+            FindIndexRemoveRecord(db->name, db->type, db->creator, h->d.rec.uniqueID);
             if (h->buf) StoPtrFree(h->buf);
             pumpkin_heap_free(h, "Handle");
             db->numRecs--;
@@ -3225,6 +3231,7 @@ Err DmAttachRecord(DmOpenRef dbP, UInt16 *atP, MemHandle newH, MemHandle *oldHP)
               storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, old->d.rec.attr & ATTR_MASK, old->d.rec.uniqueID, buf);
 //debug(1, "XXX", "DmAttachRecord remove old file [%s]", buf);
               StoVfsUnlink(sto->session, buf);
+              FindIndexRemoveRecord(db->name, db->type, db->creator, old->d.rec.uniqueID);
             } else {
               // new record is inserted at position, records are shifted down
               StoAddDatabaseHandle(sto, db, h); // just to add space, h at last position will be overwritten below
@@ -3245,6 +3252,7 @@ Err DmAttachRecord(DmOpenRef dbP, UInt16 *atP, MemHandle newH, MemHandle *oldHP)
               vfs_write(f, h->buf, h->size);
               vfs_close(f);
             }
+            FindIndexPutRecord(db->name, db->type, db->creator, h->d.rec.uniqueID, h->buf, h->size);
           }
           db->modDate = TimGetSeconds();
           StoWriteIndex(sto, db);
@@ -3303,6 +3311,7 @@ Err DmDetachRecord(DmOpenRef dbP, UInt16 index, MemHandle *oldHP) {
 
 //debug(1, "XXX", "DmDetachRecord remove old file [%s]", buf);
             StoVfsUnlink(sto->session, buf);
+            FindIndexRemoveRecord(db->name, db->type, db->creator, old->d.rec.uniqueID);
             *oldHP = old;
             for (i = index; i < db->numRecs-1; i++) {
 //debug(1, "XXX", "DmDetachRecord shift element at %d to %d", i-1, i);
@@ -3920,6 +3929,438 @@ Err DmCreateDatabaseFromImage(MemPtr bufferP) {
   return err;
 }
 
+#define STO_COPY_BUF    16384
+
+static int StoCopyFile(vfs_file_t *in, vfs_file_t *out, uint32_t size, uint8_t *buf) {
+  uint32_t n;
+
+  for (; size > 0; size -= n) {
+    n = size < STO_COPY_BUF ? size : STO_COPY_BUF;
+    if (vfs_read(in, buf, n) != n) return -1;
+    if (vfs_write(out, buf, n) != n) return -1;
+  }
+
+  return 0;
+}
+
+// Writes a database as a PDB/PRC image. Elements are copied one at a time
+// from their storage files (or from memory if they are loaded), so the
+// memory used does not depend on the size of the database. The storage
+// mutex is released before each call to progress, which may call the Data
+// Manager, and the database must not change while it is being exported.
+Err StoExportDatabase(LocalID dbID, vfs_file_t *f, StoProgressProc progress, void *data) {
+  storage_t *sto = (storage_t *)thread_get(sto_key);
+  storage_db_t *db;
+  storage_handle_t *h, **handles;
+  DmOpenRef dbRef;
+  MemHandle appInfoH, sortInfoH;
+  UInt32 appInfoSize, sortInfoSize, entrySize, offset, total, numRecs, i, *sizes;
+  UInt8 hdr[PDB_HEADER_SIZE], *buf, *p;
+  vfs_file_t *in;
+  char name[VFS_PATH], dbName[dmDBNameLength];
+  Err err = dmErrInvalidParam;
+
+  if (f == NULL || (dbRef = DmOpenDatabase(0, dbID, dmModeReadOnly)) == NULL) {
+    return err;
+  }
+
+  if ((buf = xmalloc(STO_COPY_BUF)) == NULL) {
+    DmCloseDatabase(dbRef);
+    return dmErrMemError;
+  }
+
+  handles = NULL;
+  sizes = NULL;
+  numRecs = 0;
+  offset = 0;
+  total = 0;
+  xmemset(dbName, 0, dmDBNameLength);
+
+  if (mutex_lock(sto->mutex) == 0) {
+    db = (storage_db_t *)(sto->base + dbID);
+    sys_strncpy(dbName, db->name, dmDBNameLength-1);
+
+    if (db->ftype == STO_TYPE_REC || db->ftype == STO_TYPE_RES) {
+      numRecs = db->numRecs;
+      if (numRecs && ((handles = xmalloc(numRecs * sizeof(storage_handle_t *))) == NULL || (sizes = xmalloc(numRecs * sizeof(UInt32))) == NULL)) {
+        err = dmErrMemError;
+      } else {
+        appInfoH = db->appInfoID ? MemLocalIDToHandle(db->appInfoID) : NULL;
+        sortInfoH = db->sortInfoID ? MemLocalIDToHandle(db->sortInfoID) : NULL;
+        appInfoSize = appInfoH ? MemHandleSize(appInfoH) : 0;
+        sortInfoSize = sortInfoH ? MemHandleSize(sortInfoH) : 0;
+        entrySize = db->ftype == STO_TYPE_RES ? PDB_RES_ENTRY : PDB_REC_ENTRY;
+        offset = PDB_HEADER_SIZE + numRecs * entrySize + 2;
+        for (i = 0, total = offset + appInfoSize + sortInfoSize; i < numRecs; i++) {
+          handles[i] = db->elements[i];
+          sizes[i] = handles[i]->size;
+          total += sizes[i];
+        }
+
+        xmemset(hdr, 0, sizeof(hdr));
+        sys_strncpy((char *)hdr, db->name, dmDBNameLength-1);
+        i = dmDBNameLength;
+        i += put2b(db->attributes & ~dmHdrAttrOpen, hdr, i);
+        i += put2b(db->version, hdr, i);
+        i += put4b(db->crDate, hdr, i);
+        i += put4b(db->modDate, hdr, i);
+        i += put4b(db->bckDate, hdr, i);
+        i += put4b(db->modNum, hdr, i);
+        i += put4b(appInfoSize ? offset : 0, hdr, i);
+        i += put4b(sortInfoSize ? offset + appInfoSize : 0, hdr, i);
+        i += put4b(db->type, hdr, i);
+        i += put4b(db->creator, hdr, i);
+        i += put4b(db->uniqueIDSeed, hdr, i);
+        i += put4b(0, hdr, i);
+        i += put2b(numRecs, hdr, i);
+        err = vfs_write(f, hdr, PDB_HEADER_SIZE) == PDB_HEADER_SIZE ? errNone : vfsErrVolumeFull;
+
+        offset += appInfoSize + sortInfoSize;
+        for (i = 0; i < numRecs && err == errNone; i++) {
+          h = handles[i];
+          if (db->ftype == STO_TYPE_RES) {
+            put4b(h->d.res.type, hdr, 0);
+            put2b(h->d.res.id, hdr, 4);
+            put4b(offset, hdr, 6);
+          } else {
+            put4b(offset, hdr, 0);
+            put4b(h->d.rec.uniqueID & 0xFFFFFF, hdr, 4);
+            hdr[4] = h->d.rec.attr & ATTR_MASK;
+          }
+          if (vfs_write(f, hdr, entrySize) != entrySize) err = vfsErrVolumeFull;
+          offset += h->size;
+        }
+
+        hdr[0] = hdr[1] = 0;
+        if (err == errNone && vfs_write(f, hdr, 2) != 2) err = vfsErrVolumeFull;
+
+        if (err == errNone && appInfoSize && (p = MemHandleLock(appInfoH)) != NULL) {
+          if (vfs_write(f, p, appInfoSize) != appInfoSize) err = vfsErrVolumeFull;
+          MemHandleUnlock(appInfoH);
+        }
+        if (err == errNone && sortInfoSize && (p = MemHandleLock(sortInfoH)) != NULL) {
+          if (vfs_write(f, p, sortInfoSize) != sortInfoSize) err = vfsErrVolumeFull;
+          MemHandleUnlock(sortInfoH);
+        }
+        offset = PDB_HEADER_SIZE + numRecs * entrySize + 2 + appInfoSize + sortInfoSize;
+      }
+    } else {
+      debug(DEBUG_ERROR, "STOR", "StoExportDatabase \"%s\" stream databases can not be exported", db->name);
+    }
+
+    mutex_unlock(sto->mutex);
+  }
+
+  for (i = 0; i < numRecs && err == errNone; i++) {
+    if (mutex_lock(sto->mutex) != 0) {
+      err = dmErrMemError;
+      break;
+    }
+
+    // the header and the entry table were written from the snapshot in handles
+    h = handles[i];
+    if (i >= db->numRecs || db->elements[i] != h || h->size != sizes[i]) {
+      debug(DEBUG_ERROR, "STOR", "StoExportDatabase \"%s\" changed during export", db->name);
+      err = dmErrDatabaseOpen;
+    } else if (h->htype & STO_INFLATED) {
+      // the loaded copy may be newer than the file
+      if (h->size && vfs_write(f, h->buf, h->size) != h->size) err = vfsErrVolumeFull;
+    } else {
+      if (db->ftype == STO_TYPE_RES) {
+        storage_name(sto, db->name, STO_FILE_ELEMENT, h->d.res.id, h->d.res.type, 0, 0, name);
+      } else {
+        storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, h->d.rec.attr & ATTR_MASK, h->d.rec.uniqueID, name);
+      }
+      if ((in = StoVfsOpen(sto->session, name, VFS_READ)) != NULL) {
+        if (StoCopyFile(in, f, h->size, buf) != 0) err = dmErrMemError;
+        vfs_close(in);
+      } else {
+        debug(DEBUG_ERROR, "STOR", "StoExportDatabase \"%s\" missing element %u", db->name, i);
+        err = dmErrMemError;
+      }
+    }
+    offset += h->size;
+    mutex_unlock(sto->mutex);
+
+    if (err == errNone && progress) err = progress(total, offset, data);
+  }
+
+  if (err == errNone && vfs_flush(f) != 0) err = vfsErrVolumeFull;
+  debug(DEBUG_INFO, "STOR", "StoExportDatabase \"%s\" %u elements %u bytes: %d", dbName, numRecs, total, err);
+
+  if (handles) xfree(handles);
+  if (sizes) xfree(sizes);
+  xfree(buf);
+  DmCloseDatabase(dbRef);
+
+  return err;
+}
+
+static Err StoImportInfo(vfs_file_t *f, UInt32 offset, UInt32 size, LocalID *idP) {
+  MemHandle h;
+  void *p;
+  Err err = dmErrMemError;
+
+  if ((h = MemHandleNew(size)) != NULL) {
+    if ((p = MemHandleLock(h)) != NULL) {
+      if (vfs_seek(f, offset, 0) == offset && vfs_read(f, p, size) == size) {
+        err = errNone;
+      }
+      MemHandleUnlock(h);
+    }
+    if (err == errNone) {
+      *idP = MemHandleToLocalID(h);
+    } else {
+      MemHandleFree(h);
+    }
+  }
+
+  return err;
+}
+
+typedef struct {
+  UInt32 uniqueID;
+  UInt32 index;
+} sto_import_id_t;
+
+static int compare_import_id(const void *e1, const void *e2) {
+  const sto_import_id_t *id1 = (const sto_import_id_t *)e1;
+  const sto_import_id_t *id2 = (const sto_import_id_t *)e2;
+
+  if (id1->uniqueID != id2->uniqueID) return id1->uniqueID < id2->uniqueID ? -1 : 1;
+  return id1->index < id2->index ? -1 : (id1->index > id2->index ? 1 : 0);
+}
+
+// Record element files are named after the uniqueID, so a zero or repeated
+// uniqueID in the entry table would make two records share a file. Those
+// records get new IDs above the seed and every ID in the table, written
+// back into the table. Returns -1 if the 24 bit ID space is exhausted.
+static int StoImportUniqueIDs(char *name, UInt8 *table, UInt32 numRecs, UInt32 seed) {
+  sto_import_id_t *ids;
+  UInt32 i, maxID, uniqueID;
+  UInt8 *e;
+  int r = 0;
+
+  if ((ids = xmalloc(numRecs * sizeof(sto_import_id_t))) == NULL) return -1;
+
+  maxID = seed & 0xFFFFFF;
+  for (i = 0; i < numRecs; i++) {
+    e = &table[i * PDB_REC_ENTRY];
+    ids[i].uniqueID = ((UInt32)e[5] << 16) | ((UInt32)e[6] << 8) | e[7];
+    ids[i].index = i;
+    if (ids[i].uniqueID > maxID) maxID = ids[i].uniqueID;
+  }
+  sys_qsort(ids, numRecs, sizeof(sto_import_id_t), compare_import_id);
+
+  // the first record with a given ID keeps it, the others are renumbered in table order
+  for (i = 0; i < numRecs; i++) {
+    if (ids[i].uniqueID != 0 && (i == 0 || ids[i].uniqueID != ids[i-1].uniqueID)) continue;
+    e = &table[ids[i].index * PDB_REC_ENTRY];
+    e[5] = e[6] = e[7] = 0;
+  }
+  for (i = 0; i < numRecs && r == 0; i++) {
+    e = &table[i * PDB_REC_ENTRY];
+    if (e[5] || e[6] || e[7]) continue;
+    if (maxID == 0xFFFFFF) {
+      r = -1;
+      break;
+    }
+    uniqueID = ++maxID;
+    debug(DEBUG_INFO, "STOR", "StoImportDatabase \"%s\" record %u gets uniqueID 0x%06X", name, i, uniqueID);
+    e[5] = uniqueID >> 16;
+    e[6] = uniqueID >> 8;
+    e[7] = uniqueID;
+  }
+  xfree(ids);
+
+  return r;
+}
+
+// Creates a database from a PDB/PRC image, reading the entry table and then
+// copying one element at a time straight to its storage file. If the
+// database exists and overwrite is false, dmErrAlreadyExists is returned
+// with the existing dbID.
+Err StoImportDatabase(vfs_file_t *f, Boolean overwrite, LocalID *dbIDP, StoProgressProc progress, void *data) {
+  storage_t *sto = (storage_t *)thread_get(sto_key);
+  storage_db_t *db;
+  storage_handle_t *h;
+  DmOpenRef dbRef;
+  LocalID dbID;
+  UInt8 hdr[PDB_HEADER_SIZE], *table, *buf, *e;
+  UInt16 attr, version, numRecs, id;
+  UInt32 crDate, modDate, bckDate, modNum, appInfo, sortInfo, type, creator, seed, dummy32;
+  UInt32 fileSize, entrySize, tableEnd, firstOffset, offset, next, size, uniqueID, maxID, i;
+  char name[dmDBNameLength], path[VFS_PATH];
+  vfs_file_t *out;
+  Err err = vfsErrBadData;
+
+  if (dbIDP) *dbIDP = 0;
+  if (f == NULL) return dmErrInvalidParam;
+
+  fileSize = vfs_seek(f, 0, 1);
+  if (fileSize == 0xFFFFFFFF || fileSize < PDB_HEADER_SIZE || vfs_seek(f, 0, 0) != 0) return err;
+  if (vfs_read(f, hdr, PDB_HEADER_SIZE) != PDB_HEADER_SIZE) return err;
+
+  if (!StoValidName(hdr) || !StoValidTypeCreator(&hdr[dmDBNameLength + 28]) || !StoValidTypeCreator(&hdr[dmDBNameLength + 32])) {
+    debug(DEBUG_ERROR, "STOR", "StoImportDatabase invalid header");
+    return err;
+  }
+  xmemset(name, 0, dmDBNameLength);
+  xmemcpy(name, hdr, dmDBNameLength - 1);
+  i = dmDBNameLength;
+  i += get2b(&attr, hdr, i);
+  i += get2b(&version, hdr, i);
+  i += get4b(&crDate, hdr, i);
+  i += get4b(&modDate, hdr, i);
+  i += get4b(&bckDate, hdr, i);
+  i += get4b(&modNum, hdr, i);
+  i += get4b(&appInfo, hdr, i);
+  i += get4b(&sortInfo, hdr, i);
+  i += get4b(&type, hdr, i);
+  i += get4b(&creator, hdr, i);
+  i += get4b(&seed, hdr, i);
+  i += get4b(&dummy32, hdr, i);
+  i += get2b(&numRecs, hdr, i);
+  attr &= ~dmHdrAttrOpen;
+
+  if ((dbID = DmFindDatabase(0, name)) != 0 && !overwrite) {
+    if (dbIDP) *dbIDP = dbID;
+    return dmErrAlreadyExists;
+  }
+
+  // the entry table is small, the data of the elements is never held in memory as a whole
+  entrySize = (attr & dmHdrAttrResDB) ? PDB_RES_ENTRY : PDB_REC_ENTRY;
+  table = numRecs ? xmalloc(numRecs * entrySize) : NULL;
+  if (numRecs && table == NULL) return dmErrMemError;
+  if (numRecs && vfs_read(f, table, numRecs * entrySize) != numRecs * entrySize) {
+    xfree(table);
+    return err;
+  }
+
+  // offsets must be increasing and inside the file, appInfo and sortInfo
+  // must lie between the end of the entry table and the first element
+  tableEnd = PDB_HEADER_SIZE + numRecs * entrySize;
+  firstOffset = fileSize;
+  for (i = 0, offset = tableEnd; i < numRecs; i++) {
+    get4b(&next, table, i * entrySize + (entrySize == PDB_RES_ENTRY ? 6 : 0));
+    if (next < offset || next > fileSize) break;
+    if (i == 0) firstOffset = next;
+    offset = next;
+  }
+  if (i < numRecs ||
+      (appInfo && (appInfo < tableEnd || appInfo > firstOffset || (sortInfo && sortInfo < appInfo))) ||
+      (sortInfo && (sortInfo < tableEnd || sortInfo > firstOffset))) {
+    debug(DEBUG_ERROR, "STOR", "StoImportDatabase \"%s\" invalid offsets", name);
+    if (table) xfree(table);
+    return err;
+  }
+
+  if (entrySize == PDB_REC_ENTRY && numRecs && StoImportUniqueIDs(name, table, numRecs, seed) != 0) {
+    debug(DEBUG_ERROR, "STOR", "StoImportDatabase \"%s\" invalid uniqueIDs", name);
+    xfree(table);
+    return err;
+  }
+
+  if ((buf = xmalloc(STO_COPY_BUF)) == NULL) {
+    if (table) xfree(table);
+    return dmErrMemError;
+  }
+
+  if ((err = DmCreateDatabaseEx(name, creator, type, attr, seed, true)) == errNone && (dbID = DmFindDatabase(0, name)) != 0) {
+    DmSetDatabaseInfo(0, dbID, NULL, NULL, &version, &crDate, &modDate, &bckDate, &modNum, NULL, NULL, NULL, NULL);
+
+    if ((dbRef = DmOpenDatabase(0, dbID, dmModeWrite)) != NULL) {
+      db = (storage_db_t *)(sto->base + dbID);
+      maxID = 0;
+
+      for (i = 0; i < numRecs && err == errNone; i++) {
+        e = &table[i * entrySize];
+        get4b(&offset, e, entrySize == PDB_RES_ENTRY ? 6 : 0);
+        if (i < numRecs - 1) {
+          get4b(&next, e + entrySize, entrySize == PDB_RES_ENTRY ? 6 : 0);
+        } else {
+          next = fileSize;
+        }
+        size = next - offset;
+
+        // the mutex is not held while progress runs, it may call the Data Manager
+        if (mutex_lock(sto->mutex) != 0) {
+          err = dmErrMemError;
+          break;
+        }
+
+        if (entrySize == PDB_RES_ENTRY) {
+          get4b(&type, e, 0);
+          get2b(&id, e, 4);
+          h = StoAddRes(sto, db, type, id, size);
+          storage_name(sto, db->name, STO_FILE_ELEMENT, id, type, 0, 0, path);
+        } else {
+          uniqueID = ((UInt32)e[5] << 16) | ((UInt32)e[6] << 8) | e[7];
+          if (uniqueID > maxID) maxID = uniqueID;
+          h = StoAddRec(sto, db, uniqueID, e[4] & ATTR_MASK, size);
+          storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, e[4] & ATTR_MASK, uniqueID, path);
+        }
+
+        if (h == NULL) {
+          err = dmErrMemError;
+        } else if ((out = StoVfsOpen(sto->session, path, VFS_WRITE | VFS_TRUNC)) == NULL) {
+          err = dmErrMemError;
+        } else {
+          if (vfs_seek(f, offset, 0) != offset || StoCopyFile(f, out, size, buf) != 0) err = vfsErrBadData;
+          if (vfs_close(out) != 0 && err == errNone) err = vfsErrVolumeFull;
+        }
+        mutex_unlock(sto->mutex);
+
+        if (err == errNone && progress) err = progress(fileSize, next, data);
+      }
+
+      if (err == errNone && mutex_lock(sto->mutex) == 0) {
+        if (entrySize == PDB_RES_ENTRY) {
+          StoSortHandles(db);
+        } else {
+          if (db->uniqueIDSeed <= maxID) db->uniqueIDSeed = maxID + 1;
+          if (StoWriteIndex(sto, db) != 0) err = dmErrMemError;
+          StoWriteHeader(sto, db);
+        }
+
+        if (err == errNone && appInfo) {
+          size = (sortInfo ? sortInfo : firstOffset) - appInfo;
+          if (size && (err = StoImportInfo(f, appInfo, size, &db->appInfoID)) == errNone) {
+            StoWriteAppInfo(sto, db);
+          }
+        }
+        if (err == errNone && sortInfo) {
+          size = firstOffset - sortInfo;
+          if (size && (err = StoImportInfo(f, sortInfo, size, &db->sortInfoID)) == errNone) {
+            StoWriteSortInfo(sto, db);
+          }
+        }
+
+        mutex_unlock(sto->mutex);
+      }
+      DmCloseDatabase(dbRef);
+    } else {
+      err = dmErrMemError;
+    }
+
+    if (err != errNone) {
+      debug(DEBUG_ERROR, "STOR", "StoImportDatabase \"%s\" failed: %d", name, err);
+      DmDeleteDatabase(0, dbID);
+      dbID = 0;
+    } else {
+      debug(DEBUG_INFO, "STOR", "StoImportDatabase \"%s\" %u elements", name, numRecs);
+    }
+  } else if (err == errNone) {
+    err = dmErrMemError;
+  }
+
+  if (dbIDP) *dbIDP = dbID;
+  if (table) xfree(table);
+  xfree(buf);
+
+  return err;
+}
+
 int StoDeleteFile(char *name) {
   storage_t *sto = (storage_t *)thread_get(sto_key);
   return StoVfsUnlink(sto->session, name);
@@ -3978,55 +4419,45 @@ int StoDeployFile(char *path, AppRegistryType *ar) {
   UInt32 type, creator, newDate, crDate;
   Boolean install, exists;
   char name[dmDBNameLength], stype[8], screator[8], *ext;
-  uint32_t size, hsize;
-  uint8_t *p;
+  uint8_t p[PDB_HEADER_SIZE];
   int r = -1;
 
   if (path && (ext = getext(path)) != NULL && (!sys_strcasecmp(ext, "prc") || !sys_strcasecmp(ext, "pdb"))) {
     if ((f = StoVfsOpen(sto->session, path, VFS_READ)) != NULL) {
-      size = vfs_seek(f, 0, 1);
-      hsize = 78;
-      if (size > hsize && size != 0xfffffffful) {
-        vfs_seek(f, 0, 0);
-        if ((p = MemPtrNew(size)) != NULL) {
-          if (vfs_read(f, p, hsize) == hsize) {
-            xmemset(name, 0, dmDBNameLength);
-            xmemcpy(name, p, dmDBNameLength - 1);
-            if (name[0]) {
-              install = false;
-              exists = false;
-              if ((dbID = DmFindDatabase(0, name)) == 0) {
-                install = true;
-              } else {
-                exists = true;
-                if (DmDatabaseInfo(0, dbID, NULL, NULL, NULL, &crDate, NULL, NULL, NULL, NULL, NULL, NULL, NULL) == errNone) {
-                  get4b(&newDate, p, dmDBNameLength + 4);
-                  install = (newDate > crDate);
-                }
-              }
-              if (install) {
-                if (vfs_read(f, p + hsize, size - hsize) == size - hsize) {
-                  get4b(&type, p, dmDBNameLength + 28);
-                  get4b(&creator, p, dmDBNameLength + 32);
-                  pumpkin_id2s(type, stype);
-                  pumpkin_id2s(creator, screator);
-                  debug(DEBUG_INFO, "STOR", "installing new version of \"%s\" type '%s' creator '%s' from \"%s\"", name, stype, screator, path);
-                  if (DmCreateDatabaseFromImage(p) == errNone) {
-                    debug(DEBUG_INFO, "STOR", "installed \"%s\"", name);
-                    if (type == sysFileTApplication) {
-                      StoRegistryCreate(ar, creator, exists);
-                    }
-                    r = 0;
-                  } else {
-                    debug(DEBUG_ERROR, "STOR", "error installing \"%s\"", name);
-                  }
-                }
-              } else {
-                r = 0;
+      if (vfs_read(f, p, PDB_HEADER_SIZE) == PDB_HEADER_SIZE) {
+        xmemset(name, 0, dmDBNameLength);
+        xmemcpy(name, p, dmDBNameLength - 1);
+        if (name[0]) {
+          install = false;
+          exists = false;
+          if ((dbID = DmFindDatabase(0, name)) == 0) {
+            install = true;
+          } else {
+            exists = true;
+            if (DmDatabaseInfo(0, dbID, NULL, NULL, NULL, &crDate, NULL, NULL, NULL, NULL, NULL, NULL, NULL) == errNone) {
+              get4b(&newDate, p, dmDBNameLength + 4);
+              install = (newDate > crDate);
+            }
+          }
+          if (install) {
+            get4b(&type, p, dmDBNameLength + 28);
+            get4b(&creator, p, dmDBNameLength + 32);
+            pumpkin_id2s(type, stype);
+            pumpkin_id2s(creator, screator);
+            debug(DEBUG_INFO, "STOR", "installing new version of \"%s\" type '%s' creator '%s' from \"%s\"", name, stype, screator, path);
+            // the file is copied element by element instead of being loaded in memory
+            if (StoImportDatabase(f, true, &dbID, NULL, NULL) == errNone) {
+              debug(DEBUG_INFO, "STOR", "installed \"%s\"", name);
+              if (type == sysFileTApplication) {
+                StoRegistryCreate(ar, creator, exists);
               }
+              r = 0;
+            } else {
+              debug(DEBUG_ERROR, "STOR", "error installing \"%s\"", name);
             }
+          } else {
+            r = 0;
           }
-          MemPtrFree(p);
         }
       }
       vfs_close(f);
@@ -1,6 +1,11 @@
 #ifndef PIT_STORAGE_H
 #define PIT_STORAGE_H
 
+// PDB/PRC image layout: header, then one entry per record or resource
+#define PDB_HEADER_SIZE 78
+#define PDB_REC_ENTRY   8
+#define PDB_RES_ENTRY   10
+
 void StoRemoveLocks(char *path);
 int StoInit(char *path, mutex_t *mutex);
 int StoRefresh(void);
@@ -9,6 +14,12 @@ int StoDeleteFile(char *path);
 int StoDeployFile(char *path, AppRegistryType *ar);
 int StoDeployFiles(char *path, AppRegistryType *ar);
 int StoDeployFileFromImage(uint8_t *p, uint32_t size, AppRegistryType *ar);
+
+struct vfs_file_t;
+
+typedef Err (*StoProgressProc)(UInt32 totalBytes, UInt32 offset, void *data);
+Err StoExportDatabase(LocalID dbID, struct vfs_file_t *f, StoProgressProc progress, void *data);
+Err StoImportDatabase(struct vfs_file_t *f, Boolean overwrite, LocalID *dbIDP, StoProgressProc progress, void *data);
 Int32 StoFileSeek(DmOpenRef dbP, UInt32 offset, Int32 whence);
 Int32 StoFileRead(DmOpenRef dbP, void *p, Int32 size);
 Int32 StoFileWrite(DmOpenRef dbP, void *p, Int32 size);
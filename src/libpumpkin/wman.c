@@ -22,6 +22,8 @@ typedef struct {
   int id;
   texture_t *t;
   rect_t r;
+  rect_t *vis;
+  int nvis, avis, valid;
 } wman_area_t;
 
 struct wman_t {
@@ -33,6 +35,8 @@ struct wman_t {
   rect_t r;
   int border, n;
   wman_area_t area[MAX_AREAS];
+  rect_t *aux;
+  int naux;
 };
 
 #define swap(a,b) { aux=a; a=b; b=aux; }
@@ -148,6 +152,26 @@ static int difference(rect_t *a, rect_t *b, rect_t *r) {
   return rectCount;
 }
 
+// like intersection(), but also keeps 1 pixel wide results
+static int clip(rect_t *a, rect_t *b, rect_t *r) {
+  int x1, y1, x2, y2;
+
+  x1 = max(a->x, b->x);
+  y1 = max(a->y, b->y);
+  x2 = min(a->x + a->width, b->x + b->width);
+  y2 = min(a->y + a->height, b->y + b->height);
+
+  if (x2 > x1 && y2 > y1) {
+    r->x = x1;
+    r->y = y1;
+    r->width = x2 - x1;
+    r->height = y2 - y1;
+    return 1;
+  }
+
+  return 0;
+}
+
 static void set_rect(rect_t *r, int x, int y, int width, int height, char *label) {
   if (x < 0 || y < 0 || width <= 0 || height <= 0) {
     //debug(DEBUG_ERROR, "WMAN", "%s invalid rect %d,%d,%d,%d", label, x, y, width, height);
@@ -341,6 +365,61 @@ static void change_top(wman_t *wm, int area, int select, int unselect) {
   }
 }
 
+static void invalidate(wman_t *wm) {
+  int i;
+
+  for (i = 0; i < wm->n; i++) {
+    wm->area[i].valid = 0;
+  }
+}
+
+static int grow(rect_t **r, int *size, int n) {
+  rect_t *p;
+  int m;
+
+  if (n > *size) {
+    for (m = *size ? *size : 8; m < n; m *= 2);
+    if ((p = xrealloc(*r, m * sizeof(rect_t))) == NULL) {
+      return -1;
+    }
+    *r = p;
+    *size = m;
+  }
+
+  return 0;
+}
+
+// computes the parts of area i not covered by the areas (and borders) above it
+static void visible(wman_t *wm, int i) {
+  wman_area_t *area = &wm->area[i];
+  rect_t a, *tmp;
+  int j, k, n, m;
+
+  area->nvis = 0;
+  area->valid = 1;
+  if (grow(&area->vis, &area->avis, 1) == -1) return;
+  area->vis[0] = area->r;
+  n = 1;
+
+  for (j = i+1; j < wm->n && n > 0; j++) {
+    set_rect(&a, wm->area[j].r.x - wm->border, wm->area[j].r.y - wm->border, wm->area[j].r.width + 2*wm->border, wm->area[j].r.height + 2*wm->border, "visible");
+    if (grow(&wm->aux, &wm->naux, n * 4) == -1) return;
+    for (k = 0, m = 0; k < n; k++) {
+      m += difference(&area->vis[k], &a, &wm->aux[m]);
+    }
+    tmp = area->vis;
+    area->vis = wm->aux;
+    wm->aux = tmp;
+    k = area->avis;
+    area->avis = wm->naux;
+    wm->naux = k;
+    n = m;
+  }
+
+  area->nvis = n;
+  debug(DEBUG_TRACE, "WMAN", "area %d has %d visible rects", i, n);
+}
+
 void wman_clear(wman_t *wm) {
   wman_draw(wm, WMAN_BACK, 0, 0, wm->r.width, wm->r.height, 0, 0);
 }
@@ -355,6 +434,7 @@ int wman_add(wman_t *wm, int id, texture_t *t, int x, int y, int w, int h) {
     if (x == -1) x = i ? (wm->r.width - w) / 2 : wm->border;
     if (y == -1) y = i ? (wm->r.height - h) / 2 : wm->border;
     set_rect(&wm->area[i].r, x, y, w, h, "wman_add");
+    invalidate(wm);
     change_top(wm, 0, 1, 1);
     r = 0;
   }
@@ -371,6 +451,7 @@ int wman_texture(wman_t *wm, int id, texture_t *t, int w, int h) {
         wm->area[i].t = t;
         wm->area[i].r.width = w;
         wm->area[i].r.height = h;
+        invalidate(wm);
         r = 0;
         break;
       }
@@ -380,32 +461,10 @@ int wman_texture(wman_t *wm, int id, texture_t *t, int w, int h) {
   return r;
 }
 
-static void update(wman_t *wm, int i0, int x0, int y0, rect_t *r, int i) {
-  rect_t d[4], a;
-  int j, n;
-
-  if (i > wm->n) {
-    // there is nothing on top of this area, draw it
-    wman_draw(wm, i0, r->x - x0, r->y - y0, r->width, r->height, r->x, r->y);
-    return;
-  }
-
-  set_rect(&a, wm->area[i].r.x - wm->border, wm->area[i].r.y - wm->border, wm->area[i].r.width + 2*wm->border, wm->area[i].r.height + 2*wm->border, "update");
-  n = difference(r, &a, d);
-  if (n == 0) {
-    // the area is completely obscured by other area, return without drawing
-    return;
-  }
-
-  for (j = 0; j < n; j++) {
-    update(wm, i0, x0, y0, &d[j], i+1);
-  }
-}
-
 // x,y: task relative coordinates
 int wman_update(wman_t *wm, int id, int x, int y, int w, int h) {
-  rect_t r;
-  int i, res = -1;
+  rect_t r, d;
+  int i, j, res = -1;
 
   if (wm && wm->n) {
     if (wm->area[wm->n-1].id == id) {
@@ -417,8 +476,13 @@ int wman_update(wman_t *wm, int id, int x, int y, int w, int h) {
       for (i = 0; i < wm->n-1; i++) {
         if (wm->area[i].id == id) {
 //debug(1, "XXX", "wman_update %d: %d,%d,%d,%d", i, x, y, w, h);
+          if (!wm->area[i].valid) visible(wm, i);
           set_rect(&r, wm->area[i].r.x + x, wm->area[i].r.y + y, w, h, "wman_update");
-          update(wm, i, wm->area[i].r.x, wm->area[i].r.y, &r, i+1);
+          for (j = 0; j < wm->area[i].nvis; j++) {
+            if (clip(&r, &wm->area[i].vis[j], &d)) {
+              wman_draw(wm, i, d.x - wm->area[i].r.x, d.y - wm->area[i].r.y, d.width, d.height, d.x, d.y);
+            }
+          }
           res = 0;
           break;
         }
@@ -450,6 +514,7 @@ int wman_raise(wman_t *wm, int id) {
     }
     if (found) {
       wm->area[i] = aux;
+      invalidate(wm);
       change_top(wm, 1, 1, 1);
       r = 0;
     }
@@ -530,6 +595,7 @@ int wman_move(wman_t *wm, int id, int dx, int dy) {
 
     wm->area[i].r.x += dx;
     wm->area[i].r.y += dy;
+    invalidate(wm);
 
     if (!wm->wp->move) {
       change_top(wm, 1, 1, 0);
@@ -552,7 +618,7 @@ int wman_remove(wman_t *wm, int id, int remove) {
     } else {
       found = 0;
       for (i = 0; i < wm->n-1; i++) {
-        if (found != -1) {
+        if (found) {
           wm->area[i] = wm->area[i+1];
         } else if (wm->area[i].id == id) {
           aux = wm->area[i];
@@ -562,7 +628,10 @@ int wman_remove(wman_t *wm, int id, int remove) {
       }
     }
     if (found) {
+      // keep the removed area in the last slot, so that its buffers are not lost
+      wm->area[wm->n-1] = aux;
       wm->n--;
+      invalidate(wm);
       set_rect(&r, aux.r.x - wm->border, aux.r.y - wm->border, aux.r.width + 2*wm->border, aux.r.height + 2*wm->border, "wman_remove");
       wman_draw(wm, WMAN_BACK, r.x, r.y, r.width, r.height, r.x, r.y);
       for (i = 0; i < wm->n; i++) {
@@ -571,7 +640,10 @@ int wman_remove(wman_t *wm, int id, int remove) {
           draw_border(wm, i, i == wm->n-1);
         }
       }
-      if (!remove) wm->n++;
+      if (!remove) {
+        wm->n++;
+        invalidate(wm);
+      }
       res = 0;
     }
   }
@@ -620,7 +692,7 @@ int wman_xy(wman_t *wm, int id, int *x, int *y) {
 }
 
 int wman_finish(wman_t *wm) {
-  int r = -1;
+  int i, r = -1;
 
   if (wm) {
     if (wm->background) wm->wp->destroy_texture(wm->w, wm->background);
@@ -628,6 +700,10 @@ int wman_finish(wman_t *wm) {
     if (wm->hsborder)   wm->wp->destroy_texture(wm->w, wm->hsborder);
     if (wm->vborder)    wm->wp->destroy_texture(wm->w, wm->vborder);
     if (wm->vsborder)   wm->wp->destroy_texture(wm->w, wm->vsborder);
+    for (i = 0; i < MAX_AREAS; i++) {
+      if (wm->area[i].vis) xfree(wm->area[i].vis);
+    }
+    if (wm->aux) xfree(wm->aux);
     xfree(wm);
     r = 0;
   }